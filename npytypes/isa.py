@@ -0,0 +1,45 @@
+'''Choice among the instruction set builds of the extension modules
+
+setup.py, run with NPYTYPES_OPTIMIZE=1 on x86-64, builds each extension
+module twice more, for the x86-64-v3 (AVX2) and x86-64-v4 (AVX-512)
+instruction sets, under its name with _v3 and _v4 appended.  load_extension
+imports the widest build the running CPU supports in place of the module, so
+that importing the module by its own name gets that build.  Without those
+builds, or with a NumPy too old to report CPU features, it is the module
+itself.
+'''
+
+import importlib
+import sys
+
+def cpu_suffixes():
+    '''The suffixes of the builds the running CPU can run, widest first'''
+    features = {}
+    for name in 'numpy._core._multiarray_umath', 'numpy.core._multiarray_umath':
+        try:
+            features = importlib.import_module(name).__cpu_features__
+            break
+        except (ImportError, AttributeError):
+            pass
+    suffixes = ['']
+    if all(features.get(f) for f in ('AVX', 'AVX2', 'FMA3', 'F16C')):
+        suffixes.insert(0, '_v3')
+        if features.get('AVX512_SKX'):
+            suffixes.insert(0, '_v4')
+    return suffixes
+
+def load_extension(name):
+    '''Import the widest build of the extension module name, such as
+    npytypes.rational.rational, as name'''
+    if name in sys.modules:
+        return sys.modules[name]
+    package, _, base = name.rpartition('.')
+    for suffix in cpu_suffixes()[:-1]:
+        try:
+            module = importlib.import_module(name + suffix)
+        except ImportError:
+            continue
+        sys.modules[name] = module
+        setattr(sys.modules[package], base, module)
+        return module
+    return importlib.import_module(name)
@@ -1,12 +1,36 @@
 import numpy as np
 
-from npytypes.quaternion.numpy_quaternion import quaternion
+from npytypes.isa import load_extension
+load_extension('npytypes.quaternion.numpy_quaternion')
+
+from npytypes.quaternion.numpy_quaternion import (quaternion, quaternion32,
+    dual_quaternion, rotate, as_rotation_matrix, from_rotation_matrix, as_rotation_vector,
+    from_rotation_vector, as_euler, from_euler, slerp, squad, resample, product,
+    cumulative_product, mean_rotation, weighted_mean_rotation,
+    integrate_angular_velocity, angular_velocity, inner, matrix_multiply,
+    chordal_distance, intrinsic_distance, rotation_distance, pairwise_distance,
+    normalized, transform, sclerp, from_rigid_transform, as_rigid_transform, inverse,
+    norm, isunit, unit_multiply, set_fast_normalize)
+from npytypes.quaternion.index import RotationIndex
 from npytypes.quaternion.info import __doc__
 
-__all__ = ['quaternion']
+__all__ = ['quaternion', 'quaternion32', 'dual_quaternion', 'rotate', 'as_rotation_matrix',
+           'from_rotation_matrix', 'as_rotation_vector', 'from_rotation_vector',
+           'as_euler', 'from_euler', 'slerp', 'squad', 'resample', 'product',
+           'cumulative_product', 'mean_rotation', 'weighted_mean_rotation',
+           'integrate_angular_velocity', 'angular_velocity', 'inner',
+           'matrix_multiply', 'chordal_distance', 'intrinsic_distance',
+           'rotation_distance', 'pairwise_distance', 'RotationIndex',
+           'normalized', 'transform', 'sclerp', 'from_rigid_transform',
+           'as_rigid_transform', 'inverse', 'norm', 'isunit', 'unit_multiply',
+           'set_fast_normalize']
 
 if np.__dict__.get('quaternion') is not None:
     raise RuntimeError('The NumPy package already has a quaternion type')
 
 np.quaternion = quaternion
 np.typeDict['quaternion'] = np.dtype(quaternion)
+np.quaternion32 = quaternion32
+np.typeDict['quaternion32'] = np.dtype(quaternion32)
+np.dual_quaternion = dual_quaternion
+np.typeDict['dual_quaternion'] = np.dtype(dual_quaternion)
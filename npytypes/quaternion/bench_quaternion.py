@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+'''Timings for the quaternion ufunc loops.  Run with "python bench_quaternion.py".
+
+Each loop is timed on contiguous arrays, which mostly run the vectorized
+kernels, and on strided ones, which run the element by element loops, in
+nanoseconds per element.  To see the effect of a build, such as the
+NPYTYPES_OPTIMIZE=1 profile of setup.py, save the timings of one build with
+"--save file" and give the file to a run of the other with "--compare file".
+'''
+
+from __future__ import division, print_function
+import argparse
+import json
+import sys
+import timeit
+import numpy as np
+import npytypes.quaternion as nq
+from npytypes.quaternion import numpy_quaternion
+
+def best(f, repeat=5):
+    '''Best of several timings of f(), in seconds'''
+    number = 1
+    while timeit.timeit(f, number=number) < 0.2 and number < 1<<20:
+        number *= 2
+    return min(timeit.repeat(f, number=number, repeat=repeat))/number
+
+def random_quaternions(dtype, n, seed):
+    '''n random quaternions, and the same every other element of 2n'''
+    real = np.float64 if dtype == nq.quaternion else np.float32
+    r = np.random.RandomState(seed)
+    a = r.normal(size=(2*n, 4)).astype(real).view(dtype).reshape(2*n)
+    return a[:n].copy(), a[::2]
+
+def loops(dtype):
+    '''(name, f) for the loops of dtype, f taking quaternion arrays a and b
+    and real arrays s of the same length'''
+    unary = ['negative', 'conjugate', 'absolute', 'isnan', 'isinf', 'isfinite',
+             'exp', 'log']
+    binary = ['add', 'subtract', 'multiply', 'divide', 'power', 'copysign',
+              'equal', 'not_equal', 'less', 'less_equal']
+    result = [(name, lambda a, b, s, f=getattr(np, name): f(a)) for name in unary]
+    result += [(name, lambda a, b, s, f=getattr(np, name): f(a, b)) for name in binary]
+    result += [(name + ' real', lambda a, b, s, f=getattr(np, name): f(a, s))
+               for name in ('add', 'subtract', 'multiply', 'divide', 'power')]
+    result += [(name, lambda a, b, s, f=getattr(nq, name): f(a))
+               for name in ('normalized', 'inverse', 'norm', 'isunit')]
+    result += [(name, lambda a, b, s, f=getattr(nq, name): f(a, b))
+               for name in ('unit_multiply', 'inner')]
+    if dtype == nq.quaternion:
+        result += [(name, lambda a, b, s, f=getattr(nq, name): f(a, b))
+                   for name in ('chordal_distance', 'rotation_distance')]
+        result += [('slerp', lambda a, b, s: nq.slerp(a, b, s))]
+    return result
+
+def bench_loops(n=100000):
+    '''Time every loop, returning {"dtype loop layout": ns per element}'''
+    print('ns per element, n = %d (module %s, simd %s)' % (n, numpy_quaternion.__name__,
+                                                            numpy_quaternion.simd))
+    times = {}
+    for dtype in nq.quaternion, nq.quaternion32:
+        real = np.float64 if dtype == nq.quaternion else np.float32
+        a, a_strided = random_quaternions(dtype, n, 1)
+        b, b_strided = random_quaternions(dtype, n, 2)
+        s = np.random.RandomState(3).uniform(0, 1, 2*n).astype(real)
+        for name, f in loops(dtype):
+            for layout, args in ('contiguous', (a, b, s[:n])), ('strided', (a_strided, b_strided, s[::2])):
+                key = '%s %s %s' % (dtype.__name__, name, layout)
+                times[key] = best(lambda: f(*args))/n*1e9
+    return times
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--save', help='file to save the timings in')
+    parser.add_argument('--compare', help='file of timings of another build to compare with')
+    args = parser.parse_args()
+    times = bench_loops()
+    base = {}
+    if args.compare:
+        with open(args.compare) as f:
+            base = json.load(f)
+    for key in sorted(times):
+        if key in base:
+            print('  %-44s %8.2f %8.2f %6.2fx' % (key, base[key], times[key], base[key]/times[key]))
+        else:
+            print('  %-44s %8.2f' % (key, times[key]))
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(times, f, indent=1, sort_keys=True)
@@ -0,0 +1,144 @@
+import numpy as np
+
+from npytypes.quaternion.numpy_quaternion import (quaternion, rotation_distance,
+    index_query, index_count)
+
+# QUATERNION_PLANE_ALIGN in quaternion_simd.h
+_ALIGN = 16
+# Added to the cell radii, for the vectorized distances rounding differently
+_SLACK = 1e-9
+
+def _components(q):
+    '''The w, x, y and z components of q as an (n, 4) array of doubles'''
+    return np.ascontiguousarray(q, dtype=quaternion).reshape(-1).view(np.float64).reshape(-1, 4)
+
+def _quaternions(c):
+    '''The inverse of _components'''
+    return np.ascontiguousarray(c, dtype=np.float64).view(quaternion).reshape(-1)
+
+def _planes(c, n):
+    '''Components c as planes of w, x, y and z, padded with 1, 0, 0, 0 to n'''
+    p = np.zeros((4, n))
+    p[0] = 1
+    p[:, :len(c)] = c.T
+    return p
+
+class RotationIndex(object):
+    '''Nearest neighbour index over an array of quaternions as rotations
+
+    The distance is rotation_distance, the angle of the rotation from one
+    quaternion to the other, so q and -q are the same point and quaternions
+    need not be normalized.  The unit quaternions are split into cells by
+    the face of the 4-cube their larger of q and -q projects onto, each face
+    an equal angle grid of resolution cells a side, and queries scan the
+    nonempty cells nearest first.  resolution defaults to about (n/4)**(1/6),
+    which balances scanning cell centers against scanning points.
+    Quaternions with no direction (zero, inf or nan) are never found.
+    '''
+
+    def __init__(self, q, resolution=None):
+        c = _components(q)
+        self.size = len(c)
+        with np.errstate(invalid='ignore', divide='ignore'):
+            u = c / np.sqrt((c*c).sum(1))[:, None]
+        keep = np.flatnonzero(np.isfinite(u).all(1))
+        u = u[keep]
+        if resolution is None:
+            resolution = int(round((max(len(u), 1)/4.)**(1/6.)))
+        g = max(int(resolution), 1)
+
+        # The face is the largest component, made positive, and the others
+        # divided by it are in [-1, 1], gridded equally by angle
+        face = np.abs(u).argmax(1)
+        rows = np.arange(len(u))
+        u *= np.where(u[rows, face] < 0, -1., 1.)[:, None]
+        others = (face[:, None] + np.arange(1, 4)) % 4
+        t = u[rows[:, None], others]/u[rows, face][:, None]
+        grid = np.clip(np.floor((np.arctan(t)*(4/np.pi) + 1)*(g/2.)), 0, g - 1).astype(np.intp)
+        cell = ((face*g + grid[:, 0])*g + grid[:, 1])*g + grid[:, 2]
+
+        sort = np.argsort(cell, kind='mergesort')
+        cell, u, keep = cell[sort], u[sort], keep[sort]
+        first = np.flatnonzero(np.r_[True, cell[1:] != cell[:-1]]) if len(cell) else \
+            np.zeros(0, np.intp)
+        counts = np.diff(np.r_[first, len(cell)])
+        padded = (counts + _ALIGN - 1)//_ALIGN*_ALIGN
+        self.offsets = np.r_[0, np.cumsum(padded)].astype(np.intp)
+        rank = np.repeat(np.arange(len(first)), counts)
+        at = self.offsets[rank] + np.arange(len(cell)) - np.repeat(first, counts)
+
+        p = max(self.offsets[-1], _ALIGN)
+        self.points = np.zeros((4, p))
+        self.points[0] = 1
+        self.points[:, at] = u.T
+        self.order = np.full(p, -1, dtype=np.intp)
+        self.order[at] = keep
+
+        if len(first):
+            centers = np.add.reduceat(u, first)
+            centers /= np.sqrt((centers*centers).sum(1))[:, None]
+            d = rotation_distance(_quaternions(centers)[rank], _quaternions(u))
+            self.radii = np.maximum.reduceat(d, first) + _SLACK
+        else:
+            centers = np.zeros((0, 4))
+            self.radii = np.zeros(0)
+        self.centers = _planes(centers, max(len(padded) + _ALIGN - 1, _ALIGN)//_ALIGN*_ALIGN)
+
+    def __len__(self):
+        return self.size
+
+    def _layout(self):
+        return self.points, self.order, self.centers, self.radii, self.offsets
+
+    def query(self, q, k=1, radius=np.inf):
+        '''The distances and indices of the k nearest quaternions to each q
+
+        Returns arrays of shape q.shape + (k,), nearest first, ties going to
+        the lower index, with inf and -1 past the last within radius.
+        '''
+        q = np.asarray(q, dtype=quaternion)
+        shape = np.broadcast(q, np.asarray(radius)).shape + (int(k),)
+        indices = np.empty(shape, dtype=np.intp)
+        distances = np.empty(shape)
+        index_query(q, radius, *self._layout(), out=(indices, distances))
+        return distances, indices
+
+    def count(self, q, radius):
+        '''The number of quaternions within radius of each q'''
+        return index_count(np.asarray(q, dtype=quaternion), radius, *self._layout())
+
+    def query_radius(self, q, radius):
+        '''The distances and indices of the quaternions within radius of q
+
+        For a single q returns arrays nearest first; for an array of q,
+        object arrays of its shape holding these.
+        '''
+        q = np.asarray(q, dtype=quaternion)
+        counts = self.count(q, radius)
+        distances, indices = self.query(q, counts.max() if counts.size else 0, radius)
+        if counts.ndim == 0:
+            return distances[:counts], indices[:counts]
+        d = np.empty(counts.shape, dtype=object)
+        i = np.empty(counts.shape, dtype=object)
+        for j in np.ndindex(*counts.shape):
+            d[j] = distances[j][:counts[j]]
+            i[j] = indices[j][:counts[j]]
+        return d, i
+
+    def save(self, file):
+        '''Saves the index to file (a name or open file) with np.savez'''
+        np.savez(file, size=self.size, points=self.points, order=self.order,
+                 centers=self.centers, radii=self.radii, offsets=self.offsets)
+
+    @classmethod
+    def load(cls, file):
+        '''An index saved with save'''
+        self = cls.__new__(cls)
+        with np.load(file) as f:
+            self.size = int(f['size'])
+            self.points = f['points']
+            self.order = f['order'].astype(np.intp)
+            self.centers = f['centers']
+            self.radii = f['radii']
+            self.offsets = f['offsets'].astype(np.intp)
+        return self
@@ -31,63 +31,83 @@
 
 #include <Python.h>
 #include <numpy/arrayobject.h>
+#include <numpy/arrayscalars.h>
 #include <numpy/npy_math.h>
 #include <numpy/ufuncobject.h>
 #include "structmember.h"
 #include "numpy/npy_3kcompat.h"
 
+/* Inline the quaternion arithmetic into the ufunc loops */
+#define QUATERNION_INLINE
 #include "quaternion.h"
+#include "quaternion_simd.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 typedef struct {
         PyObject_HEAD
         quaternion obval;
 } PyQuaternionScalarObject;
 
-PyMemberDef PyQuaternionArrType_members[] = {
-    {"real", T_DOUBLE, offsetof(PyQuaternionScalarObject, obval.w), READONLY,
-        "The real component of the quaternion"},
-    {"w", T_DOUBLE, offsetof(PyQuaternionScalarObject, obval.w), READONLY,
-        "The real component of the quaternion"},
-    {"x", T_DOUBLE, offsetof(PyQuaternionScalarObject, obval.x), READONLY,
-        "The first imaginary component of the quaternion"},
-    {"y", T_DOUBLE, offsetof(PyQuaternionScalarObject, obval.y), READONLY,
-        "The second imaginary component of the quaternion"},
-    {"z", T_DOUBLE, offsetof(PyQuaternionScalarObject, obval.z), READONLY,
-        "The third imaginary component of the quaternion"},
-    {NULL}
-};
-
-static PyObject *
-PyQuaternionArrType_get_components(PyObject *self, void *closure)
-{
-    quaternion *q = &((PyQuaternionScalarObject *)self)->obval;
-    PyObject *tuple = PyTuple_New(4);
-    PyTuple_SET_ITEM(tuple, 0, PyFloat_FromDouble(q->w));
-    PyTuple_SET_ITEM(tuple, 1, PyFloat_FromDouble(q->x));
-    PyTuple_SET_ITEM(tuple, 2, PyFloat_FromDouble(q->y));
-    PyTuple_SET_ITEM(tuple, 3, PyFloat_FromDouble(q->z));
-    return tuple;
-}
+typedef struct {
+        PyObject_HEAD
+        quaternion32 obval;
+} PyQuaternion32ScalarObject;
 
-static PyObject *
-PyQuaternionArrType_get_imag(PyObject *self, void *closure)
-{
-    quaternion *q = &((PyQuaternionScalarObject *)self)->obval;
-    PyObject *tuple = PyTuple_New(3);
-    PyTuple_SET_ITEM(tuple, 0, PyFloat_FromDouble(q->x));
-    PyTuple_SET_ITEM(tuple, 1, PyFloat_FromDouble(q->y));
-    PyTuple_SET_ITEM(tuple, 2, PyFloat_FromDouble(q->z));
-    return tuple;
-}
+typedef struct {
+        PyObject_HEAD
+        dual_quaternion obval;
+} PyDualQuaternionScalarObject;
 
-PyGetSetDef PyQuaternionArrType_getset[] = {
-    {"components", PyQuaternionArrType_get_components, NULL,
-        "The components of the quaternion as a (w,x,y,z) tuple", NULL},
-    {"imag", PyQuaternionArrType_get_imag, NULL,
-        "The imaginary part of the quaternion as an (x,y,z) tuple", NULL},
-    {NULL}
+#define QUATERNION_MEMBERS(Type, T_TYPE)\
+PyMemberDef Py##Type##ArrType_members[] = {\
+    {"real", T_TYPE, offsetof(Py##Type##ScalarObject, obval.w), READONLY,\
+        "The real component of the quaternion"},\
+    {"w", T_TYPE, offsetof(Py##Type##ScalarObject, obval.w), READONLY,\
+        "The real component of the quaternion"},\
+    {"x", T_TYPE, offsetof(Py##Type##ScalarObject, obval.x), READONLY,\
+        "The first imaginary component of the quaternion"},\
+    {"y", T_TYPE, offsetof(Py##Type##ScalarObject, obval.y), READONLY,\
+        "The second imaginary component of the quaternion"},\
+    {"z", T_TYPE, offsetof(Py##Type##ScalarObject, obval.z), READONLY,\
+        "The third imaginary component of the quaternion"},\
+    {NULL}\
+};\
+\
+static PyObject *\
+Py##Type##ArrType_get_components(PyObject *self, void *closure)\
+{\
+    PyObject *tuple = PyTuple_New(4);\
+    PyTuple_SET_ITEM(tuple, 0, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.w));\
+    PyTuple_SET_ITEM(tuple, 1, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.x));\
+    PyTuple_SET_ITEM(tuple, 2, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.y));\
+    PyTuple_SET_ITEM(tuple, 3, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.z));\
+    return tuple;\
+}\
+\
+static PyObject *\
+Py##Type##ArrType_get_imag(PyObject *self, void *closure)\
+{\
+    PyObject *tuple = PyTuple_New(3);\
+    PyTuple_SET_ITEM(tuple, 0, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.x));\
+    PyTuple_SET_ITEM(tuple, 1, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.y));\
+    PyTuple_SET_ITEM(tuple, 2, PyFloat_FromDouble(((Py##Type##ScalarObject *)self)->obval.z));\
+    return tuple;\
+}\
+\
+PyGetSetDef Py##Type##ArrType_getset[] = {\
+    {"components", Py##Type##ArrType_get_components, NULL,\
+        "The components of the quaternion as a (w,x,y,z) tuple", NULL},\
+    {"imag", Py##Type##ArrType_get_imag, NULL,\
+        "The imaginary part of the quaternion as an (x,y,z) tuple", NULL},\
+    {NULL}\
 };
 
+QUATERNION_MEMBERS(Quaternion, T_DOUBLE)
+QUATERNION_MEMBERS(Quaternion32, T_FLOAT)
+
 PyTypeObject PyQuaternionArrType_Type = {
 #if defined(NPY_PY3K)
     PyVarObject_HEAD_INIT(NULL, 0)
@@ -149,51 +169,265 @@ PyTypeObject PyQuaternionArrType_Type = {
 #endif
 };
 
+/* The remaining slots are filled in, as for quaternion, at module init */
+PyTypeObject PyQuaternion32ArrType_Type = {
+#if defined(NPY_PY3K)
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                                          /* ob_size */
+#endif
+    "quaternion.quaternion32",                  /* tp_name*/
+    sizeof(PyQuaternion32ScalarObject),         /* tp_basicsize*/
+};
+
+PyTypeObject PyDualQuaternionArrType_Type = {
+#if defined(NPY_PY3K)
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                                          /* ob_size */
+#endif
+    "quaternion.dual_quaternion",               /* tp_name*/
+    sizeof(PyDualQuaternionScalarObject),       /* tp_basicsize*/
+};
+
+/*
+ * Freed quaternion and quaternion32 scalars are kept for reuse, so chains of
+ * scalar arithmetic and element reads don't go through the allocator.
+ * Subclass instances are never cached.
+ */
+#define QUATERNION_FREELIST_SIZE 64
+typedef struct {
+    PyObject *items[QUATERNION_FREELIST_SIZE];
+    int count;
+} scalar_freelist;
+static scalar_freelist quaternion_freelist, quaternion32_freelist;
+
+/* The freelist for instances of exactly type, or NULL */
+static scalar_freelist *
+freelist_for(PyTypeObject *type)
+{
+    if (type == &PyQuaternionArrType_Type) {
+        return &quaternion_freelist;
+    }
+    if (type == &PyQuaternion32ArrType_Type) {
+        return &quaternion32_freelist;
+    }
+    return NULL;
+}
+
+static PyObject *
+quaternion_arrtype_alloc(PyTypeObject *type, Py_ssize_t nitems)
+{
+    scalar_freelist *f = freelist_for(type);
+    PyObject *o;
+
+    if (f && f->count > 0) {
+        o = f->items[--f->count];
+        (void)PyObject_INIT(o, type);
+        return o;
+    }
+    return PyType_GenericAlloc(type, nitems);
+}
+
+static void
+quaternion_arrtype_free(void *p)
+{
+    PyObject *o = (PyObject *)p;
+    scalar_freelist *f = freelist_for(Py_TYPE(o));
+
+    if (f && f->count < QUATERNION_FREELIST_SIZE) {
+        f->items[f->count++] = o;
+        return;
+    }
+    PyObject_Del(o);
+}
+
+static PyObject *
+PyQuaternion_FromQuaternion(quaternion q)
+{
+    PyQuaternionScalarObject *p = (PyQuaternionScalarObject *)
+        PyQuaternionArrType_Type.tp_alloc(&PyQuaternionArrType_Type, 0);
+    if (p) {
+        p->obval = q;
+    }
+    return (PyObject *)p;
+}
+
+static PyObject *
+PyQuaternion32_FromQuaternion32(quaternion32 q)
+{
+    PyQuaternion32ScalarObject *p = (PyQuaternion32ScalarObject *)
+        PyQuaternion32ArrType_Type.tp_alloc(&PyQuaternion32ArrType_Type, 0);
+    if (p) {
+        p->obval = q;
+    }
+    return (PyObject *)p;
+}
+
+/*
+ * Python real numbers, as a double, for scalar arithmetic.  Returns 0 for
+ * anything else.
+ */
+static int
+quaternion_real_operand(PyObject *o, double *s)
+{
+    if (PyFloat_Check(o)) {
+        *s = PyFloat_AS_DOUBLE(o);
+        return 1;
+    }
+    if (PyLong_Check(o) || PyInt_Check(o) || PyArray_IsScalar(o, Integer) ||
+            PyArray_IsScalar(o, Floating)) {
+        *s = PyFloat_AsDouble(o);
+        if (*s == -1 && PyErr_Occurred()) {
+            PyErr_Clear();
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
 static PyArray_ArrFuncs _PyQuaternion_ArrFuncs;
+static PyArray_ArrFuncs _PyQuaternion32_ArrFuncs;
+static PyArray_ArrFuncs _PyDualQuaternion_ArrFuncs;
 PyArray_Descr *quaternion_descr;
+PyArray_Descr *quaternion32_descr;
+PyArray_Descr *dual_quaternion_descr;
+
+/*
+ * Copy the four components of an element of ap, of type real_num, swapping
+ * their bytes if ap is byte-swapped.  Either pointer may be unaligned.
+ */
+static void
+copy_components(void *dst, void *src, int real_num, PyArrayObject *ap)
+{
+    PyArray_Descr *descr = PyArray_DescrFromType(real_num);
+    descr->f->copyswapn(dst, descr->elsize, src, descr->elsize, 4,
+            ap != NULL && !PyArray_ISNOTSWAPPED(ap), NULL);
+    Py_DECREF(descr);
+}
 
 static PyObject *
 QUATERNION_getitem(char *ip, PyArrayObject *ap)
 {
     quaternion q;
-    PyObject *tuple;
 
     if ((ap == NULL) || PyArray_ISBEHAVED_RO(ap)) {
         q = *((quaternion *)ip);
     }
     else {
-        PyArray_Descr *descr;
-        descr = PyArray_DescrFromType(NPY_DOUBLE);
-        descr->f->copyswap(&q.w, ip, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(&q.x, ip+8, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(&q.y, ip+16, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(&q.z, ip+24, !PyArray_ISNOTSWAPPED(ap), NULL);
-        Py_DECREF(descr);
+        copy_components(&q, ip, NPY_DOUBLE, ap);
     }
 
-    tuple = PyTuple_New(4);
-    PyTuple_SET_ITEM(tuple, 0, PyFloat_FromDouble(q.w));
-    PyTuple_SET_ITEM(tuple, 1, PyFloat_FromDouble(q.x));
-    PyTuple_SET_ITEM(tuple, 2, PyFloat_FromDouble(q.y));
-    PyTuple_SET_ITEM(tuple, 3, PyFloat_FromDouble(q.z));
+    return PyQuaternion_FromQuaternion(q);
+}
+
+static PyObject *
+QUATERNION32_getitem(char *ip, PyArrayObject *ap)
+{
+    quaternion32 q;
 
-    return tuple;
+    if ((ap == NULL) || PyArray_ISBEHAVED_RO(ap)) {
+        q = *((quaternion32 *)ip);
+    }
+    else {
+        copy_components(&q, ip, NPY_FLOAT, ap);
+    }
+
+    return PyQuaternion32_FromQuaternion32(q);
 }
 
-static int QUATERNION_setitem(PyObject *op, char *ov, PyArrayObject *ap)
+/*
+ * Read the components of a 4-element sequence or 1-d real array into q.
+ * Returns -1 with an exception set on failure.
+ */
+static int
+quaternion_from_sequence(PyObject *op, quaternion *q)
 {
-    quaternion q;
+    double *c = &q->w;
+    PyObject *seq, **items;
+    int i;
+
+    if (PyArray_Check(op)) {
+        PyArrayObject *arr;
+        if (!PyArray_ISNUMBER((PyArrayObject *)op) ||
+                PyArray_ISCOMPLEX((PyArrayObject *)op) ||
+                PyArray_NDIM((PyArrayObject *)op) != 1 ||
+                PyArray_DIM((PyArrayObject *)op, 0) != 4) {
+            PyErr_SetString(PyExc_ValueError,
+                    "setting an array element with a sequence.");
+            return -1;
+        }
+        arr = (PyArrayObject *)PyArray_FROM_OTF(op, NPY_DOUBLE,
+                NPY_ARRAY_CARRAY_RO | NPY_ARRAY_FORCECAST);
+        if (arr == NULL) {
+            return -1;
+        }
+        memcpy(c, PyArray_DATA(arr), 4 * sizeof(double));
+        Py_DECREF(arr);
+        return 0;
+    }
+    if (!PySequence_Check(op)) {
+        PyErr_Format(PyExc_TypeError, "can't set a quaternion from %s",
+                Py_TYPE(op)->tp_name);
+        return -1;
+    }
+    seq = PySequence_Fast(op, "setting an array element with a sequence.");
+    if (seq == NULL) {
+        return -1;
+    }
+    if (PySequence_Fast_GET_SIZE(seq) != 4) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError,
+                "setting an array element with a sequence.");
+        return -1;
+    }
+    items = PySequence_Fast_ITEMS(seq);
+    for (i = 0; i < 4; i++) {
+        if (PyFloat_CheckExact(items[i])) {
+            c[i] = PyFloat_AS_DOUBLE(items[i]);
+        }
+        else {
+            c[i] = PyFloat_AsDouble(items[i]);
+            if (c[i] == -1 && PyErr_Occurred()) {
+                Py_DECREF(seq);
+                return -1;
+            }
+        }
+    }
+    Py_DECREF(seq);
+    return 0;
+}
 
+/*
+ * The quaternion value of a quaternion scalar of either precision, a real
+ * number, a complex number (w + x i, as the casts give) or a sequence of four
+ * real numbers, for setitem.
+ */
+static int
+quaternion_from_object(PyObject *op, quaternion *q)
+{
     if (PyArray_IsScalar(op, Quaternion)) {
-        q = ((PyQuaternionScalarObject *)op)->obval;
+        *q = ((PyQuaternionScalarObject *)op)->obval;
     }
-    else {
-        q.w = PyFloat_AsDouble(PyTuple_GetItem(op, 0));
-        q.x = PyFloat_AsDouble(PyTuple_GetItem(op, 1));
-        q.y = PyFloat_AsDouble(PyTuple_GetItem(op, 2));
-        q.z = PyFloat_AsDouble(PyTuple_GetItem(op, 3));
+    else if (PyArray_IsScalar(op, Quaternion32)) {
+        quaternion32 f = ((PyQuaternion32ScalarObject *)op)->obval;
+        *q = (quaternion) {f.w, f.x, f.y, f.z};
+    }
+    else if (!PyTuple_Check(op) && !PyList_Check(op) &&
+            quaternion_real_operand(op, &q->w)) {
+        q->x = q->y = q->z = 0;
+    }
+    else if (PyComplex_Check(op) || PyArray_IsScalar(op, ComplexFloating)) {
+        Py_complex z = PyComplex_AsCComplex(op);
+        if (z.real == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        *q = (quaternion) {z.real, z.imag, 0, 0};
     }
-    if (PyErr_Occurred()) {
+    else if (quaternion_from_sequence(op, q) < 0) {
         if (PySequence_Check(op)) {
             PyErr_Clear();
             PyErr_SetString(PyExc_ValueError,
@@ -201,302 +435,2980 @@ static int QUATERNION_setitem(PyObject *op, char *ov, PyArrayObject *ap)
         }
         return -1;
     }
+    return 0;
+}
+
+static int QUATERNION_setitem(PyObject *op, char *ov, PyArrayObject *ap)
+{
+    quaternion q;
+
+    if (quaternion_from_object(op, &q) < 0) {
+        return -1;
+    }
     if (ap == NULL || PyArray_ISBEHAVED(ap))
         *((quaternion *)ov)=q;
     else {
-        PyArray_Descr *descr;
-        descr = PyArray_DescrFromType(NPY_DOUBLE);
-        descr->f->copyswap(ov, &q.w, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(ov+8, &q.x, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(ov+16, &q.y, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(ov+24, &q.z, !PyArray_ISNOTSWAPPED(ap), NULL);
-        Py_DECREF(descr);
+        copy_components(ov, &q, NPY_DOUBLE, ap);
+    }
+
+    return 0;
+}
+
+static int QUATERNION32_setitem(PyObject *op, char *ov, PyArrayObject *ap)
+{
+    quaternion32 q;
+
+    if (PyArray_IsScalar(op, Quaternion32)) {
+        q = ((PyQuaternion32ScalarObject *)op)->obval;
+    }
+    else {
+        quaternion d;
+        if (quaternion_from_object(op, &d) < 0) {
+            return -1;
+        }
+        q = (quaternion32) {(float)d.w, (float)d.x, (float)d.y, (float)d.z};
+    }
+    if (ap == NULL || PyArray_ISBEHAVED(ap))
+        *((quaternion32 *)ov)=q;
+    else {
+        copy_components(ov, &q, NPY_FLOAT, ap);
+    }
+
+    return 0;
+}
+
+static PyObject *
+DUAL_QUATERNION_getitem(char *ip, PyArrayObject *ap)
+{
+    dual_quaternion a;
+
+    if ((ap == NULL) || PyArray_ISBEHAVED_RO(ap)) {
+        a = *((dual_quaternion *)ip);
+    }
+    else {
+        copy_components(&a.r, ip, NPY_DOUBLE, ap);
+        copy_components(&a.d, ip + sizeof(quaternion), NPY_DOUBLE, ap);
+    }
+
+    return PyArray_Scalar(&a, dual_quaternion_descr, NULL);
+}
+
+/*
+ * The value of a dual quaternion scalar, a pair (r, d) of quaternion values,
+ * eight real numbers, or a quaternion value r with d = 0.
+ */
+static int
+dual_quaternion_from_object(PyObject *op, dual_quaternion *a)
+{
+    if (PyArray_IsScalar(op, DualQuaternion)) {
+        *a = ((PyDualQuaternionScalarObject *)op)->obval;
+        return 0;
+    }
+    if ((PyTuple_Check(op) || PyList_Check(op)) && PySequence_Size(op) == 2) {
+        PyObject *r = PySequence_GetItem(op, 0), *d = PySequence_GetItem(op, 1);
+        int ret = (r && d && quaternion_from_object(r, &a->r) == 0 &&
+                quaternion_from_object(d, &a->d) == 0) ? 0 : -1;
+        Py_XDECREF(r);
+        Py_XDECREF(d);
+        return ret;
+    }
+    if (((PyTuple_Check(op) || PyList_Check(op)) && PySequence_Size(op) == 8) ||
+            (PyArray_Check(op) && PyArray_SIZE((PyArrayObject *)op) == 8)) {
+        PyArrayObject *arr = (PyArrayObject *)PyArray_FROM_OTF(op, NPY_DOUBLE,
+                NPY_ARRAY_CARRAY_RO | NPY_ARRAY_FORCECAST);
+        if (arr == NULL) {
+            return -1;
+        }
+        memcpy(a, PyArray_DATA(arr), sizeof(dual_quaternion));
+        Py_DECREF(arr);
+        return 0;
+    }
+    a->d = (quaternion) {0, 0, 0, 0};
+    return quaternion_from_object(op, &a->r);
+}
+
+static int DUAL_QUATERNION_setitem(PyObject *op, char *ov, PyArrayObject *ap)
+{
+    dual_quaternion a;
+
+    if (dual_quaternion_from_object(op, &a) < 0) {
+        return -1;
+    }
+    if (ap == NULL || PyArray_ISBEHAVED(ap))
+        *((dual_quaternion *)ov)=a;
+    else {
+        copy_components(ov, &a.r, NPY_DOUBLE, ap);
+        copy_components(ov + sizeof(quaternion), &a.d, NPY_DOUBLE, ap);
     }
 
     return 0;
 }
 
+/* The remaining array functions, for quaternion type Q with components of real_num */
+#define QUATERNION_ARRFUNCS(NAME, Q, real_num)\
+static void \
+NAME##_copyswap(Q *dst, Q *src, int swap, void *NPY_UNUSED(arr))\
+{\
+    PyArray_Descr *descr;\
+    descr = PyArray_DescrFromType(real_num);\
+    descr->f->copyswapn(dst, descr->elsize, src, descr->elsize, 4, swap, NULL);\
+    Py_DECREF(descr);\
+}\
+\
+static void \
+NAME##_copyswapn(Q *dst, npy_intp dstride, Q *src, npy_intp sstride,\
+        npy_intp n, int swap, void *NPY_UNUSED(arr))\
+{\
+    PyArray_Descr *descr;\
+    descr = PyArray_DescrFromType(real_num);\
+    descr->f->copyswapn(&dst->w, dstride, &src->w, sstride, n, swap, NULL);\
+    descr->f->copyswapn(&dst->x, dstride, &src->x, sstride, n, swap, NULL);\
+    descr->f->copyswapn(&dst->y, dstride, &src->y, sstride, n, swap, NULL);\
+    descr->f->copyswapn(&dst->z, dstride, &src->z, sstride, n, swap, NULL);\
+    Py_DECREF(descr);\
+}\
+\
+static int \
+NAME##_compare(Q *pa, Q *pb, PyArrayObject *NPY_UNUSED(ap))\
+{\
+    Q a = *pa, b = *pb;\
+    npy_bool anan, bnan;\
+    int ret;\
+\
+    anan = Q##_isnan(a);\
+    bnan = Q##_isnan(b);\
+\
+    if (anan) {\
+        ret = bnan ? 0 : -1;\
+    } else if (bnan) {\
+        ret = 1;\
+    } else if(Q##_less(a, b)) {\
+        ret = -1;\
+    } else if(Q##_less(b, a)) {\
+        ret = 1;\
+    } else {\
+        ret = 0;\
+    }\
+\
+    return ret;\
+}\
+\
+static int \
+NAME##_argmax(Q *ip, npy_intp n, npy_intp *max_ind, PyArrayObject *NPY_UNUSED(aip))\
+{\
+    npy_intp i;\
+    Q mp = *ip;\
+\
+    *max_ind = 0;\
+\
+    if (Q##_isnan(mp)) {\
+        /* nan encountered; it's maximal */\
+        return 0;\
+    }\
+\
+    for (i = 1; i < n; i++) {\
+        ip++;\
+        /*\
+         * Propagate nans, similarly as max() and min()\
+         */\
+        if (!(Q##_less_equal(*ip, mp))) {  /* negated, for correct nan handling */\
+            mp = *ip;\
+            *max_ind = i;\
+            if (Q##_isnan(mp)) {\
+                /* nan encountered, it's maximal */\
+                break;\
+            }\
+        }\
+    }\
+    return 0;\
+}\
+\
+static int \
+NAME##_argmin(Q *ip, npy_intp n, npy_intp *min_ind, PyArrayObject *NPY_UNUSED(aip))\
+{\
+    npy_intp i;\
+    Q mp = *ip;\
+\
+    *min_ind = 0;\
+\
+    if (Q##_isnan(mp)) {\
+        /* nan encountered; it's minimal */\
+        return 0;\
+    }\
+\
+    for (i = 1; i < n; i++) {\
+        ip++;\
+        /*\
+         * Propagate nans, similarly as max() and min()\
+         */\
+        if (!(Q##_less_equal(mp, *ip))) {  /* negated, for correct nan handling */\
+            mp = *ip;\
+            *min_ind = i;\
+            if (Q##_isnan(mp)) {\
+                /* nan encountered, it's minimal */\
+                break;\
+            }\
+        }\
+    }\
+    return 0;\
+}\
+\
+static npy_bool \
+NAME##_nonzero (char *ip, PyArrayObject *ap)\
+{\
+    Q q;\
+    if (ap == NULL || PyArray_ISBEHAVED_RO(ap)) {\
+        q = *(Q *)ip;\
+    }\
+    else {\
+        copy_components(&q, ip, real_num, ap);\
+    }\
+    return (npy_bool) Q##_isnonzero(q);\
+}\
+\
+static void \
+NAME##_fillwithscalar(Q *buffer, npy_intp length, Q *value, void *NPY_UNUSED(ignored))\
+{\
+    npy_intp i;\
+    Q val = *value;\
+\
+    for (i = 0; i < length; ++i) {\
+        buffer[i] = val;\
+    }\
+}
+
+QUATERNION_ARRFUNCS(QUATERNION, quaternion, NPY_DOUBLE)
+QUATERNION_ARRFUNCS(QUATERNION32, quaternion32, NPY_FLOAT)
+
+/*
+ * Sorting, in the order of compare: quaternions with a nan component first,
+ * then the others lexicographically by w, x, y and z.  The comparison sorts
+ * take the quaternions directly (sort) or as indices into an array v
+ * (argsort), with the comparisons inline.  quicksort and heapsort move the nan
+ * quaternions to the front and sort the rest, quicksort as an introsort
+ * (median of three quicksort, turning to heapsort past 2 log2 n levels and to
+ * insertion sort below SORT_SMALL elements).  Stable sorts are merge sorts
+ * below RADIX_MIN elements, and from there on, as are quicksorts, the radix
+ * sort below.
+ */
+#define SORT_SMALL 16
+#define RADIX_MIN 1024
+#define RADIX_RUN 64
+
+#define SORT_NAN(q) ((q).w != (q).w || (q).x != (q).x || (q).y != (q).y || (q).z != (q).z)
+/* Less than for quaternions without nan components */
+#define SORT_LT(a, b) ((a).w < (b).w || ((a).w == (b).w &&\
+    ((a).x < (b).x || ((a).x == (b).x &&\
+    ((a).y < (b).y || ((a).y == (b).y && (a).z < (b).z))))))
+/* Less than in the order of compare */
+#define SORT_LESS(a, b) (SORT_NAN(a) ? !SORT_NAN(b) : !SORT_NAN(b) && SORT_LT(a, b))
+#define SORT_SWAP(E, a, b) { E t_ = (a); (a) = (b); (b) = t_; }
+
+#define SORT_VALUE(e) (e)
+#define SORT_INDEXED(e) (v[e])
+
+/* Sorts of n elements a of type E, each standing for the quaternion K(e) */
+#define QUATERNION_COMPARISON_SORTS(NAME, Q, E, K)\
+static void \
+NAME##_insertion(E *a, npy_intp n, const Q *v)\
+{\
+    npy_intp i, j;\
+    (void)v;\
+    for (i = 1; i < n; i++) {\
+        E e = a[i];\
+        for (j = i; j > 0 && SORT_LESS(K(e), K(a[j - 1])); j--) {\
+            a[j] = a[j - 1];\
+        }\
+        a[j] = e;\
+    }\
+}\
+\
+static void \
+NAME##_sift(E *a, npy_intp i, npy_intp n, const Q *v)\
+{\
+    E e = a[i];\
+    npy_intp j;\
+    (void)v;\
+    for (j = 2*i + 1; j < n; i = j, j = 2*i + 1) {\
+        if (j + 1 < n && SORT_LT(K(a[j]), K(a[j + 1]))) {\
+            j++;\
+        }\
+        if (!SORT_LT(K(e), K(a[j]))) {\
+            break;\
+        }\
+        a[i] = a[j];\
+    }\
+    a[i] = e;\
+}\
+\
+static void \
+NAME##_heap(E *a, npy_intp n, const Q *v)\
+{\
+    npy_intp i;\
+    for (i = n/2 - 1; i >= 0; i--) {\
+        NAME##_sift(a, i, n, v);\
+    }\
+    for (i = n - 1; i > 0; i--) {\
+        SORT_SWAP(E, a[0], a[i]);\
+        NAME##_sift(a, 0, i, v);\
+    }\
+}\
+\
+static void \
+NAME##_intro(E *a, npy_intp n, const Q *v, int depth)\
+{\
+    while (n > SORT_SMALL) {\
+        npy_intp i, j, m = n/2;\
+        E p;\
+        if (depth-- == 0) {\
+            NAME##_heap(a, n, v);\
+            return;\
+        }\
+        /* Median of three, left in a[n - 2] with a[0] <= it <= a[n - 1] */\
+        if (SORT_LT(K(a[m]), K(a[0]))) SORT_SWAP(E, a[m], a[0]);\
+        if (SORT_LT(K(a[n - 1]), K(a[m]))) SORT_SWAP(E, a[n - 1], a[m]);\
+        if (SORT_LT(K(a[m]), K(a[0]))) SORT_SWAP(E, a[m], a[0]);\
+        SORT_SWAP(E, a[m], a[n - 2]);\
+        p = a[n - 2];\
+        for (i = 0, j = n - 2;;) {\
+            do i++; while (SORT_LT(K(a[i]), K(p)));\
+            do j--; while (SORT_LT(K(p), K(a[j])));\
+            if (i >= j) {\
+                break;\
+            }\
+            SORT_SWAP(E, a[i], a[j]);\
+        }\
+        SORT_SWAP(E, a[i], a[n - 2]);\
+        /* Recurse into the smaller side, and loop on the larger */\
+        if (i < n - i - 1) {\
+            NAME##_intro(a, i, v, depth);\
+            a += i + 1;\
+            n -= i + 1;\
+        }\
+        else {\
+            NAME##_intro(a + i + 1, n - i - 1, v, depth);\
+            n = i;\
+        }\
+    }\
+    NAME##_insertion(a, n, v);\
+}\
+\
+/* heap nonzero for heapsort */\
+static void \
+NAME##_unstable(E *a, npy_intp n, const Q *v, int heap)\
+{\
+    npy_intp i, k = 0;\
+    int depth = 0;\
+    for (i = 0; i < n; i++) {\
+        if (SORT_NAN(K(a[i]))) {\
+            SORT_SWAP(E, a[i], a[k]);\
+            k++;\
+        }\
+    }\
+    for (i = n - k; i > 1; i >>= 1) {\
+        depth += 2;\
+    }\
+    if (heap) {\
+        NAME##_heap(a + k, n - k, v);\
+    }\
+    else {\
+        NAME##_intro(a + k, n - k, v, depth);\
+    }\
+}\
+\
+/* Stable, with space w for n/2 elements */\
+static void \
+NAME##_merge(E *a, npy_intp n, const Q *v, E *w)\
+{\
+    npy_intp i, j, k, m = n/2;\
+    if (n <= SORT_SMALL) {\
+        NAME##_insertion(a, n, v);\
+        return;\
+    }\
+    NAME##_merge(a, m, v, w);\
+    NAME##_merge(a + m, n - m, v, w);\
+    if (!SORT_LESS(K(a[m]), K(a[m - 1]))) {\
+        return;\
+    }\
+    memcpy(w, a, m*sizeof(E));\
+    for (i = 0, j = m, k = 0; i < m && j < n;) {\
+        a[k++] = SORT_LESS(K(a[j]), K(w[i])) ? a[j++] : w[i++];\
+    }\
+    while (i < m) {\
+        a[k++] = w[i++];\
+    }\
+}
+
+typedef struct {
+    npy_uint64 key;
+    npy_intp index;
+} sort_item;
+
+/*
+ * Unsigned keys in the order of the floating point values, with -0 the same
+ * as 0.  Any nonzero value of a nan gives a key above 0, which is used for all
+ * components of quaternions with a nan component.
+ */
+static NPY_INLINE npy_uint64
+sort_key_double(double x)
+{
+    npy_uint64 u;
+    x = x == 0 ? 0 : x;
+    memcpy(&u, &x, sizeof(u));
+    return u >> 63 ? ~u : u | (npy_uint64)1 << 63;
+}
+
+static NPY_INLINE npy_uint64
+sort_key_float(float x)
+{
+    npy_uint32 u;
+    x = x == 0 ? 0 : x;
+    memcpy(&u, &x, sizeof(u));
+    return u >> 31 ? (npy_uint32)~u : u | (npy_uint32)1 << 31;
+}
+
+/*
+ * The radix sort orders the indices idx into v stably by the keys of
+ * component c, in LSD passes over each byte of the key (skipping bytes all
+ * keys share), and then each run of equal keys by the following components,
+ * so the quaternions end up in lexicographic order of their four keys.  Going
+ * one component at a time moves 16 byte items rather than 40 byte ones, and
+ * the later components are mostly needed only for short runs; those below
+ * RADIX_RUN are merge sorted.  a and b are space for n items.
+ */
+#define QUATERNION_RADIX_SORT(NAME, Q, T, sort_key)\
+static void \
+NAME##_radix_order(const Q *v, npy_intp *idx, npy_intp n, int c, sort_item *a, sort_item *b)\
+{\
+    npy_intp count[sizeof(T)][256];\
+    npy_intp i, j, s, e;\
+    size_t d;\
+    memset(count, 0, sizeof(count));\
+    for (i = 0; i < n; i++) {\
+        const Q q = v[idx[i]];\
+        npy_uint64 k = SORT_NAN(q) ? 0 : sort_key(((const T *)&q)[c]);\
+        a[i].key = k;\
+        a[i].index = idx[i];\
+        for (d = 0; d < sizeof(T); d++) {\
+            count[d][k >> 8*d & 0xff]++;\
+        }\
+    }\
+    for (d = 0; d < sizeof(T); d++) {\
+        npy_intp *cd = count[d];\
+        sort_item *t;\
+        if (cd[a[0].key >> 8*d & 0xff] == n) {\
+            continue;\
+        }\
+        for (j = 0, s = 0; j < 256; j++) {\
+            e = cd[j];\
+            cd[j] = s;\
+            s += e;\
+        }\
+        for (i = 0; i < n; i++) {\
+            b[cd[a[i].key >> 8*d & 0xff]++] = a[i];\
+        }\
+        t = a;\
+        a = b;\
+        b = t;\
+    }\
+    for (i = 0; i < n; i++) {\
+        idx[i] = a[i].index;\
+    }\
+    /* Only nan quaternions have key 0, and they stay in order */\
+    for (s = 0; c < 3 && s < n; s = e) {\
+        for (e = s + 1; e < n && a[e].key == a[s].key; e++);\
+        if (a[s].key == 0 || e - s == 1) {\
+            continue;\
+        }\
+        if (e - s >= RADIX_RUN) {\
+            NAME##_radix_order(v, idx + s, e - s, c + 1, a + s, b + s);\
+        }\
+        else {\
+            NAME##_argsort_merge(idx + s, e - s, v, (npy_intp *)(b + s));\
+        }\
+    }\
+}\
+\
+/* Sorts the n indices idx into v, returning -1 if out of memory */\
+static int \
+NAME##_radix_argsort(const Q *v, npy_intp *idx, npy_intp n)\
+{\
+    sort_item *a = (sort_item *)malloc(2*n*sizeof(sort_item));\
+    if (a == NULL) {\
+        return -1;\
+    }\
+    NAME##_radix_order(v, idx, n, 0, a, a + n);\
+    free(a);\
+    return 0;\
+}\
+\
+static int \
+NAME##_radix_sort(Q *v, npy_intp n)\
+{\
+    /* The items hold the sorted quaternions at the end */\
+    npy_intp *idx = (npy_intp *)malloc(n*sizeof(npy_intp) + 2*n*sizeof(sort_item)), i;\
+    Q *sorted;\
+    if (idx == NULL) {\
+        return -1;\
+    }\
+    sorted = (Q *)(idx + n);\
+    for (i = 0; i < n; i++) {\
+        idx[i] = i;\
+    }\
+    NAME##_radix_order(v, idx, n, 0, (sort_item *)sorted, (sort_item *)sorted + n);\
+    for (i = 0; i < n; i++) {\
+        sorted[i] = v[idx[i]];\
+    }\
+    memcpy(v, sorted, n*sizeof(Q));\
+    free(idx);\
+    return 0;\
+}
+
+#define QUATERNION_SORTS(NAME, Q, T, sort_key)\
+QUATERNION_COMPARISON_SORTS(NAME##_sort, Q, Q, SORT_VALUE)\
+QUATERNION_COMPARISON_SORTS(NAME##_argsort, Q, npy_intp, SORT_INDEXED)\
+QUATERNION_RADIX_SORT(NAME, Q, T, sort_key)\
+\
+static int \
+NAME##_quicksort(Q *v, npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    if (n < RADIX_MIN || NAME##_radix_sort(v, n) < 0) {\
+        NAME##_sort_unstable(v, n, NULL, 0);\
+    }\
+    return 0;\
+}\
+\
+static int \
+NAME##_heapsort(Q *v, npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    NAME##_sort_unstable(v, n, NULL, 1);\
+    return 0;\
+}\
+\
+static int \
+NAME##_mergesort(Q *v, npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    Q *w;\
+    if (n >= RADIX_MIN) {\
+        return NAME##_radix_sort(v, n);\
+    }\
+    if (!(w = (Q *)malloc((n/2 + 1)*sizeof(Q)))) {\
+        return -1;\
+    }\
+    NAME##_sort_merge(v, n, NULL, w);\
+    free(w);\
+    return 0;\
+}\
+\
+static int \
+NAME##_aquicksort(Q *v, npy_intp *idx, npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    if (n < RADIX_MIN || NAME##_radix_argsort(v, idx, n) < 0) {\
+        NAME##_argsort_unstable(idx, n, v, 0);\
+    }\
+    return 0;\
+}\
+\
+static int \
+NAME##_aheapsort(Q *v, npy_intp *idx, npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    NAME##_argsort_unstable(idx, n, v, 1);\
+    return 0;\
+}\
+\
+static int \
+NAME##_amergesort(Q *v, npy_intp *idx, npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    npy_intp *w;\
+    if (n >= RADIX_MIN) {\
+        return NAME##_radix_argsort(v, idx, n);\
+    }\
+    if (!(w = (npy_intp *)malloc((n/2 + 1)*sizeof(npy_intp)))) {\
+        return -1;\
+    }\
+    NAME##_argsort_merge(idx, n, v, w);\
+    free(w);\
+    return 0;\
+}
+
+QUATERNION_SORTS(QUATERNION, quaternion, double, sort_key_double)
+QUATERNION_SORTS(QUATERNION32, quaternion32, float, sort_key_float)
+
+/* Dual quaternions have no ordering, so no compare or argmax */
 static void
-QUATERNION_copyswap(quaternion *dst, quaternion *src,
-        int swap, void *NPY_UNUSED(arr))
+DUAL_QUATERNION_copyswap(dual_quaternion *dst, dual_quaternion *src, int swap,
+        void *NPY_UNUSED(arr))
 {
     PyArray_Descr *descr;
     descr = PyArray_DescrFromType(NPY_DOUBLE);
-    descr->f->copyswapn(dst, sizeof(double), src, sizeof(double), 4, swap, NULL);
+    descr->f->copyswapn(dst, sizeof(double), src, sizeof(double), 8, swap, NULL);
     Py_DECREF(descr);
 }
 
 static void
-QUATERNION_copyswapn(quaternion *dst, npy_intp dstride,
-        quaternion *src, npy_intp sstride,
-        npy_intp n, int swap, void *NPY_UNUSED(arr))
+DUAL_QUATERNION_copyswapn(dual_quaternion *dst, npy_intp dstride, dual_quaternion *src,
+        npy_intp sstride, npy_intp n, int swap, void *NPY_UNUSED(arr))
 {
     PyArray_Descr *descr;
+    int k;
     descr = PyArray_DescrFromType(NPY_DOUBLE);
-    descr->f->copyswapn(&dst->w, dstride, &src->w, sstride, n, swap, NULL);
-    descr->f->copyswapn(&dst->x, dstride, &src->x, sstride, n, swap, NULL);
-    descr->f->copyswapn(&dst->y, dstride, &src->y, sstride, n, swap, NULL);
-    descr->f->copyswapn(&dst->z, dstride, &src->z, sstride, n, swap, NULL);
-    Py_DECREF(descr);    
+    for (k = 0; k < 8; k++) {
+        descr->f->copyswapn((double *)dst + k, dstride, src ? (double *)src + k : NULL,
+                sstride, n, swap, NULL);
+    }
+    Py_DECREF(descr);
 }
 
-static int
-QUATERNION_compare (quaternion *pa, quaternion *pb, PyArrayObject *NPY_UNUSED(ap))
+static npy_bool
+DUAL_QUATERNION_nonzero(char *ip, PyArrayObject *ap)
+{
+    dual_quaternion a;
+    if (ap == NULL || PyArray_ISBEHAVED_RO(ap)) {
+        a = *(dual_quaternion *)ip;
+    }
+    else {
+        copy_components(&a.r, ip, NPY_DOUBLE, ap);
+        copy_components(&a.d, ip + sizeof(quaternion), NPY_DOUBLE, ap);
+    }
+    return (npy_bool) dual_quaternion_isnonzero(a);
+}
+
+static void
+DUAL_QUATERNION_fillwithscalar(dual_quaternion *buffer, npy_intp length,
+        dual_quaternion *value, void *NPY_UNUSED(ignored))
+{
+    npy_intp i;
+    dual_quaternion val = *value;
+
+    for (i = 0; i < length; ++i) {
+        buffer[i] = val;
+    }
+}
+
+/*
+ * Casts between quaternions and real (m = 1) or complex (m = 2) types, whose
+ * components become the first m of the quaternion.  Casts go through the
+ * vectorized pack and unpack kernels, directly if type is the component type
+ * real, and otherwise converting CAST_BLOCK elements at a time through a
+ * buffer.
+ */
+#define CAST_BLOCK 256
+
+/* type is the floating type real itself */
+#define CAST_DIRECT(type, real) (sizeof(type) == sizeof(real) && (type)0.5 != 0)
+
+#define MAKE_M_TO_QUATERNION(TYPE, type, Q, real, m)                           \
+static void                                                                    \
+TYPE ## _to_ ## Q(type *ip, Q *op, npy_intp n,                                 \
+               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop)) \
+{                                                                              \
+    real buf[m*CAST_BLOCK];                                                    \
+    npy_intp i, j, b;                                                          \
+    if (CAST_DIRECT(type, real)) {                                             \
+        Q ## _from_real_kernel(op, (real *)ip, m, n);                          \
+        return;                                                                \
+    }                                                                          \
+    for (i = 0; i < n; i += b) {                                               \
+        b = n - i < CAST_BLOCK ? n - i : CAST_BLOCK;                           \
+        for (j = 0; j < m*b; j++) {                                            \
+            buf[j] = (real)ip[m*i + j];                                        \
+        }                                                                      \
+        Q ## _from_real_kernel(op + i, buf, m, b);                             \
+    }                                                                          \
+}
+
+#define MAKE_QUATERNION_TO_M(TYPE, type, Q, real, m)                           \
+static void                                                                    \
+Q ## _to_ ## TYPE(Q *ip, type *op, npy_intp n,                                 \
+               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop)) \
+{                                                                              \
+    real buf[m*CAST_BLOCK];                                                    \
+    npy_intp i, j, b;                                                          \
+    if (CAST_DIRECT(type, real)) {                                             \
+        Q ## _to_real_kernel((real *)op, ip, m, n);                            \
+        return;                                                                \
+    }                                                                          \
+    for (i = 0; i < n; i += b) {                                               \
+        b = n - i < CAST_BLOCK ? n - i : CAST_BLOCK;                           \
+        Q ## _to_real_kernel(buf, ip + i, m, b);                               \
+        for (j = 0; j < m*b; j++) {                                            \
+            op[m*i + j] = (type)buf[j];                                        \
+        }                                                                      \
+    }                                                                          \
+}
+
+#define MAKE_T_TO_QUATERNION(TYPE, type, Q, real)                              \
+    MAKE_M_TO_QUATERNION(TYPE, type, Q, real, 1)
+
+MAKE_T_TO_QUATERNION(FLOAT, npy_float, quaternion, double);
+MAKE_T_TO_QUATERNION(DOUBLE, npy_double, quaternion, double);
+MAKE_T_TO_QUATERNION(LONGDOUBLE, npy_longdouble, quaternion, double);
+MAKE_T_TO_QUATERNION(BOOL, npy_bool, quaternion, double);
+MAKE_T_TO_QUATERNION(BYTE, npy_byte, quaternion, double);
+MAKE_T_TO_QUATERNION(UBYTE, npy_ubyte, quaternion, double);
+MAKE_T_TO_QUATERNION(SHORT, npy_short, quaternion, double);
+MAKE_T_TO_QUATERNION(USHORT, npy_ushort, quaternion, double);
+MAKE_T_TO_QUATERNION(INT, npy_int, quaternion, double);
+MAKE_T_TO_QUATERNION(UINT, npy_uint, quaternion, double);
+MAKE_T_TO_QUATERNION(LONG, npy_long, quaternion, double);
+MAKE_T_TO_QUATERNION(ULONG, npy_ulong, quaternion, double);
+MAKE_T_TO_QUATERNION(LONGLONG, npy_longlong, quaternion, double);
+MAKE_T_TO_QUATERNION(ULONGLONG, npy_ulonglong, quaternion, double);
+
+MAKE_T_TO_QUATERNION(FLOAT, npy_float, quaternion32, float);
+MAKE_T_TO_QUATERNION(DOUBLE, npy_double, quaternion32, float);
+MAKE_T_TO_QUATERNION(LONGDOUBLE, npy_longdouble, quaternion32, float);
+MAKE_T_TO_QUATERNION(BOOL, npy_bool, quaternion32, float);
+MAKE_T_TO_QUATERNION(BYTE, npy_byte, quaternion32, float);
+MAKE_T_TO_QUATERNION(UBYTE, npy_ubyte, quaternion32, float);
+MAKE_T_TO_QUATERNION(SHORT, npy_short, quaternion32, float);
+MAKE_T_TO_QUATERNION(USHORT, npy_ushort, quaternion32, float);
+MAKE_T_TO_QUATERNION(INT, npy_int, quaternion32, float);
+MAKE_T_TO_QUATERNION(UINT, npy_uint, quaternion32, float);
+MAKE_T_TO_QUATERNION(LONG, npy_long, quaternion32, float);
+MAKE_T_TO_QUATERNION(ULONG, npy_ulong, quaternion32, float);
+MAKE_T_TO_QUATERNION(LONGLONG, npy_longlong, quaternion32, float);
+MAKE_T_TO_QUATERNION(ULONGLONG, npy_ulonglong, quaternion32, float);
+
+#define MAKE_CT_TO_QUATERNION(TYPE, type, Q, real)                             \
+    MAKE_M_TO_QUATERNION(TYPE, type, Q, real, 2)
+
+MAKE_CT_TO_QUATERNION(CFLOAT, npy_float, quaternion, double);
+MAKE_CT_TO_QUATERNION(CDOUBLE, npy_double, quaternion, double);
+MAKE_CT_TO_QUATERNION(CLONGDOUBLE, npy_longdouble, quaternion, double);
+
+MAKE_CT_TO_QUATERNION(CFLOAT, npy_float, quaternion32, float);
+MAKE_CT_TO_QUATERNION(CDOUBLE, npy_double, quaternion32, float);
+MAKE_CT_TO_QUATERNION(CLONGDOUBLE, npy_longdouble, quaternion32, float);
+
+/* The real part, or the real part and the first imaginary component */
+MAKE_QUATERNION_TO_M(FLOAT, npy_float, quaternion, double, 1);
+MAKE_QUATERNION_TO_M(DOUBLE, npy_double, quaternion, double, 1);
+MAKE_QUATERNION_TO_M(LONGDOUBLE, npy_longdouble, quaternion, double, 1);
+MAKE_QUATERNION_TO_M(CFLOAT, npy_float, quaternion, double, 2);
+MAKE_QUATERNION_TO_M(CDOUBLE, npy_double, quaternion, double, 2);
+MAKE_QUATERNION_TO_M(CLONGDOUBLE, npy_longdouble, quaternion, double, 2);
+
+MAKE_QUATERNION_TO_M(FLOAT, npy_float, quaternion32, float, 1);
+MAKE_QUATERNION_TO_M(DOUBLE, npy_double, quaternion32, float, 1);
+MAKE_QUATERNION_TO_M(LONGDOUBLE, npy_longdouble, quaternion32, float, 1);
+MAKE_QUATERNION_TO_M(CFLOAT, npy_float, quaternion32, float, 2);
+MAKE_QUATERNION_TO_M(CDOUBLE, npy_double, quaternion32, float, 2);
+MAKE_QUATERNION_TO_M(CLONGDOUBLE, npy_longdouble, quaternion32, float, 2);
+
+/* Between the two precisions */
+static void
+quaternion_to_quaternion32(quaternion *ip, quaternion32 *op, npy_intp n,
+               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop))
+{
+    npy_intp i;
+    for (i = 0; i < n; i++) {
+        op[i] = (quaternion32) {(float)ip[i].w, (float)ip[i].x, (float)ip[i].y, (float)ip[i].z};
+    }
+}
+
+static void
+quaternion32_to_quaternion(quaternion32 *ip, quaternion *op, npy_intp n,
+               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop))
+{
+    npy_intp i;
+    for (i = 0; i < n; i++) {
+        op[i] = (quaternion) {ip[i].w, ip[i].x, ip[i].y, ip[i].z};
+    }
+}
+
+/* Rotations, with no translation */
+#define MAKE_QUATERNION_TO_DUAL_QUATERNION(Q)                                  \
+static void                                                                    \
+Q ## _to_dual_quaternion(Q *ip, dual_quaternion *op, npy_intp n,               \
+               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop)) \
+{                                                                              \
+    npy_intp i;                                                                \
+    for (i = 0; i < n; i++) {                                                  \
+        op[i].r = (quaternion) {ip[i].w, ip[i].x, ip[i].y, ip[i].z};           \
+        op[i].d = (quaternion) {0, 0, 0, 0};                                   \
+    }                                                                          \
+}
+
+MAKE_QUATERNION_TO_DUAL_QUATERNION(quaternion)
+MAKE_QUATERNION_TO_DUAL_QUATERNION(quaternion32)
+
+static void register_cast_function(int sourceType, int destType, PyArray_VectorUnaryFunc *castfunc)
+{
+    PyArray_Descr *descr = PyArray_DescrFromType(sourceType);
+    PyArray_RegisterCastFunc(descr, destType, castfunc);
+    PyArray_RegisterCanCast(descr, destType, NPY_NOSCALAR);
+    Py_DECREF(descr);
+}
+
+/* As register_cast_function, for casts which may lose precision */
+static void register_unsafe_cast_function(int sourceType, int destType, PyArray_VectorUnaryFunc *castfunc)
+{
+    PyArray_Descr *descr = PyArray_DescrFromType(sourceType);
+    PyArray_RegisterCastFunc(descr, destType, castfunc);
+    Py_DECREF(descr);
+}
+
+static PyObject *
+gentype_richcompare(PyObject *self, PyObject *other, int cmp_op)
+{
+    PyObject *arr, *ret;
+
+    arr = PyArray_FromScalar(self, NULL);
+    if (arr == NULL) {
+        return NULL;
+    }
+    ret = Py_TYPE(arr)->tp_richcompare(arr, other, cmp_op);
+    Py_DECREF(arr);
+    return ret;
+}
+
+/*
+ * Arithmetic between quaternion scalars, or a quaternion scalar and a Python
+ * real number, is done directly.  Other operands, such as arrays, go through
+ * the generic scalar methods and so the ufuncs.
+ */
+#define QUATERNION_SCALAR_BINOP(name, qq, qs, sq) \
+static PyObject * \
+quaternion_arrtype_##name(PyObject *a, PyObject *b) \
+{ \
+    quaternion x, y; \
+    double s; \
+    if (PyArray_IsScalar(a, Quaternion)) { \
+        x = ((PyQuaternionScalarObject *)a)->obval; \
+        if (PyArray_IsScalar(b, Quaternion)) { \
+            y = ((PyQuaternionScalarObject *)b)->obval; \
+            return PyQuaternion_FromQuaternion(qq); \
+        } \
+        if (quaternion_real_operand(b, &s)) { \
+            return PyQuaternion_FromQuaternion(qs); \
+        } \
+    } \
+    else if (PyArray_IsScalar(b, Quaternion) && quaternion_real_operand(a, &s)) { \
+        y = ((PyQuaternionScalarObject *)b)->obval; \
+        return PyQuaternion_FromQuaternion(sq); \
+    } \
+    return PyGenericArrType_Type.tp_as_number->nb_##name(a, b); \
+}
+
+#define QUATERNION_REAL(s) ((quaternion){s, 0, 0, 0})
+
+QUATERNION_SCALAR_BINOP(add, quaternion_add(x, y),
+        quaternion_add(x, QUATERNION_REAL(s)),
+        quaternion_add(QUATERNION_REAL(s), y))
+QUATERNION_SCALAR_BINOP(subtract, quaternion_subtract(x, y),
+        quaternion_subtract(x, QUATERNION_REAL(s)),
+        quaternion_subtract(QUATERNION_REAL(s), y))
+QUATERNION_SCALAR_BINOP(multiply, quaternion_multiply(x, y),
+        quaternion_multiply_scalar(x, s),
+        quaternion_multiply_scalar(y, s))
+QUATERNION_SCALAR_BINOP(true_divide, quaternion_divide(x, y),
+        quaternion_divide_scalar(x, s),
+        quaternion_divide(QUATERNION_REAL(s), y))
+#if !defined(NPY_PY3K)
+QUATERNION_SCALAR_BINOP(divide, quaternion_divide(x, y),
+        quaternion_divide_scalar(x, s),
+        quaternion_divide(QUATERNION_REAL(s), y))
+#endif
+
+static PyObject *
+quaternion_arrtype_power(PyObject *a, PyObject *b, PyObject *modulo)
+{
+    quaternion x, y;
+    double s;
+
+    if (modulo == Py_None) {
+        if (PyArray_IsScalar(a, Quaternion)) {
+            x = ((PyQuaternionScalarObject *)a)->obval;
+            if (PyArray_IsScalar(b, Quaternion)) {
+                y = ((PyQuaternionScalarObject *)b)->obval;
+                return PyQuaternion_FromQuaternion(quaternion_power(x, y));
+            }
+            if (quaternion_real_operand(b, &s)) {
+                return PyQuaternion_FromQuaternion(quaternion_power_scalar(x, s));
+            }
+        }
+        else if (PyArray_IsScalar(b, Quaternion) && quaternion_real_operand(a, &s)) {
+            y = ((PyQuaternionScalarObject *)b)->obval;
+            return PyQuaternion_FromQuaternion(
+                    quaternion_power(QUATERNION_REAL(s), y));
+        }
+    }
+    return PyGenericArrType_Type.tp_as_number->nb_power(a, b, modulo);
+}
+
+static PyObject *
+quaternion_arrtype_negative(PyObject *o)
+{
+    return PyQuaternion_FromQuaternion(
+            quaternion_negative(((PyQuaternionScalarObject *)o)->obval));
+}
+
+static PyObject *
+quaternion_arrtype_positive(PyObject *o)
+{
+    return PyQuaternion_FromQuaternion(((PyQuaternionScalarObject *)o)->obval);
+}
+
+static PyObject *
+quaternion_arrtype_absolute(PyObject *o)
+{
+    return PyFloat_FromDouble(
+            quaternion_absolute(((PyQuaternionScalarObject *)o)->obval));
+}
+
+static int
+quaternion_arrtype_nonzero(PyObject *o)
+{
+    return quaternion_isnonzero(((PyQuaternionScalarObject *)o)->obval);
+}
+
+static PyNumberMethods quaternion_arrtype_as_number;
+
+static PyObject *
+quaternion_arrtype_richcompare(PyObject *self, PyObject *other, int cmp_op)
+{
+    quaternion x, y;
+    double s;
+    int result;
+
+    if (!PyArray_IsScalar(self, Quaternion)) {
+        return gentype_richcompare(self, other, cmp_op);
+    }
+    x = ((PyQuaternionScalarObject *)self)->obval;
+    if (PyArray_IsScalar(other, Quaternion)) {
+        y = ((PyQuaternionScalarObject *)other)->obval;
+    }
+    else if (quaternion_real_operand(other, &s)) {
+        y = QUATERNION_REAL(s);
+    }
+    else {
+        return gentype_richcompare(self, other, cmp_op);
+    }
+    switch (cmp_op) {
+    case Py_EQ: result = quaternion_equal(x, y); break;
+    case Py_NE: result = quaternion_not_equal(x, y); break;
+    case Py_LT: result = quaternion_less(x, y); break;
+    case Py_LE: result = quaternion_less_equal(x, y); break;
+    case Py_GT: result = quaternion_less(y, x); break;
+    case Py_GE: result = quaternion_less_equal(y, x); break;
+    default: return gentype_richcompare(self, other, cmp_op);
+    }
+    PyArrayScalar_RETURN_BOOL_FROM_LONG(result);
+}
+
+#define QUATERNION_ARRTYPE_FUNCS(Q, Type, format)\
+static PyObject *\
+Q##_arrtype_new(PyTypeObject *type, PyObject *args, PyObject *kwds)\
+{\
+    Q q;\
+\
+    if (!PyArg_ParseTuple(args, format, &q.w, &q.x, &q.y, &q.z))\
+        return NULL;\
+\
+    return PyArray_Scalar(&q, Q##_descr, NULL);\
+}\
+\
+static long \
+Q##_arrtype_hash(PyObject *o)\
+{\
+    Q q = ((Py##Type##ScalarObject *)o)->obval;\
+    long value = 0x456789;\
+    value = (10000004 * value) ^ _Py_HashDouble(q.w);\
+    value = (10000004 * value) ^ _Py_HashDouble(q.x);\
+    value = (10000004 * value) ^ _Py_HashDouble(q.y);\
+    value = (10000004 * value) ^ _Py_HashDouble(q.z);\
+    if (value == -1)\
+        value = -2;\
+    return value;\
+}\
+\
+static PyObject *\
+Q##_arrtype_repr(PyObject *o)\
+{\
+    char str[128];\
+    Q q = ((Py##Type##ScalarObject *)o)->obval;\
+    sprintf(str, #Q "(%g, %g, %g, %g)", q.w, q.x, q.y, q.z);\
+    return PyUString_FromString(str);\
+}\
+\
+static PyObject *\
+Q##_arrtype_str(PyObject *o)\
+{\
+    char str[128];\
+    Q q = ((Py##Type##ScalarObject *)o)->obval;\
+    sprintf(str, #Q "(%g, %g, %g, %g)", q.w, q.x, q.y, q.z);\
+    return PyString_FromString(str);\
+}
+
+QUATERNION_ARRTYPE_FUNCS(quaternion, Quaternion, "dddd")
+QUATERNION_ARRTYPE_FUNCS(quaternion32, Quaternion32, "ffff")
+
+/* dual_quaternion(r, d), dual_quaternion(q) or dual_quaternion of eight numbers */
+static PyObject *
+dual_quaternion_arrtype_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    dual_quaternion a;
+    double *c = &a.r.w;
+
+    if (PyTuple_GET_SIZE(args) == 1 || PyTuple_GET_SIZE(args) == 2) {
+        if (dual_quaternion_from_object(PyTuple_GET_SIZE(args) == 1 ?
+                PyTuple_GET_ITEM(args, 0) : args, &a) < 0) {
+            return NULL;
+        }
+    }
+    else if (!PyArg_ParseTuple(args, "dddddddd", c, c + 1, c + 2, c + 3,
+                c + 4, c + 5, c + 6, c + 7)) {
+        return NULL;
+    }
+
+    return PyArray_Scalar(&a, dual_quaternion_descr, NULL);
+}
+
+static long
+dual_quaternion_arrtype_hash(PyObject *o)
+{
+    dual_quaternion a = ((PyDualQuaternionScalarObject *)o)->obval;
+    const double *c = &a.r.w;
+    long value = 0x456789;
+    int k;
+    for (k = 0; k < 8; k++) {
+        value = (10000004 * value) ^ _Py_HashDouble(c[k]);
+    }
+    if (value == -1)
+        value = -2;
+    return value;
+}
+
+#define DUAL_QUATERNION_FORMAT "dual_quaternion(%g, %g, %g, %g, %g, %g, %g, %g)"
+#define DUAL_QUATERNION_COMPONENTS(a) \
+    a.r.w, a.r.x, a.r.y, a.r.z, a.d.w, a.d.x, a.d.y, a.d.z
+
+static PyObject *
+dual_quaternion_arrtype_repr(PyObject *o)
+{
+    char str[256];
+    dual_quaternion a = ((PyDualQuaternionScalarObject *)o)->obval;
+    sprintf(str, DUAL_QUATERNION_FORMAT, DUAL_QUATERNION_COMPONENTS(a));
+    return PyUString_FromString(str);
+}
+
+static PyObject *
+dual_quaternion_arrtype_str(PyObject *o)
+{
+    char str[256];
+    dual_quaternion a = ((PyDualQuaternionScalarObject *)o)->obval;
+    sprintf(str, DUAL_QUATERNION_FORMAT, DUAL_QUATERNION_COMPONENTS(a));
+    return PyString_FromString(str);
+}
+
+static PyObject *
+dual_quaternion_arrtype_get_real(PyObject *self, void *closure)
+{
+    return PyQuaternion_FromQuaternion(((PyDualQuaternionScalarObject *)self)->obval.r);
+}
+
+static PyObject *
+dual_quaternion_arrtype_get_dual(PyObject *self, void *closure)
+{
+    return PyQuaternion_FromQuaternion(((PyDualQuaternionScalarObject *)self)->obval.d);
+}
+
+static PyObject *
+dual_quaternion_arrtype_get_components(PyObject *self, void *closure)
+{
+    const double *c = &((PyDualQuaternionScalarObject *)self)->obval.r.w;
+    PyObject *tuple = PyTuple_New(8);
+    int k;
+    for (k = 0; k < 8; k++) {
+        PyTuple_SET_ITEM(tuple, k, PyFloat_FromDouble(c[k]));
+    }
+    return tuple;
+}
+
+PyGetSetDef PyDualQuaternionArrType_getset[] = {
+    {"real", dual_quaternion_arrtype_get_real, NULL,
+        "The real part r, the rotation, as a quaternion", NULL},
+    {"dual", dual_quaternion_arrtype_get_dual, NULL,
+        "The dual part d, half the translation times r, as a quaternion", NULL},
+    {"components", dual_quaternion_arrtype_get_components, NULL,
+        "The components of r and d as an 8-tuple", NULL},
+    {NULL}
+};
+
+static PyObject *
+set_fast_normalize(PyObject *self, PyObject *args)
+{
+    int fast;
+    if (!PyArg_ParseTuple(args, "i", &fast)) {
+        return NULL;
+    }
+    return PyBool_FromLong(quaternion_simd_fast_normalize(fast));
+}
+
+static PyMethodDef QuaternionMethods[] = {
+    {"set_fast_normalize", set_fast_normalize, METH_VARARGS,
+        "set_fast_normalize(fast)\n\n"
+        "Make normalized and unit_multiply use approximate reciprocal square\n"
+        "roots refined by Newton's method if fast is true, or exact square roots\n"
+        "and divisions if false.  Returns whether the approximate kernels are\n"
+        "in use, which needs AVX2.\n\n"
+        "The setting is global: it applies to every caller and thread in the\n"
+        "process until it is set again, so libraries should leave it alone."},
+    {NULL, NULL, 0, NULL}
+};
+
+#define UNARY_UFUNC(Q, name, ret_type)\
+static void \
+Q##_##name##_ufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *op1 = args[1];\
+    npy_intp is1 = steps[0], os1 = steps[1];\
+    npy_intp n = dimensions[0];\
+    npy_intp i;\
+    for(i = 0; i < n; i++, ip1 += is1, op1 += os1){\
+        const Q in1 = *(Q *)ip1;\
+        *((ret_type *)op1) = Q##_##name(in1);};}
+
+UNARY_UFUNC(quaternion, isnan, npy_bool)
+UNARY_UFUNC(quaternion, isinf, npy_bool)
+UNARY_UFUNC(quaternion, isfinite, npy_bool)
+UNARY_UFUNC(quaternion, absolute, npy_double)
+UNARY_UFUNC(quaternion, negative, quaternion)
+UNARY_UFUNC(quaternion, conjugate, quaternion)
+
+UNARY_UFUNC(quaternion32, isnan, npy_bool)
+UNARY_UFUNC(quaternion32, isinf, npy_bool)
+UNARY_UFUNC(quaternion32, isfinite, npy_bool)
+UNARY_UFUNC(quaternion32, absolute, npy_float)
+UNARY_UFUNC(quaternion32, negative, quaternion32)
+UNARY_UFUNC(quaternion32, conjugate, quaternion32)
+UNARY_UFUNC(quaternion32, log, quaternion32)
+UNARY_UFUNC(quaternion32, exp, quaternion32)
+
+UNARY_UFUNC(dual_quaternion, isnan, npy_bool)
+UNARY_UFUNC(dual_quaternion, isinf, npy_bool)
+UNARY_UFUNC(dual_quaternion, isfinite, npy_bool)
+UNARY_UFUNC(dual_quaternion, conjugate, dual_quaternion)
+UNARY_UFUNC(dual_quaternion, normalized, dual_quaternion)
+
+/* As UNARY_UFUNC, using the vectorized kernel on contiguous arrays */
+#define UNARY_KERNEL_UFUNC(Q, name, ret_type)\
+static void \
+Q##_##name##_ufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *op1 = args[1];\
+    npy_intp is1 = steps[0], os1 = steps[1];\
+    npy_intp n = dimensions[0];\
+    npy_intp i;\
+    if (is1 == sizeof(Q) && os1 == sizeof(ret_type)) {\
+        Q##_##name##_kernel((ret_type *)op1, (Q *)ip1, n);\
+        return;\
+    }\
+    for(i = 0; i < n; i++, ip1 += is1, op1 += os1){\
+        const Q in1 = *(Q *)ip1;\
+        *((ret_type *)op1) = Q##_##name(in1);};}
+
+UNARY_KERNEL_UFUNC(quaternion, log, quaternion)
+UNARY_KERNEL_UFUNC(quaternion, exp, quaternion)
+UNARY_KERNEL_UFUNC(quaternion, normalized, quaternion)
+UNARY_KERNEL_UFUNC(quaternion, inverse, quaternion)
+UNARY_KERNEL_UFUNC(quaternion, norm, npy_double)
+UNARY_KERNEL_UFUNC(quaternion32, normalized, quaternion32)
+UNARY_KERNEL_UFUNC(quaternion32, inverse, quaternion32)
+UNARY_KERNEL_UFUNC(quaternion32, norm, npy_float)
+
+/*
+ * isunit of contiguous arrays, from squared norms computed by the vectorized
+ * kernel ISUNIT_BLOCK at a time
+ */
+#define ISUNIT_BLOCK 256
+
+#define ISUNIT_UFUNC(QN, Q, T)\
+static void \
+Q##_isunit_ufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *op1 = args[1];\
+    npy_intp is1 = steps[0], os1 = steps[1];\
+    npy_intp n = dimensions[0];\
+    npy_intp i, j, m;\
+    T norms[ISUNIT_BLOCK];\
+    if (is1 != sizeof(Q)) {\
+        for (i = 0; i < n; i++, ip1 += is1, op1 += os1) {\
+            *(npy_bool *)op1 = Q##_isunit(*(Q *)ip1);\
+        }\
+        return;\
+    }\
+    for (i = 0; i < n; i += m) {\
+        m = n - i < ISUNIT_BLOCK ? n - i : ISUNIT_BLOCK;\
+        Q##_norm_kernel(norms, (Q *)ip1 + i, m);\
+        for (j = 0; j < m; j++, op1 += os1) {\
+            *(npy_bool *)op1 = fabs(norms[j] - 1) <= QN##_UNIT_TOLERANCE;\
+        }\
+    }\
+}
+
+ISUNIT_UFUNC(QUATERNION, quaternion, npy_double)
+ISUNIT_UFUNC(QUATERNION32, quaternion32, npy_float)
+
+/*
+ * Reductions and accumulations.  numpy reduces with out = out op in[i], the
+ * accumulator being both the first input and the output with stride 0, and
+ * accumulates with out[i] = out[i-1] op in[i].  The add and multiply loops
+ * recognize these calls and evaluate them as trees: reductions pairwise, over
+ * chunks which run in parallel if built with OpenMP, and accumulations as
+ * blocked scans, each block scanned on its own and then combined with the
+ * total of the blocks before it.  Rounding errors then grow with log n and
+ * sqrt n rather than n.  The order of the operands is kept, which the
+ * non-commutative multiply needs.  If k > 0, partial results are renormalized
+ * to unit length after at most k steps, for products of rotations (or for
+ * dual quaternions, of rigid transforms).
+ */
+#define PAIRWISE_BLOCK 8
+#define REDUCE_CHUNK 8192
+#define SCAN_MIN_BLOCK 64
+
+#ifdef _OPENMP
+#define OMP_PARALLEL_FOR _Pragma("omp parallel for schedule(static)")
+#define QUATERNION_THREADS() omp_get_max_threads()
+#define QUATERNION_THREAD() omp_get_thread_num()
+#else
+#define OMP_PARALLEL_FOR
+#define QUATERNION_THREADS() 1
+#define QUATERNION_THREAD() 0
+#endif
+
+#define QUATERNION_RENORMALIZE(Q)\
+static Q \
+Q##_renormalize(Q q)\
+{\
+    return Q##_normalized(q);\
+}
+
+QUATERNION_RENORMALIZE(quaternion)
+QUATERNION_RENORMALIZE(quaternion32)
+
+static dual_quaternion
+dual_quaternion_renormalize(dual_quaternion a)
+{
+    return dual_quaternion_normalized(a);
+}
+
+#define QUATERNION_TREE_FUNCS(Q)\
+static Q \
+Q##_pairwise(Q (*f)(Q, Q), const char *ip, npy_intp is, npy_intp n, npy_intp k)\
+{\
+    Q r;\
+    npy_intp i;\
+    if (n <= PAIRWISE_BLOCK) {\
+        r = *(Q *)ip;\
+        for (i = 1; i < n; i++) {\
+            r = f(r, *(Q *)(ip + i*is));\
+            if (k > 0 && i % k == 0) {\
+                r = Q##_renormalize(r);\
+            }\
+        }\
+        return r;\
+    }\
+    i = n/2;\
+    r = f(Q##_pairwise(f, ip, is, i, k), Q##_pairwise(f, ip + i*is, is, n - i, k));\
+    return k > 0 ? Q##_renormalize(r) : r;\
+}\
+\
+/* in[0] f in[1] f ... f in[n-1], for n > 0 */\
+static Q \
+Q##_tree_reduce(Q (*f)(Q, Q), const char *ip, npy_intp is, npy_intp n, npy_intp k)\
+{\
+    npy_intp chunks = (n + REDUCE_CHUNK - 1)/REDUCE_CHUNK, c;\
+    Q *partial, r;\
+    if (chunks <= 1 || !(partial = (Q *)malloc(chunks*sizeof(Q)))) {\
+        return Q##_pairwise(f, ip, is, n, k);\
+    }\
+    OMP_PARALLEL_FOR\
+    for (c = 0; c < chunks; c++) {\
+        npy_intp m = n - c*REDUCE_CHUNK;\
+        partial[c] = Q##_pairwise(f, ip + c*REDUCE_CHUNK*is, is,\
+            m < REDUCE_CHUNK ? m : REDUCE_CHUNK, k);\
+    }\
+    r = Q##_pairwise(f, (char *)partial, sizeof(Q), chunks, k);\
+    free(partial);\
+    return r;\
+}\
+\
+/* out[i] = in[0] f ... f in[i], starting from *init if not NULL */\
+static void \
+Q##_scan(Q (*f)(Q, Q), const Q *init, const char *ip, npy_intp is,\
+    char *op, npy_intp os, npy_intp n, npy_intp k)\
+{\
+    Q r;\
+    npy_intp i;\
+    r = init ? f(*init, *(Q *)ip) : *(Q *)ip;\
+    *(Q *)op = r;\
+    for (i = 1; i < n; i++) {\
+        r = f(r, *(Q *)(ip + i*is));\
+        if (k > 0 && i % k == 0) {\
+            r = Q##_renormalize(r);\
+        }\
+        *(Q *)(op + i*os) = r;\
+    }\
+}\
+\
+/* out[i] = carry f out[i] for the m outputs at op, using kernel if contiguous */\
+static void \
+Q##_apply_carry(Q (*f)(Q, Q), Q##_binary_kernel *kernel, Q carry,\
+    char *op, npy_intp os, npy_intp m)\
+{\
+    npy_intp i;\
+    if (os == sizeof(Q)) {\
+        kernel((Q *)op, &carry, 0, (Q *)op, 1, m);\
+        return;\
+    }\
+    for (i = 0; i < m; i++, op += os) {\
+        *(Q *)op = f(carry, *(Q *)op);\
+    }\
+}\
+\
+/*\
+ * As Q##_scan, in blocks of about sqrt(n) elements; kernel is the vectorized\
+ * f.  Large arrays with several threads are scanned block by block in\
+ * parallel, then given their carries in parallel; otherwise each block is\
+ * finished while it is in cache.\
+ */\
+static void \
+Q##_tree_accumulate(Q (*f)(Q, Q), Q##_binary_kernel *kernel, const Q *init,\
+    const char *ip, npy_intp is, char *op, npy_intp os, npy_intp n, npy_intp k)\
+{\
+    npy_intp block = SCAN_MIN_BLOCK, blocks, b;\
+    Q *carry, c = init ? *init : *(const Q *)ip;\
+    while (block*block < n) {\
+        block *= 2;\
+    }\
+    blocks = (n + block - 1)/block;\
+    if (blocks > 1 && n >= 2*REDUCE_CHUNK && QUATERNION_THREADS() > 1 &&\
+        (carry = (Q *)malloc(blocks*sizeof(Q)))) {\
+        OMP_PARALLEL_FOR\
+        for (b = 0; b < blocks; b++) {\
+            npy_intp m = n - b*block;\
+            Q##_scan(f, NULL, ip + b*block*is, is, op + b*block*os, os,\
+                m < block ? m : block, k);\
+        }\
+        if (init) {\
+            carry[0] = *init;\
+        }\
+        for (b = 1; b < blocks; b++) {\
+            Q last = *(Q *)(op + (b*block - 1)*os);\
+            carry[b] = b == 1 && !init ? last : f(carry[b - 1], last);\
+            if (k > 0) {\
+                carry[b] = Q##_renormalize(carry[b]);\
+            }\
+        }\
+        OMP_PARALLEL_FOR\
+        for (b = init ? 0 : 1; b < blocks; b++) {\
+            npy_intp m = n - b*block;\
+            Q##_apply_carry(f, kernel, carry[b], op + b*block*os, os,\
+                m < block ? m : block);\
+        }\
+        free(carry);\
+        return;\
+    }\
+    for (b = 0; b < blocks; b++) {\
+        npy_intp m = n - b*block < block ? n - b*block : block;\
+        char *o = op + b*block*os;\
+        Q##_scan(f, NULL, ip + b*block*is, is, o, os, m, k);\
+        if (b > 0 || init) {\
+            Q##_apply_carry(f, kernel, c, o, os, m);\
+        }\
+        c = *(Q *)(o + (m - 1)*os);\
+        if (k > 0) {\
+            c = Q##_renormalize(c);\
+        }\
+    }\
+}
+
+QUATERNION_TREE_FUNCS(quaternion)
+QUATERNION_TREE_FUNCS(quaternion32)
+QUATERNION_TREE_FUNCS(dual_quaternion)
+
+/*
+ * dotfunc, for np.dot: in0[0]*in1[0] + ... + in0[n-1]*in1[n-1].  The
+ * products are formed DOT_BLOCK at a time with the vectorized kernel, from
+ * copies of strided inputs, and summed pairwise within each block.
+ */
+#define DOT_BLOCK 64
+
+#define QUATERNION_DOT(NAME, Q)\
+static void \
+NAME##_dot(char *ip0, npy_intp is0, char *ip1, npy_intp is1, char *op,\
+        npy_intp n, void *NPY_UNUSED(arr))\
+{\
+    Q a[DOT_BLOCK], b[DOT_BLOCK], s = {0, 0, 0, 0};\
+    npy_intp i, j, m;\
+    for (i = 0; i < n; i += m, ip0 += m*is0, ip1 += m*is1) {\
+        const Q *pa = (Q *)ip0, *pb = (Q *)ip1;\
+        m = n - i < DOT_BLOCK ? n - i : DOT_BLOCK;\
+        if (is0 != sizeof(Q)) {\
+            for (j = 0; j < m; j++) {\
+                a[j] = *(Q *)(ip0 + j*is0);\
+            }\
+            pa = a;\
+        }\
+        if (is1 != sizeof(Q)) {\
+            for (j = 0; j < m; j++) {\
+                b[j] = *(Q *)(ip1 + j*is1);\
+            }\
+            pb = b;\
+        }\
+        Q##_multiply_kernel(a, pa, 1, pb, 1, m);\
+        s = Q##_add(s, Q##_pairwise(Q##_add, (char *)a, sizeof(Q), m, 0));\
+    }\
+    *(Q *)op = s;\
+}
+
+QUATERNION_DOT(QUATERNION, quaternion)
+QUATERNION_DOT(QUATERNION32, quaternion32)
+
+#define BINARY_GEN_UFUNC(Q, name, func_name, arg_type, ret_type)\
+static void \
+Q##_##func_name##_ufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];\
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];\
+    npy_intp n = dimensions[0];\
+    npy_intp i;\
+    for(i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1){\
+        const Q in1 = *(Q *)ip1;\
+        const arg_type in2 = *(arg_type *)ip2;\
+        *((ret_type *)op1) = Q##_##func_name(in1, in2);};};
+
+/*
+ * Loops with vectorized kernels in quaternion_simd.c, used when each input is
+ * contiguous or a broadcast single element and the output is contiguous.
+ * tree is TREE_LOOP for the add and multiply loops, which take reductions and
+ * accumulations to the functions above, and NO_TREE for the others.
+ */
+#define TREE_LOOP(Q, func_name)\
+    if (n > 0 && is1 == 0 && os1 == 0 && ip1 == op1) {\
+        *(Q *)op1 = Q##_##func_name(*(Q *)op1,\
+            Q##_tree_reduce(Q##_##func_name, ip2, is2, n, 0));\
+        return;\
+    }\
+    if (n > 0 && os1 != 0 && is1 == os1 && op1 == ip1 + os1) {\
+        Q##_tree_accumulate(Q##_##func_name, Q##_##func_name##_kernel,\
+            (Q *)ip1, ip2, is2, op1, os1, n, 0);\
+        return;\
+    }
+#define NO_TREE(Q, func_name)
+
+/*
+ * Whether a kernel writing n elements of size osize at op may read the input
+ * at ip, of stride is (0 or its element size isize): the input must be the
+ * output itself or lie apart from it.  In an accumulation the output is the
+ * first input shifted by one element, so each element depends on the one
+ * before, which only the element by element loop sees in time.
+ */
+static NPY_INLINE int
+kernel_input_ok(const char *ip, npy_intp is, npy_intp isize,
+    const char *op, npy_intp osize, npy_intp n)
+{
+    return (ip == op && is == osize) || ip + (is ? n*is : isize) <= op ||
+        op + n*osize <= ip;
+}
+
+#define BINARY_KERNEL_GEN_UFUNC(Q, name, func_name, arg_type, tree)\
+static void \
+Q##_##func_name##_ufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];\
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];\
+    npy_intp n = dimensions[0];\
+    npy_intp i;\
+    tree(Q, func_name)\
+    if ((is1 == 0 || is1 == sizeof(Q)) &&\
+        (is2 == 0 || is2 == sizeof(arg_type)) && os1 == sizeof(Q) &&\
+        kernel_input_ok(ip1, is1, sizeof(Q), op1, sizeof(Q), n) &&\
+        kernel_input_ok(ip2, is2, sizeof(arg_type), op1, sizeof(Q), n)) {\
+        Q##_##func_name##_kernel((Q *)op1, (Q *)ip1, is1 != 0,\
+            (arg_type *)ip2, is2 != 0, n);\
+        return;\
+    }\
+    for(i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1){\
+        const Q in1 = *(Q *)ip1;\
+        const arg_type in2 = *(arg_type *)ip2;\
+        *((Q *)op1) = Q##_##func_name(in1, in2);};};
+
+#define BINARY_UFUNC(Q, name, ret_type)\
+    BINARY_GEN_UFUNC(Q, name, name, Q, ret_type)
+#define BINARY_SCALAR_UFUNC(Q, name, real_type)\
+    BINARY_GEN_UFUNC(Q, name, name##_scalar, real_type, Q)
+#define BINARY_KERNEL_UFUNC(Q, name)\
+    BINARY_KERNEL_GEN_UFUNC(Q, name, name, Q, NO_TREE)
+#define BINARY_TREE_KERNEL_UFUNC(Q, name)\
+    BINARY_KERNEL_GEN_UFUNC(Q, name, name, Q, TREE_LOOP)
+#define BINARY_SCALAR_KERNEL_UFUNC(Q, name, real_type)\
+    BINARY_KERNEL_GEN_UFUNC(Q, name, name##_scalar, real_type, NO_TREE)
+
+BINARY_TREE_KERNEL_UFUNC(quaternion, add)
+BINARY_KERNEL_UFUNC(quaternion, subtract)
+BINARY_TREE_KERNEL_UFUNC(quaternion, multiply)
+BINARY_KERNEL_UFUNC(quaternion, divide)
+BINARY_KERNEL_UFUNC(quaternion, power)
+BINARY_KERNEL_UFUNC(quaternion, unit_multiply)
+BINARY_UFUNC(quaternion, copysign, quaternion)
+BINARY_UFUNC(quaternion, equal, npy_bool)
+BINARY_UFUNC(quaternion, not_equal, npy_bool)
+BINARY_UFUNC(quaternion, less, npy_bool)
+BINARY_UFUNC(quaternion, less_equal, npy_bool)
+BINARY_UFUNC(quaternion, inner, npy_double)
+BINARY_UFUNC(quaternion, chordal_distance, npy_double)
+BINARY_UFUNC(quaternion, intrinsic_distance, npy_double)
+BINARY_UFUNC(quaternion, rotation_distance, npy_double)
+
+BINARY_SCALAR_KERNEL_UFUNC(quaternion, power, npy_double)
+
+BINARY_TREE_KERNEL_UFUNC(quaternion32, add)
+BINARY_KERNEL_UFUNC(quaternion32, subtract)
+BINARY_TREE_KERNEL_UFUNC(quaternion32, multiply)
+BINARY_KERNEL_UFUNC(quaternion32, divide)
+BINARY_KERNEL_UFUNC(quaternion32, unit_multiply)
+BINARY_UFUNC(quaternion32, power, quaternion32)
+BINARY_UFUNC(quaternion32, copysign, quaternion32)
+BINARY_UFUNC(quaternion32, equal, npy_bool)
+BINARY_UFUNC(quaternion32, not_equal, npy_bool)
+BINARY_UFUNC(quaternion32, less, npy_bool)
+BINARY_UFUNC(quaternion32, less_equal, npy_bool)
+BINARY_UFUNC(quaternion32, inner, npy_float)
+
+BINARY_SCALAR_UFUNC(quaternion32, power, npy_float)
+
+/*
+ * Loops for add, subtract, multiply and divide mixing quaternions Q with an
+ * array of a real type T, in either order, so that the reals are not cast to
+ * a temporary quaternion array first.  They go through the vectorized scalar
+ * kernels with the quaternions contiguous or broadcast, converting the reals
+ * to the component type real directly if T is real and otherwise CAST_BLOCK
+ * at a time; a broadcast real (stride 0) is converted once.  func is the
+ * quaternion function taking (q, s) for the operation.
+ */
+#define MIXED_GEN_UFUNC(loop_name, Q, T, real, func, qi)\
+static void \
+loop_name(char** args, npy_intp* dimensions, npy_intp* steps, void* data) {\
+    char *qp = args[qi], *sp = args[1 - qi], *op = args[2];\
+    npy_intp qs = steps[qi], ss = steps[1 - qi], os = steps[2];\
+    npy_intp n = dimensions[0];\
+    npy_intp i, j, b;\
+    real buf[CAST_BLOCK];\
+    if ((qs == 0 || qs == sizeof(Q)) && os == sizeof(Q)) {\
+        if (ss == 0) {\
+            buf[0] = (real)*(T *)sp;\
+            Q##_##func##_kernel((Q *)op, (Q *)qp, qs != 0, buf, 0, n);\
+        }\
+        else if (CAST_DIRECT(T, real) && ss == sizeof(T)) {\
+            Q##_##func##_kernel((Q *)op, (Q *)qp, qs != 0, (real *)sp, 1, n);\
+        }\
+        else {\
+            for (i = 0; i < n; i += b) {\
+                b = n - i < CAST_BLOCK ? n - i : CAST_BLOCK;\
+                for (j = 0; j < b; j++) {\
+                    buf[j] = (real)*(T *)(sp + (i + j)*ss);\
+                }\
+                Q##_##func##_kernel((Q *)op + i, (Q *)(qp + i*qs), qs != 0, buf, 1, b);\
+            }\
+        }\
+        return;\
+    }\
+    if (ss == 0) {\
+        const real s = (real)*(T *)sp;\
+        for (i = 0; i < n; i++, qp += qs, op += os) {\
+            *(Q *)op = Q##_##func(*(Q *)qp, s);\
+        }\
+        return;\
+    }\
+    for (i = 0; i < n; i++, qp += qs, sp += ss, op += os) {\
+        *(Q *)op = Q##_##func(*(Q *)qp, (real)*(T *)sp);\
+    }\
+}
+
+#define MIXED_UFUNCS(Q, T, real)\
+    MIXED_GEN_UFUNC(Q##_add_##T##_ufunc, Q, T, real, add_scalar, 0)\
+    MIXED_GEN_UFUNC(T##_add_##Q##_ufunc, Q, T, real, add_scalar, 1)\
+    MIXED_GEN_UFUNC(Q##_subtract_##T##_ufunc, Q, T, real, subtract_scalar, 0)\
+    MIXED_GEN_UFUNC(T##_subtract_##Q##_ufunc, Q, T, real, rsubtract_scalar, 1)\
+    MIXED_GEN_UFUNC(Q##_multiply_##T##_ufunc, Q, T, real, multiply_scalar, 0)\
+    MIXED_GEN_UFUNC(T##_multiply_##Q##_ufunc, Q, T, real, multiply_scalar, 1)\
+    MIXED_GEN_UFUNC(Q##_divide_##T##_ufunc, Q, T, real, divide_scalar, 0)\
+    MIXED_GEN_UFUNC(T##_divide_##Q##_ufunc, Q, T, real, rdivide_scalar, 1)
+
+MIXED_UFUNCS(quaternion, npy_double, npy_double)
+MIXED_UFUNCS(quaternion, npy_int32, npy_double)
+MIXED_UFUNCS(quaternion, npy_int64, npy_double)
+MIXED_UFUNCS(quaternion32, npy_float, npy_float)
+
+BINARY_TREE_KERNEL_UFUNC(dual_quaternion, multiply)
+BINARY_UFUNC(dual_quaternion, equal, npy_bool)
+BINARY_UFUNC(dual_quaternion, not_equal, npy_bool)
+
+/*
+ * rotate(q, v), signature (),(3)->(3).  Contiguous vectors are passed to the
+ * vectorized kernel in chunks, which run in parallel if built with OpenMP.
+ * A single broadcast quaternion is applied as a rotation matrix.
+ */
+#define ROTATE_CHUNK 4096
+
+static void
+quaternion_rotate_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is2_v = steps[3], os1_v = steps[4];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    double m[9];
+    int k;
+    if ((is1 == 0 || is1 == sizeof(quaternion)) &&
+        is2 == 3*sizeof(double) && is2_v == sizeof(double) &&
+        os1 == 3*sizeof(double) && os1_v == sizeof(double)) {
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) if (n >= 2*ROTATE_CHUNK)
+#endif
+        for (i = 0; i < n; i += ROTATE_CHUNK) {
+            quaternion_rotate_kernel((double *)op1 + 3*i, (quaternion *)(ip1 + is1*i),
+                is1 != 0, (double *)ip2 + 3*i, n - i < ROTATE_CHUNK ? n - i : ROTATE_CHUNK);
+        }
+        return;
+    }
+    if (is1 == 0) {
+        quaternion_rotation_matrix(*(quaternion *)ip1, m);
+    }
+    for (i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1) {
+        double v[3], r[3];
+        for (k = 0; k < 3; k++) {
+            v[k] = *(double *)(ip2 + k*is2_v);
+        }
+        if (is1 == 0) {
+            for (k = 0; k < 3; k++) {
+                r[k] = m[3*k]*v[0] + m[3*k + 1]*v[1] + m[3*k + 2]*v[2];
+            }
+        }
+        else {
+            quaternion_rotate_vector(*(quaternion *)ip1, v, r);
+        }
+        for (k = 0; k < 3; k++) {
+            *(double *)(op1 + k*os1_v) = r[k];
+        }
+    }
+}
+
+/* slerp(q0, q1, t), using the vectorized kernel as BINARY_KERNEL_GEN_UFUNC */
+static void
+quaternion_slerp_ufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *ip3 = args[2], *op1 = args[3];
+    npy_intp is1 = steps[0], is2 = steps[1], is3 = steps[2], os1 = steps[3];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    if ((is1 == 0 || is1 == sizeof(quaternion)) &&
+        (is2 == 0 || is2 == sizeof(quaternion)) &&
+        (is3 == 0 || is3 == sizeof(double)) && os1 == sizeof(quaternion)) {
+        quaternion_slerp_kernel((quaternion *)op1, (quaternion *)ip1, is1 != 0,
+            (quaternion *)ip2, is2 != 0, (double *)ip3, is3 != 0, n);
+        return;
+    }
+    for (i = 0; i < n; i++, ip1 += is1, ip2 += is2, ip3 += is3, op1 += os1) {
+        *(quaternion *)op1 = quaternion_slerp(*(quaternion *)ip1, *(quaternion *)ip2,
+            *(double *)ip3);
+    }
+}
+
+static void
+quaternion_squad_ufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *ip3 = args[2], *ip4 = args[3];
+    char *ip5 = args[4], *op1 = args[5];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    for (i = 0; i < n; i++) {
+        *(quaternion *)op1 = quaternion_squad(*(quaternion *)ip1, *(quaternion *)ip2,
+            *(quaternion *)ip3, *(quaternion *)ip4, *(double *)ip5);
+        ip1 += steps[0];
+        ip2 += steps[1];
+        ip3 += steps[2];
+        ip4 += steps[3];
+        ip5 += steps[4];
+        op1 += steps[5];
+    }
+}
+
+/*
+ * resample(times, quats, new_times), signature (n),(n),(m)->(m): slerp the
+ * series quats sampled at increasing times to each of new_times, holding the
+ * end values outside the series.  For sorted new_times the bracketing
+ * intervals are found by a single merged walk through times, and blocks of
+ * slerps go to the vectorized kernel.
+ */
+#define RESAMPLE_BLOCK 256
+
+static void
+quaternion_resample_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *ip3 = args[2], *op1 = args[3];
+    npy_intp is1 = steps[0], is2 = steps[1], is3 = steps[2], os1 = steps[3];
+    npy_intp is1_n = steps[4], is2_n = steps[5], is3_m = steps[6], os1_m = steps[7];
+    npy_intp N = dimensions[0], n = dimensions[1], m = dimensions[2];
+    npy_intp N_, i, j, k, b;
+    quaternion q0[RESAMPLE_BLOCK], q1[RESAMPLE_BLOCK], r[RESAMPLE_BLOCK];
+    double u[RESAMPLE_BLOCK];
+
+#define TIME(j) (*(double *)(ip1 + (j)*is1_n))
+#define QUAT(j) (*(quaternion *)(ip2 + (j)*is2_n))
+
+    for (N_ = 0; N_ < N; N_++, ip1 += is1, ip2 += is2, ip3 += is3, op1 += os1) {
+        if (n < 2) {
+            quaternion fill = n ? QUAT(0) : (quaternion) {NPY_NAN, NPY_NAN, NPY_NAN, NPY_NAN};
+            for (i = 0; i < m; i++) {
+                *(quaternion *)(op1 + i*os1_m) = fill;
+            }
+            continue;
+        }
+        j = 0;
+        for (i = 0; i < m; i += b) {
+            b = m - i < RESAMPLE_BLOCK ? m - i : RESAMPLE_BLOCK;
+            for (k = 0; k < b; k++) {
+                double x = *(double *)(ip3 + (i + k)*is3_m), dt, t;
+                /* Move to the interval [times[j], times[j+1]] containing x */
+                while (j + 2 < n && TIME(j + 1) <= x) {
+                    j++;
+                }
+                while (j > 0 && TIME(j) > x) {
+                    j--;
+                }
+                dt = TIME(j + 1) - TIME(j);
+                t = dt > 0 ? (x - TIME(j)) / dt : x >= TIME(j + 1);
+                u[k] = t < 0 ? 0 : t > 1 ? 1 : t;
+                q0[k] = QUAT(j);
+                q1[k] = QUAT(j + 1);
+            }
+            if (os1_m == sizeof(quaternion)) {
+                quaternion_slerp_kernel((quaternion *)(op1 + i*os1_m), q0, 1, q1, 1, u, 1, b);
+            }
+            else {
+                quaternion_slerp_kernel(r, q0, 1, q1, 1, u, 1, b);
+                for (k = 0; k < b; k++) {
+                    *(quaternion *)(op1 + (i + k)*os1_m) = r[k];
+                }
+            }
+        }
+    }
+
+#undef TIME
+#undef QUAT
+}
+
+/*
+ * product(q, k), signature (n),()->(), and cumulative_product(q, k),
+ * signature (n),()->(n): the ordered products of q as the multiply
+ * reduction and accumulation, renormalized after at most k steps if k > 0.
+ * The empty product is 1.
+ */
+static void
+quaternion_product_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2], is1_n = steps[3];
+    npy_intp N = dimensions[0], n = dimensions[1];
+    npy_intp i;
+    for (i = 0; i < N; i++, ip1 += is1, ip2 += is2, op1 += os1) {
+        npy_intp k = *(npy_intp *)ip2;
+        quaternion r = {1, 0, 0, 0};
+        if (n > 0) {
+            r = quaternion_tree_reduce(quaternion_multiply, ip1, is1_n, n, k);
+        }
+        *(quaternion *)op1 = k > 0 ? quaternion_renormalize(r) : r;
+    }
+}
+
+static void
+quaternion_cumulative_product_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_n = steps[3], os1_n = steps[4];
+    npy_intp N = dimensions[0], n = dimensions[1];
+    npy_intp i;
+    for (i = 0; i < N; i++, ip1 += is1, ip2 += is2, op1 += os1) {
+        quaternion_tree_accumulate(quaternion_multiply, quaternion_multiply_kernel, NULL,
+            ip1, is1_n, op1, os1_n, n, *(npy_intp *)ip2);
+    }
+}
+
+/*
+ * mean_rotation(q), signature (n)->(), and weighted_mean_rotation(q, w),
+ * signature (n),(n)->(): the rotation minimizing the weighted sum of squared
+ * chordal distances to q, which is the unit eigenvector of the largest
+ * eigenvalue of the moment matrix M = sum w[i] q[i] q[i]^T / |q[i]|^2
+ * (Markley et al., "Averaging Quaternions", 2007), with w >= 0.  M is summed
+ * by the vectorized kernel over chunks of REDUCE_CHUNK quaternions, which run
+ * in parallel if built with OpenMP, and the eigenvector is found by Jacobi
+ * rotations.  Stacked means run in parallel instead.  Zero quaternions have
+ * no direction and are skipped, weights and all.  The mean of nothing, or of
+ * weights summing to zero or less over the rest, is nan.
+ */
+#define MOMENT_BLOCK 256
+#define JACOBI_SWEEPS 16
+
+/* Adds the moment of n quaternions at ip weighted by those at wp to m */
+static void
+quaternion_moment_add(double *m, char *ip, npy_intp is, char *wp, npy_intp ws, npy_intp n)
+{
+    quaternion q[MOMENT_BLOCK];
+    double w[MOMENT_BLOCK];
+    npy_intp i, j, b;
+
+    if (is == sizeof(quaternion) && (ws == 0 || ws == sizeof(double))) {
+        quaternion_moment_kernel(m, (quaternion *)ip, (double *)wp, ws != 0, n);
+        return;
+    }
+    for (i = 0; i < n; i += b) {
+        b = n - i < MOMENT_BLOCK ? n - i : MOMENT_BLOCK;
+        for (j = 0; j < b; j++) {
+            q[j] = *(quaternion *)(ip + (i + j)*is);
+            w[j] = *(double *)(wp + (i + j)*ws);
+        }
+        quaternion_moment_kernel(m, q, w, 1, b);
+    }
+}
+
+static void
+quaternion_moment(double *m, char *ip, npy_intp is, char *wp, npy_intp ws, npy_intp n,
+    int parallel)
+{
+    npy_intp chunks = (n + REDUCE_CHUNK - 1)/REDUCE_CHUNK, c;
+    double *partial = NULL;
+    int k;
+
+    memset(m, 0, 16*sizeof(double));
+    if (parallel && chunks > 1 && QUATERNION_THREADS() > 1) {
+        partial = (double *)calloc(16*chunks, sizeof(double));
+    }
+    if (partial) {
+        OMP_PARALLEL_FOR
+        for (c = 0; c < chunks; c++) {
+            npy_intp i = c*REDUCE_CHUNK;
+            quaternion_moment_add(partial + 16*c, ip + i*is, is, wp + i*ws, ws,
+                n - i < REDUCE_CHUNK ? n - i : REDUCE_CHUNK);
+        }
+    }
+    for (c = 0; c < chunks; c++) {
+        npy_intp i = c*REDUCE_CHUNK;
+        double t[16] = {0};
+        if (!partial) {
+            quaternion_moment_add(t, ip + i*is, is, wp + i*ws, ws,
+                n - i < REDUCE_CHUNK ? n - i : REDUCE_CHUNK);
+        }
+        for (k = 0; k < 16; k++) {
+            m[k] += partial ? partial[16*c + k] : t[k];
+        }
+    }
+    free(partial);
+}
+
+/* The unit eigenvector, with w >= 0, of the largest eigenvalue of m */
+static quaternion
+quaternion_principal_axis(const double *m)
+{
+    double a[4][4], v[4][4], total = 0, off;
+    quaternion r;
+    int i, j, k, p, q, sweep;
+
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            a[i][j] = m[4*i + j];
+            v[i][j] = i == j;
+            total += a[i][j]*a[i][j];
+        }
+    }
+    if (!(a[0][0] + a[1][1] + a[2][2] + a[3][3] > 0)) {
+        r.w = r.x = r.y = r.z = NPY_NAN;
+        return r;
+    }
+    for (sweep = 0; sweep < JACOBI_SWEEPS; sweep++) {
+        off = 0;
+        for (p = 0; p < 3; p++) {
+            for (q = p + 1; q < 4; q++) {
+                off += a[p][q]*a[p][q];
+            }
+        }
+        if (!(off > 1e-36*total)) {
+            break;
+        }
+        for (p = 0; p < 3; p++) {
+            for (q = p + 1; q < 4; q++) {
+                double theta, t, c, s;
+                /* negligible against the diagonal, as in Numerical Recipes */
+                if (fabs(a[p][q]) <= 1e-18*(fabs(a[p][p]) + fabs(a[q][q]))) {
+                    a[p][q] = a[q][p] = 0;
+                    continue;
+                }
+                /* the rotation in the p, q plane zeroing a[p][q] */
+                theta = (a[q][q] - a[p][p])/(2*a[p][q]);
+                t = fabs(theta) > 1e150 ? 0.5/theta :
+                    (theta < 0 ? -1 : 1)/(fabs(theta) + sqrt(theta*theta + 1));
+                c = 1/sqrt(t*t + 1);
+                s = t*c;
+                for (k = 0; k < 4; k++) {
+                    double akp = a[k][p], akq = a[k][q];
+                    a[k][p] = c*akp - s*akq;
+                    a[k][q] = s*akp + c*akq;
+                }
+                for (k = 0; k < 4; k++) {
+                    double apk = a[p][k], aqk = a[q][k];
+                    a[p][k] = c*apk - s*aqk;
+                    a[q][k] = s*apk + c*aqk;
+                }
+                for (k = 0; k < 4; k++) {
+                    double vkp = v[k][p], vkq = v[k][q];
+                    v[k][p] = c*vkp - s*vkq;
+                    v[k][q] = s*vkp + c*vkq;
+                }
+                a[p][q] = a[q][p] = 0;
+            }
+        }
+    }
+    for (k = 0, i = 1; i < 4; i++) {
+        if (a[i][i] > a[k][k]) {
+            k = i;
+        }
+    }
+    r.w = v[0][k];
+    r.x = v[1][k];
+    r.y = v[2][k];
+    r.z = v[3][k];
+    if (r.w < 0) {
+        r = quaternion_negative(r);
+    }
+    return quaternion_renormalize(r);
+}
+
+static void
+quaternion_mean_rotation_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *op1 = args[1];
+    npy_intp is1 = steps[0], os1 = steps[1], is1_n = steps[2];
+    npy_intp N = dimensions[0], n = dimensions[1];
+    npy_intp i;
+    double one = 1;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (N > 1)
+#endif
+    for (i = 0; i < N; i++) {
+        double m[16];
+        quaternion_moment(m, ip1 + i*is1, is1_n, (char *)&one, 0, n, N == 1);
+        *(quaternion *)(op1 + i*os1) = quaternion_principal_axis(m);
+    }
+}
+
+static void
+quaternion_weighted_mean_rotation_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_n = steps[3], is2_n = steps[4];
+    npy_intp N = dimensions[0], n = dimensions[1];
+    npy_intp i;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (N > 1)
+#endif
+    for (i = 0; i < N; i++) {
+        double m[16];
+        quaternion_moment(m, ip1 + i*is1, is1_n, ip2 + i*is2, is2_n, n, N == 1);
+        *(quaternion *)(op1 + i*os1) = quaternion_principal_axis(m);
+    }
+}
+
+/*
+ * integrate_angular_velocity(w, t), signature (n,3),(n)->(n), and
+ * angular_velocity(q, t), signature (n),(n)->(n,3), for body frame angular
+ * velocities w of orientations q sampled at times t, dq/dt = q w / 2.
+ *
+ * integrate_angular_velocity starts from q[0] = 1.  Each step interpolates w
+ * by cubic Hermite splines, with slopes from the neighbouring samples, and
+ * takes the fourth order Magnus step q[j+1] = q[j] exp(W/2) with the
+ * rotation vector W = h (w1 + w2)/2 + sqrt(3) h^2 (w1 x w2)/12 from w at the
+ * two Gauss points.  The steps are exponentiated INTEGRATE_BLOCK at a time by
+ * the vectorized kernel, written to the output and multiplied out in place as
+ * a blocked scan.  The error over a fixed time falls as h^4.
+ *
+ * angular_velocity is its inverse to second order: 2 log(conj(q[j]) q[j+1])/h
+ * is w at the middle of each step, found a block at a time with the
+ * vectorized multiply and log kernels, and w at each sample is interpolated
+ * (at the ends extrapolated) linearly from the neighbouring steps.  The
+ * shorter of the rotations to q[j+1] and -q[j+1] is taken, so signs may flip
+ * between samples.  Stacked series run in parallel if built with OpenMP.
+ */
+#define INTEGRATE_BLOCK 256
+
+static void
+quaternion_integrate_angular_velocity_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_n = steps[3], is1_3 = steps[4], is2_n = steps[5], os1_n = steps[6];
+    npy_intp N = dimensions[0], n = dimensions[1];
+    npy_intp i;
+    /* Gauss points and the Hermite basis there */
+    const double g[2] = {0.5 - 0.5/sqrt(3.0), 0.5 + 0.5/sqrt(3.0)};
+    double hb[2][4];
+    int e;
+    for (e = 0; e < 2; e++) {
+        double c = g[e];
+        hb[e][0] = (2*c - 3)*c*c + 1;
+        hb[e][1] = ((c - 2)*c + 1)*c;
+        hb[e][2] = (3 - 2*c)*c*c;
+        hb[e][3] = (c - 1)*c*c;
+    }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (N > 1)
+#endif
+    for (i = 0; i < N; i++) {
+        quaternion buf[INTEGRATE_BLOCK];
+        const char *w = ip1 + i*is1, *t = ip2 + i*is2;
+        char *o = op1 + i*os1;
+        /*
+         * A window over samples j to j + 2: w there, the steps' lengths and
+         * slopes (of the step before too) and the slope estimate at j
+         */
+        double w0[3], w1[3], w2[3] = {0, 0, 0}, h0 = 0, h1 = 0, hp = 0;
+        double s0[3], s1[3] = {0, 0, 0}, sp[3] = {0, 0, 0}, d0[3], d1[3];
+        npy_intp j0, j, m;
+        int c;
+
+        if (n == 0) {
+            continue;
+        }
+        *(quaternion *)o = (quaternion) {1, 0, 0, 0};
+        if (n == 1) {
+            continue;
+        }
+        h0 = *(double *)(t + is2_n) - *(double *)t;
+        if (n > 2) {
+            h1 = *(double *)(t + 2*is2_n) - *(double *)(t + is2_n);
+        }
+        for (c = 0; c < 3; c++) {
+            w0[c] = *(double *)(w + c*is1_3);
+            w1[c] = *(double *)(w + is1_n + c*is1_3);
+            s0[c] = (w1[c] - w0[c])/h0;
+            if (n > 2) {
+                w2[c] = *(double *)(w + 2*is1_n + c*is1_3);
+                s1[c] = (w2[c] - w1[c])/h1;
+                d0[c] = s0[c] - h0*(s1[c] - s0[c])/(h0 + h1);
+            }
+            else {
+                d0[c] = s0[c];
+            }
+        }
+        for (j0 = 0; j0 < n - 1; j0 += m) {
+            m = n - 1 - j0 < INTEGRATE_BLOCK ? n - 1 - j0 : INTEGRATE_BLOCK;
+            for (j = j0; j < j0 + m; j++) {
+                double v[2][3], h = h0;
+                if (j + 2 < n) {
+                    double r = 1/(h0 + h1);
+                    for (c = 0; c < 3; c++) {
+                        d1[c] = (h1*s0[c] + h0*s1[c])*r;
+                    }
+                }
+                else {
+                    for (c = 0; c < 3; c++) {
+                        d1[c] = j == 0 ? s0[c] : s0[c] + h0*(s0[c] - sp[c])/(hp + h0);
+                    }
+                }
+                for (e = 0; e < 2; e++) {
+                    for (c = 0; c < 3; c++) {
+                        v[e][c] = hb[e][0]*w0[c] + hb[e][1]*h*d0[c] +
+                            hb[e][2]*w1[c] + hb[e][3]*h*d1[c];
+                    }
+                }
+                /* half the rotation vector of the step */
+                buf[j - j0].w = 0;
+                buf[j - j0].x = 0.25*h*(v[0][0] + v[1][0]) +
+                    sqrt(3.0)/24*h*h*(v[0][1]*v[1][2] - v[0][2]*v[1][1]);
+                buf[j - j0].y = 0.25*h*(v[0][1] + v[1][1]) +
+                    sqrt(3.0)/24*h*h*(v[0][2]*v[1][0] - v[0][0]*v[1][2]);
+                buf[j - j0].z = 0.25*h*(v[0][2] + v[1][2]) +
+                    sqrt(3.0)/24*h*h*(v[0][0]*v[1][1] - v[0][1]*v[1][0]);
+                /* slide the window */
+                hp = h0;
+                h0 = h1;
+                for (c = 0; c < 3; c++) {
+                    sp[c] = s0[c];
+                    s0[c] = s1[c];
+                    w0[c] = w1[c];
+                    w1[c] = w2[c];
+                    d0[c] = d1[c];
+                }
+                if (j + 3 < n) {
+                    h1 = *(double *)(t + (j + 3)*is2_n) - *(double *)(t + (j + 2)*is2_n);
+                    for (c = 0; c < 3; c++) {
+                        w2[c] = *(double *)(w + (j + 3)*is1_n + c*is1_3);
+                        s1[c] = (w2[c] - w1[c])/h1;
+                    }
+                }
+            }
+            quaternion_exp_kernel(buf, buf, m);
+            for (j = 0; j < m; j++) {
+                *(quaternion *)(o + (j0 + j + 1)*os1_n) = buf[j];
+            }
+        }
+        quaternion_tree_accumulate(quaternion_multiply, quaternion_multiply_kernel, NULL,
+            o, os1_n, o, os1_n, n, 0);
+    }
+}
+
+static void
+quaternion_angular_velocity_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_n = steps[3], is2_n = steps[4], os1_n = steps[5], os1_3 = steps[6];
+    npy_intp N = dimensions[0], n = dimensions[1];
+    npy_intp i;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if (N > 1)
+#endif
+    for (i = 0; i < N; i++) {
+        quaternion a[INTEGRATE_BLOCK], b[INTEGRATE_BLOCK];
+        const char *q = ip1 + i*is1, *t = ip2 + i*is2;
+        char *o = op1 + i*os1;
+        /* the rates and lengths of the last two steps */
+        double r[2][3] = {{0, 0, 0}, {0, 0, 0}}, h[2] = {0, 0};
+        npy_intp j0, j, m;
+        int c;
+
+        for (j0 = 0; j0 < n - 1; j0 += m) {
+            m = n - 1 - j0 < INTEGRATE_BLOCK ? n - 1 - j0 : INTEGRATE_BLOCK;
+            for (j = 0; j < m; j++) {
+                a[j] = quaternion_conjugate(*(quaternion *)(q + (j0 + j)*is1_n));
+                b[j] = *(quaternion *)(q + (j0 + j + 1)*is1_n);
+            }
+            quaternion_multiply_kernel(a, a, 1, b, 1, m);
+            for (j = 0; j < m; j++) {
+                if (a[j].w < 0) {
+                    a[j] = quaternion_negative(a[j]);
+                }
+            }
+            quaternion_log_kernel(a, a, m);
+            for (j = j0; j < j0 + m; j++) {
+                double hj = *(double *)(t + (j + 1)*is2_n) - *(double *)(t + j*is2_n);
+                const quaternion *l = a + (j - j0);
+                memcpy(r[0], r[1], sizeof(r[0]));
+                h[0] = h[1];
+                r[1][0] = 2*l->x/hj;
+                r[1][1] = 2*l->y/hj;
+                r[1][2] = 2*l->z/hj;
+                h[1] = hj;
+                if (j == 0) {
+                    continue;
+                }
+                for (c = 0; c < 3; c++) {
+                    double s0 = r[0][c], s1 = r[1][c];
+                    if (j == 1) {
+                        *(double *)(o + c*os1_3) = s0 - h[0]*(s1 - s0)/(h[0] + h[1]);
+                    }
+                    *(double *)(o + j*os1_n + c*os1_3) = (h[1]*s0 + h[0]*s1)/(h[0] + h[1]);
+                }
+            }
+        }
+        for (c = 0; c < 3 && n > 0; c++) {
+            double s0 = r[0][c], s1 = r[1][c];
+            if (n <= 2) {
+                *(double *)(o + c*os1_3) = s1;
+                *(double *)(o + (n - 1)*os1_n + c*os1_3) = s1;
+            }
+            else {
+                *(double *)(o + (n - 1)*os1_n + c*os1_3) = s1 + h[1]*(s1 - s0)/(h[0] + h[1]);
+            }
+        }
+    }
+}
+
+/*
+ * matrix_multiply(a, b), signature (m,n),(n,p)->(m,p), also the quaternion
+ * loop of np.matmul.  The output is computed in blocks of MATMUL_ROWS rows by
+ * MATMUL_COLS columns, summing over MATMUL_DEPTH columns of a at a time: the
+ * block of b is packed into planes of w, x, y and z components, which stay in
+ * cache while the vectorized kernel adds to each row of the output block,
+ * kept in the same form.  Rows run in parallel if built with OpenMP.  Each
+ * element sums its n products in order.
+ */
+#define MATMUL_ROWS 256
+#define MATMUL_COLS 64
+#define MATMUL_DEPTH 64
+
+static void
+quaternion_matrix_multiply_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_m = steps[3], is1_n = steps[4], is2_n = steps[5], is2_p = steps[6];
+    npy_intp os1_m = steps[7], os1_p = steps[8];
+    npy_intp N = dimensions[0], dm = dimensions[1], dn = dimensions[2], dp = dimensions[3];
+    npy_intp N_, i0, j0, k0, i, j, k;
+    double *b = (double *)malloc(MATMUL_DEPTH*4*MATMUL_COLS*sizeof(double));
+    double *c = (double *)malloc(MATMUL_ROWS*4*MATMUL_COLS*sizeof(double));
+
+    if (!b || !c) {
+        /* Without buffers, one dot product at a time */
+        for (N_ = 0; N_ < N; N_++, ip1 += is1, ip2 += is2, op1 += os1) {
+            for (i = 0; i < dm; i++) {
+                for (j = 0; j < dp; j++) {
+                    QUATERNION_dot(ip1 + i*is1_m, is1_n, ip2 + j*is2_p, is2_n,
+                        op1 + i*os1_m + j*os1_p, dn, NULL);
+                }
+            }
+        }
+        free(b);
+        free(c);
+        return;
+    }
+
+    for (N_ = 0; N_ < N; N_++, ip1 += is1, ip2 += is2, op1 += os1) {
+        for (j0 = 0; j0 < dp; j0 += MATMUL_COLS) {
+            npy_intp pb = dp - j0 < MATMUL_COLS ? dp - j0 : MATMUL_COLS;
+            /* Planes are padded with zeros to a multiple of the kernel's width */
+            npy_intp p = (pb + QUATERNION_PLANE_ALIGN - 1)/QUATERNION_PLANE_ALIGN*
+                QUATERNION_PLANE_ALIGN;
+            for (i0 = 0; i0 < dm; i0 += MATMUL_ROWS) {
+                npy_intp mb = dm - i0 < MATMUL_ROWS ? dm - i0 : MATMUL_ROWS;
+                memset(c, 0, mb*4*p*sizeof(double));
+                for (k0 = 0; k0 < dn; k0 += MATMUL_DEPTH) {
+                    npy_intp kb = dn - k0 < MATMUL_DEPTH ? dn - k0 : MATMUL_DEPTH;
+                    for (k = 0; k < kb; k++) {
+                        double *bk = b + 4*p*k;
+                        for (j = 0; j < p; j++) {
+                            quaternion q = {0, 0, 0, 0};
+                            if (j < pb) {
+                                q = *(quaternion *)(ip2 + (k0 + k)*is2_n + (j0 + j)*is2_p);
+                            }
+                            bk[j] = q.w;
+                            bk[p + j] = q.x;
+                            bk[2*p + j] = q.y;
+                            bk[3*p + j] = q.z;
+                        }
+                    }
+                    OMP_PARALLEL_FOR
+                    for (i = 0; i < mb; i++) {
+                        quaternion a[MATMUL_DEPTH];
+                        const char *ai = ip1 + (i0 + i)*is1_m + k0*is1_n;
+                        const quaternion *pa = (const quaternion *)ai;
+                        npy_intp kk;
+                        if (is1_n != sizeof(quaternion)) {
+                            for (kk = 0; kk < kb; kk++) {
+                                a[kk] = *(quaternion *)(ai + kk*is1_n);
+                            }
+                            pa = a;
+                        }
+                        quaternion_matmul_kernel(c + 4*p*i, pa, kb, b, p);
+                    }
+                }
+                for (i = 0; i < mb; i++) {
+                    const double *ci = c + 4*p*i;
+                    char *o = op1 + (i0 + i)*os1_m + j0*os1_p;
+                    for (j = 0; j < pb; j++, o += os1_p) {
+                        *(quaternion *)o = (quaternion) {ci[j], ci[p + j], ci[2*p + j], ci[3*p + j]};
+                    }
+                }
+            }
+        }
+    }
+    free(b);
+    free(c);
+}
+
+/*
+ * matrix_multiply for quaternion32: each element is a QUATERNION32_dot, so
+ * the products agree with np.dot of the same arrays.  The packed planes of the
+ * double loop have no single precision kernel.
+ */
+static void
+quaternion32_matrix_multiply_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_m = steps[3], is1_n = steps[4], is2_n = steps[5], is2_p = steps[6];
+    npy_intp os1_m = steps[7], os1_p = steps[8];
+    npy_intp N = dimensions[0], dm = dimensions[1], dn = dimensions[2], dp = dimensions[3];
+    npy_intp N_, i, j;
+
+    for (N_ = 0; N_ < N; N_++, ip1 += is1, ip2 += is2, op1 += os1) {
+        for (i = 0; i < dm; i++) {
+            for (j = 0; j < dp; j++) {
+                QUATERNION32_dot(ip1 + i*is1_m, is1_n, ip2 + j*is2_p, is2_n,
+                    op1 + i*os1_m + j*os1_p, dn, NULL);
+            }
+        }
+    }
+}
+
+/*
+ * pairwise_distance(a, b), signature (n),(m)->(n,m): the rotation_distance of
+ * every a[i] and b[j].  b is normalized and packed into planes of w, x, y and
+ * z components DISTANCE_COLS at a time, which stay in cache while the
+ * vectorized kernel computes their distances from each a[i].  Rows run in
+ * parallel if built with OpenMP.
+ */
+#define DISTANCE_COLS 512
+
+static void
+quaternion_pairwise_distance_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is1_n = steps[3], is2_m = steps[4], os1_n = steps[5], os1_m = steps[6];
+    npy_intp N = dimensions[0], dn = dimensions[1], dm = dimensions[2];
+    npy_intp N_, i, j, j0;
+    double *b = (double *)malloc(4*DISTANCE_COLS*sizeof(double));
+
+    if (!b) {
+        for (N_ = 0; N_ < N; N_++, ip1 += is1, ip2 += is2, op1 += os1) {
+            for (i = 0; i < dn; i++) {
+                for (j = 0; j < dm; j++) {
+                    *(double *)(op1 + i*os1_n + j*os1_m) = quaternion_rotation_distance(
+                        *(quaternion *)(ip1 + i*is1_n), *(quaternion *)(ip2 + j*is2_m));
+                }
+            }
+        }
+        return;
+    }
+
+    for (N_ = 0; N_ < N; N_++, ip1 += is1, ip2 += is2, op1 += os1) {
+        for (j0 = 0; j0 < dm; j0 += DISTANCE_COLS) {
+            npy_intp pb = dm - j0 < DISTANCE_COLS ? dm - j0 : DISTANCE_COLS;
+            npy_intp p = (pb + QUATERNION_PLANE_ALIGN - 1)/QUATERNION_PLANE_ALIGN*
+                QUATERNION_PLANE_ALIGN;
+            /* Padding with 1 keeps the kernel's spare lanes finite */
+            for (j = 0; j < p; j++) {
+                quaternion q = {1, 0, 0, 0};
+                if (j < pb) {
+                    q = *(quaternion *)(ip2 + (j0 + j)*is2_m);
+                    q = quaternion_divide_scalar(q, quaternion_absolute(q));
+                }
+                b[j] = q.w;
+                b[p + j] = q.x;
+                b[2*p + j] = q.y;
+                b[3*p + j] = q.z;
+            }
+            OMP_PARALLEL_FOR
+            for (i = 0; i < dn; i++) {
+                double row[DISTANCE_COLS];
+                quaternion q = *(quaternion *)(ip1 + i*is1_n);
+                char *o = op1 + i*os1_n + j0*os1_m;
+                npy_intp jj;
+                q = quaternion_divide_scalar(q, quaternion_absolute(q));
+                if (os1_m == sizeof(double) && pb == p) {
+                    quaternion_distance_kernel((double *)o, q, b, p, p);
+                    continue;
+                }
+                quaternion_distance_kernel(row, q, b, p, p);
+                for (jj = 0; jj < pb; jj++, o += os1_m) {
+                    *(double *)o = row[jj];
+                }
+            }
+        }
+    }
+    free(b);
+}
+
+/*
+ * Rotation index queries, over the layout RotationIndex (index.py) builds:
+ * unit points sorted by cell and held in planes of w, x, y and z components
+ * (4,p), their original indices (p) with -1 marking padding, the cells' unit
+ * centers in planes (4,c), their radii, no less than the rotation_distance of
+ * any of their points from the center (cells), and the offsets of the cells
+ * in the point planes (cells+1), multiples of QUATERNION_PLANE_ALIGN.
+ *
+ * index_query(q, radius, ...), signature (),(),(4,p),(p),(4,c),(d),(e)->(k),(k):
+ * the indices and rotation distances of the k points nearest q within radius,
+ * nearest first and padded with -1 and inf.  No point of a cell is nearer q
+ * than the center's distance less the radius, so the cells are scanned in
+ * order of that bound until it passes the kth nearest distance found.
+ * index_count(q, radius, ...), signature (),(),(4,p),(p),(4,c),(d),(e)->(),
+ * counts the points within radius.  Queries run in parallel if built with
+ * OpenMP.
+ */
+typedef struct {
+    const double *points;
+    const npy_intp *order;
+    npy_intp p;
+    const double *centers;
+    const double *radii;
+    const npy_intp *offsets;
+    npy_intp c, cells, width;
+} rotation_index;
+
+typedef struct {
+    double bound;
+    npy_intp cell;
+} rotation_index_cell;
+
+static int
+rotation_index_cell_compare(const void *a, const void *b)
+{
+    double da = ((const rotation_index_cell *)a)->bound;
+    double db = ((const rotation_index_cell *)b)->bound;
+    return da < db ? -1 : da > db;
+}
+
+/* Max-heap of the k nearest, nearest meaning smaller distance then index */
+#define INDEX_NEARER(d1, i1, d2, i2) ((d1) < (d2) || ((d1) == (d2) && (i1) < (i2)))
+
+static void
+rotation_index_sift_down(double *hd, npy_intp *hi, npy_intp n, npy_intp j)
+{
+    double d = hd[j];
+    npy_intp i = hi[j];
+    for (;;) {
+        npy_intp l = 2*j + 1;
+        if (l >= n) {
+            break;
+        }
+        if (l + 1 < n && INDEX_NEARER(hd[l], hi[l], hd[l + 1], hi[l + 1])) {
+            l++;
+        }
+        if (!INDEX_NEARER(d, i, hd[l], hi[l])) {
+            break;
+        }
+        hd[j] = hd[l];
+        hi[j] = hi[l];
+        j = l;
+    }
+    hd[j] = d;
+    hi[j] = i;
+}
+
+/*
+ * Adds the points of cell within radius to the heap of at most k, or if k is
+ * negative to *count.  work holds ix->width doubles.
+ */
+static void
+rotation_index_scan(const rotation_index *ix, npy_intp cell, quaternion q,
+    double radius, npy_intp k, double *hd, npy_intp *hi, npy_intp *count,
+    double *work)
+{
+    npy_intp start = ix->offsets[cell], end = ix->offsets[cell + 1], j;
+    const npy_intp *order = ix->order + start;
+
+    quaternion_distance_kernel(work, q, ix->points + start, ix->p, end - start);
+    for (j = 0; j < end - start; j++) {
+        double d = work[j];
+        npy_intp i = order[j];
+        if (i < 0 || !(d <= radius)) {
+            continue;
+        }
+        if (k < 0) {
+            (*count)++;
+        }
+        else if (*count < k) {
+            /* sift up */
+            npy_intp m = (*count)++;
+            while (m > 0 && INDEX_NEARER(hd[(m - 1)/2], hi[(m - 1)/2], d, i)) {
+                hd[m] = hd[(m - 1)/2];
+                hi[m] = hi[(m - 1)/2];
+                m = (m - 1)/2;
+            }
+            hd[m] = d;
+            hi[m] = i;
+        }
+        else if (k > 0 && INDEX_NEARER(d, i, hd[0], hi[0])) {
+            hd[0] = d;
+            hi[0] = i;
+            rotation_index_sift_down(hd, hi, k, 0);
+        }
+    }
+}
+
+/*
+ * The k nearest points to unit q within radius into the heap hd, hi, returning
+ * how many were found, or with k negative the number within radius.  cells
+ * and work hold ix->cells and ix->width entries.
+ */
+static npy_intp
+rotation_index_search(const rotation_index *ix, quaternion q, double radius,
+    npy_intp k, double *hd, npy_intp *hi, rotation_index_cell *cells, double *work)
+{
+    npy_intp count = 0, m = 0, j;
+
+    quaternion_distance_kernel(work, q, ix->centers, ix->c, ix->c);
+    for (j = 0; j < ix->cells; j++) {
+        double bound = work[j] - ix->radii[j];
+        if (bound <= radius) {
+            cells[m].bound = bound;
+            cells[m].cell = j;
+            m++;
+        }
+    }
+    if (k < 0) {
+        for (j = 0; j < m; j++) {
+            rotation_index_scan(ix, cells[j].cell, q, radius, k, hd, hi, &count, work);
+        }
+        return count;
+    }
+    /* Nearest cells first until k points are found, usually just one */
+    while (m > 0 && count < k) {
+        npy_intp best = 0;
+        for (j = 1; j < m; j++) {
+            if (cells[j].bound < cells[best].bound) {
+                best = j;
+            }
+        }
+        rotation_index_scan(ix, cells[best].cell, q, radius, k, hd, hi, &count, work);
+        cells[best] = cells[--m];
+    }
+    if (m > 0 && k > 0) {
+        /* then only cells which might hold nearer points, in order */
+        npy_intp n = 0;
+        for (j = 0; j < m; j++) {
+            if (cells[j].bound <= hd[0]) {
+                cells[n++] = cells[j];
+            }
+        }
+        qsort(cells, n, sizeof(rotation_index_cell), rotation_index_cell_compare);
+        for (j = 0; j < n && cells[j].bound <= hd[0]; j++) {
+            rotation_index_scan(ix, cells[j].cell, q, radius, k, hd, hi, &count, work);
+        }
+    }
+    return count;
+}
+
+/*
+ * Answers the n queries q = ip1[i], radius = ip2[i] into op1[i] and op2[i],
+ * the indices and distances of the k nearest with stride os_k and os_d, or
+ * into op1[i] alone their count if k is negative.  Returns -1 if out of
+ * memory.
+ */
+static int
+rotation_index_run(const rotation_index *ix, npy_intp n, npy_intp k,
+    char *ip1, npy_intp is1, char *ip2, npy_intp is2,
+    char *op1, npy_intp os1, npy_intp os_k, char *op2, npy_intp os2, npy_intp os_d)
+{
+    npy_intp heap = k > 0 ? k : 1, i;
+    size_t each = ix->cells*sizeof(rotation_index_cell) +
+        heap*(sizeof(double) + sizeof(npy_intp)) + ix->width*sizeof(double);
+    char *space = (char *)malloc(QUATERNION_THREADS()*each);
+
+    if (!space) {
+        return -1;
+    }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 16) if (n > 1)
+#endif
+    for (i = 0; i < n; i++) {
+        char *s = space + QUATERNION_THREAD()*each;
+        rotation_index_cell *cells = (rotation_index_cell *)s;
+        double *hd = (double *)(cells + ix->cells);
+        npy_intp *hi = (npy_intp *)(hd + heap);
+        double *work = (double *)(hi + heap);
+        quaternion q = *(quaternion *)(ip1 + i*is1);
+        double radius = *(double *)(ip2 + i*is2);
+        npy_intp count, j;
+
+        q = quaternion_divide_scalar(q, quaternion_absolute(q));
+        count = rotation_index_search(ix, q, radius, k, hd, hi, cells, work);
+        if (k < 0) {
+            *(npy_intp *)(op1 + i*os1) = count;
+            continue;
+        }
+        for (j = count; j < k; j++) {
+            *(npy_intp *)(op1 + i*os1 + j*os_k) = -1;
+            *(double *)(op2 + i*os2 + j*os_d) = NPY_INFINITY;
+        }
+        /* Popping the farthest fills the outputs from the back */
+        for (j = count - 1; j >= 0; j--) {
+            *(npy_intp *)(op1 + i*os1 + j*os_k) = hi[0];
+            *(double *)(op2 + i*os2 + j*os_d) = hd[0];
+            hd[0] = hd[j];
+            hi[0] = hi[j];
+            rotation_index_sift_down(hd, hi, j, 0);
+        }
+    }
+    free(space);
+    return 0;
+}
+
+/*
+ * The same by scanning every point, kept sorted in the outputs by insertion,
+ * for when there is no memory to copy the layout or for workspace.
+ */
+static void
+rotation_index_brute(char *pp, npy_intp ps_4, npy_intp ps_p, npy_intp p,
+    char *po, npy_intp po_p, npy_intp n, npy_intp k,
+    char *ip1, npy_intp is1, char *ip2, npy_intp is2,
+    char *op1, npy_intp os1, npy_intp os_k, char *op2, npy_intp os2, npy_intp os_d)
 {
-    quaternion a = *pa, b = *pb;
-    npy_bool anan, bnan;
-    int ret;
-
-    anan = quaternion_isnan(a);
-    bnan = quaternion_isnan(b);
+    npy_intp i, j, m;
+    for (i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1, op2 += os2) {
+        quaternion q = *(quaternion *)ip1;
+        double radius = *(double *)ip2;
+        npy_intp count = 0;
 
-    if (anan) {
-        ret = bnan ? 0 : -1;
-    } else if (bnan) {
-        ret = 1;
-    } else if(quaternion_less(a, b)) {
-        ret = -1;
-    } else if(quaternion_less(b, a)) {
-        ret = 1;
-    } else {
-        ret = 0;
+        q = quaternion_divide_scalar(q, quaternion_absolute(q));
+        for (j = 0; j < p; j++) {
+            char *b = pp + j*ps_p;
+            quaternion r = {*(double *)b, *(double *)(b + ps_4),
+                *(double *)(b + 2*ps_4), *(double *)(b + 3*ps_4)};
+            npy_intp idx = *(npy_intp *)(po + j*po_p);
+            double d = quaternion_rotation_distance(q, r);
+            if (idx < 0 || !(d <= radius)) {
+                continue;
+            }
+            if (k < 0) {
+                count++;
+                continue;
+            }
+            m = count < k ? count++ : k;
+            while (m > 0 && INDEX_NEARER(d, idx, *(double *)(op2 + (m - 1)*os_d),
+                    *(npy_intp *)(op1 + (m - 1)*os_k))) {
+                if (m < k) {
+                    *(double *)(op2 + m*os_d) = *(double *)(op2 + (m - 1)*os_d);
+                    *(npy_intp *)(op1 + m*os_k) = *(npy_intp *)(op1 + (m - 1)*os_k);
+                }
+                m--;
+            }
+            if (m < k) {
+                *(double *)(op2 + m*os_d) = d;
+                *(npy_intp *)(op1 + m*os_k) = idx;
+            }
+        }
+        if (k < 0) {
+            *(npy_intp *)op1 = count;
+            continue;
+        }
+        for (j = count; j < k; j++) {
+            *(npy_intp *)(op1 + j*os_k) = -1;
+            *(double *)(op2 + j*os_d) = NPY_INFINITY;
+        }
     }
+}
 
-    return ret;
+/*
+ * Copies a core array of n elements of the given size and stride if it is
+ * not contiguous, returning the data to use and setting *copy to any buffer.
+ */
+static const void *
+rotation_index_contiguous(char *p, npy_intp stride, npy_intp n, size_t size, void **copy)
+{
+    npy_intp i;
+    *copy = NULL;
+    if (stride == (npy_intp)size || n <= 1) {
+        return p;
+    }
+    *copy = malloc(n*size);
+    if (*copy) {
+        for (i = 0; i < n; i++) {
+            memcpy((char *)*copy + i*size, p + i*stride, size);
+        }
+    }
+    return *copy;
 }
 
+/*
+ * Whether the cells tile the planes as the kernels need.  The kernels fill
+ * whole vectors, so every offset, the last included, must be aligned.
+ */
 static int
-QUATERNION_argmax(quaternion *ip, npy_intp n, npy_intp *max_ind, PyArrayObject *NPY_UNUSED(aip))
+rotation_index_valid(const rotation_index *ix)
 {
     npy_intp i;
-    quaternion mp = *ip;
-
-    *max_ind = 0;
-
-    if (quaternion_isnan(mp)) {
-        /* nan encountered; it's maximal */
+    if (ix->p % QUATERNION_PLANE_ALIGN || ix->c % QUATERNION_PLANE_ALIGN ||
+            ix->cells > ix->c || ix->offsets[0] < 0 || ix->offsets[ix->cells] > ix->p ||
+            ix->offsets[ix->cells] % QUATERNION_PLANE_ALIGN) {
         return 0;
     }
-
-    for (i = 1; i < n; i++) {
-        ip++;
-        /*
-         * Propagate nans, similarly as max() and min()
-         */
-        if (!(quaternion_less_equal(*ip, mp))) {  /* negated, for correct nan handling */
-            mp = *ip;
-            *max_ind = i;
-            if (quaternion_isnan(mp)) {
-                /* nan encountered, it's maximal */
-                break;
-            }
+    for (i = 0; i < ix->cells; i++) {
+        if (ix->offsets[i] % QUATERNION_PLANE_ALIGN || ix->offsets[i + 1] < ix->offsets[i]) {
+            return 0;
         }
     }
-    return 0;
+    return 1;
 }
 
-static npy_bool
-QUATERNION_nonzero (char *ip, PyArrayObject *ap)
+/* Copies planes of n doubles to contiguous planes if they are not already */
+static const double *
+rotation_index_planes(char *p, npy_intp s_4, npy_intp s_n, npy_intp n, void **copy)
 {
-    quaternion q;
-    if (ap == NULL || PyArray_ISBEHAVED_RO(ap)) {
-        q = *(quaternion *)ip;
+    npy_intp i, j;
+    *copy = NULL;
+    if (s_n == sizeof(double) && s_4 == n*(npy_intp)sizeof(double)) {
+        return (const double *)p;
     }
-    else {
-        PyArray_Descr *descr;
-        descr = PyArray_DescrFromType(NPY_DOUBLE);
-        descr->f->copyswap(&q.w, ip, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(&q.x, ip+8, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(&q.y, ip+16, !PyArray_ISNOTSWAPPED(ap), NULL);
-        descr->f->copyswap(&q.z, ip+24, !PyArray_ISNOTSWAPPED(ap), NULL);
-        Py_DECREF(descr);
+    *copy = malloc(4*n*sizeof(double));
+    if (*copy) {
+        for (i = 0; i < 4; i++) {
+            for (j = 0; j < n; j++) {
+                ((double *)*copy)[i*n + j] = *(double *)(p + i*s_4 + j*s_n);
+            }
+        }
     }
-    return (npy_bool) !quaternion_equal(q, (quaternion) {0,0,0,0});
+    return (const double *)*copy;
 }
 
+/*
+ * The index_query and index_count loops.  The layout is normally broadcast
+ * over the queries, so those sharing it are answered together.  A layout whose
+ * cells the kernels cannot use is answered by scanning every point.
+ */
 static void
-QUATERNION_fillwithscalar(quaternion *buffer, npy_intp length, quaternion *value, void *NPY_UNUSED(ignored))
+rotation_index_gufunc(char** args, npy_intp* dimensions, npy_intp* steps, npy_intp k)
 {
-    npy_intp i;
-    quaternion val = *value;
+    int nout = k < 0 ? 1 : 2, nop = 7 + nout, a;
+    npy_intp N = dimensions[0], p = dimensions[2], c = dimensions[3];
+    npy_intp cells = dimensions[4], e = dimensions[5];
+    npy_intp *cs = steps + nop;
+    npy_intp os_k = k < 0 ? 0 : cs[7], os_d = k < 0 ? 0 : cs[8];
+    npy_intp start, n, i;
 
-    for (i = 0; i < length; ++i) {
-        buffer[i] = val;
+    for (start = 0; start < N; start += n) {
+        char *arg[9];
+        void *copy[5];
+        rotation_index ix;
+        int done = 0;
+
+        for (a = 0; a < nop; a++) {
+            arg[a] = args[a] + start*steps[a];
+        }
+        n = N - start;
+        for (a = 2; a < 7; a++) {
+            if (steps[a] != 0) {
+                n = 1;
+            }
+        }
+        ix.p = p;
+        ix.c = c;
+        ix.cells = cells;
+        ix.points = rotation_index_planes(arg[2], cs[0], cs[1], p, &copy[0]);
+        ix.order = (const npy_intp *)rotation_index_contiguous(arg[3], cs[2], p,
+            sizeof(npy_intp), &copy[1]);
+        ix.centers = rotation_index_planes(arg[4], cs[3], cs[4], c, &copy[2]);
+        ix.radii = (const double *)rotation_index_contiguous(arg[5], cs[5], cells,
+            sizeof(double), &copy[3]);
+        ix.offsets = (const npy_intp *)rotation_index_contiguous(arg[6], cs[6], e,
+            sizeof(npy_intp), &copy[4]);
+        if (ix.points && ix.order && ix.centers && ix.radii && ix.offsets &&
+                e == cells + 1 && rotation_index_valid(&ix)) {
+            ix.width = c;
+            for (i = 0; i < cells; i++) {
+                if (ix.offsets[i + 1] - ix.offsets[i] > ix.width) {
+                    ix.width = ix.offsets[i + 1] - ix.offsets[i];
+                }
+            }
+            done = rotation_index_run(&ix, n, k, arg[0], steps[0], arg[1], steps[1],
+                arg[7], steps[7], os_k, nout > 1 ? arg[8] : NULL,
+                nout > 1 ? steps[8] : 0, os_d) == 0;
+        }
+        if (!done) {
+            rotation_index_brute(arg[2], cs[0], cs[1], p, arg[3], cs[2], n, k,
+                arg[0], steps[0], arg[1], steps[1], arg[7], steps[7], os_k,
+                nout > 1 ? arg[8] : NULL, nout > 1 ? steps[8] : 0, os_d);
+        }
+        for (a = 0; a < 5; a++) {
+            free(copy[a]);
+        }
     }
 }
 
-#define MAKE_T_TO_QUATERNION(TYPE, type)                                       \
-static void                                                                    \
-TYPE ## _to_quaternion(type *ip, quaternion *op, npy_intp n,                   \
-               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop)) \
-{                                                                              \
-    while (n--) {                                                              \
-        op->w = (double)(*ip++);                                               \
-        op->x = 0;                                                             \
-        op->y = 0;                                                             \
-        op->z = 0;                                                             \
-    }                                                                          \
+static void
+quaternion_index_query_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    rotation_index_gufunc(args, dimensions, steps, dimensions[6]);
 }
 
-MAKE_T_TO_QUATERNION(FLOAT, npy_float);
-MAKE_T_TO_QUATERNION(DOUBLE, npy_double);
-MAKE_T_TO_QUATERNION(LONGDOUBLE, npy_longdouble);
-MAKE_T_TO_QUATERNION(BOOL, npy_bool);
-MAKE_T_TO_QUATERNION(BYTE, npy_byte);
-MAKE_T_TO_QUATERNION(UBYTE, npy_ubyte);
-MAKE_T_TO_QUATERNION(SHORT, npy_short);
-MAKE_T_TO_QUATERNION(USHORT, npy_ushort);
-MAKE_T_TO_QUATERNION(INT, npy_int);
-MAKE_T_TO_QUATERNION(UINT, npy_uint);
-MAKE_T_TO_QUATERNION(LONG, npy_long);
-MAKE_T_TO_QUATERNION(ULONG, npy_ulong);
-MAKE_T_TO_QUATERNION(LONGLONG, npy_longlong);
-MAKE_T_TO_QUATERNION(ULONGLONG, npy_ulonglong);
-
-#define MAKE_CT_TO_QUATERNION(TYPE, type)                                      \
-static void                                                                    \
-TYPE ## _to_quaternion(type *ip, quaternion *op, npy_intp n,                   \
-               PyArrayObject *NPY_UNUSED(aip), PyArrayObject *NPY_UNUSED(aop)) \
-{                                                                              \
-    while (n--) {                                                              \
-        op->w = (double)(*ip++);                                               \
-        op->x = (double)(*ip++);                                               \
-        op->y = 0;                                                             \
-        op->z = 0;                                                             \
-    }                                                                          \
+static void
+quaternion_index_count_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    rotation_index_gufunc(args, dimensions, steps, -1);
 }
 
-MAKE_CT_TO_QUATERNION(CFLOAT, npy_double);
-MAKE_CT_TO_QUATERNION(CDOUBLE, npy_double);
-MAKE_CT_TO_QUATERNION(CLONGDOUBLE, npy_longdouble);
-
-static void register_cast_function(int sourceType, int destType, PyArray_VectorUnaryFunc *castfunc)
-{
-    PyArray_Descr *descr = PyArray_DescrFromType(sourceType);
-    PyArray_RegisterCastFunc(descr, destType, castfunc);
-    PyArray_RegisterCanCast(descr, destType, NPY_NOSCALAR);
-    Py_DECREF(descr);
+/*
+ * Conversions between quaternions and core arrays of doubles with shape
+ * (rows, cols), where cols is 1 for vectors.  Elements whose doubles are
+ * contiguous are converted directly; others go through a buffer.
+ */
+#define AS_DOUBLES_GUFUNC(name, func, rows, cols)\
+static void \
+quaternion_##name##_gufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *op1 = args[1];\
+    npy_intp is1 = steps[0], os1 = steps[1];\
+    npy_intp rs = steps[2], cs = cols > 1 ? steps[3] : (npy_intp)sizeof(double);\
+    npy_intp n = dimensions[0];\
+    npy_intp i, k;\
+    double r[rows*cols];\
+    if (rs == cols*sizeof(double) && cs == sizeof(double)) {\
+        for (i = 0; i < n; i++, ip1 += is1, op1 += os1) {\
+            func(*(quaternion *)ip1, (double *)op1);\
+        }\
+        return;\
+    }\
+    for (i = 0; i < n; i++, ip1 += is1, op1 += os1) {\
+        func(*(quaternion *)ip1, r);\
+        for (k = 0; k < rows*cols; k++) {\
+            *(double *)(op1 + k/cols*rs + k%cols*cs) = r[k];\
+        }\
+    }\
 }
 
-static PyObject *
-quaternion_arrtype_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
-{
-    quaternion q;
-
-    if (!PyArg_ParseTuple(args, "dddd", &q.w, &q.x, &q.y, &q.z))
-        return NULL;
-
-    return PyArray_Scalar(&q, quaternion_descr, NULL);
+#define FROM_DOUBLES_GUFUNC(name, func, rows, cols)\
+static void \
+quaternion_##name##_gufunc(char** args, npy_intp* dimensions,\
+    npy_intp* steps, void* data) {\
+    char *ip1 = args[0], *op1 = args[1];\
+    npy_intp is1 = steps[0], os1 = steps[1];\
+    npy_intp rs = steps[2], cs = cols > 1 ? steps[3] : (npy_intp)sizeof(double);\
+    npy_intp n = dimensions[0];\
+    npy_intp i, k;\
+    double r[rows*cols];\
+    if (rs == cols*sizeof(double) && cs == sizeof(double)) {\
+        for (i = 0; i < n; i++, ip1 += is1, op1 += os1) {\
+            *(quaternion *)op1 = func((double *)ip1);\
+        }\
+        return;\
+    }\
+    for (i = 0; i < n; i++, ip1 += is1, op1 += os1) {\
+        for (k = 0; k < rows*cols; k++) {\
+            r[k] = *(double *)(ip1 + k/cols*rs + k%cols*cs);\
+        }\
+        *(quaternion *)op1 = func(r);\
+    }\
 }
 
-static PyObject *
-gentype_richcompare(PyObject *self, PyObject *other, int cmp_op)
-{
-    PyObject *arr, *ret;
+AS_DOUBLES_GUFUNC(as_rotation_matrix, quaternion_rotation_matrix, 3, 3)
+AS_DOUBLES_GUFUNC(as_rotation_vector, quaternion_rotation_vector, 3, 1)
+AS_DOUBLES_GUFUNC(as_euler, quaternion_euler_angles, 3, 1)
+FROM_DOUBLES_GUFUNC(from_rotation_matrix, quaternion_from_rotation_matrix, 3, 3)
+FROM_DOUBLES_GUFUNC(from_euler, quaternion_from_euler_angles, 3, 1)
+FROM_DOUBLES_GUFUNC(from_rotation_vector_elements, quaternion_from_rotation_vector, 3, 1)
 
-    arr = PyArray_FromScalar(self, NULL);
-    if (arr == NULL) {
-        return NULL;
+/*
+ * Contiguous rotation vectors v become pure quaternions v/2 in the output,
+ * then go through the vectorized exp kernel in place.
+ */
+static void
+quaternion_from_rotation_vector_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    const double *v = (double *)args[0];
+    quaternion *out = (quaternion *)args[1];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    if (steps[0] != 3*sizeof(double) || steps[2] != sizeof(double) ||
+        steps[1] != sizeof(quaternion)) {
+        quaternion_from_rotation_vector_elements_gufunc(args, dimensions, steps, data);
+        return;
     }
-    ret = Py_TYPE(arr)->tp_richcompare(arr, other, cmp_op);
-    Py_DECREF(arr);
-    return ret;
+    for (i = 0; i < n; i++) {
+        out[i] = (quaternion) {0, 0.5*v[3*i], 0.5*v[3*i + 1], 0.5*v[3*i + 2]};
+    }
+    quaternion_exp_kernel(out, out, n);
 }
 
-static long
-quaternion_arrtype_hash(PyObject *o)
-{
-    quaternion q = ((PyQuaternionScalarObject *)o)->obval;
-    long value = 0x456789;
-    value = (10000004 * value) ^ _Py_HashDouble(q.w);
-    value = (10000004 * value) ^ _Py_HashDouble(q.x);
-    value = (10000004 * value) ^ _Py_HashDouble(q.y);
-    value = (10000004 * value) ^ _Py_HashDouble(q.z);
-    if (value == -1)
-        value = -2;
-    return value;
+/*
+ * transform(a, v), signature (),(3)->(3): points v moved by the rigid
+ * transforms a.  As rotate, contiguous points go to the vectorized kernel in
+ * chunks, in parallel if built with OpenMP.
+ */
+static void
+dual_quaternion_transform_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];
+    npy_intp is2_v = steps[3], os1_v = steps[4];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    int k;
+    if ((is1 == 0 || is1 == sizeof(dual_quaternion)) &&
+        is2 == 3*sizeof(double) && is2_v == sizeof(double) &&
+        os1 == 3*sizeof(double) && os1_v == sizeof(double)) {
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(static) if (n >= 2*ROTATE_CHUNK)
+#endif
+        for (i = 0; i < n; i += ROTATE_CHUNK) {
+            dual_quaternion_transform_kernel((double *)op1 + 3*i,
+                (dual_quaternion *)(ip1 + is1*i), is1 != 0, (double *)ip2 + 3*i,
+                n - i < ROTATE_CHUNK ? n - i : ROTATE_CHUNK);
+        }
+        return;
+    }
+    for (i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1) {
+        double v[3];
+        for (k = 0; k < 3; k++) {
+            v[k] = *(double *)(ip2 + k*is2_v);
+        }
+        dual_quaternion_transform_point(*(dual_quaternion *)ip1, v, v);
+        for (k = 0; k < 3; k++) {
+            *(double *)(op1 + k*os1_v) = v[k];
+        }
+    }
 }
 
-static PyObject *
-quaternion_arrtype_repr(PyObject *o)
-{
-    char str[128];
-    quaternion q = ((PyQuaternionScalarObject *)o)->obval;
-    sprintf(str, "quaternion(%g, %g, %g, %g)", q.w, q.x, q.y, q.z);
-    return PyUString_FromString(str);
+static void
+dual_quaternion_sclerp_ufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *ip3 = args[2], *op1 = args[3];
+    npy_intp is1 = steps[0], is2 = steps[1], is3 = steps[2], os1 = steps[3];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    for (i = 0; i < n; i++, ip1 += is1, ip2 += is2, ip3 += is3, op1 += os1) {
+        *(dual_quaternion *)op1 = dual_quaternion_sclerp(*(dual_quaternion *)ip1,
+            *(dual_quaternion *)ip2, *(double *)ip3);
+    }
 }
 
-static PyObject *
-quaternion_arrtype_str(PyObject *o)
-{
-    char str[128];
-    quaternion q = ((PyQuaternionScalarObject *)o)->obval;
-    sprintf(str, "quaternion(%g, %g, %g, %g)", q.w, q.x, q.y, q.z);
-    return PyString_FromString(str);
+/* from_rigid_transform(q, t), signature (),(3)->() */
+static void
+dual_quaternion_from_rigid_transform_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];
+    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2], is2_v = steps[3];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    for (i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1) {
+        double t[3];
+        t[0] = *(double *)ip2;
+        t[1] = *(double *)(ip2 + is2_v);
+        t[2] = *(double *)(ip2 + 2*is2_v);
+        *(dual_quaternion *)op1 = dual_quaternion_from_rigid_transform(*(quaternion *)ip1, t);
+    }
 }
 
-static PyMethodDef QuaternionMethods[] = {
-    {NULL, NULL, 0, NULL}
-};
+/* as_rigid_transform(a), signature ()->(),(3) */
+static void
+dual_quaternion_as_rigid_transform_gufunc(char** args, npy_intp* dimensions,
+    npy_intp* steps, void* data) {
+    char *ip1 = args[0], *op1 = args[1], *op2 = args[2];
+    npy_intp is1 = steps[0], os1 = steps[1], os2 = steps[2], os2_v = steps[3];
+    npy_intp n = dimensions[0];
+    npy_intp i;
+    for (i = 0; i < n; i++, ip1 += is1, op1 += os1, op2 += os2) {
+        double t[3];
+        *(quaternion *)op1 = dual_quaternion_rigid_transform(*(dual_quaternion *)ip1, t);
+        *(double *)op2 = t[0];
+        *(double *)(op2 + os2_v) = t[1];
+        *(double *)(op2 + 2*os2_v) = t[2];
+    }
+}
 
-#define UNARY_UFUNC(name, ret_type)\
-static void \
-quaternion_##name##_ufunc(char** args, npy_intp* dimensions,\
-    npy_intp* steps, void* data) {\
-    char *ip1 = args[0], *op1 = args[1];\
-    npy_intp is1 = steps[0], os1 = steps[1];\
-    npy_intp n = dimensions[0];\
-    npy_intp i;\
-    for(i = 0; i < n; i++, ip1 += is1, op1 += os1){\
-        const quaternion in1 = *(quaternion *)ip1;\
-        *((ret_type *)op1) = quaternion_##name(in1);};}
-
-UNARY_UFUNC(isnan, npy_bool)
-UNARY_UFUNC(isinf, npy_bool)
-UNARY_UFUNC(isfinite, npy_bool)
-UNARY_UFUNC(absolute, npy_double)
-UNARY_UFUNC(log, quaternion)
-UNARY_UFUNC(exp, quaternion)
-UNARY_UFUNC(negative, quaternion)
-UNARY_UFUNC(conjugate, quaternion)
-
-#define BINARY_GEN_UFUNC(name, func_name, arg_type, ret_type)\
-static void \
-quaternion_##func_name##_ufunc(char** args, npy_intp* dimensions,\
-    npy_intp* steps, void* data) {\
-    char *ip1 = args[0], *ip2 = args[1], *op1 = args[2];\
-    npy_intp is1 = steps[0], is2 = steps[1], os1 = steps[2];\
-    npy_intp n = dimensions[0];\
-    npy_intp i;\
-    for(i = 0; i < n; i++, ip1 += is1, ip2 += is2, op1 += os1){\
-        const quaternion in1 = *(quaternion *)ip1;\
-        const arg_type in2 = *(arg_type *)ip2;\
-        *((ret_type *)op1) = quaternion_##func_name(in1, in2);};};
-
-#define BINARY_UFUNC(name, ret_type)\
-    BINARY_GEN_UFUNC(name, name, quaternion, ret_type)
-#define BINARY_SCALAR_UFUNC(name, ret_type)\
-    BINARY_GEN_UFUNC(name, name##_scalar, npy_double, ret_type)
-
-BINARY_UFUNC(add, quaternion)
-BINARY_UFUNC(subtract, quaternion)
-BINARY_UFUNC(multiply, quaternion)
-BINARY_UFUNC(divide, quaternion)
-BINARY_UFUNC(power, quaternion)
-BINARY_UFUNC(copysign, quaternion)
-BINARY_UFUNC(equal, npy_bool)
-BINARY_UFUNC(not_equal, npy_bool)
-BINARY_UFUNC(less, npy_bool)
-BINARY_UFUNC(less_equal, npy_bool)
-
-BINARY_SCALAR_UFUNC(multiply, quaternion)
-BINARY_SCALAR_UFUNC(divide, quaternion)
-BINARY_SCALAR_UFUNC(power, quaternion)
+/*
+ * The module name; setup.py builds the optimized profile again under other
+ * names, one for each instruction set
+ */
+#ifndef NPYTYPES_MODULE
+#define NPYTYPES_MODULE numpy_quaternion
+#endif
+#define MODULE_STRING(name) MODULE_STRING2(name)
+#define MODULE_STRING2(name) #name
+#define MODULE_INIT(prefix, name) MODULE_INIT2(prefix, name)
+#define MODULE_INIT2(prefix, name) prefix##name
 
 #if defined(NPY_PY3K)
 static struct PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
-    "numpy_quaternion",
+    MODULE_STRING(NPYTYPES_MODULE),
     NULL,
     -1,
     QuaternionMethods,
@@ -508,21 +3420,22 @@ static struct PyModuleDef moduledef = {
 #endif
 
 #if defined(NPY_PY3K)
-PyMODINIT_FUNC PyInit_numpy_quaternion(void) {
+PyMODINIT_FUNC MODULE_INIT(PyInit_, NPYTYPES_MODULE)(void) {
 #else
-PyMODINIT_FUNC initnumpy_quaternion(void) {
+PyMODINIT_FUNC MODULE_INIT(init, NPYTYPES_MODULE)(void) {
 #endif
 
     PyObject *m;
-    int quaternionNum;
+    int quaternionNum, quaternion32Num, dualQuaternionNum;
+    const char *fast_normalize;
     PyObject* numpy = PyImport_ImportModule("numpy");
     PyObject* numpy_dict = PyModule_GetDict(numpy);
-    int arg_types[3];
+    int arg_types[9];
 
 #if defined(NPY_PY3K)
     m = PyModule_Create(&moduledef);
 #else
-    m = Py_InitModule("numpy_quaternion", QuaternionMethods);
+    m = Py_InitModule(MODULE_STRING(NPYTYPES_MODULE), QuaternionMethods);
 #endif
 
     if (!m) {
@@ -540,7 +3453,24 @@ PyMODINIT_FUNC initnumpy_quaternion(void) {
     PyQuaternionArrType_Type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_CHECKTYPES;
 #endif
     PyQuaternionArrType_Type.tp_new = quaternion_arrtype_new;
-    PyQuaternionArrType_Type.tp_richcompare = gentype_richcompare;
+    PyQuaternionArrType_Type.tp_richcompare = quaternion_arrtype_richcompare;
+    PyQuaternionArrType_Type.tp_alloc = quaternion_arrtype_alloc;
+    PyQuaternionArrType_Type.tp_free = quaternion_arrtype_free;
+    quaternion_arrtype_as_number.nb_add = quaternion_arrtype_add;
+    quaternion_arrtype_as_number.nb_subtract = quaternion_arrtype_subtract;
+    quaternion_arrtype_as_number.nb_multiply = quaternion_arrtype_multiply;
+#if !defined(NPY_PY3K)
+    quaternion_arrtype_as_number.nb_divide = quaternion_arrtype_divide;
+    quaternion_arrtype_as_number.nb_nonzero = quaternion_arrtype_nonzero;
+#else
+    quaternion_arrtype_as_number.nb_bool = quaternion_arrtype_nonzero;
+#endif
+    quaternion_arrtype_as_number.nb_true_divide = quaternion_arrtype_true_divide;
+    quaternion_arrtype_as_number.nb_power = quaternion_arrtype_power;
+    quaternion_arrtype_as_number.nb_negative = quaternion_arrtype_negative;
+    quaternion_arrtype_as_number.nb_positive = quaternion_arrtype_positive;
+    quaternion_arrtype_as_number.nb_absolute = quaternion_arrtype_absolute;
+    PyQuaternionArrType_Type.tp_as_number = &quaternion_arrtype_as_number;
     PyQuaternionArrType_Type.tp_hash = quaternion_arrtype_hash;
     PyQuaternionArrType_Type.tp_repr = quaternion_arrtype_repr;
     PyQuaternionArrType_Type.tp_str = quaternion_arrtype_str;
@@ -551,6 +3481,45 @@ PyMODINIT_FUNC initnumpy_quaternion(void) {
         return NULL;
     }
 
+#if defined(NPY_PY3K)
+    PyQuaternion32ArrType_Type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+#else
+    PyQuaternion32ArrType_Type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_CHECKTYPES;
+#endif
+    PyQuaternion32ArrType_Type.tp_new = quaternion32_arrtype_new;
+    PyQuaternion32ArrType_Type.tp_alloc = quaternion_arrtype_alloc;
+    PyQuaternion32ArrType_Type.tp_free = quaternion_arrtype_free;
+    PyQuaternion32ArrType_Type.tp_richcompare = gentype_richcompare;
+    PyQuaternion32ArrType_Type.tp_hash = quaternion32_arrtype_hash;
+    PyQuaternion32ArrType_Type.tp_repr = quaternion32_arrtype_repr;
+    PyQuaternion32ArrType_Type.tp_str = quaternion32_arrtype_str;
+    PyQuaternion32ArrType_Type.tp_members = PyQuaternion32ArrType_members;
+    PyQuaternion32ArrType_Type.tp_getset = PyQuaternion32ArrType_getset;
+    PyQuaternion32ArrType_Type.tp_base = &PyGenericArrType_Type;
+    if (PyType_Ready(&PyQuaternion32ArrType_Type) < 0) {
+        PyErr_Print();
+        PyErr_SetString(PyExc_SystemError, "could not initialize PyQuaternion32ArrType_Type");
+        return NULL;
+    }
+
+#if defined(NPY_PY3K)
+    PyDualQuaternionArrType_Type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+#else
+    PyDualQuaternionArrType_Type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_CHECKTYPES;
+#endif
+    PyDualQuaternionArrType_Type.tp_new = dual_quaternion_arrtype_new;
+    PyDualQuaternionArrType_Type.tp_richcompare = gentype_richcompare;
+    PyDualQuaternionArrType_Type.tp_hash = dual_quaternion_arrtype_hash;
+    PyDualQuaternionArrType_Type.tp_repr = dual_quaternion_arrtype_repr;
+    PyDualQuaternionArrType_Type.tp_str = dual_quaternion_arrtype_str;
+    PyDualQuaternionArrType_Type.tp_getset = PyDualQuaternionArrType_getset;
+    PyDualQuaternionArrType_Type.tp_base = &PyGenericArrType_Type;
+    if (PyType_Ready(&PyDualQuaternionArrType_Type) < 0) {
+        PyErr_Print();
+        PyErr_SetString(PyExc_SystemError, "could not initialize PyDualQuaternionArrType_Type");
+        return NULL;
+    }
+
     /* The array functions */
     PyArray_InitArrFuncs(&_PyQuaternion_ArrFuncs);
     _PyQuaternion_ArrFuncs.getitem = (PyArray_GetItemFunc*)QUATERNION_getitem;
@@ -559,8 +3528,16 @@ PyMODINIT_FUNC initnumpy_quaternion(void) {
     _PyQuaternion_ArrFuncs.copyswapn = (PyArray_CopySwapNFunc*)QUATERNION_copyswapn;
     _PyQuaternion_ArrFuncs.compare = (PyArray_CompareFunc*)QUATERNION_compare;
     _PyQuaternion_ArrFuncs.argmax = (PyArray_ArgFunc*)QUATERNION_argmax;
+    _PyQuaternion_ArrFuncs.argmin = (PyArray_ArgFunc*)QUATERNION_argmin;
+    _PyQuaternion_ArrFuncs.sort[NPY_QUICKSORT] = (PyArray_SortFunc*)QUATERNION_quicksort;
+    _PyQuaternion_ArrFuncs.sort[NPY_HEAPSORT] = (PyArray_SortFunc*)QUATERNION_heapsort;
+    _PyQuaternion_ArrFuncs.sort[NPY_MERGESORT] = (PyArray_SortFunc*)QUATERNION_mergesort;
+    _PyQuaternion_ArrFuncs.argsort[NPY_QUICKSORT] = (PyArray_ArgSortFunc*)QUATERNION_aquicksort;
+    _PyQuaternion_ArrFuncs.argsort[NPY_HEAPSORT] = (PyArray_ArgSortFunc*)QUATERNION_aheapsort;
+    _PyQuaternion_ArrFuncs.argsort[NPY_MERGESORT] = (PyArray_ArgSortFunc*)QUATERNION_amergesort;
     _PyQuaternion_ArrFuncs.nonzero = (PyArray_NonzeroFunc*)QUATERNION_nonzero;
     _PyQuaternion_ArrFuncs.fillwithscalar = (PyArray_FillWithScalarFunc*)QUATERNION_fillwithscalar;
+    _PyQuaternion_ArrFuncs.dotfunc = (PyArray_DotFunc*)QUATERNION_dot;
 
     /* The quaternion array descr */
     quaternion_descr = PyObject_New(PyArray_Descr, &PyArrayDescr_Type);
@@ -600,64 +3577,710 @@ PyMODINIT_FUNC initnumpy_quaternion(void) {
     register_cast_function(NPY_CDOUBLE, quaternionNum, (PyArray_VectorUnaryFunc*)CDOUBLE_to_quaternion);
     register_cast_function(NPY_CLONGDOUBLE, quaternionNum, (PyArray_VectorUnaryFunc*)CLONGDOUBLE_to_quaternion);
 
-#define REGISTER_UFUNC(name)\
+    /* The single precision quaternion32 descr */
+    PyArray_InitArrFuncs(&_PyQuaternion32_ArrFuncs);
+    _PyQuaternion32_ArrFuncs.getitem = (PyArray_GetItemFunc*)QUATERNION32_getitem;
+    _PyQuaternion32_ArrFuncs.setitem = (PyArray_SetItemFunc*)QUATERNION32_setitem;
+    _PyQuaternion32_ArrFuncs.copyswap = (PyArray_CopySwapFunc*)QUATERNION32_copyswap;
+    _PyQuaternion32_ArrFuncs.copyswapn = (PyArray_CopySwapNFunc*)QUATERNION32_copyswapn;
+    _PyQuaternion32_ArrFuncs.compare = (PyArray_CompareFunc*)QUATERNION32_compare;
+    _PyQuaternion32_ArrFuncs.argmax = (PyArray_ArgFunc*)QUATERNION32_argmax;
+    _PyQuaternion32_ArrFuncs.argmin = (PyArray_ArgFunc*)QUATERNION32_argmin;
+    _PyQuaternion32_ArrFuncs.sort[NPY_QUICKSORT] = (PyArray_SortFunc*)QUATERNION32_quicksort;
+    _PyQuaternion32_ArrFuncs.sort[NPY_HEAPSORT] = (PyArray_SortFunc*)QUATERNION32_heapsort;
+    _PyQuaternion32_ArrFuncs.sort[NPY_MERGESORT] = (PyArray_SortFunc*)QUATERNION32_mergesort;
+    _PyQuaternion32_ArrFuncs.argsort[NPY_QUICKSORT] = (PyArray_ArgSortFunc*)QUATERNION32_aquicksort;
+    _PyQuaternion32_ArrFuncs.argsort[NPY_HEAPSORT] = (PyArray_ArgSortFunc*)QUATERNION32_aheapsort;
+    _PyQuaternion32_ArrFuncs.argsort[NPY_MERGESORT] = (PyArray_ArgSortFunc*)QUATERNION32_amergesort;
+    _PyQuaternion32_ArrFuncs.nonzero = (PyArray_NonzeroFunc*)QUATERNION32_nonzero;
+    _PyQuaternion32_ArrFuncs.fillwithscalar = (PyArray_FillWithScalarFunc*)QUATERNION32_fillwithscalar;
+    _PyQuaternion32_ArrFuncs.dotfunc = (PyArray_DotFunc*)QUATERNION32_dot;
+
+    quaternion32_descr = PyObject_New(PyArray_Descr, &PyArrayDescr_Type);
+    quaternion32_descr->typeobj = &PyQuaternion32ArrType_Type;
+    quaternion32_descr->kind = 'q';
+    quaternion32_descr->type = 'J';
+    quaternion32_descr->byteorder = '=';
+    quaternion32_descr->type_num = 0; /* assigned at registration */
+    quaternion32_descr->elsize = 4*4;
+    quaternion32_descr->alignment = 4;
+    quaternion32_descr->subarray = NULL;
+    quaternion32_descr->fields = NULL;
+    quaternion32_descr->names = NULL;
+    quaternion32_descr->f = &_PyQuaternion32_ArrFuncs;
+
+    Py_INCREF(&PyQuaternion32ArrType_Type);
+    quaternion32Num = PyArray_RegisterDataType(quaternion32_descr);
+
+    if (quaternion32Num < 0)
+        return NULL;
+
+    /* Types which float represents exactly cast safely; the others only explicitly */
+    register_cast_function(NPY_BOOL, quaternion32Num, (PyArray_VectorUnaryFunc*)BOOL_to_quaternion32);
+    register_cast_function(NPY_BYTE, quaternion32Num, (PyArray_VectorUnaryFunc*)BYTE_to_quaternion32);
+    register_cast_function(NPY_UBYTE, quaternion32Num, (PyArray_VectorUnaryFunc*)UBYTE_to_quaternion32);
+    register_cast_function(NPY_SHORT, quaternion32Num, (PyArray_VectorUnaryFunc*)SHORT_to_quaternion32);
+    register_cast_function(NPY_USHORT, quaternion32Num, (PyArray_VectorUnaryFunc*)USHORT_to_quaternion32);
+    register_unsafe_cast_function(NPY_INT, quaternion32Num, (PyArray_VectorUnaryFunc*)INT_to_quaternion32);
+    register_unsafe_cast_function(NPY_UINT, quaternion32Num, (PyArray_VectorUnaryFunc*)UINT_to_quaternion32);
+    register_unsafe_cast_function(NPY_LONG, quaternion32Num, (PyArray_VectorUnaryFunc*)LONG_to_quaternion32);
+    register_unsafe_cast_function(NPY_ULONG, quaternion32Num, (PyArray_VectorUnaryFunc*)ULONG_to_quaternion32);
+    register_unsafe_cast_function(NPY_LONGLONG, quaternion32Num, (PyArray_VectorUnaryFunc*)LONGLONG_to_quaternion32);
+    register_unsafe_cast_function(NPY_ULONGLONG, quaternion32Num, (PyArray_VectorUnaryFunc*)ULONGLONG_to_quaternion32);
+    register_cast_function(NPY_FLOAT, quaternion32Num, (PyArray_VectorUnaryFunc*)FLOAT_to_quaternion32);
+    register_unsafe_cast_function(NPY_DOUBLE, quaternion32Num, (PyArray_VectorUnaryFunc*)DOUBLE_to_quaternion32);
+    register_unsafe_cast_function(NPY_LONGDOUBLE, quaternion32Num, (PyArray_VectorUnaryFunc*)LONGDOUBLE_to_quaternion32);
+    register_cast_function(NPY_CFLOAT, quaternion32Num, (PyArray_VectorUnaryFunc*)CFLOAT_to_quaternion32);
+    register_unsafe_cast_function(NPY_CDOUBLE, quaternion32Num, (PyArray_VectorUnaryFunc*)CDOUBLE_to_quaternion32);
+    register_unsafe_cast_function(NPY_CLONGDOUBLE, quaternion32Num, (PyArray_VectorUnaryFunc*)CLONGDOUBLE_to_quaternion32);
+    register_cast_function(quaternion32Num, quaternionNum, (PyArray_VectorUnaryFunc*)quaternion32_to_quaternion);
+    register_unsafe_cast_function(quaternionNum, quaternion32Num, (PyArray_VectorUnaryFunc*)quaternion_to_quaternion32);
+
+    /* Casts to real and complex types drop components, so are only explicit */
+    register_unsafe_cast_function(quaternionNum, NPY_FLOAT, (PyArray_VectorUnaryFunc*)quaternion_to_FLOAT);
+    register_unsafe_cast_function(quaternionNum, NPY_DOUBLE, (PyArray_VectorUnaryFunc*)quaternion_to_DOUBLE);
+    register_unsafe_cast_function(quaternionNum, NPY_LONGDOUBLE, (PyArray_VectorUnaryFunc*)quaternion_to_LONGDOUBLE);
+    register_unsafe_cast_function(quaternionNum, NPY_CFLOAT, (PyArray_VectorUnaryFunc*)quaternion_to_CFLOAT);
+    register_unsafe_cast_function(quaternionNum, NPY_CDOUBLE, (PyArray_VectorUnaryFunc*)quaternion_to_CDOUBLE);
+    register_unsafe_cast_function(quaternionNum, NPY_CLONGDOUBLE, (PyArray_VectorUnaryFunc*)quaternion_to_CLONGDOUBLE);
+    register_unsafe_cast_function(quaternion32Num, NPY_FLOAT, (PyArray_VectorUnaryFunc*)quaternion32_to_FLOAT);
+    register_unsafe_cast_function(quaternion32Num, NPY_DOUBLE, (PyArray_VectorUnaryFunc*)quaternion32_to_DOUBLE);
+    register_unsafe_cast_function(quaternion32Num, NPY_LONGDOUBLE, (PyArray_VectorUnaryFunc*)quaternion32_to_LONGDOUBLE);
+    register_unsafe_cast_function(quaternion32Num, NPY_CFLOAT, (PyArray_VectorUnaryFunc*)quaternion32_to_CFLOAT);
+    register_unsafe_cast_function(quaternion32Num, NPY_CDOUBLE, (PyArray_VectorUnaryFunc*)quaternion32_to_CDOUBLE);
+    register_unsafe_cast_function(quaternion32Num, NPY_CLONGDOUBLE, (PyArray_VectorUnaryFunc*)quaternion32_to_CLONGDOUBLE);
+
+    /* The dual quaternion descr, a pair of quaternions */
+    PyArray_InitArrFuncs(&_PyDualQuaternion_ArrFuncs);
+    _PyDualQuaternion_ArrFuncs.getitem = (PyArray_GetItemFunc*)DUAL_QUATERNION_getitem;
+    _PyDualQuaternion_ArrFuncs.setitem = (PyArray_SetItemFunc*)DUAL_QUATERNION_setitem;
+    _PyDualQuaternion_ArrFuncs.copyswap = (PyArray_CopySwapFunc*)DUAL_QUATERNION_copyswap;
+    _PyDualQuaternion_ArrFuncs.copyswapn = (PyArray_CopySwapNFunc*)DUAL_QUATERNION_copyswapn;
+    _PyDualQuaternion_ArrFuncs.nonzero = (PyArray_NonzeroFunc*)DUAL_QUATERNION_nonzero;
+    _PyDualQuaternion_ArrFuncs.fillwithscalar = (PyArray_FillWithScalarFunc*)DUAL_QUATERNION_fillwithscalar;
+
+    dual_quaternion_descr = PyObject_New(PyArray_Descr, &PyArrayDescr_Type);
+    dual_quaternion_descr->typeobj = &PyDualQuaternionArrType_Type;
+    dual_quaternion_descr->kind = 'q';
+    dual_quaternion_descr->type = 'K';
+    dual_quaternion_descr->byteorder = '=';
+    dual_quaternion_descr->type_num = 0; /* assigned at registration */
+    dual_quaternion_descr->elsize = 8*8;
+    dual_quaternion_descr->alignment = 8;
+    dual_quaternion_descr->subarray = NULL;
+    dual_quaternion_descr->fields = NULL;
+    dual_quaternion_descr->names = NULL;
+    dual_quaternion_descr->f = &_PyDualQuaternion_ArrFuncs;
+
+    Py_INCREF(&PyDualQuaternionArrType_Type);
+    dualQuaternionNum = PyArray_RegisterDataType(dual_quaternion_descr);
+
+    if (dualQuaternionNum < 0)
+        return NULL;
+
+    /* Rotations are the transforms with no translation */
+    register_cast_function(quaternionNum, dualQuaternionNum, (PyArray_VectorUnaryFunc*)quaternion_to_dual_quaternion);
+    register_cast_function(quaternion32Num, dualQuaternionNum, (PyArray_VectorUnaryFunc*)quaternion32_to_dual_quaternion);
+
+#define REGISTER_UFUNC(usertype, Q, name)\
+    PyUFunc_RegisterLoopForType((PyUFuncObject *)PyDict_GetItemString(numpy_dict, #name),\
+            usertype, Q##_##name##_ufunc, arg_types, NULL)
+
+#define REGISTER_SCALAR_UFUNC(usertype, Q, name)\
     PyUFunc_RegisterLoopForType((PyUFuncObject *)PyDict_GetItemString(numpy_dict, #name),\
-            quaternion_descr->type_num, quaternion_##name##_ufunc, arg_types, NULL)
+            usertype, Q##_##name##_scalar_ufunc, arg_types, NULL)
 
-#define REGISTER_SCALAR_UFUNC(name)\
+#define REGISTER_MIXED_UFUNC(usertype, name, loop_name)\
     PyUFunc_RegisterLoopForType((PyUFuncObject *)PyDict_GetItemString(numpy_dict, #name),\
-            quaternion_descr->type_num, quaternion_##name##_scalar_ufunc, arg_types, NULL)
+            usertype, loop_name, arg_types, NULL)
+
+/* The MIXED_UFUNCS loops for Q and T, whose type number is real_num */
+#define REGISTER_MIXED_UFUNCS(usertype, Q, T, real_num)\
+    /* quat, real -> quat */\
+    arg_types[0] = Q##_descr->type_num;\
+    arg_types[1] = real_num;\
+    arg_types[2] = Q##_descr->type_num;\
+\
+    REGISTER_MIXED_UFUNC(usertype, add, Q##_add_##T##_ufunc);\
+    REGISTER_MIXED_UFUNC(usertype, subtract, Q##_subtract_##T##_ufunc);\
+    REGISTER_MIXED_UFUNC(usertype, multiply, Q##_multiply_##T##_ufunc);\
+    REGISTER_MIXED_UFUNC(usertype, divide, Q##_divide_##T##_ufunc);\
+\
+    /* real, quat -> quat */\
+\
+    arg_types[0] = real_num;\
+    arg_types[1] = Q##_descr->type_num;\
+\
+    REGISTER_MIXED_UFUNC(usertype, add, T##_add_##Q##_ufunc);\
+    REGISTER_MIXED_UFUNC(usertype, subtract, T##_subtract_##Q##_ufunc);\
+    REGISTER_MIXED_UFUNC(usertype, multiply, T##_multiply_##Q##_ufunc);\
+    REGISTER_MIXED_UFUNC(usertype, divide, T##_divide_##Q##_ufunc)
+
+/*
+ * The arithmetic ufunc loops for quaternion type Q with components of
+ * real_num, registered for the user type usertype
+ */
+#define REGISTER_UFUNCS(usertype, Q, real_num)\
+    /* quat -> bool */\
+    arg_types[0] = Q##_descr->type_num;\
+    arg_types[1] = NPY_BOOL;\
+\
+    REGISTER_UFUNC(usertype, Q, isnan);\
+    REGISTER_UFUNC(usertype, Q, isinf);\
+    REGISTER_UFUNC(usertype, Q, isfinite);\
+    /* quat -> real */\
+    arg_types[1] = real_num;\
+\
+    REGISTER_UFUNC(usertype, Q, absolute);\
+\
+    /* quat -> quat */\
+    arg_types[1] = Q##_descr->type_num;\
+\
+    REGISTER_UFUNC(usertype, Q, log);\
+    REGISTER_UFUNC(usertype, Q, exp);\
+    REGISTER_UFUNC(usertype, Q, negative);\
+    REGISTER_UFUNC(usertype, Q, conjugate);\
+\
+    /* quat, quat -> bool */\
+\
+    arg_types[2] = NPY_BOOL;\
+\
+    REGISTER_UFUNC(usertype, Q, equal);\
+    REGISTER_UFUNC(usertype, Q, not_equal);\
+    REGISTER_UFUNC(usertype, Q, less);\
+    REGISTER_UFUNC(usertype, Q, less_equal);\
+\
+    /* quat, real -> quat */\
+\
+    arg_types[1] = real_num;\
+    arg_types[2] = Q##_descr->type_num;\
+\
+    REGISTER_SCALAR_UFUNC(usertype, Q, power);\
+\
+    /* quat, quat -> quat */\
+\
+    arg_types[1] = Q##_descr->type_num;\
+\
+    REGISTER_UFUNC(usertype, Q, add);\
+    REGISTER_UFUNC(usertype, Q, subtract);\
+    REGISTER_UFUNC(usertype, Q, multiply);\
+    REGISTER_UFUNC(usertype, Q, divide);\
+    REGISTER_UFUNC(usertype, Q, power);\
+    REGISTER_UFUNC(usertype, Q, copysign)
 
-    /* quat -> bool */
-    arg_types[0] = quaternion_descr->type_num;
+    REGISTER_UFUNCS(quaternionNum, quaternion, NPY_DOUBLE);
+    REGISTER_UFUNCS(quaternion32Num, quaternion32, NPY_FLOAT);
+    /*
+     * numpy only searches the loops of the user types among the operands, so
+     * quaternion32 with double operands needs the double loops too; they come
+     * after its own, which are preferred.
+     */
+    REGISTER_UFUNCS(quaternion32Num, quaternion, NPY_DOUBLE);
+
+    /*
+     * Quaternions with real arrays.  numpy compares Python floats with
+     * quaternion arrays as the smallest float type holding their value, so a
+     * float32 loop for quaternion would round them; float32 arrays take the
+     * float64 loops, which only need the reals cast.
+     */
+    REGISTER_MIXED_UFUNCS(quaternionNum, quaternion, npy_double, NPY_DOUBLE);
+    REGISTER_MIXED_UFUNCS(quaternionNum, quaternion, npy_int32, NPY_INT32);
+    REGISTER_MIXED_UFUNCS(quaternionNum, quaternion, npy_int64, NPY_INT64);
+    REGISTER_MIXED_UFUNCS(quaternion32Num, quaternion32, npy_float, NPY_FLOAT);
+    REGISTER_MIXED_UFUNCS(quaternion32Num, quaternion, npy_double, NPY_DOUBLE);
+    REGISTER_MIXED_UFUNCS(quaternion32Num, quaternion, npy_int32, NPY_INT32);
+    REGISTER_MIXED_UFUNCS(quaternion32Num, quaternion, npy_int64, NPY_INT64);
+
+    /* dual quaternion -> bool, dual quaternion */
+    arg_types[0] = dualQuaternionNum;
     arg_types[1] = NPY_BOOL;
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, isnan);
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, isinf);
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, isfinite);
+    arg_types[1] = dualQuaternionNum;
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, conjugate);
+    /* dual quaternion, dual quaternion -> bool, dual quaternion */
+    arg_types[2] = NPY_BOOL;
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, equal);
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, not_equal);
+    arg_types[2] = dualQuaternionNum;
+    REGISTER_UFUNC(dualQuaternionNum, dual_quaternion, multiply);
+
+    PyModule_AddObject(m, "quaternion", (PyObject *)&PyQuaternionArrType_Type);
+    PyModule_AddObject(m, "quaternion32", (PyObject *)&PyQuaternion32ArrType_Type);
+    PyModule_AddObject(m, "dual_quaternion", (PyObject *)&PyDualQuaternionArrType_Type);
+
+    /* quat, double[3] -> double[3] */
+    {
+        PyObject *gufunc = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "rotate", "rotate 3-vectors v by quaternions q, as q*v*q**-1",
+                0, "(),(3)->(3)");
+        if (!gufunc) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = NPY_DOUBLE;
+        arg_types[2] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, quaternion_descr->type_num,
+                quaternion_rotate_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "rotate", gufunc);
+    }
+
+    /* quat, quat, double -> quat */
+    {
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, 3, 1,
+                PyUFunc_None, "slerp",
+                "spherical linear interpolation from q0 (t = 0) to q1 (t = 1)", 0);
+        if (!ufunc) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = quaternion_descr->type_num;
+        arg_types[2] = NPY_DOUBLE;
+        arg_types[3] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion_descr->type_num,
+                quaternion_slerp_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "slerp", ufunc);
+    }
+
+    /* quat, quat, quat, quat, double -> quat */
+    {
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, 5, 1,
+                PyUFunc_None, "squad",
+                "spherical quadrangle interpolation from q0 to q1 with control points s0, s1",
+                0);
+        if (!ufunc) {
+            return NULL;
+        }
+        arg_types[2] = quaternion_descr->type_num;
+        arg_types[3] = quaternion_descr->type_num;
+        arg_types[4] = NPY_DOUBLE;
+        arg_types[5] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion_descr->type_num,
+                quaternion_squad_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "squad", ufunc);
+    }
 
-    REGISTER_UFUNC(isnan);
-    REGISTER_UFUNC(isinf);
-    REGISTER_UFUNC(isfinite);
-    /* quat -> double */
-    arg_types[1] = NPY_DOUBLE;
+    /* double[n], quat[n], double[m] -> quat[m] */
+    {
+        PyObject *gufunc = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 3, 1,
+                PyUFunc_None, "resample",
+                "slerp a quaternion series sampled at increasing times to new times",
+                0, "(n),(n),(m)->(m)");
+        if (!gufunc) {
+            return NULL;
+        }
+        arg_types[0] = NPY_DOUBLE;
+        arg_types[1] = quaternion_descr->type_num;
+        arg_types[2] = NPY_DOUBLE;
+        arg_types[3] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, quaternion_descr->type_num,
+                quaternion_resample_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "resample", gufunc);
+    }
 
-    REGISTER_UFUNC(absolute);
+    /* quat[n], intp -> quat and quat[n] */
+    {
+        PyObject *product = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "product",
+                "the ordered product q[0]*q[1]*...*q[n-1], evaluated as a tree and "
+                "renormalized after at most k steps if k > 0",
+                0, "(n),()->()");
+        PyObject *cumulative_product = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL,
+                0, 2, 1, PyUFunc_None, "cumulative_product",
+                "the ordered products q[0]*...*q[i], evaluated as a blocked scan and "
+                "renormalized after at most k steps if k > 0",
+                0, "(n),()->(n)");
+        if (!product || !cumulative_product) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = NPY_INTP;
+        arg_types[2] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)product, quaternion_descr->type_num,
+                quaternion_product_gufunc, arg_types, NULL) < 0 ||
+            PyUFunc_RegisterLoopForType((PyUFuncObject *)cumulative_product,
+                quaternion_descr->type_num, quaternion_cumulative_product_gufunc,
+                arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "product", product);
+        PyModule_AddObject(m, "cumulative_product", cumulative_product);
+    }
 
-    /* quat -> quat */
-    arg_types[1] = quaternion_descr->type_num;
+    /* quat[n] -> quat and quat[n], double[n] -> quat */
+    {
+        PyObject *mean = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 1, 1,
+                PyUFunc_None, "mean_rotation",
+                "the average rotation of q, the principal eigenvector of sum q q^T",
+                0, "(n)->()");
+        PyObject *weighted = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "weighted_mean_rotation",
+                "the average rotation of q weighted by w, the principal eigenvector of "
+                "sum w q q^T",
+                0, "(n),(n)->()");
+        if (!mean || !weighted) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)mean, quaternion_descr->type_num,
+                quaternion_mean_rotation_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[1] = NPY_DOUBLE;
+        arg_types[2] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)weighted, quaternion_descr->type_num,
+                quaternion_weighted_mean_rotation_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "mean_rotation", mean);
+        PyModule_AddObject(m, "weighted_mean_rotation", weighted);
+    }
 
-    REGISTER_UFUNC(log);
-    REGISTER_UFUNC(exp);
-    REGISTER_UFUNC(negative);
-    REGISTER_UFUNC(conjugate);
+    /* double[n,3], double[n] -> quat[n] and quat[n], double[n] -> double[n,3] */
+    {
+        PyObject *integrate = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "integrate_angular_velocity",
+                "the orientations from 1 with body frame angular velocity w at times t",
+                0, "(n,3),(n)->(n)");
+        PyObject *velocity = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "angular_velocity",
+                "the body frame angular velocity of orientations q at times t",
+                0, "(n),(n)->(n,3)");
+        if (!integrate || !velocity) {
+            return NULL;
+        }
+        arg_types[0] = NPY_DOUBLE;
+        arg_types[1] = NPY_DOUBLE;
+        arg_types[2] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)integrate, quaternion_descr->type_num,
+                quaternion_integrate_angular_velocity_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[2] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)velocity, quaternion_descr->type_num,
+                quaternion_angular_velocity_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "integrate_angular_velocity", integrate);
+        PyModule_AddObject(m, "angular_velocity", velocity);
+    }
 
-    /* quat, quat -> bool */
+    /* quat, quat -> real */
+    {
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "inner",
+                "the Euclidean inner product of q1 and q2 as 4-vectors", 0);
+        if (!ufunc) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = quaternion_descr->type_num;
+        arg_types[2] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion_descr->type_num,
+                quaternion_inner_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[0] = quaternion32_descr->type_num;
+        arg_types[1] = quaternion32_descr->type_num;
+        arg_types[2] = NPY_FLOAT;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion32_descr->type_num,
+                quaternion32_inner_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "inner", ufunc);
+    }
 
-    arg_types[2] = NPY_BOOL;
+    /* quat[m,n], quat[n,p] -> quat[m,p] */
+    {
+        PyObject *gufunc = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "matrix_multiply",
+                "the matrix product of quaternion matrices a and b",
+                0, "(m,n),(n,p)->(m,p)");
+        PyObject *matmul = PyDict_GetItemString(numpy_dict, "matmul");
+        if (!gufunc) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = quaternion_descr->type_num;
+        arg_types[2] = quaternion_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, quaternion_descr->type_num,
+                quaternion_matrix_multiply_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        /* np.matmul, where numpy has it, takes the same loops */
+        if (matmul && PyUFunc_RegisterLoopForType((PyUFuncObject *)matmul,
+                quaternion_descr->type_num, quaternion_matrix_multiply_gufunc,
+                arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[0] = quaternion32_descr->type_num;
+        arg_types[1] = quaternion32_descr->type_num;
+        arg_types[2] = quaternion32_descr->type_num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, quaternion32_descr->type_num,
+                quaternion32_matrix_multiply_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        if (matmul && PyUFunc_RegisterLoopForType((PyUFuncObject *)matmul,
+                quaternion32_descr->type_num, quaternion32_matrix_multiply_gufunc,
+                arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "matrix_multiply", gufunc);
+    }
 
-    REGISTER_UFUNC(equal);
-    REGISTER_UFUNC(not_equal);
-    REGISTER_UFUNC(less);
-    REGISTER_UFUNC(less_equal);
+#define REGISTER_DISTANCE_UFUNC(name, doc) {\
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, 2, 1,\
+                PyUFunc_None, #name, doc, 0);\
+        if (!ufunc) {\
+            return NULL;\
+        }\
+        arg_types[0] = quaternion_descr->type_num;\
+        arg_types[1] = quaternion_descr->type_num;\
+        arg_types[2] = NPY_DOUBLE;\
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion_descr->type_num,\
+                quaternion_##name##_ufunc, arg_types, NULL) < 0) {\
+            return NULL;\
+        }\
+        PyModule_AddObject(m, #name, ufunc);\
+    }
 
-    /* quat, double -> quat */
+    REGISTER_DISTANCE_UFUNC(chordal_distance,
+            "min(|q1 - q2|, |q1 + q2|), the same for q2 and -q2");
+    REGISTER_DISTANCE_UFUNC(intrinsic_distance,
+            "the angle in [0, pi/2] between q1 and the nearer of q2 and -q2 on the unit sphere");
+    REGISTER_DISTANCE_UFUNC(rotation_distance,
+            "the angle in [0, pi] of the rotation from q1 to q2, twice their intrinsic distance");
 
-    arg_types[1] = NPY_DOUBLE;
-    arg_types[2] = quaternion_descr->type_num;
+    /* quat[n], quat[m] -> double[n,m] */
+    {
+        PyObject *gufunc = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "pairwise_distance",
+                "the rotation_distance of every a[i] and b[j]",
+                0, "(n),(m)->(n,m)");
+        if (!gufunc) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = quaternion_descr->type_num;
+        arg_types[2] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, quaternion_descr->type_num,
+                quaternion_pairwise_distance_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "pairwise_distance", gufunc);
+    }
 
-    REGISTER_SCALAR_UFUNC(multiply);
-    REGISTER_SCALAR_UFUNC(divide);
-    REGISTER_SCALAR_UFUNC(power);
+    /* quat, double, layout -> intp[k], double[k] and quat, double, layout -> intp */
+    {
+        PyObject *query = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 7, 2,
+                PyUFunc_None, "index_query",
+                "the indices and rotation distances of the k points of an index nearest q within radius",
+                0, "(),(),(4,p),(p),(4,c),(d),(e)->(k),(k)");
+        PyObject *count = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 7, 1,
+                PyUFunc_None, "index_count",
+                "the number of points of an index within radius of q",
+                0, "(),(),(4,p),(p),(4,c),(d),(e)->()");
+        if (!query || !count) {
+            return NULL;
+        }
+        arg_types[0] = quaternion_descr->type_num;
+        arg_types[1] = NPY_DOUBLE;
+        arg_types[2] = NPY_DOUBLE;
+        arg_types[3] = NPY_INTP;
+        arg_types[4] = NPY_DOUBLE;
+        arg_types[5] = NPY_DOUBLE;
+        arg_types[6] = NPY_INTP;
+        arg_types[7] = NPY_INTP;
+        arg_types[8] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)query, quaternion_descr->type_num,
+                quaternion_index_query_gufunc, arg_types, NULL) < 0 ||
+            PyUFunc_RegisterLoopForType((PyUFuncObject *)count, quaternion_descr->type_num,
+                quaternion_index_count_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "index_query", query);
+        PyModule_AddObject(m, "index_count", count);
+    }
 
-    /* quat, quat -> quat */
+#define REGISTER_CONVERSION_GUFUNC(name, signature, in_type, out_type, doc) {\
+        PyObject *gufunc = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 1, 1,\
+                PyUFunc_None, #name, doc, 0, signature);\
+        if (!gufunc) {\
+            return NULL;\
+        }\
+        arg_types[0] = in_type;\
+        arg_types[1] = out_type;\
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, quaternion_descr->type_num,\
+                quaternion_##name##_gufunc, arg_types, NULL) < 0) {\
+            return NULL;\
+        }\
+        PyModule_AddObject(m, #name, gufunc);\
+    }
 
-    arg_types[1] = quaternion_descr->type_num;
+    REGISTER_CONVERSION_GUFUNC(as_rotation_matrix, "()->(3,3)",
+            quaternion_descr->type_num, NPY_DOUBLE,
+            "the 3x3 matrix of the rotation by q");
+    REGISTER_CONVERSION_GUFUNC(as_rotation_vector, "()->(3)",
+            quaternion_descr->type_num, NPY_DOUBLE,
+            "the rotation vector of q, its axis times its angle in [0, pi]");
+    REGISTER_CONVERSION_GUFUNC(as_euler, "()->(3)",
+            quaternion_descr->type_num, NPY_DOUBLE,
+            "z-y-z Euler angles (alpha, beta, gamma) of the rotation by q");
+    REGISTER_CONVERSION_GUFUNC(from_rotation_matrix, "(3,3)->()",
+            NPY_DOUBLE, quaternion_descr->type_num,
+            "the unit quaternion of a rotation matrix, by Shepperd's method");
+    REGISTER_CONVERSION_GUFUNC(from_rotation_vector, "(3)->()",
+            NPY_DOUBLE, quaternion_descr->type_num,
+            "the unit quaternion rotating by |v| about v");
+    REGISTER_CONVERSION_GUFUNC(from_euler, "(3)->()",
+            NPY_DOUBLE, quaternion_descr->type_num,
+            "the unit quaternion of z-y-z Euler angles (alpha, beta, gamma)");
 
-    REGISTER_UFUNC(add);
-    REGISTER_UFUNC(subtract);
-    REGISTER_UFUNC(multiply);
-    REGISTER_UFUNC(divide);
-    REGISTER_UFUNC(power);
-    REGISTER_UFUNC(copysign);
+    /* quat -> quat, dual quat -> dual quat */
+    {
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, 1, 1,
+                PyUFunc_None, "normalized",
+                "q/|q|, or the nearest unit dual quaternion, with |r| = 1 and r.d = 0", 0);
+        if (!ufunc) {
+            return NULL;
+        }
+        arg_types[0] = quaternionNum;
+        arg_types[1] = quaternionNum;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternionNum,
+                quaternion_normalized_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[0] = quaternion32Num;
+        arg_types[1] = quaternion32Num;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion32Num,
+                quaternion32_normalized_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[0] = dualQuaternionNum;
+        arg_types[1] = dualQuaternionNum;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, dualQuaternionNum,
+                dual_quaternion_normalized_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "normalized", ufunc);
+    }
 
-    PyModule_AddObject(m, "quaternion", (PyObject *)&PyQuaternionArrType_Type);
+    /* Unit quaternion ufuncs, with loops for quaternion and quaternion32 */
+#define REGISTER_UNIT_UFUNC(name, nin, out_type, out32_type, doc) {\
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, nin, 1,\
+                PyUFunc_None, #name, doc, 0);\
+        if (!ufunc) {\
+            return NULL;\
+        }\
+        arg_types[0] = arg_types[1] = quaternionNum;\
+        arg_types[nin] = out_type;\
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternionNum,\
+                quaternion_##name##_ufunc, arg_types, NULL) < 0) {\
+            return NULL;\
+        }\
+        arg_types[0] = arg_types[1] = quaternion32Num;\
+        arg_types[nin] = out32_type;\
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, quaternion32Num,\
+                quaternion32_##name##_ufunc, arg_types, NULL) < 0) {\
+            return NULL;\
+        }\
+        PyModule_AddObject(m, #name, ufunc);\
+    }
+
+    REGISTER_UNIT_UFUNC(inverse, 1, quaternionNum, quaternion32Num,
+            "the inverse 1/q = conj(q)/|q|**2");
+    REGISTER_UNIT_UFUNC(norm, 1, NPY_DOUBLE, NPY_FLOAT,
+            "the squared norm |q|**2");
+    REGISTER_UNIT_UFUNC(isunit, 1, NPY_BOOL, NPY_BOOL,
+            "whether |q|**2 is 1 to within 1024 machine epsilons");
+    REGISTER_UNIT_UFUNC(unit_multiply, 2, quaternionNum, quaternion32Num,
+            "the product q1*q2 scaled to unit length");
+
+    /* dual quat, double[3] -> double[3] */
+    {
+        PyObject *gufunc = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "transform",
+                "move points v by rigid transforms a: rotate by r, then translate",
+                0, "(),(3)->(3)");
+        if (!gufunc) {
+            return NULL;
+        }
+        arg_types[0] = dualQuaternionNum;
+        arg_types[1] = NPY_DOUBLE;
+        arg_types[2] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)gufunc, dualQuaternionNum,
+                dual_quaternion_transform_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "transform", gufunc);
+    }
+
+    /* dual quat, dual quat, double -> dual quat */
+    {
+        PyObject *ufunc = PyUFunc_FromFuncAndData(NULL, NULL, NULL, 0, 3, 1,
+                PyUFunc_None, "sclerp",
+                "screw linear interpolation from a0 (t = 0) to a1 (t = 1)", 0);
+        if (!ufunc) {
+            return NULL;
+        }
+        arg_types[0] = dualQuaternionNum;
+        arg_types[1] = dualQuaternionNum;
+        arg_types[2] = NPY_DOUBLE;
+        arg_types[3] = dualQuaternionNum;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)ufunc, dualQuaternionNum,
+                dual_quaternion_sclerp_ufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "sclerp", ufunc);
+    }
+
+    /* quat, double[3] -> dual quat and back */
+    {
+        PyObject *from = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 2, 1,
+                PyUFunc_None, "from_rigid_transform",
+                "the unit dual quaternion rotating by q, then translating by t",
+                0, "(),(3)->()");
+        PyObject *as = PyUFunc_FromFuncAndDataAndSignature(NULL, NULL, NULL, 0, 1, 2,
+                PyUFunc_None, "as_rigid_transform",
+                "the unit rotation quaternion and the translation of a",
+                0, "()->(),(3)");
+        if (!from || !as) {
+            return NULL;
+        }
+        arg_types[0] = quaternionNum;
+        arg_types[1] = NPY_DOUBLE;
+        arg_types[2] = dualQuaternionNum;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)from, quaternionNum,
+                dual_quaternion_from_rigid_transform_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        arg_types[0] = dualQuaternionNum;
+        arg_types[1] = quaternionNum;
+        arg_types[2] = NPY_DOUBLE;
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject *)as, dualQuaternionNum,
+                dual_quaternion_as_rigid_transform_gufunc, arg_types, NULL) < 0) {
+            return NULL;
+        }
+        PyModule_AddObject(m, "from_rigid_transform", from);
+        PyModule_AddObject(m, "as_rigid_transform", as);
+    }
+
+    /* Pick vectorized kernels, optionally limited by NPYTYPES_QUATERNION_SIMD */
+    PyModule_AddStringConstant(m, "simd",
+            quaternion_simd_init(getenv("NPYTYPES_QUATERNION_SIMD")));
+    fast_normalize = getenv("NPYTYPES_QUATERNION_FAST_NORMALIZE");
+    quaternion_simd_fast_normalize(fast_normalize && *fast_normalize && strcmp(fast_normalize, "0"));
 
     return m;
 }
@@ -29,195 +29,361 @@
 #include "quaternion.h"
 #include "math.h"
 
-#define _QUAT_EPS 1e-6
 
-int
-quaternion_isnonzero(quaternion q)
-{
-    return q.w != 0 && q.x != 0 && q.y != 0 && q.z != 0;
-}
+#define Q quaternion
+#define T double
+#define F(name) quaternion_##name
+#define M(name) name
+#define L(name) DBL_##name
+#define E QUATERNION_UNIT_TOLERANCE
+#define S
+#include "quaternion_template.h"
 
-int
-quaternion_isnan(quaternion q)
+#define Q quaternion32
+#define T float
+#define F(name) quaternion32_##name
+#define M(name) name##f
+#define L(name) FLT_##name
+#define E QUATERNION32_UNIT_TOLERANCE
+#define S
+#include "quaternion_template.h"
+
+/*
+ * q v q**-1 for a 3-vector v, as v + w*t + u x t with u the vector part of q
+ * and t = 2 u x v / |q|**2.  out may be v.
+ */
+void
+quaternion_rotate_vector(quaternion q, const double *v, double *out)
 {
-    return isnan(q.w) || isnan(q.x) || isnan(q.y) || isnan(q.z);
+   double s = 2 / (q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z);
+   double tx = s*(q.y*v[2] - q.z*v[1]);
+   double ty = s*(q.z*v[0] - q.x*v[2]);
+   double tz = s*(q.x*v[1] - q.y*v[0]);
+   double x = v[0] + q.w*tx + (q.y*tz - q.z*ty);
+   double y = v[1] + q.w*ty + (q.z*tx - q.x*tz);
+   double z = v[2] + q.w*tz + (q.x*ty - q.y*tx);
+   out[0] = x;
+   out[1] = y;
+   out[2] = z;
 }
 
-int
-quaternion_isinf(quaternion q)
+/* The row-major 3x3 matrix m with m v = q v q**-1 */
+void
+quaternion_rotation_matrix(quaternion q, double *m)
 {
-    return isinf(q.w) || isinf(q.x) || isinf(q.y) || isnan(q.z);
+   double s = 2 / (q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z);
+   double wx = s*q.w*q.x, wy = s*q.w*q.y, wz = s*q.w*q.z;
+   double xx = s*q.x*q.x, xy = s*q.x*q.y, xz = s*q.x*q.z;
+   double yy = s*q.y*q.y, yz = s*q.y*q.z, zz = s*q.z*q.z;
+   m[0] = 1 - (yy + zz);
+   m[1] = xy - wz;
+   m[2] = xz + wy;
+   m[3] = xy + wz;
+   m[4] = 1 - (xx + zz);
+   m[5] = yz - wx;
+   m[6] = xz - wy;
+   m[7] = yz + wx;
+   m[8] = 1 - (xx + yy);
 }
 
-int
-quaternion_isfinite(quaternion q)
+/*
+ * The unit quaternion for a rotation matrix, by Shepperd's method.  With
+ * K = 4 q q^T, whose diagonal and off-diagonal elements are linear in m, take
+ * the row k of K with the largest diagonal and q = K[k] / (2 sqrt(K[k][k])).
+ * Only the choice of k branches.
+ */
+quaternion
+quaternion_from_rotation_matrix(const double *m)
 {
-    return isfinite(q.w) && isfinite(q.x) && isfinite(q.y) && isfinite(q.z);
+   double K[4][4];
+   double s;
+   int k = 0, j;
+   K[0][0] = 1 + m[0] + m[4] + m[8];
+   K[1][1] = 1 + m[0] - m[4] - m[8];
+   K[2][2] = 1 - m[0] + m[4] - m[8];
+   K[3][3] = 1 - m[0] - m[4] + m[8];
+   K[0][1] = K[1][0] = m[7] - m[5];
+   K[0][2] = K[2][0] = m[2] - m[6];
+   K[0][3] = K[3][0] = m[3] - m[1];
+   K[1][2] = K[2][1] = m[1] + m[3];
+   K[1][3] = K[3][1] = m[2] + m[6];
+   K[2][3] = K[3][2] = m[5] + m[7];
+   for (j = 1; j < 4; j++) {
+      k = K[j][j] > K[k][k] ? j : k;
+   }
+   s = 0.5 / sqrt(K[k][k]);
+   return (quaternion) {s*K[k][0], s*K[k][1], s*K[k][2], s*K[k][3]};
 }
 
-double
-quaternion_absolute(quaternion q)
+/*
+ * The rotation vector of q: its axis times its angle, which is taken in
+ * [0, pi] by using -q if w < 0.  Real q, the zero quaternion included, give
+ * the zero vector.
+ */
+void
+quaternion_rotation_vector(quaternion q, double *v)
 {
-   return sqrt(q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z);
+   double vnorm = sqrt(q.x*q.x + q.y*q.y + q.z*q.z);
+   double s = vnorm > 0 ? 2*atan2(vnorm, fabs(q.w)) / vnorm :
+              q.w != 0 ? 2 / fabs(q.w) : 0;
+   s = copysign(s, q.w);
+   v[0] = s*q.x;
+   v[1] = s*q.y;
+   v[2] = s*q.z;
 }
 
+/* exp(v/2), the unit quaternion rotating by |v| about v */
 quaternion
-quaternion_add(quaternion q1, quaternion q2)
+quaternion_from_rotation_vector(const double *v)
 {
-   return (quaternion) {
-      q1.w+q2.w,
-      q1.x+q2.x,
-      q1.y+q2.y,
-      q1.z+q2.z,
-   };
+   return quaternion_exp((quaternion) {0, 0.5*v[0], 0.5*v[1], 0.5*v[2]});
 }
 
-quaternion
-quaternion_subtract(quaternion q1, quaternion q2)
+/*
+ * Euler angles (alpha, beta, gamma) in the z-y-z convention, so that q is a
+ * multiple of exp(alpha z/2) exp(beta y/2) exp(gamma z/2), with beta in
+ * [0, pi].
+ */
+void
+quaternion_euler_angles(quaternion q, double *angles)
 {
-   return (quaternion) {
-      q1.w-q2.w,
-      q1.x-q2.x,
-      q1.y-q2.y,
-      q1.z-q2.z,
-   };
+   double a = atan2(q.z, q.w), b = atan2(-q.x, q.y);
+   angles[0] = a + b;
+   angles[1] = 2*atan2(sqrt(q.x*q.x + q.y*q.y), sqrt(q.w*q.w + q.z*q.z));
+   angles[2] = a - b;
 }
 
 quaternion
-quaternion_multiply(quaternion q1, quaternion q2)
+quaternion_from_euler_angles(const double *angles)
 {
-   return (quaternion) {
-      q1.w*q2.w - q1.x*q2.x - q1.y*q2.y - q1.z*q2.z,
-      q1.w*q2.x + q1.x*q2.w + q1.y*q2.z - q1.z*q2.y,
-      q1.w*q2.y - q1.x*q2.z + q1.y*q2.w + q1.z*q2.x,
-      q1.w*q2.z + q1.x*q2.y - q1.y*q2.x + q1.z*q2.w,
-   };
+   double cb = cos(0.5*angles[1]), sb = sin(0.5*angles[1]);
+   double sum = 0.5*(angles[0] + angles[2]), diff = 0.5*(angles[0] - angles[2]);
+   return (quaternion) {cb*cos(sum), -sb*sin(diff), sb*cos(diff), cb*sin(sum)};
 }
 
-quaternion
-quaternion_divide(quaternion q1, quaternion q2)
+/*
+ * Interpolate along the great arc from unit quaternion q0 (t = 0) to q1
+ * (t = 1), whose angle is 2 atan2(|q1 - q0|, |q1 + q0|).  Below 2**-20
+ * radians nlerp agrees with slerp to rounding, and is used instead.
+ */
+static quaternion
+quaternion_slerp_arc(quaternion q0, quaternion q1, double t)
 {
-   double s = q2.w*q2.w + q2.x*q2.x + q2.y*q2.y + q2.z*q2.z;
-   return (quaternion) {
-      (  q1.w*q2.w + q1.x*q2.x + q1.y*q2.y + q1.z*q2.z) / s,
-      (- q1.w*q2.x + q1.x*q2.w + q1.y*q2.z - q1.z*q2.y) / s,
-      (- q1.w*q2.y - q1.x*q2.z + q1.y*q2.w + q1.z*q2.x) / s,
-      (- q1.w*q2.z + q1.x*q2.y - q1.y*q2.x + q1.z*q2.w) / s
-   };
+   quaternion d = quaternion_subtract(q1, q0), s = quaternion_add(q1, q0), r;
+   double a, b;
+   double omega = 2*atan2(sqrt(quaternion_inner(d, d)), sqrt(quaternion_inner(s, s)));
+   if (omega < 0x1p-20) {
+      r = quaternion_add(quaternion_multiply_scalar(q0, 1 - t),
+            quaternion_multiply_scalar(q1, t));
+      return quaternion_divide_scalar(r, sqrt(quaternion_inner(r, r)));
+   }
+   /* sin((1-t) omega) / sin(omega) = cos(t omega) - cos(omega) sin(t omega) / sin(omega) */
+   b = sin(t*omega) / sin(omega);
+   a = cos(t*omega) - cos(omega)*b;
+   return quaternion_add(quaternion_multiply_scalar(q0, a), quaternion_multiply_scalar(q1, b));
 }
 
+/* slerp by the shorter of the arcs to q1 and -q1, which are the same rotation */
 quaternion
-quaternion_multiply_scalar(quaternion q, double s)
+quaternion_slerp(quaternion q0, quaternion q1, double t)
 {
-   return (quaternion) {s*q.w, s*q.x, s*q.y, s*q.z};
+   if (quaternion_inner(q0, q1) < 0) {
+      q1 = quaternion_negative(q1);
+   }
+   return quaternion_slerp_arc(q0, q1, t);
 }
 
+/*
+ * Shoemake's spherical quadrangle interpolation between q0 and q1 with inner
+ * control points s0 and s1.  As in his paper the slerps don't change
+ * hemisphere, so neighbouring inputs should have positive dot products.
+ */
 quaternion
-quaternion_divide_scalar(quaternion q, double s)
+quaternion_squad(quaternion q0, quaternion q1, quaternion s0, quaternion s1, double t)
 {
-   return (quaternion) {q.w/s, q.x/s, q.y/s, q.z/s};
+   return quaternion_slerp_arc(quaternion_slerp_arc(q0, q1, t),
+         quaternion_slerp_arc(s0, s1, t), 2*t*(1 - t));
 }
 
-quaternion
-quaternion_log(quaternion q)
-{
-   double sumvsq = q.x*q.x + q.y*q.y + q.z*q.z;
-   double vnorm = sqrt(sumvsq);
-   if (vnorm > _QUAT_EPS) {
-      double m = sqrt(q.w*q.w + sumvsq);
-      double s = acos(q.w/m) / vnorm;
-      return (quaternion) {log(m), s*q.x, s*q.y, s*q.z};
-   } else {
-      return (quaternion) {0, 0, 0, 0};
-   }
+/* min(|q1 - q2|, |q1 + q2|), the chordal distance of q1 and q2 as rotations */
+double
+quaternion_chordal_distance(quaternion q1, quaternion q2)
+{
+   quaternion d = quaternion_subtract(q1, q2), s = quaternion_add(q1, q2);
+   return sqrt(fmin(quaternion_inner(d, d), quaternion_inner(s, s)));
 }
 
-quaternion
-quaternion_exp(quaternion q)
+/*
+ * The angle on the unit sphere between q1/|q1| and the nearer of q2/|q2| and
+ * -q2/|q2|, in [0, pi/2], as 2 atan2(|q1 - q2|, |q1 + q2|) after the sign
+ * change, which stays accurate near both ends
+ */
+double
+quaternion_intrinsic_distance(quaternion q1, quaternion q2)
 {
-   double vnorm = sqrt(q.x*q.x + q.y*q.y + q.z*q.z);
-   if (vnorm > _QUAT_EPS) {
-      double s = sin(vnorm) / vnorm;
-      double e = exp(q.w);
-      return (quaternion) {e*cos(vnorm), e*s*q.x, e*s*q.y, e*s*q.z};
-   } else {
-      return (quaternion) {exp(q.w), 0, 0, 0};
-   }
+   quaternion d, s;
+   double d2, s2;
+   q1 = quaternion_divide_scalar(q1, quaternion_absolute(q1));
+   q2 = quaternion_divide_scalar(q2, quaternion_absolute(q2));
+   d = quaternion_subtract(q1, q2);
+   s = quaternion_add(q1, q2);
+   d2 = quaternion_inner(d, d);
+   s2 = quaternion_inner(s, s);
+   return 2*atan2(sqrt(fmin(d2, s2)), sqrt(fmax(d2, s2)));
 }
 
-quaternion
-quaternion_power(quaternion q, quaternion p)
+/* The angle of the rotation taking q1 to q2, in [0, pi] */
+double
+quaternion_rotation_distance(quaternion q1, quaternion q2)
 {
-   return quaternion_exp(quaternion_multiply(quaternion_log(q), p));
+   return 2*quaternion_intrinsic_distance(q1, q2);
 }
 
-quaternion
-quaternion_power_scalar(quaternion q, double p)
+/*
+ * Dual quaternions a = r + e d represent rigid transforms: a unit dual
+ * quaternion, with |r| = 1 and r.d = 0, rotates by r and then translates by
+ * t = 2 d r*, so d = t r / 2.
+ */
+int
+dual_quaternion_isnonzero(dual_quaternion a)
 {
-   return quaternion_exp(quaternion_multiply_scalar(quaternion_log(q), p));
+   return quaternion_isnonzero(a.r) || quaternion_isnonzero(a.d);
 }
 
-quaternion
-quaternion_negative(quaternion q)
+int
+dual_quaternion_isnan(dual_quaternion a)
 {
-   return (quaternion) {-q.w, -q.x, -q.y, -q.z};
+   return quaternion_isnan(a.r) || quaternion_isnan(a.d);
 }
 
-quaternion
-quaternion_conjugate(quaternion q)
+int
+dual_quaternion_isinf(dual_quaternion a)
 {
-   return (quaternion) {q.w, -q.x, -q.y, -q.z};
+   return quaternion_isinf(a.r) || quaternion_isinf(a.d);
 }
 
-quaternion
-quaternion_copysign(quaternion q1, quaternion q2)
+int
+dual_quaternion_isfinite(dual_quaternion a)
 {
-    return (quaternion) {
-        copysign(q1.w, q2.w),
-        copysign(q1.x, q2.x),
-        copysign(q1.y, q2.y),
-        copysign(q1.z, q2.z)
-    };
+   return quaternion_isfinite(a.r) && quaternion_isfinite(a.d);
 }
 
 int
-quaternion_equal(quaternion q1, quaternion q2)
+dual_quaternion_equal(dual_quaternion a, dual_quaternion b)
 {
-    return 
-        !quaternion_isnan(q1) &&
-        !quaternion_isnan(q2) &&
-        q1.w == q2.w && 
-        q1.x == q2.x && 
-        q1.y == q2.y && 
-        q1.z == q2.z;
+   return quaternion_equal(a.r, b.r) && quaternion_equal(a.d, b.d);
 }
 
 int
-quaternion_not_equal(quaternion q1, quaternion q2)
+dual_quaternion_not_equal(dual_quaternion a, dual_quaternion b)
 {
-    return !quaternion_equal(q1, q2);
+   return !dual_quaternion_equal(a, b);
 }
 
-int
-quaternion_less(quaternion q1, quaternion q2)
+/* (ar + e ad)(br + e bd) = ar br + e (ar bd + ad br), the transform b then a */
+dual_quaternion
+dual_quaternion_multiply(dual_quaternion a, dual_quaternion b)
 {
-    return
-        (!quaternion_isnan(q1) &&
-        !quaternion_isnan(q2)) && (
-            q1.w != q2.w ? q1.w < q2.w :
-            q1.x != q2.x ? q1.x < q2.x :
-            q1.y != q2.y ? q1.y < q2.y :
-            q1.z != q2.z ? q1.z < q2.z : 0);
+   dual_quaternion c;
+   c.r = quaternion_multiply(a.r, b.r);
+   c.d = quaternion_add(quaternion_multiply(a.r, b.d), quaternion_multiply(a.d, b.r));
+   return c;
 }
 
-int
-quaternion_less_equal(quaternion q1, quaternion q2)
-{
-   return
-        (!quaternion_isnan(q1) &&
-        !quaternion_isnan(q2)) && (
-            q1.w != q2.w ? q1.w < q2.w :
-            q1.x != q2.x ? q1.x < q2.x :
-            q1.y != q2.y ? q1.y < q2.y :
-            q1.z != q2.z ? q1.z < q2.z : 1);
+/* r* + e d*, the inverse transform of a unit dual quaternion */
+dual_quaternion
+dual_quaternion_conjugate(dual_quaternion a)
+{
+   a.r = quaternion_conjugate(a.r);
+   a.d = quaternion_conjugate(a.d);
+   return a;
+}
+
+/*
+ * The nearest unit dual quaternion: both parts divided by |r|, and the
+ * component of d along r removed
+ */
+dual_quaternion
+dual_quaternion_normalized(dual_quaternion a)
+{
+   double s = 1 / quaternion_absolute(a.r);
+   a.r = quaternion_multiply_scalar(a.r, s);
+   a.d = quaternion_multiply_scalar(a.d, s);
+   a.d = quaternion_subtract(a.d,
+         quaternion_multiply_scalar(a.r, quaternion_inner(a.r, a.d)));
+   return a;
+}
+
+/* Rotation by q, normalized, then translation by t */
+dual_quaternion
+dual_quaternion_from_rigid_transform(quaternion q, const double *t)
+{
+   dual_quaternion a;
+   a.r = quaternion_divide_scalar(q, quaternion_absolute(q));
+   a.d = quaternion_multiply((quaternion) {0, 0.5*t[0], 0.5*t[1], 0.5*t[2]}, a.r);
+   return a;
+}
+
+/*
+ * The unit rotation r/|r| of a, returned, and its translation
+ * t = 2 vec(d r*) / |r|**2
+ */
+quaternion
+dual_quaternion_rigid_transform(dual_quaternion a, double *t)
+{
+   quaternion r = a.r, d = a.d;
+   double s = 2 / quaternion_inner(r, r);
+   t[0] = s*(r.w*d.x - d.w*r.x + (r.y*d.z - r.z*d.y));
+   t[1] = s*(r.w*d.y - d.w*r.y + (r.z*d.x - r.x*d.z));
+   t[2] = s*(r.w*d.z - d.w*r.z + (r.x*d.y - r.y*d.x));
+   return quaternion_divide_scalar(r, quaternion_absolute(r));
+}
+
+/* The point v moved by a: rotated by r, then translated.  out may be v. */
+void
+dual_quaternion_transform_point(dual_quaternion a, const double *v, double *out)
+{
+   double t[3];
+   dual_quaternion_rigid_transform(a, t);
+   quaternion_rotate_vector(a.r, v, out);
+   out[0] += t[0];
+   out[1] += t[1];
+   out[2] += t[2];
+}
+
+/*
+ * Screw linear interpolation a (a* b)**t of unit dual quaternions, moving
+ * along the screw axis of c = a* b at constant rotation and translation
+ * rates.  With c = (cos h, u) + e d, h in [0, pi/2] by taking the shorter of
+ * c and -c, and translation p = 2 vec(d r*), c**t rotates by (cos th, k u)
+ * with k = sin(th)/sin(h), and its dual part is
+ *    (-t k (p.u), k (p x u + cos(h) p) + (t cos(th) - k cos(h)) (p.u) u/|u|**2) / 2,
+ * which is (0, t p/2) for pure translations: the last coefficient vanishes
+ * like h**2 as the axis becomes undefined.
+ */
+dual_quaternion
+dual_quaternion_sclerp(dual_quaternion a, dual_quaternion b, double t)
+{
+   dual_quaternion c = dual_quaternion_multiply(dual_quaternion_conjugate(a), b), e;
+   quaternion r;
+   double p[3], u2, pu, h, k, ch, cth, l;
+   if (c.r.w < 0) {
+      c.r = quaternion_negative(c.r);
+      c.d = quaternion_negative(c.d);
+   }
+   r = c.r;
+   dual_quaternion_rigid_transform(c, p);
+   u2 = r.x*r.x + r.y*r.y + r.z*r.z;
+   pu = p[0]*r.x + p[1]*r.y + p[2]*r.z;
+   h = atan2(sqrt(u2), r.w);
+   k = u2 > 0 ? sin(t*h) / sin(h) : t;
+   ch = cos(h);
+   cth = cos(t*h);
+   l = u2 > 0 ? (t*cth - k*ch) * pu / u2 : 0;
+   e.r = (quaternion) {cth, k*r.x, k*r.y, k*r.z};
+   e.d.w = -0.5*t*k*pu;
+   e.d.x = 0.5*(k*((p[1]*r.z - p[2]*r.y) + ch*p[0]) + l*r.x);
+   e.d.y = 0.5*(k*((p[2]*r.x - p[0]*r.z) + ch*p[1]) + l*r.y);
+   e.d.z = 0.5*(k*((p[0]*r.y - p[1]*r.x) + ch*p[2]) + l*r.z);
+   return dual_quaternion_multiply(a, e);
 }
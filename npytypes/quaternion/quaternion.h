@@ -29,6 +29,8 @@
 #ifndef __QUATERNION_H__
 #define __QUATERNION_H__
 
+#include <float.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -40,28 +42,116 @@ typedef struct {
 	double z;
 } quaternion;
 
-int quaternion_isnonzero(quaternion q);
-int quaternion_isnan(quaternion q);
-int quaternion_isinf(quaternion q);
-int quaternion_isfinite(quaternion q);
-double quaternion_absolute(quaternion q);
-quaternion quaternion_add(quaternion q1, quaternion q2);
-quaternion quaternion_subtract(quaternion q1, quaternion q2);
-quaternion quaternion_multiply(quaternion q1, quaternion q2);
-quaternion quaternion_divide(quaternion q1, quaternion q2);
-quaternion quaternion_multiply_scalar(quaternion q, double s);
-quaternion quaternion_divide_scalar(quaternion q, double s);
-quaternion quaternion_log(quaternion q);
-quaternion quaternion_exp(quaternion q);
-quaternion quaternion_power(quaternion q, quaternion p);
-quaternion quaternion_power_scalar(quaternion q, double p);
-quaternion quaternion_negative(quaternion q);
-quaternion quaternion_conjugate(quaternion q);
-quaternion quaternion_copysign(quaternion q1, quaternion q2);
-int quaternion_equal(quaternion q1, quaternion q2);
-int quaternion_not_equal(quaternion q1, quaternion q2);
-int quaternion_less(quaternion q1, quaternion q2);
-int quaternion_less_equal(quaternion q1, quaternion q2);
+/* Single precision quaternions, for the quaternion32 dtype */
+typedef struct {
+	float w;
+	float x;
+	float y;
+	float z;
+} quaternion32;
+
+/* Dual quaternions r + e d, with e**2 = 0, for the dual_quaternion dtype */
+typedef struct {
+	quaternion r;
+	quaternion d;
+} dual_quaternion;
+
+/*
+ * The arithmetic functions exist for each precision, with the names
+ * quaternion_* and quaternion32_*; they are defined by quaternion_template.h.
+ * isunit accepts squared norms within the unit tolerance of 1.  A file which
+ * defines QUATERNION_INLINE before including this header gets them as static
+ * inline functions, which the compiler can inline into its loops, instead of
+ * calls to those compiled in quaternion.c.
+ */
+#define QUATERNION_UNIT_TOLERANCE (1024*DBL_EPSILON)
+#define QUATERNION32_UNIT_TOLERANCE (1024*FLT_EPSILON)
+
+#define QUATERNION_DECLARE(Q, T) \
+int Q##_isnonzero(Q q); \
+int Q##_isnan(Q q); \
+int Q##_isinf(Q q); \
+int Q##_isfinite(Q q); \
+T Q##_absolute(Q q); \
+T Q##_inner(Q q1, Q q2); \
+T Q##_norm(Q q); \
+int Q##_isunit(Q q); \
+Q Q##_normalized(Q q); \
+Q Q##_inverse(Q q); \
+Q Q##_add(Q q1, Q q2); \
+Q Q##_subtract(Q q1, Q q2); \
+Q Q##_multiply(Q q1, Q q2); \
+Q Q##_divide(Q q1, Q q2); \
+Q Q##_unit_multiply(Q q1, Q q2); \
+Q Q##_multiply_scalar(Q q, T s); \
+Q Q##_divide_scalar(Q q, T s); \
+Q Q##_add_scalar(Q q, T s); \
+Q Q##_subtract_scalar(Q q, T s); \
+Q Q##_rsubtract_scalar(Q q, T s); \
+Q Q##_rdivide_scalar(Q q, T s); \
+Q Q##_log(Q q); \
+Q Q##_exp(Q q); \
+Q Q##_power(Q q, Q p); \
+Q Q##_power_scalar(Q q, T p); \
+Q Q##_negative(Q q); \
+Q Q##_conjugate(Q q); \
+Q Q##_copysign(Q q1, Q q2); \
+int Q##_equal(Q q1, Q q2); \
+int Q##_not_equal(Q q1, Q q2); \
+int Q##_less(Q q1, Q q2); \
+int Q##_less_equal(Q q1, Q q2);
+
+#ifdef QUATERNION_INLINE
+#include <math.h>
+
+#define Q quaternion
+#define T double
+#define F(name) quaternion_##name
+#define M(name) name
+#define L(name) DBL_##name
+#define E QUATERNION_UNIT_TOLERANCE
+#define S static inline
+#include "quaternion_template.h"
+
+#define Q quaternion32
+#define T float
+#define F(name) quaternion32_##name
+#define M(name) name##f
+#define L(name) FLT_##name
+#define E QUATERNION32_UNIT_TOLERANCE
+#define S static inline
+#include "quaternion_template.h"
+#else
+QUATERNION_DECLARE(quaternion, double)
+QUATERNION_DECLARE(quaternion32, float)
+#endif
+
+void quaternion_rotate_vector(quaternion q, const double *v, double *out);
+void quaternion_rotation_matrix(quaternion q, double *m);
+quaternion quaternion_from_rotation_matrix(const double *m);
+void quaternion_rotation_vector(quaternion q, double *v);
+quaternion quaternion_from_rotation_vector(const double *v);
+void quaternion_euler_angles(quaternion q, double *angles);
+quaternion quaternion_from_euler_angles(const double *angles);
+quaternion quaternion_slerp(quaternion q0, quaternion q1, double t);
+quaternion quaternion_squad(quaternion q0, quaternion q1, quaternion s0, quaternion s1, double t);
+double quaternion_chordal_distance(quaternion q1, quaternion q2);
+double quaternion_intrinsic_distance(quaternion q1, quaternion q2);
+double quaternion_rotation_distance(quaternion q1, quaternion q2);
+
+int dual_quaternion_isnonzero(dual_quaternion a);
+int dual_quaternion_isnan(dual_quaternion a);
+int dual_quaternion_isinf(dual_quaternion a);
+int dual_quaternion_isfinite(dual_quaternion a);
+int dual_quaternion_equal(dual_quaternion a, dual_quaternion b);
+int dual_quaternion_not_equal(dual_quaternion a, dual_quaternion b);
+dual_quaternion dual_quaternion_multiply(dual_quaternion a, dual_quaternion b);
+dual_quaternion dual_quaternion_conjugate(dual_quaternion a);
+dual_quaternion dual_quaternion_normalized(dual_quaternion a);
+dual_quaternion dual_quaternion_from_rigid_transform(quaternion q, const double *t);
+quaternion dual_quaternion_rigid_transform(dual_quaternion a, double *t);
+void dual_quaternion_transform_point(dual_quaternion a, const double *v, double *out);
+dual_quaternion dual_quaternion_sclerp(dual_quaternion a, dual_quaternion b, double t);
 
 #ifdef __cplusplus
 }
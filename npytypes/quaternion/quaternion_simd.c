@@ -0,0 +1,2473 @@
+/*
+ * Vectorized quaternion array kernels
+ *
+ * The AVX2 kernels transpose four quaternions at a time into w, x, y and z
+ * vectors; the AVX-512 kernels keep one quaternion per 256 bit lane and use
+ * in-lane permutes.  Both evaluate every component with the same sequence of
+ * fused multiply-adds, so they give identical results, and partial blocks at
+ * the end are handled by the same code so results don't depend on position.
+ * They may differ from the portable kernels in the last bit.  The matrix
+ * product kernels take their blocks already split into planes of w, x, y and
+ * z components, so need no transposes.  exp, log and power, slerp, vector
+ * rotation, distances, moments, casts, adding and subtracting reals, dividing
+ * reals by quaternions, norms, inverses and normalizing, and the single
+ * precision (quaternion32) and dual quaternion kernels have only AVX2
+ * versions, which the AVX-512 level uses as well.
+ */
+#include <math.h>
+#include <string.h>
+/* Inline the quaternion arithmetic into the portable kernels */
+#define QUATERNION_INLINE
+#include "quaternion_simd.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define QUATERNION_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Portable kernels */
+
+#define GENERIC_KERNEL(name, b_type)\
+static void \
+name##_generic(quaternion *out, const quaternion *a, int sa,\
+      const b_type *b, int sb, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++, a += sa, b += sb) {\
+      out[i] = quaternion_##name(*a, *b);\
+   }\
+}
+
+GENERIC_KERNEL(add, quaternion)
+GENERIC_KERNEL(subtract, quaternion)
+GENERIC_KERNEL(multiply, quaternion)
+GENERIC_KERNEL(divide, quaternion)
+GENERIC_KERNEL(multiply_scalar, double)
+GENERIC_KERNEL(divide_scalar, double)
+GENERIC_KERNEL(add_scalar, double)
+GENERIC_KERNEL(subtract_scalar, double)
+GENERIC_KERNEL(rsubtract_scalar, double)
+GENERIC_KERNEL(rdivide_scalar, double)
+GENERIC_KERNEL(power, quaternion)
+GENERIC_KERNEL(power_scalar, double)
+GENERIC_KERNEL(unit_multiply, quaternion)
+
+#define GENERIC_UNARY_KERNEL(name)\
+static void \
+name##_generic(quaternion *out, const quaternion *a, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++) {\
+      out[i] = quaternion_##name(a[i]);\
+   }\
+}
+
+GENERIC_UNARY_KERNEL(exp)
+GENERIC_UNARY_KERNEL(log)
+GENERIC_UNARY_KERNEL(normalized)
+GENERIC_UNARY_KERNEL(inverse)
+
+#define GENERIC_KERNEL32(name, b_type)\
+static void \
+name##32_generic(quaternion32 *out, const quaternion32 *a, int sa,\
+      const b_type *b, int sb, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++, a += sa, b += sb) {\
+      out[i] = quaternion32_##name(*a, *b);\
+   }\
+}
+
+GENERIC_KERNEL32(add, quaternion32)
+GENERIC_KERNEL32(subtract, quaternion32)
+GENERIC_KERNEL32(multiply, quaternion32)
+GENERIC_KERNEL32(divide, quaternion32)
+GENERIC_KERNEL32(multiply_scalar, float)
+GENERIC_KERNEL32(divide_scalar, float)
+GENERIC_KERNEL32(add_scalar, float)
+GENERIC_KERNEL32(subtract_scalar, float)
+GENERIC_KERNEL32(rsubtract_scalar, float)
+GENERIC_KERNEL32(rdivide_scalar, float)
+GENERIC_KERNEL32(unit_multiply, quaternion32)
+
+#define GENERIC_UNARY_KERNEL32(name)\
+static void \
+name##32_generic(quaternion32 *out, const quaternion32 *a, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++) {\
+      out[i] = quaternion32_##name(a[i]);\
+   }\
+}
+
+GENERIC_UNARY_KERNEL32(normalized)
+GENERIC_UNARY_KERNEL32(inverse)
+
+#define GENERIC_NORM_KERNEL(Q, T, suffix)\
+static void \
+norm##suffix##_generic(T *out, const Q *a, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++) {\
+      out[i] = Q##_norm(a[i]);\
+   }\
+}
+
+GENERIC_NORM_KERNEL(quaternion, double, )
+GENERIC_NORM_KERNEL(quaternion32, float, 32)
+
+/* Casts from and to m = 1 (real) or 2 (complex) components */
+#define GENERIC_CAST_KERNELS(Q, T, suffix)\
+static void \
+from_real##suffix##_generic(Q *out, const T *a, int m, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++, a += m) {\
+      out[i] = (Q) {a[0], m > 1 ? a[1] : 0, 0, 0};\
+   }\
+}\
+\
+static void \
+to_real##suffix##_generic(T *out, const Q *q, int m, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i++, out += m) {\
+      out[0] = q[i].w;\
+      if (m > 1) {\
+         out[1] = q[i].x;\
+      }\
+   }\
+}
+
+GENERIC_CAST_KERNELS(quaternion, double, )
+GENERIC_CAST_KERNELS(quaternion32, float, 32)
+
+/* m v for a row-major 3x3 matrix m */
+static void
+matrix_vector(const double *m, const double *v, double *out)
+{
+   double x = m[0]*v[0] + m[1]*v[1] + m[2]*v[2];
+   double y = m[3]*v[0] + m[4]*v[1] + m[5]*v[2];
+   double z = m[6]*v[0] + m[7]*v[1] + m[8]*v[2];
+   out[0] = x;
+   out[1] = y;
+   out[2] = z;
+}
+
+static void
+slerp_generic(quaternion *out, const quaternion *a, int sa, const quaternion *b, int sb,
+      const double *t, int st, size_t n)
+{
+   size_t i;
+   for (i = 0; i < n; i++, a += sa, b += sb, t += st) {
+      out[i] = quaternion_slerp(*a, *b, *t);
+   }
+}
+
+static void
+rotate_generic(double *out, const quaternion *q, int sq, const double *v, size_t n)
+{
+   size_t i;
+   if (!sq) {
+      double m[9];
+      quaternion_rotation_matrix(*q, m);
+      for (i = 0; i < n; i++) {
+         matrix_vector(m, v + 3*i, out + 3*i);
+      }
+      return;
+   }
+   for (i = 0; i < n; i++) {
+      quaternion_rotate_vector(q[i], v + 3*i, out + 3*i);
+   }
+}
+
+/* Each component sums its terms in the order of hamilton4, onto c */
+static void
+matmul_generic(double *c, const quaternion *a, size_t kb, const double *b, size_t p)
+{
+   size_t j, k;
+   for (k = 0; k < kb; k++, b += 4*p) {
+      const quaternion q = a[k];
+      for (j = 0; j < p; j++) {
+         double w = b[j], x = b[p + j], y = b[2*p + j], z = b[3*p + j];
+         c[j] = c[j] + q.w*w - q.x*x - q.y*y - q.z*z;
+         c[p + j] = c[p + j] + q.w*x + q.x*w + q.y*z - q.z*y;
+         c[2*p + j] = c[2*p + j] + q.w*y - q.x*z + q.y*w + q.z*x;
+         c[3*p + j] = c[3*p + j] + q.w*z + q.x*y - q.y*x + q.z*w;
+      }
+   }
+}
+
+/* As quaternion_rotation_distance, 4 atan2(|q - b|, |q + b|) for the nearer b */
+static void
+distance_generic(double *out, quaternion q, const double *b, size_t stride, size_t p)
+{
+   size_t j;
+   for (j = 0; j < p; j++) {
+      double bw = b[j], bx = b[stride + j], by = b[2*stride + j], bz = b[3*stride + j];
+      double dw = q.w - bw, dx = q.x - bx, dy = q.y - by, dz = q.z - bz;
+      double sw = q.w + bw, sx = q.x + bx, sy = q.y + by, sz = q.z + bz;
+      double d2 = dw*dw + dx*dx + dy*dy + dz*dz, s2 = sw*sw + sx*sx + sy*sy + sz*sz;
+      out[j] = 2*(2*atan2(sqrt(fmin(d2, s2)), sqrt(fmax(d2, s2))));
+   }
+}
+
+/*
+ * Each of the 16 sums in order; m is symmetric, so m[4*k + l] == m[4*l + k].
+ * Zero quaternions, which have no direction, add nothing.
+ */
+static void
+moment_generic(double *m, const quaternion *q, const double *w, int sw, size_t n)
+{
+   size_t i;
+   int k, l;
+   for (i = 0; i < n; i++) {
+      double v[4] = {q[i].w, q[i].x, q[i].y, q[i].z};
+      double n2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2] + v[3]*v[3];
+      double s = n2 != 0 ? w[sw*i]/n2 : 0;
+      for (k = 0; k < 4; k++) {
+         for (l = 0; l < 4; l++) {
+            m[4*k + l] += s*v[k]*v[l];
+         }
+      }
+   }
+}
+
+static void
+dual_multiply_generic(dual_quaternion *out, const dual_quaternion *a, int sa,
+      const dual_quaternion *b, int sb, size_t n)
+{
+   size_t i;
+   for (i = 0; i < n; i++, a += sa, b += sb) {
+      out[i] = dual_quaternion_multiply(*a, *b);
+   }
+}
+
+static void
+dual_transform_generic(double *out, const dual_quaternion *q, int sq, const double *v,
+      size_t n)
+{
+   size_t i;
+   if (!sq) {
+      double m[9], t[3];
+      quaternion_rotation_matrix(dual_quaternion_rigid_transform(*q, t), m);
+      for (i = 0; i < n; i++) {
+         matrix_vector(m, v + 3*i, out + 3*i);
+         out[3*i] += t[0];
+         out[3*i + 1] += t[1];
+         out[3*i + 2] += t[2];
+      }
+      return;
+   }
+   for (i = 0; i < n; i++) {
+      dual_quaternion_transform_point(q[i], v + 3*i, out + 3*i);
+   }
+}
+
+quaternion_binary_kernel *quaternion_add_kernel = add_generic;
+quaternion_binary_kernel *quaternion_subtract_kernel = subtract_generic;
+quaternion_binary_kernel *quaternion_multiply_kernel = multiply_generic;
+quaternion_binary_kernel *quaternion_divide_kernel = divide_generic;
+quaternion_scalar_kernel *quaternion_multiply_scalar_kernel = multiply_scalar_generic;
+quaternion_scalar_kernel *quaternion_divide_scalar_kernel = divide_scalar_generic;
+quaternion_scalar_kernel *quaternion_add_scalar_kernel = add_scalar_generic;
+quaternion_scalar_kernel *quaternion_subtract_scalar_kernel = subtract_scalar_generic;
+quaternion_scalar_kernel *quaternion_rsubtract_scalar_kernel = rsubtract_scalar_generic;
+quaternion_scalar_kernel *quaternion_rdivide_scalar_kernel = rdivide_scalar_generic;
+quaternion_binary_kernel *quaternion_power_kernel = power_generic;
+quaternion_scalar_kernel *quaternion_power_scalar_kernel = power_scalar_generic;
+quaternion_unary_kernel *quaternion_exp_kernel = exp_generic;
+quaternion_unary_kernel *quaternion_log_kernel = log_generic;
+quaternion_unary_kernel *quaternion_normalized_kernel = normalized_generic;
+quaternion_unary_kernel *quaternion_inverse_kernel = inverse_generic;
+quaternion_real_kernel *quaternion_norm_kernel = norm_generic;
+quaternion_binary_kernel *quaternion_unit_multiply_kernel = unit_multiply_generic;
+quaternion_vector_kernel *quaternion_rotate_kernel = rotate_generic;
+quaternion_interpolate_kernel *quaternion_slerp_kernel = slerp_generic;
+quaternion_panel_kernel *quaternion_matmul_kernel = matmul_generic;
+quaternion_plane_kernel *quaternion_distance_kernel = distance_generic;
+quaternion_outer_kernel *quaternion_moment_kernel = moment_generic;
+quaternion32_binary_kernel *quaternion32_add_kernel = add32_generic;
+quaternion32_binary_kernel *quaternion32_subtract_kernel = subtract32_generic;
+quaternion32_binary_kernel *quaternion32_multiply_kernel = multiply32_generic;
+quaternion32_binary_kernel *quaternion32_divide_kernel = divide32_generic;
+quaternion32_scalar_kernel *quaternion32_multiply_scalar_kernel = multiply_scalar32_generic;
+quaternion32_scalar_kernel *quaternion32_divide_scalar_kernel = divide_scalar32_generic;
+quaternion32_scalar_kernel *quaternion32_add_scalar_kernel = add_scalar32_generic;
+quaternion32_scalar_kernel *quaternion32_subtract_scalar_kernel = subtract_scalar32_generic;
+quaternion32_scalar_kernel *quaternion32_rsubtract_scalar_kernel = rsubtract_scalar32_generic;
+quaternion32_scalar_kernel *quaternion32_rdivide_scalar_kernel = rdivide_scalar32_generic;
+quaternion_pack_kernel *quaternion_from_real_kernel = from_real_generic;
+quaternion_unpack_kernel *quaternion_to_real_kernel = to_real_generic;
+quaternion32_unary_kernel *quaternion32_normalized_kernel = normalized32_generic;
+quaternion32_unary_kernel *quaternion32_inverse_kernel = inverse32_generic;
+quaternion32_real_kernel *quaternion32_norm_kernel = norm32_generic;
+quaternion32_binary_kernel *quaternion32_unit_multiply_kernel = unit_multiply32_generic;
+quaternion32_pack_kernel *quaternion32_from_real_kernel = from_real32_generic;
+quaternion32_unpack_kernel *quaternion32_to_real_kernel = to_real32_generic;
+dual_quaternion_binary_kernel *dual_quaternion_multiply_kernel = dual_multiply_generic;
+dual_quaternion_vector_kernel *dual_quaternion_transform_kernel = dual_transform_generic;
+
+#ifdef QUATERNION_SIMD_X86
+
+/* AVX2 kernels */
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+/*
+ * The portable kernels, for the rare blocks the vector code declines, called
+ * out of line so that they don't crowd the vector loops' registers
+ */
+#define COLD __attribute__((noinline, cold))
+
+static COLD void
+portable_normalized(quaternion *q, size_t n)
+{
+   normalized_generic(q, q, n);
+}
+
+static COLD void
+portable_unit_multiply(quaternion *out, const quaternion *a, int sa,
+      const quaternion *b, int sb, size_t n)
+{
+   unit_multiply_generic(out, a, sa, b, sb, n);
+}
+
+static COLD void
+portable_normalized32(quaternion32 *q, size_t n)
+{
+   normalized32_generic(q, q, n);
+}
+
+static COLD void
+portable_unit_multiply32(quaternion32 *out, const quaternion32 *a, int sa,
+      const quaternion32 *b, int sb, size_t n)
+{
+   unit_multiply32_generic(out, a, sa, b, sb, n);
+}
+
+/* Transpose four quaternions held in r[0..3] into w, x, y, z vectors, or back */
+static AVX2 inline void
+transpose4(__m256d r[4])
+{
+   __m256d t0 = _mm256_unpacklo_pd(r[0], r[1]), t1 = _mm256_unpackhi_pd(r[0], r[1]);
+   __m256d t2 = _mm256_unpacklo_pd(r[2], r[3]), t3 = _mm256_unpackhi_pd(r[2], r[3]);
+   r[0] = _mm256_permute2f128_pd(t0, t2, 0x20);
+   r[1] = _mm256_permute2f128_pd(t1, t3, 0x20);
+   r[2] = _mm256_permute2f128_pd(t0, t2, 0x31);
+   r[3] = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+/* Load q[0..3] as w, x, y, z vectors, or q[0] four times if s is zero */
+static AVX2 inline void
+load4(const quaternion *q, int s, __m256d v[4])
+{
+   if (s) {
+      v[0] = _mm256_loadu_pd(&q[0].w);
+      v[1] = _mm256_loadu_pd(&q[1].w);
+      v[2] = _mm256_loadu_pd(&q[2].w);
+      v[3] = _mm256_loadu_pd(&q[3].w);
+      transpose4(v);
+   }
+   else {
+      v[0] = _mm256_set1_pd(q->w);
+      v[1] = _mm256_set1_pd(q->x);
+      v[2] = _mm256_set1_pd(q->y);
+      v[3] = _mm256_set1_pd(q->z);
+   }
+}
+
+static AVX2 inline void
+store4(quaternion *q, __m256d v[4])
+{
+   transpose4(v);
+   _mm256_storeu_pd(&q[0].w, v[0]);
+   _mm256_storeu_pd(&q[1].w, v[1]);
+   _mm256_storeu_pd(&q[2].w, v[2]);
+   _mm256_storeu_pd(&q[3].w, v[3]);
+}
+
+/* Hamilton product, accumulating the terms of each component in order */
+static AVX2 inline void
+hamilton4(const __m256d a[4], const __m256d b[4], __m256d r[4])
+{
+   r[0] = _mm256_fnmadd_pd(a[3], b[3], _mm256_fnmadd_pd(a[2], b[2],
+         _mm256_fnmadd_pd(a[1], b[1], _mm256_mul_pd(a[0], b[0]))));
+   r[1] = _mm256_fnmadd_pd(a[3], b[2], _mm256_fmadd_pd(a[2], b[3],
+         _mm256_fmadd_pd(a[1], b[0], _mm256_mul_pd(a[0], b[1]))));
+   r[2] = _mm256_fmadd_pd(a[3], b[1], _mm256_fmadd_pd(a[2], b[0],
+         _mm256_fnmadd_pd(a[1], b[3], _mm256_mul_pd(a[0], b[2]))));
+   r[3] = _mm256_fmadd_pd(a[3], b[0], _mm256_fnmadd_pd(a[2], b[1],
+         _mm256_fmadd_pd(a[1], b[2], _mm256_mul_pd(a[0], b[3]))));
+}
+
+static AVX2 inline void
+multiply4(const __m256d a[4], const __m256d b[4], __m256d r[4])
+{
+   hamilton4(a, b, r);
+}
+
+/* conj(b)*a/|b|**2, matching quaternion_divide */
+static AVX2 inline void
+divide4(const __m256d a[4], const __m256d b[4], __m256d r[4])
+{
+   const __m256d sign = _mm256_set1_pd(-0.0);
+   __m256d c[4], s;
+   int k;
+   c[0] = b[0];
+   c[1] = _mm256_xor_pd(b[1], sign);
+   c[2] = _mm256_xor_pd(b[2], sign);
+   c[3] = _mm256_xor_pd(b[3], sign);
+   hamilton4(c, a, r);
+   s = _mm256_fmadd_pd(b[3], b[3], _mm256_fmadd_pd(b[2], b[2],
+         _mm256_fmadd_pd(b[1], b[1], _mm256_mul_pd(b[0], b[0]))));
+   for (k = 0; k < 4; k++) {
+      r[k] = _mm256_div_pd(r[k], s);
+   }
+}
+
+/*
+ * Four quaternions per step.  The last partial block is padded with copies of
+ * its final element, so no lane sees values which could raise spurious
+ * floating point exceptions.
+ */
+#define AVX2_PRODUCT_KERNEL(name)\
+static AVX2 void \
+name##_avx2(quaternion *out, const quaternion *a, int sa,\
+      const quaternion *b, int sb, size_t n)\
+{\
+   __m256d va[4], vb[4], r[4];\
+   size_t i = 0;\
+   for (; i + 4 <= n; i += 4) {\
+      load4(a + sa*i, sa, va);\
+      load4(b + sb*i, sb, vb);\
+      name##4(va, vb, r);\
+      store4(out + i, r);\
+   }\
+   if (i < n) {\
+      quaternion ta[4], tb[4], to[4];\
+      size_t k, m = n - i;\
+      for (k = 0; k < 4; k++) {\
+         ta[k] = a[sa*(i + (k < m ? k : m - 1))];\
+         tb[k] = b[sb*(i + (k < m ? k : m - 1))];\
+      }\
+      load4(ta, 1, va);\
+      load4(tb, 1, vb);\
+      name##4(va, vb, r);\
+      store4(to, r);\
+      memcpy(out + i, to, m*sizeof(quaternion));\
+   }\
+}
+
+AVX2_PRODUCT_KERNEL(multiply)
+AVX2_PRODUCT_KERNEL(divide)
+
+/* s/|q|**2 conj(q), matching quaternion_rdivide_scalar, blocked as above */
+static AVX2 inline void
+rdivide_scalar4(__m256d q[4], __m256d s)
+{
+   __m256d k = _mm256_div_pd(s, _mm256_fmadd_pd(q[3], q[3], _mm256_fmadd_pd(q[2], q[2],
+         _mm256_fmadd_pd(q[1], q[1], _mm256_mul_pd(q[0], q[0])))));
+   __m256d t = _mm256_xor_pd(k, _mm256_set1_pd(-0.0));
+   q[0] = _mm256_mul_pd(k, q[0]);
+   q[1] = _mm256_mul_pd(t, q[1]);
+   q[2] = _mm256_mul_pd(t, q[2]);
+   q[3] = _mm256_mul_pd(t, q[3]);
+}
+
+static AVX2 void
+rdivide_scalar_avx2(quaternion *out, const quaternion *a, int sa,
+      const double *b, int sb, size_t n)
+{
+   __m256d va[4];
+   size_t i = 0;
+   for (; i + 4 <= n; i += 4) {
+      load4(a + sa*i, sa, va);
+      rdivide_scalar4(va, sb ? _mm256_loadu_pd(b + i) : _mm256_broadcast_sd(b));
+      store4(out + i, va);
+   }
+   if (i < n) {
+      quaternion ta[4], to[4];
+      double tb[4];
+      size_t k, m = n - i;
+      for (k = 0; k < 4; k++) {
+         ta[k] = a[sa*(i + (k < m ? k : m - 1))];
+         tb[k] = b[sb*(i + (k < m ? k : m - 1))];
+      }
+      load4(ta, 1, va);
+      rdivide_scalar4(va, _mm256_loadu_pd(tb));
+      store4(to, va);
+      memcpy(out + i, to, m*sizeof(quaternion));
+   }
+}
+
+/*
+ * Normalizing, four quaternions at a time.  The exact versions divide by
+ * sqrt(|q|**2) as quaternion_normalized does.  The fast ones multiply by an
+ * approximate 1/sqrt(|q|**2): the single precision estimate, good to 12 bits,
+ * refined by three Newton steps, each of which doubles the bits correct.  A
+ * block with a component whose square could leave the normal range, of double
+ * for the exact versions and of float for the fast ones, or with zero, inf or
+ * nan, goes to the portable functions, which scale q down first.
+ */
+static AVX2 inline __m256d
+norm4(const __m256d q[4])
+{
+   return _mm256_fmadd_pd(q[3], q[3], _mm256_fmadd_pd(q[2], q[2],
+         _mm256_fmadd_pd(q[1], q[1], _mm256_mul_pd(q[0], q[0]))));
+}
+
+/* The largest absolute component of each of the four quaternions */
+static AVX2 inline __m256d
+maxabs4(const __m256d q[4])
+{
+   const __m256d sign = _mm256_set1_pd(-0.0);
+   return _mm256_max_pd(
+         _mm256_max_pd(_mm256_andnot_pd(sign, q[0]), _mm256_andnot_pd(sign, q[1])),
+         _mm256_max_pd(_mm256_andnot_pd(sign, q[2]), _mm256_andnot_pd(sign, q[3])));
+}
+
+/* Whether all four of min are at least lo and all four of max at most hi */
+static AVX2 inline int
+inrange4(__m256d min, __m256d max, double lo, double hi)
+{
+   return _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(min, _mm256_set1_pd(lo), _CMP_GE_OQ),
+         _mm256_cmp_pd(max, _mm256_set1_pd(hi), _CMP_LE_OQ))) == 0xf;
+}
+
+/* q/|q|, and its fast version, for q whose squares stay in the normal range */
+static AVX2 inline void
+unit4(__m256d q[4])
+{
+   __m256d s = _mm256_sqrt_pd(norm4(q));
+   int k;
+   for (k = 0; k < 4; k++) {
+      q[k] = _mm256_div_pd(q[k], s);
+   }
+}
+
+static AVX2 inline void
+fast_unit4(__m256d q[4])
+{
+   const __m256d three_halves = _mm256_set1_pd(1.5);
+   __m256d n = norm4(q), h, y;
+   int k;
+   h = _mm256_mul_pd(n, _mm256_set1_pd(0.5));
+   y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(n)));
+   for (k = 0; k < 3; k++) {
+      y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(h, y), y, three_halves));
+   }
+   for (k = 0; k < 4; k++) {
+      q[k] = _mm256_mul_pd(q[k], y);
+   }
+}
+
+static AVX2 inline void
+normalized4(__m256d q[4])
+{
+   __m256d m = maxabs4(q);
+   if (!inrange4(m, m, 0x1p-511, 0x1p510)) {
+      quaternion t[4];
+      store4(t, q);
+      portable_normalized(t, 4);
+      load4(t, 1, q);
+      return;
+   }
+   unit4(q);
+}
+
+static AVX2 inline void
+fast_normalized4(__m256d q[4])
+{
+   __m256d m = maxabs4(q);
+   if (!inrange4(m, m, 0x1p-63, 0x1p62)) {
+      quaternion t[4];
+      store4(t, q);
+      portable_normalized(t, 4);
+      load4(t, 1, q);
+      return;
+   }
+   fast_unit4(q);
+}
+
+static AVX2 inline void
+inverse4(__m256d q[4])
+{
+   rdivide_scalar4(q, _mm256_set1_pd(1));
+}
+
+/*
+ * The unit product r of a and b, returning 0, or 1 without computing it if a
+ * or b is so large or small that the squares of the product could leave the
+ * normal range, of double or, for the fast version, of float
+ */
+static AVX2 inline int
+unit_multiply4(const __m256d a[4], const __m256d b[4], __m256d r[4])
+{
+   __m256d ma = maxabs4(a), mb = maxabs4(b);
+   if (!inrange4(_mm256_min_pd(ma, mb), _mm256_max_pd(ma, mb), 0x1p-255, 0x1p253)) {
+      return 1;
+   }
+   hamilton4(a, b, r);
+   unit4(r);
+   return 0;
+}
+
+static AVX2 inline int
+fast_unit_multiply4(const __m256d a[4], const __m256d b[4], __m256d r[4])
+{
+   __m256d ma = maxabs4(a), mb = maxabs4(b);
+   if (!inrange4(_mm256_min_pd(ma, mb), _mm256_max_pd(ma, mb), 0x1p-31, 0x1p29)) {
+      return 1;
+   }
+   hamilton4(a, b, r);
+   fast_unit4(r);
+   return 0;
+}
+
+/*
+ * As AVX2_PRODUCT_KERNEL, with blocks the vector code declines computed by
+ * quaternion_unit_multiply, which scales them first.  Keeping the fallback in
+ * the kernel rather than in unit_multiply4 keeps the blocks in registers.
+ */
+#define AVX2_UNIT_PRODUCT_KERNEL(name)\
+static AVX2 void \
+name##_avx2(quaternion *out, const quaternion *a, int sa,\
+      const quaternion *b, int sb, size_t n)\
+{\
+   __m256d va[4], vb[4], r[4];\
+   quaternion ta[4], tb[4], to[4];\
+   size_t i = 0, k, m;\
+   for (; i + 4 <= n; i += 4) {\
+      load4(a + sa*i, sa, va);\
+      load4(b + sb*i, sb, vb);\
+      if (!name##4(va, vb, r)) {\
+         store4(out + i, r);\
+         continue;\
+      }\
+      portable_unit_multiply(to, a + sa*i, sa, b + sb*i, sb, 4);\
+      memcpy(out + i, to, sizeof(to));\
+   }\
+   if (i < n) {\
+      m = n - i;\
+      for (k = 0; k < 4; k++) {\
+         ta[k] = a[sa*(i + (k < m ? k : m - 1))];\
+         tb[k] = b[sb*(i + (k < m ? k : m - 1))];\
+      }\
+      load4(ta, 1, va);\
+      load4(tb, 1, vb);\
+      if (!name##4(va, vb, r)) {\
+         store4(to, r);\
+      }\
+      else {\
+         portable_unit_multiply(to, ta, 1, tb, 1, m);\
+      }\
+      memcpy(out + i, to, m*sizeof(quaternion));\
+   }\
+}
+
+AVX2_UNIT_PRODUCT_KERNEL(unit_multiply)
+AVX2_UNIT_PRODUCT_KERNEL(fast_unit_multiply)
+
+/* Unary kernels, blocked as the products */
+#define AVX2_UNARY_KERNEL(name)\
+static AVX2 void \
+name##_avx2(quaternion *out, const quaternion *a, size_t n)\
+{\
+   __m256d v[4];\
+   size_t i = 0;\
+   for (; i + 4 <= n; i += 4) {\
+      load4(a + i, 1, v);\
+      name##4(v);\
+      store4(out + i, v);\
+   }\
+   if (i < n) {\
+      quaternion t[4];\
+      size_t k, m = n - i;\
+      for (k = 0; k < 4; k++) {\
+         t[k] = a[i + (k < m ? k : m - 1)];\
+      }\
+      load4(t, 1, v);\
+      name##4(v);\
+      store4(t, v);\
+      memcpy(out + i, t, m*sizeof(quaternion));\
+   }\
+}
+
+AVX2_UNARY_KERNEL(normalized)
+AVX2_UNARY_KERNEL(fast_normalized)
+AVX2_UNARY_KERNEL(inverse)
+
+static AVX2 void
+norm_avx2(double *out, const quaternion *a, size_t n)
+{
+   __m256d v[4];
+   size_t i = 0;
+   for (; i + 4 <= n; i += 4) {
+      load4(a + i, 1, v);
+      _mm256_storeu_pd(out + i, norm4(v));
+   }
+   if (i < n) {
+      quaternion t[4];
+      double r[4];
+      size_t k, m = n - i;
+      for (k = 0; k < 4; k++) {
+         t[k] = a[i + (k < m ? k : m - 1)];
+      }
+      load4(t, 1, v);
+      _mm256_storeu_pd(r, norm4(v));
+      memcpy(out + i, r, m*sizeof(double));
+   }
+}
+
+/* Componentwise kernels, one quaternion per vector, a broadcast b loaded once */
+#define AVX2_COMPONENT_KERNEL(name, b_type, load_b, op)\
+static AVX2 void \
+name##_avx2(quaternion *out, const quaternion *a, int sa,\
+      const b_type *b, int sb, size_t n)\
+{\
+   size_t i;\
+   if (!sb) {\
+      const __m256d vb = load_b(b);\
+      for (i = 0; i < n; i++) {\
+         _mm256_storeu_pd(&out[i].w, op(_mm256_loadu_pd(&a[sa*i].w), vb));\
+      }\
+      return;\
+   }\
+   for (i = 0; i < n; i++) {\
+      __m256d va = _mm256_loadu_pd(&a[sa*i].w);\
+      __m256d vb = load_b(b + sb*i);\
+      _mm256_storeu_pd(&out[i].w, op(va, vb));\
+   }\
+}
+
+#define AVX2_LOAD_QUATERNION(q) _mm256_loadu_pd(&(q)->w)
+#define AVX2_LOAD_SCALAR(s) _mm256_broadcast_sd(s)
+
+AVX2_COMPONENT_KERNEL(add, quaternion, AVX2_LOAD_QUATERNION, _mm256_add_pd)
+AVX2_COMPONENT_KERNEL(subtract, quaternion, AVX2_LOAD_QUATERNION, _mm256_sub_pd)
+AVX2_COMPONENT_KERNEL(multiply_scalar, double, AVX2_LOAD_SCALAR, _mm256_mul_pd)
+AVX2_COMPONENT_KERNEL(divide_scalar, double, AVX2_LOAD_SCALAR, _mm256_div_pd)
+
+/* q + s, q - s and s - q for a quaternion vector q and a broadcast real s */
+static AVX2 inline __m256d
+add_real(__m256d q, __m256d s)
+{
+   return _mm256_blend_pd(q, _mm256_add_pd(q, s), 1);
+}
+
+static AVX2 inline __m256d
+subtract_real(__m256d q, __m256d s)
+{
+   return _mm256_blend_pd(q, _mm256_sub_pd(q, s), 1);
+}
+
+static AVX2 inline __m256d
+rsubtract_real(__m256d q, __m256d s)
+{
+   return _mm256_blend_pd(_mm256_xor_pd(q, _mm256_set1_pd(-0.0)), _mm256_sub_pd(s, q), 1);
+}
+
+AVX2_COMPONENT_KERNEL(add_scalar, double, AVX2_LOAD_SCALAR, add_real)
+AVX2_COMPONENT_KERNEL(subtract_scalar, double, AVX2_LOAD_SCALAR, subtract_real)
+AVX2_COMPONENT_KERNEL(rsubtract_scalar, double, AVX2_LOAD_SCALAR, rsubtract_real)
+
+/* r += a b, the terms added to r in the order of hamilton4 */
+static AVX2 inline void
+multiply_add4(const __m256d a[4], const __m256d b[4], __m256d r[4])
+{
+   r[0] = _mm256_fnmadd_pd(a[3], b[3], _mm256_fnmadd_pd(a[2], b[2],
+         _mm256_fnmadd_pd(a[1], b[1], _mm256_fmadd_pd(a[0], b[0], r[0]))));
+   r[1] = _mm256_fnmadd_pd(a[3], b[2], _mm256_fmadd_pd(a[2], b[3],
+         _mm256_fmadd_pd(a[1], b[0], _mm256_fmadd_pd(a[0], b[1], r[1]))));
+   r[2] = _mm256_fmadd_pd(a[3], b[1], _mm256_fmadd_pd(a[2], b[0],
+         _mm256_fnmadd_pd(a[1], b[3], _mm256_fmadd_pd(a[0], b[2], r[2]))));
+   r[3] = _mm256_fmadd_pd(a[3], b[0], _mm256_fnmadd_pd(a[2], b[1],
+         _mm256_fmadd_pd(a[1], b[2], _mm256_fmadd_pd(a[0], b[3], r[3]))));
+}
+
+/*
+ * Eight quaternions of c at a time, held in registers over all kb terms; two
+ * independent sets of accumulators hide the latency of the multiply-adds.
+ */
+static AVX2 void
+matmul_avx2(double *c, const quaternion *a, size_t kb, const double *b, size_t p)
+{
+   size_t j, k;
+   int h, i;
+   for (j = 0; j < p; j += 8) {
+      __m256d r[2][4], q[4], v[4];
+      for (h = 0; h < 2; h++) {
+         for (i = 0; i < 4; i++) {
+            r[h][i] = _mm256_loadu_pd(c + i*p + j + 4*h);
+         }
+      }
+      for (k = 0; k < kb; k++) {
+         const double *bk = b + 4*p*k + j;
+         load4(a + k, 0, q);
+         for (h = 0; h < 2; h++) {
+            for (i = 0; i < 4; i++) {
+               v[i] = _mm256_loadu_pd(bk + i*p + 4*h);
+            }
+            multiply_add4(q, v, r[h]);
+         }
+      }
+      for (h = 0; h < 2; h++) {
+         for (i = 0; i < 4; i++) {
+            _mm256_storeu_pd(c + i*p + j + 4*h, r[h][i]);
+         }
+      }
+   }
+}
+
+/*
+ * Single precision AVX2 kernels
+ *
+ * A vector holds two quaternions.  The products transpose eight quaternions,
+ * one pair per vector, into w, x, y and z vectors with in-lane shuffles; the
+ * lanes then hold quaternions 0, 2, 4, 6, 1, 3, 5, 7, which the inverse
+ * transpose puts back in order.
+ */
+
+static AVX2 inline void
+transpose8(__m256 r[4])
+{
+   __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpacklo_ps(r[2], r[3]);
+   __m256 t2 = _mm256_unpackhi_ps(r[0], r[1]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+   r[0] = _mm256_shuffle_ps(t0, t1, 0x44);
+   r[1] = _mm256_shuffle_ps(t0, t1, 0xee);
+   r[2] = _mm256_shuffle_ps(t2, t3, 0x44);
+   r[3] = _mm256_shuffle_ps(t2, t3, 0xee);
+}
+
+static AVX2 inline void
+load8(const quaternion32 *q, int s, __m256 v[4])
+{
+   if (s) {
+      v[0] = _mm256_loadu_ps(&q[0].w);
+      v[1] = _mm256_loadu_ps(&q[2].w);
+      v[2] = _mm256_loadu_ps(&q[4].w);
+      v[3] = _mm256_loadu_ps(&q[6].w);
+      transpose8(v);
+   }
+   else {
+      v[0] = _mm256_set1_ps(q->w);
+      v[1] = _mm256_set1_ps(q->x);
+      v[2] = _mm256_set1_ps(q->y);
+      v[3] = _mm256_set1_ps(q->z);
+   }
+}
+
+static AVX2 inline void
+store8(quaternion32 *q, __m256 v[4])
+{
+   transpose8(v);
+   _mm256_storeu_ps(&q[0].w, v[0]);
+   _mm256_storeu_ps(&q[2].w, v[1]);
+   _mm256_storeu_ps(&q[4].w, v[2]);
+   _mm256_storeu_ps(&q[6].w, v[3]);
+}
+
+static AVX2 inline void
+hamilton8(const __m256 a[4], const __m256 b[4], __m256 r[4])
+{
+   r[0] = _mm256_fnmadd_ps(a[3], b[3], _mm256_fnmadd_ps(a[2], b[2],
+         _mm256_fnmadd_ps(a[1], b[1], _mm256_mul_ps(a[0], b[0]))));
+   r[1] = _mm256_fnmadd_ps(a[3], b[2], _mm256_fmadd_ps(a[2], b[3],
+         _mm256_fmadd_ps(a[1], b[0], _mm256_mul_ps(a[0], b[1]))));
+   r[2] = _mm256_fmadd_ps(a[3], b[1], _mm256_fmadd_ps(a[2], b[0],
+         _mm256_fnmadd_ps(a[1], b[3], _mm256_mul_ps(a[0], b[2]))));
+   r[3] = _mm256_fmadd_ps(a[3], b[0], _mm256_fnmadd_ps(a[2], b[1],
+         _mm256_fmadd_ps(a[1], b[2], _mm256_mul_ps(a[0], b[3]))));
+}
+
+static AVX2 inline void
+multiply8(const __m256 a[4], const __m256 b[4], __m256 r[4])
+{
+   hamilton8(a, b, r);
+}
+
+static AVX2 inline void
+divide8(const __m256 a[4], const __m256 b[4], __m256 r[4])
+{
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+   __m256 c[4], s;
+   int k;
+   c[0] = b[0];
+   c[1] = _mm256_xor_ps(b[1], sign);
+   c[2] = _mm256_xor_ps(b[2], sign);
+   c[3] = _mm256_xor_ps(b[3], sign);
+   hamilton8(c, a, r);
+   s = _mm256_fmadd_ps(b[3], b[3], _mm256_fmadd_ps(b[2], b[2],
+         _mm256_fmadd_ps(b[1], b[1], _mm256_mul_ps(b[0], b[0]))));
+   for (k = 0; k < 4; k++) {
+      r[k] = _mm256_div_ps(r[k], s);
+   }
+}
+
+#define AVX2_PRODUCT_KERNEL32(name)\
+static AVX2 void \
+name##32_avx2(quaternion32 *out, const quaternion32 *a, int sa,\
+      const quaternion32 *b, int sb, size_t n)\
+{\
+   __m256 va[4], vb[4], r[4];\
+   size_t i = 0;\
+   for (; i + 8 <= n; i += 8) {\
+      load8(a + sa*i, sa, va);\
+      load8(b + sb*i, sb, vb);\
+      name##8(va, vb, r);\
+      store8(out + i, r);\
+   }\
+   if (i < n) {\
+      quaternion32 ta[8], tb[8], to[8];\
+      size_t k, m = n - i;\
+      for (k = 0; k < 8; k++) {\
+         ta[k] = a[sa*(i + (k < m ? k : m - 1))];\
+         tb[k] = b[sb*(i + (k < m ? k : m - 1))];\
+      }\
+      load8(ta, 1, va);\
+      load8(tb, 1, vb);\
+      name##8(va, vb, r);\
+      store8(to, r);\
+      memcpy(out + i, to, m*sizeof(quaternion32));\
+   }\
+}
+
+AVX2_PRODUCT_KERNEL32(multiply)
+AVX2_PRODUCT_KERNEL32(divide)
+
+/*
+ * As normalized4 and the rest, eight quaternions at a time.  One Newton step
+ * takes the estimate to single precision.
+ */
+static AVX2 inline __m256
+norm8(const __m256 q[4])
+{
+   return _mm256_fmadd_ps(q[3], q[3], _mm256_fmadd_ps(q[2], q[2],
+         _mm256_fmadd_ps(q[1], q[1], _mm256_mul_ps(q[0], q[0]))));
+}
+
+/* As maxabs4 and inrange4, for eight quaternions */
+static AVX2 inline __m256
+maxabs8(const __m256 q[4])
+{
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+   return _mm256_max_ps(
+         _mm256_max_ps(_mm256_andnot_ps(sign, q[0]), _mm256_andnot_ps(sign, q[1])),
+         _mm256_max_ps(_mm256_andnot_ps(sign, q[2]), _mm256_andnot_ps(sign, q[3])));
+}
+
+static AVX2 inline int
+inrange8(__m256 min, __m256 max, float lo, float hi)
+{
+   return _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(min, _mm256_set1_ps(lo), _CMP_GE_OQ),
+         _mm256_cmp_ps(max, _mm256_set1_ps(hi), _CMP_LE_OQ))) == 0xff;
+}
+
+static AVX2 inline void
+unit8(__m256 q[4])
+{
+   __m256 s = _mm256_sqrt_ps(norm8(q));
+   int k;
+   for (k = 0; k < 4; k++) {
+      q[k] = _mm256_div_ps(q[k], s);
+   }
+}
+
+static AVX2 inline void
+fast_unit8(__m256 q[4])
+{
+   __m256 n = norm8(q), y;
+   int k;
+   y = _mm256_rsqrt_ps(n);
+   y = _mm256_mul_ps(y, _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_mul_ps(n, _mm256_set1_ps(0.5f)), y),
+         y, _mm256_set1_ps(1.5f)));
+   for (k = 0; k < 4; k++) {
+      q[k] = _mm256_mul_ps(q[k], y);
+   }
+}
+
+static AVX2 inline void
+normalized8(__m256 q[4])
+{
+   __m256 m = maxabs8(q);
+   if (!inrange8(m, m, 0x1p-63f, 0x1p62f)) {
+      quaternion32 t[8];
+      store8(t, q);
+      portable_normalized32(t, 8);
+      load8(t, 1, q);
+      return;
+   }
+   unit8(q);
+}
+
+static AVX2 inline void
+fast_normalized8(__m256 q[4])
+{
+   __m256 m = maxabs8(q);
+   if (!inrange8(m, m, 0x1p-63f, 0x1p62f)) {
+      quaternion32 t[8];
+      store8(t, q);
+      portable_normalized32(t, 8);
+      load8(t, 1, q);
+      return;
+   }
+   fast_unit8(q);
+}
+
+static AVX2 inline void
+inverse8(__m256 q[4])
+{
+   __m256 k = _mm256_div_ps(_mm256_set1_ps(1), norm8(q));
+   __m256 t = _mm256_xor_ps(k, _mm256_set1_ps(-0.0f));
+   q[0] = _mm256_mul_ps(k, q[0]);
+   q[1] = _mm256_mul_ps(t, q[1]);
+   q[2] = _mm256_mul_ps(t, q[2]);
+   q[3] = _mm256_mul_ps(t, q[3]);
+}
+
+/* As unit_multiply4 */
+static AVX2 inline int
+unit_multiply8(const __m256 a[4], const __m256 b[4], __m256 r[4])
+{
+   __m256 ma = maxabs8(a), mb = maxabs8(b);
+   if (!inrange8(_mm256_min_ps(ma, mb), _mm256_max_ps(ma, mb), 0x1p-31f, 0x1p29f)) {
+      return 1;
+   }
+   hamilton8(a, b, r);
+   unit8(r);
+   return 0;
+}
+
+static AVX2 inline int
+fast_unit_multiply8(const __m256 a[4], const __m256 b[4], __m256 r[4])
+{
+   __m256 ma = maxabs8(a), mb = maxabs8(b);
+   if (!inrange8(_mm256_min_ps(ma, mb), _mm256_max_ps(ma, mb), 0x1p-31f, 0x1p29f)) {
+      return 1;
+   }
+   hamilton8(a, b, r);
+   fast_unit8(r);
+   return 0;
+}
+
+#define AVX2_UNIT_PRODUCT_KERNEL32(name)\
+static AVX2 void \
+name##32_avx2(quaternion32 *out, const quaternion32 *a, int sa,\
+      const quaternion32 *b, int sb, size_t n)\
+{\
+   __m256 va[4], vb[4], r[4];\
+   quaternion32 ta[8], tb[8], to[8];\
+   size_t i = 0, k, m;\
+   for (; i + 8 <= n; i += 8) {\
+      load8(a + sa*i, sa, va);\
+      load8(b + sb*i, sb, vb);\
+      if (!name##8(va, vb, r)) {\
+         store8(out + i, r);\
+         continue;\
+      }\
+      portable_unit_multiply32(to, a + sa*i, sa, b + sb*i, sb, 8);\
+      memcpy(out + i, to, sizeof(to));\
+   }\
+   if (i < n) {\
+      m = n - i;\
+      for (k = 0; k < 8; k++) {\
+         ta[k] = a[sa*(i + (k < m ? k : m - 1))];\
+         tb[k] = b[sb*(i + (k < m ? k : m - 1))];\
+      }\
+      load8(ta, 1, va);\
+      load8(tb, 1, vb);\
+      if (!name##8(va, vb, r)) {\
+         store8(to, r);\
+      }\
+      else {\
+         portable_unit_multiply32(to, ta, 1, tb, 1, m);\
+      }\
+      memcpy(out + i, to, m*sizeof(quaternion32));\
+   }\
+}
+
+AVX2_UNIT_PRODUCT_KERNEL32(unit_multiply)
+AVX2_UNIT_PRODUCT_KERNEL32(fast_unit_multiply)
+
+#define AVX2_UNARY_KERNEL32(name)\
+static AVX2 void \
+name##32_avx2(quaternion32 *out, const quaternion32 *a, size_t n)\
+{\
+   __m256 v[4];\
+   size_t i = 0;\
+   for (; i + 8 <= n; i += 8) {\
+      load8(a + i, 1, v);\
+      name##8(v);\
+      store8(out + i, v);\
+   }\
+   if (i < n) {\
+      quaternion32 t[8];\
+      size_t k, m = n - i;\
+      for (k = 0; k < 8; k++) {\
+         t[k] = a[i + (k < m ? k : m - 1)];\
+      }\
+      load8(t, 1, v);\
+      name##8(v);\
+      store8(t, v);\
+      memcpy(out + i, t, m*sizeof(quaternion32));\
+   }\
+}
+
+AVX2_UNARY_KERNEL32(normalized)
+AVX2_UNARY_KERNEL32(fast_normalized)
+AVX2_UNARY_KERNEL32(inverse)
+
+/* The lanes of norm8 hold quaternions 0, 2, 4, 6, 1, 3, 5, 7 */
+static AVX2 void
+norm32_avx2(float *out, const quaternion32 *a, size_t n)
+{
+   const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+   __m256 v[4];
+   size_t i = 0;
+   for (; i + 8 <= n; i += 8) {
+      load8(a + i, 1, v);
+      _mm256_storeu_ps(out + i, _mm256_permutevar8x32_ps(norm8(v), order));
+   }
+   if (i < n) {
+      quaternion32 t[8];
+      float r[8];
+      size_t k, m = n - i;
+      for (k = 0; k < 8; k++) {
+         t[k] = a[i + (k < m ? k : m - 1)];
+      }
+      load8(t, 1, v);
+      _mm256_storeu_ps(r, _mm256_permutevar8x32_ps(norm8(v), order));
+      memcpy(out + i, r, m*sizeof(float));
+   }
+}
+
+/* q[0] and q[1], or q[0] in both halves if s is zero */
+static AVX2 inline __m256
+load2f(const quaternion32 *q, int s)
+{
+   return s ? _mm256_loadu_ps(&q->w) : _mm256_broadcast_ps((const __m128 *)&q->w);
+}
+
+static AVX2 inline __m256
+load2f_scalar(const float *b, int s)
+{
+   return _mm256_insertf128_ps(_mm256_set1_ps(b[0]), _mm_set1_ps(b[s]), 1);
+}
+
+/*
+ * Componentwise kernels, two quaternions per vector, a broadcast b loaded once;
+ * an odd last one is paired with itself
+ */
+#define AVX2_COMPONENT_KERNEL32(name, b_type, load_b, op)\
+static AVX2 void \
+name##32_avx2(quaternion32 *out, const quaternion32 *a, int sa,\
+      const b_type *b, int sb, size_t n)\
+{\
+   size_t i;\
+   if (!sb) {\
+      const __m256 vb = load_b(b, 0);\
+      for (i = 0; i + 2 <= n; i += 2) {\
+         _mm256_storeu_ps(&out[i].w, op(load2f(a + sa*i, sa), vb));\
+      }\
+   }\
+   else {\
+      for (i = 0; i + 2 <= n; i += 2) {\
+         _mm256_storeu_ps(&out[i].w, op(load2f(a + sa*i, sa), load_b(b + sb*i, sb)));\
+      }\
+   }\
+   if (i < n) {\
+      __m256 r = op(load2f(a + sa*i, 0), load_b(b + sb*i, 0));\
+      _mm_storeu_ps(&out[i].w, _mm256_castps256_ps128(r));\
+   }\
+}
+
+AVX2_COMPONENT_KERNEL32(add, quaternion32, load2f, _mm256_add_ps)
+AVX2_COMPONENT_KERNEL32(subtract, quaternion32, load2f, _mm256_sub_ps)
+AVX2_COMPONENT_KERNEL32(multiply_scalar, float, load2f_scalar, _mm256_mul_ps)
+AVX2_COMPONENT_KERNEL32(divide_scalar, float, load2f_scalar, _mm256_div_ps)
+
+/* As add_real, subtract_real and rsubtract_real, two quaternions per vector */
+static AVX2 inline __m256
+add_real32(__m256 q, __m256 s)
+{
+   return _mm256_blend_ps(q, _mm256_add_ps(q, s), 0x11);
+}
+
+static AVX2 inline __m256
+subtract_real32(__m256 q, __m256 s)
+{
+   return _mm256_blend_ps(q, _mm256_sub_ps(q, s), 0x11);
+}
+
+static AVX2 inline __m256
+rsubtract_real32(__m256 q, __m256 s)
+{
+   return _mm256_blend_ps(_mm256_xor_ps(q, _mm256_set1_ps(-0.0f)), _mm256_sub_ps(s, q), 0x11);
+}
+
+/* s/|q|**2 conj(q), the squares summed by the dot product instruction */
+static AVX2 inline __m256
+rdivide_real32(__m256 q, __m256 s)
+{
+   const __m256 sign = _mm256_setr_ps(0, -0.0f, -0.0f, -0.0f, 0, -0.0f, -0.0f, -0.0f);
+   return _mm256_mul_ps(_mm256_div_ps(s, _mm256_dp_ps(q, q, 0xff)), _mm256_xor_ps(q, sign));
+}
+
+AVX2_COMPONENT_KERNEL32(add_scalar, float, load2f_scalar, add_real32)
+AVX2_COMPONENT_KERNEL32(subtract_scalar, float, load2f_scalar, subtract_real32)
+AVX2_COMPONENT_KERNEL32(rsubtract_scalar, float, load2f_scalar, rsubtract_real32)
+AVX2_COMPONENT_KERNEL32(rdivide_scalar, float, load2f_scalar, rdivide_real32)
+
+/*
+ * AVX2 elementary functions
+ *
+ * These follow fdlibm: Cody-Waite range reduction followed by the fdlibm
+ * polynomial kernels, evaluated with fused multiply-adds.  Each assumes its
+ * argument is in a restricted range, and the quaternion kernels below send
+ * any lane outside it to the portable functions.  Measured against long
+ * double references, the maximum errors are
+ *
+ *    vexp      |x| <= 708                    1 ulp
+ *    vlog      normal x > 0                  1 ulp
+ *    vsincos   |x| <= 1e5                    1 ulp
+ *    vatan2    finite y >= 0, not y = x = 0  2 ulp
+ *
+ * The quaternion kernels round further in combining them, as the portable
+ * functions do.
+ */
+
+#define CONST4(x) _mm256_set1_pd(x)
+
+/* Select a where mask is set and b elsewhere */
+static AVX2 inline __m256d
+vselect(__m256d mask, __m256d a, __m256d b)
+{
+   return _mm256_blendv_pd(b, a, mask);
+}
+
+/* 2**k for integral k with |k| <= 1022 */
+static AVX2 inline __m256d
+vpow2i(__m256d k)
+{
+   __m256d t = _mm256_add_pd(k, CONST4(0x1.8p52 + 1023));
+   return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_castpd_si256(t), 52));
+}
+
+static AVX2 inline __m256d
+vexp(__m256d x)
+{
+   __m256d k = _mm256_round_pd(_mm256_mul_pd(x, CONST4(1.44269504088896338700e+00)),
+         _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   __m256d r = _mm256_fnmadd_pd(k, CONST4(6.93147180369123816490e-01), x);
+   __m256d p;
+   r = _mm256_fnmadd_pd(k, CONST4(1.90821492927058770002e-10), r);
+   /* Taylor series to degree 13, which converges to 2**-60 for |r| <= ln(2)/2 */
+   p = _mm256_fmadd_pd(CONST4(1.0/6227020800), r, CONST4(1.0/479001600));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/39916800));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/3628800));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/362880));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/40320));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/5040));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/720));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/120));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/24));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0/6));
+   p = _mm256_fmadd_pd(p, r, CONST4(0.5));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0));
+   p = _mm256_fmadd_pd(p, r, CONST4(1.0));
+   return _mm256_mul_pd(p, vpow2i(k));
+}
+
+static AVX2 inline __m256d
+vlog(__m256d x)
+{
+   const __m256d one = CONST4(1.0);
+   __m256i bits = _mm256_castpd_si256(x);
+   /* x = 2**e*m with m in [sqrt(2)/2, sqrt(2)) */
+   __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52),
+         _mm256_castpd_si256(CONST4(0x1p52)))), CONST4(0x1p52 + 1023));
+   __m256d m = _mm256_castsi256_pd(_mm256_or_si256(
+         _mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+         _mm256_castpd_si256(one)));
+   __m256d big = _mm256_cmp_pd(m, CONST4(1.41421356237309504880), _CMP_GT_OQ);
+   __m256d f, s, z, w, t1, t2, r, hfsq;
+   m = vselect(big, _mm256_mul_pd(m, CONST4(0.5)), m);
+   e = _mm256_add_pd(e, _mm256_and_pd(big, one));
+   f = _mm256_sub_pd(m, one);
+   s = _mm256_div_pd(f, _mm256_add_pd(CONST4(2.0), f));
+   z = _mm256_mul_pd(s, s);
+   w = _mm256_mul_pd(z, z);
+   t1 = _mm256_fmadd_pd(w, CONST4(1.531383769920937332e-01), CONST4(2.222219843214978396e-01));
+   t1 = _mm256_fmadd_pd(w, t1, CONST4(3.999999999940941908e-01));
+   t1 = _mm256_mul_pd(w, t1);
+   t2 = _mm256_fmadd_pd(w, CONST4(1.479819860511658591e-01), CONST4(1.818357216161805012e-01));
+   t2 = _mm256_fmadd_pd(w, t2, CONST4(2.857142874366239149e-01));
+   t2 = _mm256_fmadd_pd(w, t2, CONST4(6.666666666666735130e-01));
+   t2 = _mm256_mul_pd(z, t2);
+   r = _mm256_add_pd(t1, t2);
+   hfsq = _mm256_mul_pd(CONST4(0.5), _mm256_mul_pd(f, f));
+   /* e*ln2_hi - ((hfsq - (s*(hfsq+R) + e*ln2_lo)) - f) */
+   t1 = _mm256_fmadd_pd(s, _mm256_add_pd(hfsq, r), _mm256_mul_pd(e, CONST4(1.90821492927058770002e-10)));
+   t1 = _mm256_sub_pd(_mm256_sub_pd(hfsq, t1), f);
+   return _mm256_fmsub_pd(e, CONST4(6.93147180369123816490e-01), t1);
+}
+
+static AVX2 inline void
+vsincos(__m256d x, __m256d *sinx, __m256d *cosx)
+{
+   const __m256d one = CONST4(1.0);
+   __m256d k = _mm256_round_pd(_mm256_mul_pd(x, CONST4(6.36619772367581382433e-01)),
+         _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   __m256d r = _mm256_fnmadd_pd(k, CONST4(1.57079632673412561417e+00), x);
+   __m256d z, p, sr, cr, hz, w, c, swap;
+   __m256i q;
+   /* Reduced argument r + c, keeping the rounding error of r in c */
+   w = _mm256_fnmadd_pd(k, CONST4(6.07710050630396597660e-11), r);
+   c = _mm256_fnmadd_pd(k, CONST4(6.07710050630396597660e-11), _mm256_sub_pd(r, w));
+   c = _mm256_fnmadd_pd(k, CONST4(2.02226624871116645580e-21), c);
+   r = _mm256_add_pd(w, c);
+   c = _mm256_sub_pd(c, _mm256_sub_pd(r, w));
+   z = _mm256_mul_pd(r, r);
+   /* fdlibm __kernel_sin */
+   p = _mm256_fmadd_pd(z, CONST4(1.58969099521155010221e-10), CONST4(-2.50507602534068634195e-08));
+   p = _mm256_fmadd_pd(z, p, CONST4(2.75573137070700676789e-06));
+   p = _mm256_fmadd_pd(z, p, CONST4(-1.98412698298579493134e-04));
+   p = _mm256_fmadd_pd(z, p, CONST4(8.33333333332248946124e-03));
+   p = _mm256_fmadd_pd(z, p, CONST4(-1.66666666666666324348e-01));
+   /* sin(r + c) = sin(r) + c*(1 - r*r/2) */
+   sr = _mm256_fmadd_pd(_mm256_mul_pd(z, r), p, _mm256_fnmadd_pd(_mm256_mul_pd(CONST4(0.5), z), c, c));
+   sr = _mm256_add_pd(r, sr);
+   /* fdlibm __kernel_cos */
+   p = _mm256_fmadd_pd(z, CONST4(-1.13596475577881948265e-11), CONST4(2.08757232129817482790e-09));
+   p = _mm256_fmadd_pd(z, p, CONST4(-2.75573143513906633035e-07));
+   p = _mm256_fmadd_pd(z, p, CONST4(2.48015872894767294178e-05));
+   p = _mm256_fmadd_pd(z, p, CONST4(-1.38888888888741095749e-03));
+   p = _mm256_fmadd_pd(z, p, CONST4(4.16666666666666019037e-02));
+   p = _mm256_mul_pd(z, p);
+   hz = _mm256_mul_pd(CONST4(0.5), z);
+   w = _mm256_sub_pd(one, hz);
+   /* cos(r + c) = cos(r) - c*r */
+   cr = _mm256_add_pd(w, _mm256_fmadd_pd(z, p, _mm256_fnmadd_pd(c, r,
+         _mm256_sub_pd(_mm256_sub_pd(one, w), hz))));
+   /* Quadrant from the low bits of k */
+   q = _mm256_castpd_si256(_mm256_add_pd(k, CONST4(0x1.8p52)));
+   swap = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(1)),
+         _mm256_set1_epi64x(1)));
+   *sinx = _mm256_xor_pd(vselect(swap, cr, sr), _mm256_castsi256_pd(
+         _mm256_slli_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(2)), 62)));
+   *cosx = _mm256_xor_pd(vselect(swap, sr, cr), _mm256_castsi256_pd(
+         _mm256_slli_epi64(_mm256_and_si256(_mm256_add_epi64(q, _mm256_set1_epi64x(1)),
+         _mm256_set1_epi64x(2)), 62)));
+}
+
+static AVX2 inline __m256d
+vatan2(__m256d y, __m256d x)
+{
+   const __m256d sign = CONST4(-0.0);
+   __m256d ax = _mm256_andnot_pd(sign, x);
+   __m256d lo = _mm256_min_pd(ax, y), hi = _mm256_max_pd(ax, y);
+   /* Reduce to |t| <= tan(pi/8) using atan(t) = pi/4 + atan((t-1)/(t+1)) */
+   __m256d reduce = _mm256_cmp_pd(lo, _mm256_mul_pd(hi, CONST4(4.14213562373095048802e-01)),
+         _CMP_GT_OQ);
+   __m256d t = _mm256_div_pd(vselect(reduce, _mm256_sub_pd(lo, hi), lo),
+         vselect(reduce, _mm256_add_pd(lo, hi), hi));
+   __m256d z, w, s1, s2, a;
+   hi = _mm256_and_pd(reduce, CONST4(7.85398163397448278999e-01));
+   lo = _mm256_and_pd(reduce, CONST4(3.06161699786838301793e-17));
+   /* fdlibm atan */
+   z = _mm256_mul_pd(t, t);
+   w = _mm256_mul_pd(z, z);
+   s1 = _mm256_fmadd_pd(w, CONST4(1.62858201153657823623e-02), CONST4(4.97687799461593236017e-02));
+   s1 = _mm256_fmadd_pd(w, s1, CONST4(6.66107313738753120669e-02));
+   s1 = _mm256_fmadd_pd(w, s1, CONST4(9.09088713343650656196e-02));
+   s1 = _mm256_fmadd_pd(w, s1, CONST4(1.42857142725034663711e-01));
+   s1 = _mm256_fmadd_pd(w, s1, CONST4(3.33333333333329318027e-01));
+   s1 = _mm256_mul_pd(z, s1);
+   s2 = _mm256_fmadd_pd(w, CONST4(-3.65315727442169155270e-02), CONST4(-5.83357013379057348645e-02));
+   s2 = _mm256_fmadd_pd(w, s2, CONST4(-7.69187620504482999495e-02));
+   s2 = _mm256_fmadd_pd(w, s2, CONST4(-1.11111104054623557880e-01));
+   s2 = _mm256_fmadd_pd(w, s2, CONST4(-1.99999999998764832476e-01));
+   s2 = _mm256_mul_pd(w, s2);
+   a = _mm256_sub_pd(hi, _mm256_sub_pd(_mm256_fmsub_pd(t, _mm256_add_pd(s1, s2), lo), t));
+   /* Undo the swap of x and y, then reflect for negative x */
+   a = vselect(_mm256_cmp_pd(y, ax, _CMP_GT_OQ), _mm256_sub_pd(CONST4(1.57079632679489655800e+00),
+         _mm256_sub_pd(a, CONST4(6.12323399573676603587e-17))), a);
+   return vselect(_mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ), _mm256_sub_pd(
+         CONST4(3.14159265358979311600e+00), _mm256_sub_pd(a, CONST4(1.22464679914735317720e-16))), a);
+}
+
+/*
+ * Quaternion exp, log and powers
+ *
+ * Each function works on w, x, y, z vectors and returns a bit mask of lanes
+ * outside the range of the elementary functions, whose inputs it replaces by
+ * harmless values so they raise no floating point exceptions.  The caller
+ * recomputes those lanes with the portable functions.
+ */
+
+static AVX2 inline __m256d
+vnorm2(__m256d x, __m256d y, __m256d z)
+{
+   return _mm256_fmadd_pd(z, z, _mm256_fmadd_pd(y, y, _mm256_mul_pd(x, x)));
+}
+
+/* |q|**2 - 1 with the rounding errors of the squares and sums added back */
+static AVX2 inline __m256d
+vnorm2m1(__m256d q[4])
+{
+   __m256d r = CONST4(-1.0), c = _mm256_setzero_pd(), t, b, a;
+   int i;
+   for (i = 0; i < 4; i++) {
+      a = _mm256_mul_pd(q[i], q[i]);
+      c = _mm256_add_pd(c, _mm256_fmsub_pd(q[i], q[i], a));
+      t = _mm256_add_pd(r, a);
+      b = _mm256_sub_pd(t, r);
+      c = _mm256_add_pd(c, _mm256_add_pd(_mm256_sub_pd(r, _mm256_sub_pd(t, b)),
+            _mm256_sub_pd(a, b)));
+      r = t;
+   }
+   return _mm256_add_pd(r, c);
+}
+
+/* Replace lanes of v in mask by c */
+#define SANITIZE(v, mask, c) (v) = vselect((mask), CONST4(c), (v))
+
+static AVX2 inline int
+exp4(__m256d q[4], __m256d r[4])
+{
+   const __m256d one = CONST4(1.0), zero = _mm256_setzero_pd();
+   __m256d t = _mm256_sqrt_pd(vnorm2(q[1], q[2], q[3]));
+   __m256d bad = _mm256_or_pd(
+         _mm256_cmp_pd(_mm256_andnot_pd(CONST4(-0.0), q[0]), CONST4(708), _CMP_NLE_UQ),
+         _mm256_cmp_pd(t, CONST4(1e5), _CMP_NLE_UQ));
+   __m256d e, s, c, sinc, small;
+   SANITIZE(q[0], bad, 0);
+   SANITIZE(t, bad, 0);
+   /* Pure vectors, as from rotation vectors, need no exponential */
+   e = _mm256_movemask_pd(_mm256_cmp_pd(q[0], zero, _CMP_EQ_OQ)) == 0xf ? one : vexp(q[0]);
+   vsincos(t, &s, &c);
+   small = _mm256_cmp_pd(t, zero, _CMP_EQ_OQ);
+   sinc = vselect(small, one, _mm256_div_pd(s, vselect(small, one, t)));
+   r[0] = _mm256_mul_pd(e, c);
+   e = _mm256_mul_pd(e, sinc);
+   r[1] = _mm256_mul_pd(e, q[1]);
+   r[2] = _mm256_mul_pd(e, q[2]);
+   r[3] = _mm256_mul_pd(e, q[3]);
+   return _mm256_movemask_pd(bad);
+}
+
+/*
+ * log|q| and the angle of q, leaving q's vector part scaled by s such that
+ * log(q) = (logm, s*x, s*y, s*z)
+ */
+static AVX2 inline int
+polar4(__m256d q[4], __m256d *logm, __m256d *angle, __m256d *s)
+{
+   const __m256d one = CONST4(1.0), zero = _mm256_setzero_pd();
+   __m256d t2 = vnorm2(q[1], q[2], q[3]), t, m2, real;
+   __m256d bad, r, u, near;
+   m2 = _mm256_fmadd_pd(q[0], q[0], t2);
+   real = _mm256_cmp_pd(t2, zero, _CMP_EQ_OQ);
+   /* Outside the normal range, or negative reals (whose axis is arbitrary) */
+   bad = _mm256_or_pd(_mm256_or_pd(
+         _mm256_cmp_pd(m2, CONST4(0x1p-1000), _CMP_NGE_UQ),
+         _mm256_cmp_pd(m2, CONST4(0x1p1000), _CMP_NLE_UQ)),
+         _mm256_and_pd(real, _mm256_cmp_pd(q[0], zero, _CMP_LT_OQ)));
+   SANITIZE(m2, bad, 1);
+   SANITIZE(t2, bad, 0);
+   SANITIZE(q[0], bad, 1);
+   real = _mm256_cmp_pd(t2, zero, _CMP_EQ_OQ);
+   t = _mm256_sqrt_pd(t2);
+   /*
+    * Near |q| = 1, log1p(r)/2 for r = |q|**2 - 1 summed exactly as in
+    * quaternion_log, with log1p(r) = log(u) - ((u-1)-r)/u for u = 1+r
+    */
+   r = vnorm2m1(q);
+   near = _mm256_cmp_pd(_mm256_andnot_pd(CONST4(-0.0), r), CONST4(0.5), _CMP_LT_OQ);
+   u = _mm256_add_pd(one, r);
+   *logm = _mm256_sub_pd(vlog(vselect(near, u, m2)), _mm256_and_pd(near,
+         _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(u, one), r), u)));
+   *logm = _mm256_mul_pd(CONST4(0.5), *logm);
+   *angle = vatan2(t, q[0]);
+   *s = _mm256_div_pd(*angle, vselect(real, one, t));
+   return _mm256_movemask_pd(bad);
+}
+
+static AVX2 inline int
+log4(__m256d q[4], __m256d r[4])
+{
+   __m256d s;
+   int bad = polar4(q, &r[0], &s, &s);
+   r[1] = _mm256_mul_pd(s, q[1]);
+   r[2] = _mm256_mul_pd(s, q[2]);
+   r[3] = _mm256_mul_pd(s, q[3]);
+   return bad;
+}
+
+/* exp(log(q)*p) */
+static AVX2 inline int
+power4(__m256d q[4], __m256d p[4], __m256d r[4])
+{
+   __m256d l[4], m[4];
+   int bad = log4(q, l);
+   hamilton4(l, p, m);
+   return bad | exp4(m, r);
+}
+
+/* exp(p*log(q)) as |q|**p (cos(p*angle), sin(p*angle)*axis) */
+static AVX2 inline int
+power_scalar4(__m256d q[4], __m256d p, __m256d r[4])
+{
+   __m256d logm, angle, s, l, a, e, sn, cs, bad2;
+   int bad = polar4(q, &logm, &angle, &s);
+   l = _mm256_mul_pd(p, logm);
+   a = _mm256_mul_pd(p, angle);
+   bad2 = _mm256_or_pd(
+         _mm256_cmp_pd(_mm256_andnot_pd(CONST4(-0.0), l), CONST4(708), _CMP_NLE_UQ),
+         _mm256_cmp_pd(_mm256_andnot_pd(CONST4(-0.0), a), CONST4(1e5), _CMP_NLE_UQ));
+   SANITIZE(l, bad2, 0);
+   SANITIZE(a, bad2, 0);
+   e = vexp(l);
+   vsincos(a, &sn, &cs);
+   r[0] = _mm256_mul_pd(e, cs);
+   /* s*v/angle is the unit axis, or zero for positive reals */
+   e = _mm256_mul_pd(e, _mm256_div_pd(sn, vselect(_mm256_cmp_pd(angle, _mm256_setzero_pd(),
+         _CMP_EQ_OQ), CONST4(1.0), angle)));
+   e = _mm256_mul_pd(e, s);
+   r[1] = _mm256_mul_pd(e, q[1]);
+   r[2] = _mm256_mul_pd(e, q[2]);
+   r[3] = _mm256_mul_pd(e, q[3]);
+   return bad | _mm256_movemask_pd(bad2);
+}
+
+/*
+ * Blocks of four as in AVX2_PRODUCT_KERNEL.  Lanes flagged by the vector code
+ * are recomputed by the portable function before the block is stored, so the
+ * output may overwrite an input.
+ */
+#define AVX2_TRANSCENDENTAL_KERNEL(name, b_type, load_b, b_arg)\
+static AVX2 void \
+name##_avx2(quaternion *out, const quaternion *a, int sa,\
+      const b_type *b, int sb, size_t n)\
+{\
+   __m256d va[4], vb[4], r[4];\
+   quaternion ta[4], to[4];\
+   b_type tb[4];\
+   size_t i = 0, k, m;\
+   int bad;\
+   for (; i + 4 <= n; i += 4) {\
+      load4(a + sa*i, sa, va);\
+      load_b(b + sb*i, sb, vb);\
+      bad = name##4(va, b_arg, r);\
+      if (!bad) {\
+         store4(out + i, r);\
+         continue;\
+      }\
+      store4(to, r);\
+      for (k = 0; k < 4; k++) {\
+         to[k] = bad >> k & 1 ? quaternion_##name(a[sa*(i + k)], b[sb*(i + k)]) : to[k];\
+      }\
+      memcpy(out + i, to, sizeof(to));\
+   }\
+   if (i < n) {\
+      m = n - i;\
+      for (k = 0; k < 4; k++) {\
+         ta[k] = a[sa*(i + (k < m ? k : m - 1))];\
+         tb[k] = b[sb*(i + (k < m ? k : m - 1))];\
+      }\
+      load4(ta, 1, va);\
+      load_b(tb, 1, vb);\
+      bad = name##4(va, b_arg, r);\
+      store4(to, r);\
+      for (k = 0; k < m; k++) {\
+         to[k] = bad >> k & 1 ? quaternion_##name(ta[k], tb[k]) : to[k];\
+      }\
+      memcpy(out + i, to, m*sizeof(quaternion));\
+   }\
+}
+
+/* Load b[0..3] into v[0], or b[0] four times if s is zero */
+static AVX2 inline void
+load_scalar4(const double *b, int s, __m256d v[4])
+{
+   v[0] = s ? _mm256_loadu_pd(b) : _mm256_broadcast_sd(b);
+}
+
+AVX2_TRANSCENDENTAL_KERNEL(power, quaternion, load4, vb)
+AVX2_TRANSCENDENTAL_KERNEL(power_scalar, double, load_scalar4, vb[0])
+
+#define AVX2_UNARY_TRANSCENDENTAL_KERNEL(name)\
+static AVX2 void \
+name##_avx2(quaternion *out, const quaternion *a, size_t n)\
+{\
+   __m256d va[4], r[4];\
+   quaternion ta[4], to[4];\
+   size_t i = 0, k, m;\
+   int bad;\
+   for (; i + 4 <= n; i += 4) {\
+      load4(a + i, 1, va);\
+      bad = name##4(va, r);\
+      if (!bad) {\
+         store4(out + i, r);\
+         continue;\
+      }\
+      store4(to, r);\
+      for (k = 0; k < 4; k++) {\
+         to[k] = bad >> k & 1 ? quaternion_##name(a[i + k]) : to[k];\
+      }\
+      memcpy(out + i, to, sizeof(to));\
+   }\
+   if (i < n) {\
+      m = n - i;\
+      for (k = 0; k < 4; k++) {\
+         ta[k] = a[i + (k < m ? k : m - 1)];\
+      }\
+      load4(ta, 1, va);\
+      bad = name##4(va, r);\
+      store4(to, r);\
+      for (k = 0; k < m; k++) {\
+         to[k] = bad >> k & 1 ? quaternion_##name(ta[k]) : to[k];\
+      }\
+      memcpy(out + i, to, m*sizeof(quaternion));\
+   }\
+}
+
+AVX2_UNARY_TRANSCENDENTAL_KERNEL(exp)
+AVX2_UNARY_TRANSCENDENTAL_KERNEL(log)
+
+/* Spherical linear interpolation */
+
+/* Replace lanes of q in mask by 1 */
+static AVX2 inline void
+sanitize4(__m256d q[4], __m256d mask)
+{
+   SANITIZE(q[0], mask, 1);
+   SANITIZE(q[1], mask, 0);
+   SANITIZE(q[2], mask, 0);
+   SANITIZE(q[3], mask, 0);
+}
+
+/* As quaternion_slerp, returning lanes to recompute as for exp4 */
+static AVX2 inline int
+slerp4(__m256d a[4], __m256d b[4], __m256d t, __m256d r[4])
+{
+   const __m256d one = CONST4(1.0), zero = _mm256_setzero_pd(), sign = CONST4(-0.0);
+   __m256d bad = _mm256_cmp_pd(_mm256_andnot_pd(sign, t), CONST4(3e4), _CMP_NLE_UQ);
+   __m256d flip, nd, ns, omega, small, so, co, sb, cb, wa, wb, c;
+   int k;
+   /* Non-finite or huge components would raise exceptions in the norms */
+   for (k = 0; k < 4; k++) {
+      bad = _mm256_or_pd(bad, _mm256_cmp_pd(_mm256_andnot_pd(sign, a[k]), CONST4(0x1p500),
+            _CMP_NLE_UQ));
+      bad = _mm256_or_pd(bad, _mm256_cmp_pd(_mm256_andnot_pd(sign, b[k]), CONST4(0x1p500),
+            _CMP_NLE_UQ));
+   }
+   sanitize4(a, bad);
+   sanitize4(b, bad);
+   SANITIZE(t, bad, 0);
+   flip = _mm256_fmadd_pd(a[3], b[3], _mm256_fmadd_pd(a[2], b[2],
+         _mm256_fmadd_pd(a[1], b[1], _mm256_mul_pd(a[0], b[0]))));
+   flip = _mm256_and_pd(_mm256_cmp_pd(flip, zero, _CMP_LT_OQ), sign);
+   nd = ns = zero;
+   for (k = 0; k < 4; k++) {
+      b[k] = _mm256_xor_pd(b[k], flip);
+      c = _mm256_sub_pd(b[k], a[k]);
+      nd = _mm256_fmadd_pd(c, c, nd);
+      c = _mm256_add_pd(b[k], a[k]);
+      ns = _mm256_fmadd_pd(c, c, ns);
+   }
+   /* Zero or tiny quaternions, whose arc is undefined */
+   c = _mm256_cmp_pd(ns, CONST4(0x1p-1000), _CMP_LT_OQ);
+   bad = _mm256_or_pd(bad, c);
+   sanitize4(a, c);
+   sanitize4(b, c);
+   SANITIZE(nd, c, 0);
+   SANITIZE(ns, c, 1);
+   omega = _mm256_mul_pd(CONST4(2.0), vatan2(_mm256_sqrt_pd(nd), _mm256_sqrt_pd(ns)));
+   small = _mm256_cmp_pd(omega, CONST4(0x1p-20), _CMP_LT_OQ);
+   /* sin((1-t) omega) / sin(omega) = cos(t omega) - cos(omega) sin(t omega) / sin(omega) */
+   vsincos(omega, &so, &co);
+   vsincos(_mm256_mul_pd(t, omega), &sb, &cb);
+   wb = _mm256_div_pd(sb, vselect(small, one, so));
+   wa = vselect(small, _mm256_sub_pd(one, t), _mm256_fnmadd_pd(co, wb, cb));
+   wb = vselect(small, t, wb);
+   for (k = 0; k < 4; k++) {
+      r[k] = _mm256_fmadd_pd(wb, b[k], _mm256_mul_pd(wa, a[k]));
+   }
+   /* nlerp lanes are normalized */
+   if (_mm256_movemask_pd(small)) {
+      c = _mm256_sqrt_pd(_mm256_fmadd_pd(r[0], r[0], vnorm2(r[1], r[2], r[3])));
+      c = vselect(small, c, one);
+      for (k = 0; k < 4; k++) {
+         r[k] = _mm256_div_pd(r[k], c);
+      }
+   }
+   return _mm256_movemask_pd(bad);
+}
+
+static AVX2 void
+slerp_avx2(quaternion *out, const quaternion *a, int sa, const quaternion *b, int sb,
+      const double *t, int st, size_t n)
+{
+   __m256d va[4], vb[4], vt[4], r[4];
+   quaternion ta[4], tb[4], to[4];
+   double tt[4];
+   size_t i = 0, k, m;
+   int bad;
+   for (; i + 4 <= n; i += 4) {
+      load4(a + sa*i, sa, va);
+      load4(b + sb*i, sb, vb);
+      load_scalar4(t + st*i, st, vt);
+      bad = slerp4(va, vb, vt[0], r);
+      if (!bad) {
+         store4(out + i, r);
+         continue;
+      }
+      store4(to, r);
+      for (k = 0; k < 4; k++) {
+         to[k] = bad >> k & 1 ? quaternion_slerp(a[sa*(i + k)], b[sb*(i + k)], t[st*(i + k)]) : to[k];
+      }
+      memcpy(out + i, to, sizeof(to));
+   }
+   if (i < n) {
+      m = n - i;
+      for (k = 0; k < 4; k++) {
+         size_t e = i + (k < m ? k : m - 1);
+         ta[k] = a[sa*e];
+         tb[k] = b[sb*e];
+         tt[k] = t[st*e];
+      }
+      load4(ta, 1, va);
+      load4(tb, 1, vb);
+      load_scalar4(tt, 1, vt);
+      bad = slerp4(va, vb, vt[0], r);
+      store4(to, r);
+      for (k = 0; k < m; k++) {
+         to[k] = bad >> k & 1 ? quaternion_slerp(ta[k], tb[k], tt[k]) : to[k];
+      }
+      memcpy(out + i, to, m*sizeof(quaternion));
+   }
+}
+
+/* Rotation of 3-vectors */
+
+/* Load v[0..11] as x, y, z vectors of four 3-vectors */
+static AVX2 inline void
+load_vectors4(const double *v, __m256d r[3])
+{
+   __m256d v0 = _mm256_loadu_pd(v), v1 = _mm256_loadu_pd(v + 4), v2 = _mm256_loadu_pd(v + 8);
+   __m256d a = _mm256_permute2f128_pd(v0, v1, 0x30);   /* x0 y0 x2 y2 */
+   __m256d b = _mm256_permute2f128_pd(v0, v2, 0x21);   /* z0 x1 z2 x3 */
+   __m256d c = _mm256_permute2f128_pd(v1, v2, 0x30);   /* y1 z1 y3 z3 */
+   r[0] = _mm256_blend_pd(a, b, 0xa);
+   r[1] = _mm256_shuffle_pd(a, c, 0x5);
+   r[2] = _mm256_blend_pd(b, c, 0xa);
+}
+
+static AVX2 inline void
+store_vectors4(double *v, const __m256d r[3])
+{
+   __m256d a = _mm256_shuffle_pd(r[0], r[1], 0x0);
+   __m256d b = _mm256_blend_pd(r[2], r[0], 0xa);
+   __m256d c = _mm256_shuffle_pd(r[1], r[2], 0xf);
+   _mm256_storeu_pd(v, _mm256_permute2f128_pd(a, b, 0x20));
+   _mm256_storeu_pd(v + 4, _mm256_permute2f128_pd(c, a, 0x30));
+   _mm256_storeu_pd(v + 8, _mm256_permute2f128_pd(b, c, 0x31));
+}
+
+/* a x b, or a x b + c */
+static AVX2 inline void
+cross4(const __m256d a[3], const __m256d b[3], __m256d r[3])
+{
+   r[0] = _mm256_fmsub_pd(a[1], b[2], _mm256_mul_pd(a[2], b[1]));
+   r[1] = _mm256_fmsub_pd(a[2], b[0], _mm256_mul_pd(a[0], b[2]));
+   r[2] = _mm256_fmsub_pd(a[0], b[1], _mm256_mul_pd(a[1], b[0]));
+}
+
+static AVX2 inline void
+cross_add4(const __m256d a[3], const __m256d b[3], const __m256d c[3], __m256d r[3])
+{
+   r[0] = _mm256_fmsub_pd(a[1], b[2], _mm256_fmsub_pd(a[2], b[1], c[0]));
+   r[1] = _mm256_fmsub_pd(a[2], b[0], _mm256_fmsub_pd(a[0], b[2], c[1]));
+   r[2] = _mm256_fmsub_pd(a[0], b[1], _mm256_fmsub_pd(a[1], b[0], c[2]));
+}
+
+/* As quaternion_rotate_vector */
+static AVX2 inline void
+rotate4(const __m256d q[4], const __m256d v[3], __m256d r[3])
+{
+   __m256d s = _mm256_div_pd(_mm256_set1_pd(2), _mm256_fmadd_pd(q[3], q[3],
+         _mm256_fmadd_pd(q[2], q[2], _mm256_fmadd_pd(q[1], q[1], _mm256_mul_pd(q[0], q[0])))));
+   __m256d t[3], c[3];
+   int k;
+   cross4(q + 1, v, t);
+   for (k = 0; k < 3; k++) {
+      t[k] = _mm256_mul_pd(s, t[k]);
+      c[k] = _mm256_fmadd_pd(q[0], t[k], v[k]);
+   }
+   cross_add4(q + 1, t, c, r);
+}
+
+/* m v for m broadcast from a row-major 3x3 matrix */
+static AVX2 inline void
+matrix_vector4(const __m256d m[9], const __m256d v[3], __m256d r[3])
+{
+   int k;
+   for (k = 0; k < 3; k++) {
+      r[k] = _mm256_fmadd_pd(m[3*k + 2], v[2],
+            _mm256_fmadd_pd(m[3*k + 1], v[1], _mm256_mul_pd(m[3*k], v[0])));
+   }
+}
+
+static AVX2 void
+rotate_avx2(double *out, const quaternion *q, int sq, const double *v, size_t n)
+{
+   __m256d vq[4], vv[3], r[3], m[9];
+   size_t i = 0, k;
+   /* A single rotation is cheaper applied as a matrix */
+   if (!sq) {
+      double a[9];
+      quaternion_rotation_matrix(*q, a);
+      for (k = 0; k < 9; k++) {
+         m[k] = _mm256_set1_pd(a[k]);
+      }
+   }
+   for (; i + 4 <= n; i += 4) {
+      load_vectors4(v + 3*i, vv);
+      if (sq) {
+         load4(q + i, 1, vq);
+         rotate4(vq, vv, r);
+      }
+      else {
+         matrix_vector4(m, vv, r);
+      }
+      store_vectors4(out + 3*i, r);
+   }
+   if (i < n) {
+      /* Pad the last block with copies of its final element, as elsewhere */
+      quaternion tq[4];
+      double tv[12], to[12];
+      size_t j = n - i;
+      for (k = 0; k < 4; k++) {
+         size_t e = i + (k < j ? k : j - 1);
+         tq[k] = q[sq ? e : 0];
+         memcpy(tv + 3*k, v + 3*e, 3*sizeof(double));
+      }
+      load_vectors4(tv, vv);
+      if (sq) {
+         load4(tq, 1, vq);
+         rotate4(vq, vv, r);
+      }
+      else {
+         matrix_vector4(m, vv, r);
+      }
+      store_vectors4(to, r);
+      memcpy(out + 3*i, to, 3*j*sizeof(double));
+   }
+}
+
+/* Rotation distances */
+
+static AVX2 void
+distance_avx2(double *out, quaternion q, const double *b, size_t stride, size_t p)
+{
+   __m256d vq[4], d2, s2, r;
+   size_t j;
+   int i;
+   load4(&q, 0, vq);
+   for (j = 0; j < p; j += 4) {
+      d2 = s2 = _mm256_setzero_pd();
+      for (i = 0; i < 4; i++) {
+         __m256d v = _mm256_loadu_pd(b + i*stride + j);
+         __m256d d = _mm256_sub_pd(vq[i], v), s = _mm256_add_pd(vq[i], v);
+         d2 = _mm256_fmadd_pd(d, d, d2);
+         s2 = _mm256_fmadd_pd(s, s, s2);
+      }
+      r = _mm256_mul_pd(CONST4(4), vatan2(_mm256_sqrt_pd(_mm256_min_pd(d2, s2)),
+            _mm256_sqrt_pd(_mm256_max_pd(d2, s2))));
+      /* vatan2 takes finite inputs; pass on NaNs from zero or non-finite quaternions */
+      _mm256_storeu_pd(out + j, vselect(_mm256_cmp_pd(d2, s2, _CMP_UNORD_Q), d2, r));
+   }
+}
+
+/*
+ * Four quaternions per step, as w, x, y and z vectors, accumulating the ten
+ * distinct products in their lanes; the last partial block is padded with
+ * copies of its final element at weight zero.
+ */
+static AVX2 void
+moment_avx2(double *m, const quaternion *q, const double *w, int sw, size_t n)
+{
+   __m256d acc[10], v[4], s, n2, zero;
+   double t[4];
+   size_t i;
+   int k, l, j;
+   for (j = 0; j < 10; j++) {
+      acc[j] = _mm256_setzero_pd();
+   }
+   for (i = 0; i < n; i += 4) {
+      if (i + 4 <= n) {
+         load4(q + i, 1, v);
+         s = sw ? _mm256_loadu_pd(w + i) : _mm256_broadcast_sd(w);
+      }
+      else {
+         quaternion tq[4];
+         size_t h, r = n - i;
+         for (h = 0; h < 4; h++) {
+            tq[h] = q[i + (h < r ? h : r - 1)];
+            t[h] = h < r ? w[sw*(i + h)] : 0;
+         }
+         load4(tq, 1, v);
+         s = _mm256_loadu_pd(t);
+      }
+      n2 = _mm256_fmadd_pd(v[3], v[3], _mm256_fmadd_pd(v[2], v[2],
+            _mm256_fmadd_pd(v[1], v[1], _mm256_mul_pd(v[0], v[0]))));
+      /* Zero quaternions add nothing, as in moment_generic, without 0/0 */
+      zero = _mm256_cmp_pd(n2, _mm256_setzero_pd(), _CMP_EQ_OQ);
+      s = _mm256_andnot_pd(zero, _mm256_div_pd(s, vselect(zero, CONST4(1.0), n2)));
+      for (k = 0, j = 0; k < 4; k++) {
+         __m256d sv = _mm256_mul_pd(s, v[k]);
+         for (l = k; l < 4; l++, j++) {
+            acc[j] = _mm256_fmadd_pd(sv, v[l], acc[j]);
+         }
+      }
+   }
+   for (k = 0, j = 0; k < 4; k++) {
+      for (l = k; l < 4; l++, j++) {
+         _mm256_storeu_pd(t, acc[j]);
+         m[4*k + l] += (t[0] + t[1]) + (t[2] + t[3]);
+         if (l != k) {
+            m[4*l + k] = m[4*k + l];
+         }
+      }
+   }
+}
+
+/*
+ * Casts.  Each quaternion is written with one store, its real or complex
+ * part in the low lanes and zeros above; real parts are gathered four (or
+ * eight) quaternions at a time with in-lane unpacks.
+ */
+static AVX2 void
+from_real_avx2(quaternion *out, const double *a, int m, size_t n)
+{
+   const __m256d zero = _mm256_setzero_pd();
+   size_t i;
+   for (i = 0; i < n; i++) {
+      _mm256_storeu_pd(&out[i].w, m > 1 ?
+            _mm256_insertf128_pd(zero, _mm_loadu_pd(a + 2*i), 0) :
+            _mm256_blend_pd(zero, _mm256_broadcast_sd(a + i), 1));
+   }
+}
+
+static AVX2 void
+to_real_avx2(double *out, const quaternion *q, int m, size_t n)
+{
+   size_t i = 0;
+   if (m > 1) {
+      for (; i < n; i++) {
+         _mm_storeu_pd(out + 2*i, _mm_loadu_pd(&q[i].w));
+      }
+      return;
+   }
+   for (; i + 4 <= n; i += 4) {
+      __m256d t0 = _mm256_unpacklo_pd(_mm256_loadu_pd(&q[i].w), _mm256_loadu_pd(&q[i + 1].w));
+      __m256d t1 = _mm256_unpacklo_pd(_mm256_loadu_pd(&q[i + 2].w), _mm256_loadu_pd(&q[i + 3].w));
+      _mm256_storeu_pd(out + i, _mm256_permute2f128_pd(t0, t1, 0x20));
+   }
+   for (; i < n; i++) {
+      out[i] = q[i].w;
+   }
+}
+
+static AVX2 void
+from_real32_avx2(quaternion32 *out, const float *a, int m, size_t n)
+{
+   size_t i;
+   for (i = 0; i < n; i++) {
+      _mm_storeu_ps(&out[i].w, m > 1 ?
+            _mm_castpd_ps(_mm_load_sd((const double *)(a + 2*i))) : _mm_load_ss(a + i));
+   }
+}
+
+static AVX2 void
+to_real32_avx2(float *out, const quaternion32 *q, int m, size_t n)
+{
+   size_t i = 0;
+   if (m > 1) {
+      for (; i < n; i++) {
+         _mm_store_sd((double *)(out + 2*i), _mm_castps_pd(_mm_loadu_ps(&q[i].w)));
+      }
+      return;
+   }
+   for (; i + 8 <= n; i += 8) {
+      /* Lanes hold (q0, q1), (q2, q3), ...; unpack to (w0 w2 w4 w6 | w1 w3 w5 w7) */
+      __m256 t0 = _mm256_unpacklo_ps(_mm256_loadu_ps(&q[i].w), _mm256_loadu_ps(&q[i + 2].w));
+      __m256 t1 = _mm256_unpacklo_ps(_mm256_loadu_ps(&q[i + 4].w), _mm256_loadu_ps(&q[i + 6].w));
+      __m256 w = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+      _mm256_storeu_ps(out + i, _mm256_permutevar8x32_ps(w,
+            _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)));
+   }
+   for (; i < n; i++) {
+      out[i] = q[i].w;
+   }
+}
+
+/* Dual quaternions */
+
+/* Load the parts of q[0..3] as w, x, y, z vectors, or of q[0] if s is zero */
+static AVX2 inline void
+load_dual4(const dual_quaternion *q, int s, __m256d r[4], __m256d d[4])
+{
+   int k;
+   if (!s) {
+      load4(&q->r, 0, r);
+      load4(&q->d, 0, d);
+      return;
+   }
+   for (k = 0; k < 4; k++) {
+      r[k] = _mm256_loadu_pd(&q[k].r.w);
+      d[k] = _mm256_loadu_pd(&q[k].d.w);
+   }
+   transpose4(r);
+   transpose4(d);
+}
+
+static AVX2 inline void
+store_dual4(dual_quaternion *q, __m256d r[4], __m256d d[4])
+{
+   int k;
+   transpose4(r);
+   transpose4(d);
+   for (k = 0; k < 4; k++) {
+      _mm256_storeu_pd(&q[k].r.w, r[k]);
+      _mm256_storeu_pd(&q[k].d.w, d[k]);
+   }
+}
+
+/* Four dual quaternions per step, padded at the end as elsewhere */
+static AVX2 void
+dual_multiply_avx2(dual_quaternion *out, const dual_quaternion *a, int sa,
+      const dual_quaternion *b, int sb, size_t n)
+{
+   __m256d ar[4], ad[4], br[4], bd[4], r[4], d[4];
+   dual_quaternion ta[4], tb[4], to[4];
+   size_t i, k, m;
+   for (i = 0; i < n; i += 4) {
+      const dual_quaternion *pa = a + sa*i, *pb = b + sb*i;
+      int s1 = sa, s2 = sb;
+      m = n - i;
+      if (m < 4) {
+         for (k = 0; k < 4; k++) {
+            ta[k] = pa[sa*(k < m ? k : m - 1)];
+            tb[k] = pb[sb*(k < m ? k : m - 1)];
+         }
+         pa = ta;
+         pb = tb;
+         s1 = s2 = 1;
+      }
+      load_dual4(pa, s1, ar, ad);
+      load_dual4(pb, s2, br, bd);
+      hamilton4(ar, br, r);
+      hamilton4(ar, bd, d);
+      multiply_add4(ad, br, d);
+      if (m < 4) {
+         store_dual4(to, r, d);
+         memcpy(out + i, to, m*sizeof(dual_quaternion));
+      }
+      else {
+         store_dual4(out + i, r, d);
+      }
+   }
+}
+
+/*
+ * As dual_quaternion_transform_point: rotate4 plus the translation
+ * 2 (r_w d_v - d_w r_v + r_v x d_v) / |r|**2.  A single transform is applied
+ * as a matrix, m[0..8], and a translation, m[9..11].
+ */
+static AVX2 void
+dual_transform_avx2(double *out, const dual_quaternion *q, int sq, const double *v,
+      size_t n)
+{
+   __m256d r[4], d[4], vv[3], o[3], m[12];
+   dual_quaternion tq[4];
+   double tv[12], to[12];
+   size_t i, k, j;
+   int h;
+   if (!sq) {
+      double a[9], b[3];
+      quaternion_rotation_matrix(dual_quaternion_rigid_transform(*q, b), a);
+      for (k = 0; k < 9; k++) {
+         m[k] = _mm256_set1_pd(a[k]);
+      }
+      for (k = 0; k < 3; k++) {
+         m[9 + k] = _mm256_set1_pd(b[k]);
+      }
+   }
+   for (i = 0; i < n; i += 4) {
+      const dual_quaternion *pq = q + (sq ? i : 0);
+      const double *pv = v + 3*i;
+      j = n - i;
+      if (j < 4) {
+         for (k = 0; k < 4; k++) {
+            size_t e = i + (k < j ? k : j - 1);
+            tq[k] = q[sq ? e : 0];
+            memcpy(tv + 3*k, v + 3*e, 3*sizeof(double));
+         }
+         pq = tq;
+         pv = tv;
+      }
+      load_vectors4(pv, vv);
+      if (sq) {
+         __m256d t[3], c[3], s;
+         load_dual4(pq, 1, r, d);
+         rotate4(r, vv, o);
+         s = _mm256_div_pd(CONST4(2), _mm256_fmadd_pd(r[3], r[3], _mm256_fmadd_pd(r[2], r[2],
+               _mm256_fmadd_pd(r[1], r[1], _mm256_mul_pd(r[0], r[0])))));
+         for (h = 0; h < 3; h++) {
+            c[h] = _mm256_fnmadd_pd(d[0], r[h + 1], _mm256_mul_pd(r[0], d[h + 1]));
+         }
+         cross_add4(r + 1, d + 1, c, t);
+         for (h = 0; h < 3; h++) {
+            o[h] = _mm256_fmadd_pd(s, t[h], o[h]);
+         }
+      }
+      else {
+         matrix_vector4(m, vv, o);
+         for (h = 0; h < 3; h++) {
+            o[h] = _mm256_add_pd(o[h], m[9 + h]);
+         }
+      }
+      if (j < 4) {
+         store_vectors4(to, o);
+         memcpy(out + 3*i, to, 3*j*sizeof(double));
+      }
+      else {
+         store_vectors4(out + 3*i, o);
+      }
+   }
+}
+
+/* AVX-512 kernels */
+
+#define AVX512 __attribute__((target("avx512f")))
+
+/* Sign bit of a double */
+#define SIGN (-0x7fffffffffffffffLL - 1)
+
+static AVX512 inline __m512d
+flip_signs(__m512d v, __m512i signs)
+{
+   return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(v), signs));
+}
+
+/* Load q[0..1], or q[0] twice if s is zero, leaving lanes past m zero */
+static AVX512 inline __m512d
+load2(const quaternion *q, int s, size_t m)
+{
+   if (!s) {
+      return _mm512_broadcast_f64x4(_mm256_loadu_pd(&q->w));
+   }
+   return m < 2 ? _mm512_maskz_loadu_pd(0x0f, &q->w) : _mm512_loadu_pd(&q->w);
+}
+
+static AVX512 inline void
+store2(quaternion *q, __m512d v, size_t m)
+{
+   if (m < 2) {
+      _mm512_mask_storeu_pd(&q->w, 0x0f, v);
+   }
+   else {
+      _mm512_storeu_pd(&q->w, v);
+   }
+}
+
+/*
+ * Hamilton product of the quaternions in each lane.  Each component sums the
+ * same products in the same order as hamilton4; the signs of the permuted b
+ * terms fold the subtractions into the multiply-adds exactly.
+ */
+static AVX512 inline __m512d
+hamilton2(__m512d a, __m512d b)
+{
+   const __m512i s1 = _mm512_set_epi64(0, SIGN, 0, SIGN, 0, SIGN, 0, SIGN);
+   const __m512i s2 = _mm512_set_epi64(SIGN, 0, 0, SIGN, SIGN, 0, 0, SIGN);
+   const __m512i s3 = _mm512_set_epi64(0, 0, SIGN, SIGN, 0, 0, SIGN, SIGN);
+   __m512d r = _mm512_mul_pd(_mm512_permutex_pd(a, 0x00), b);
+   r = _mm512_fmadd_pd(_mm512_permutex_pd(a, 0x55),
+         flip_signs(_mm512_permutex_pd(b, _MM_SHUFFLE(2, 3, 0, 1)), s1), r);
+   r = _mm512_fmadd_pd(_mm512_permutex_pd(a, 0xaa),
+         flip_signs(_mm512_permutex_pd(b, _MM_SHUFFLE(1, 0, 3, 2)), s2), r);
+   r = _mm512_fmadd_pd(_mm512_permutex_pd(a, 0xff),
+         flip_signs(_mm512_permutex_pd(b, _MM_SHUFFLE(0, 1, 2, 3)), s3), r);
+   return r;
+}
+
+static AVX512 inline __m512d
+multiply2(__m512d a, __m512d b, __mmask8 k)
+{
+   (void)k;
+   return hamilton2(a, b);
+}
+
+/* Divide only in lanes k, so padding lanes can't raise exceptions */
+static AVX512 inline __m512d
+divide2(__m512d a, __m512d b, __mmask8 k)
+{
+   const __m512i conj = _mm512_set_epi64(SIGN, SIGN, SIGN, 0, SIGN, SIGN, SIGN, 0);
+   __m512d bw = _mm512_permutex_pd(b, 0x00), bx = _mm512_permutex_pd(b, 0x55);
+   __m512d by = _mm512_permutex_pd(b, 0xaa), bz = _mm512_permutex_pd(b, 0xff);
+   __m512d s = _mm512_fmadd_pd(bz, bz, _mm512_fmadd_pd(by, by,
+         _mm512_fmadd_pd(bx, bx, _mm512_mul_pd(bw, bw))));
+   return _mm512_maskz_div_pd(k, hamilton2(flip_signs(b, conj), a), s);
+}
+
+/* Two quaternions per step, masking the last one if n is odd */
+#define AVX512_PRODUCT_KERNEL(name)\
+static AVX512 void \
+name##_avx512f(quaternion *out, const quaternion *a, int sa,\
+      const quaternion *b, int sb, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i += 2) {\
+      size_t m = n - i;\
+      __m512d va = load2(a + sa*i, sa, m), vb = load2(b + sb*i, sb, m);\
+      store2(out + i, name##2(va, vb, m < 2 ? 0x0f : 0xff), m);\
+   }\
+}
+
+AVX512_PRODUCT_KERNEL(multiply)
+AVX512_PRODUCT_KERNEL(divide)
+
+static AVX512 inline __m512d
+add2(__m512d a, __m512d b, __mmask8 k)
+{
+   (void)k;
+   return _mm512_add_pd(a, b);
+}
+
+static AVX512 inline __m512d
+subtract2(__m512d a, __m512d b, __mmask8 k)
+{
+   (void)k;
+   return _mm512_sub_pd(a, b);
+}
+
+AVX512_PRODUCT_KERNEL(add)
+AVX512_PRODUCT_KERNEL(subtract)
+
+/* Scalar kernels: broadcast b[i] across the lane of a[i] */
+static AVX512 inline __m512d
+load_scalar2(const double *s, int ss, size_t m)
+{
+   if (!ss || m < 2) {
+      return _mm512_set1_pd(*s);
+   }
+   return _mm512_permutexvar_pd(_mm512_set_epi64(1, 1, 1, 1, 0, 0, 0, 0),
+         _mm512_castpd128_pd512(_mm_loadu_pd(s)));
+}
+
+#define AVX512_SCALAR_KERNEL(name, op)\
+static AVX512 void \
+name##_avx512f(quaternion *out, const quaternion *a, int sa,\
+      const double *b, int sb, size_t n)\
+{\
+   size_t i;\
+   for (i = 0; i < n; i += 2) {\
+      size_t m = n - i;\
+      __m512d va = load2(a + sa*i, sa, m), vb = load_scalar2(b + sb*i, sb, m);\
+      store2(out + i, op(_mm512_setzero_pd(), m < 2 ? 0x0f : 0xff, va, vb), m);\
+   }\
+}
+
+AVX512_SCALAR_KERNEL(multiply_scalar, _mm512_mask_mul_pd)
+AVX512_SCALAR_KERNEL(divide_scalar, _mm512_mask_div_pd)
+
+/* As multiply_add4, eight quaternions per vector */
+static AVX512 inline void
+multiply_add8d(const __m512d a[4], const __m512d b[4], __m512d r[4])
+{
+   r[0] = _mm512_fnmadd_pd(a[3], b[3], _mm512_fnmadd_pd(a[2], b[2],
+         _mm512_fnmadd_pd(a[1], b[1], _mm512_fmadd_pd(a[0], b[0], r[0]))));
+   r[1] = _mm512_fnmadd_pd(a[3], b[2], _mm512_fmadd_pd(a[2], b[3],
+         _mm512_fmadd_pd(a[1], b[0], _mm512_fmadd_pd(a[0], b[1], r[1]))));
+   r[2] = _mm512_fmadd_pd(a[3], b[1], _mm512_fmadd_pd(a[2], b[0],
+         _mm512_fnmadd_pd(a[1], b[3], _mm512_fmadd_pd(a[0], b[2], r[2]))));
+   r[3] = _mm512_fmadd_pd(a[3], b[0], _mm512_fnmadd_pd(a[2], b[1],
+         _mm512_fmadd_pd(a[1], b[2], _mm512_fmadd_pd(a[0], b[3], r[3]))));
+}
+
+/* As matmul_avx2, sixteen quaternions of c at a time */
+static AVX512 void
+matmul_avx512f(double *c, const quaternion *a, size_t kb, const double *b, size_t p)
+{
+   size_t j, k;
+   int h, i;
+   for (j = 0; j < p; j += 16) {
+      __m512d r[2][4], q[4], v[4];
+      for (h = 0; h < 2; h++) {
+         for (i = 0; i < 4; i++) {
+            r[h][i] = _mm512_loadu_pd(c + i*p + j + 8*h);
+         }
+      }
+      for (k = 0; k < kb; k++) {
+         const double *bk = b + 4*p*k + j;
+         q[0] = _mm512_set1_pd(a[k].w);
+         q[1] = _mm512_set1_pd(a[k].x);
+         q[2] = _mm512_set1_pd(a[k].y);
+         q[3] = _mm512_set1_pd(a[k].z);
+         for (h = 0; h < 2; h++) {
+            for (i = 0; i < 4; i++) {
+               v[i] = _mm512_loadu_pd(bk + i*p + 8*h);
+            }
+            multiply_add8d(q, v, r[h]);
+         }
+      }
+      for (h = 0; h < 2; h++) {
+         for (i = 0; i < 4; i++) {
+            _mm512_storeu_pd(c + i*p + j + 8*h, r[h][i]);
+         }
+      }
+   }
+}
+
+#endif
+
+/* Whether quaternion_simd_init selected AVX2 or wider kernels */
+static int simd_avx2 = 0;
+
+const char *
+quaternion_simd_init(const char *max_isa)
+{
+   int level = 2;
+   if (max_isa && !strcmp(max_isa, "none")) {
+      level = 0;
+   }
+   else if (max_isa && !strcmp(max_isa, "avx2")) {
+      level = 1;
+   }
+#ifdef QUATERNION_SIMD_X86
+   __builtin_cpu_init();
+   if (level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      /* AVX-512 has no faster transcendental or single precision kernels */
+      quaternion_power_kernel = power_avx2;
+      quaternion_power_scalar_kernel = power_scalar_avx2;
+      quaternion_exp_kernel = exp_avx2;
+      quaternion_log_kernel = log_avx2;
+      quaternion_rotate_kernel = rotate_avx2;
+      quaternion_slerp_kernel = slerp_avx2;
+      quaternion_distance_kernel = distance_avx2;
+      quaternion_moment_kernel = moment_avx2;
+      quaternion_from_real_kernel = from_real_avx2;
+      quaternion_to_real_kernel = to_real_avx2;
+      quaternion32_from_real_kernel = from_real32_avx2;
+      quaternion32_to_real_kernel = to_real32_avx2;
+      dual_quaternion_multiply_kernel = dual_multiply_avx2;
+      dual_quaternion_transform_kernel = dual_transform_avx2;
+      quaternion32_add_kernel = add32_avx2;
+      quaternion32_subtract_kernel = subtract32_avx2;
+      quaternion32_multiply_kernel = multiply32_avx2;
+      quaternion32_divide_kernel = divide32_avx2;
+      quaternion32_multiply_scalar_kernel = multiply_scalar32_avx2;
+      quaternion32_divide_scalar_kernel = divide_scalar32_avx2;
+      quaternion_add_scalar_kernel = add_scalar_avx2;
+      quaternion_subtract_scalar_kernel = subtract_scalar_avx2;
+      quaternion_rsubtract_scalar_kernel = rsubtract_scalar_avx2;
+      quaternion_rdivide_scalar_kernel = rdivide_scalar_avx2;
+      quaternion32_add_scalar_kernel = add_scalar32_avx2;
+      quaternion32_subtract_scalar_kernel = subtract_scalar32_avx2;
+      quaternion32_rsubtract_scalar_kernel = rsubtract_scalar32_avx2;
+      quaternion32_rdivide_scalar_kernel = rdivide_scalar32_avx2;
+      quaternion_inverse_kernel = inverse_avx2;
+      quaternion_norm_kernel = norm_avx2;
+      quaternion32_inverse_kernel = inverse32_avx2;
+      quaternion32_norm_kernel = norm32_avx2;
+      simd_avx2 = 1;
+      quaternion_simd_fast_normalize(0);
+   }
+   if (level >= 2 && __builtin_cpu_supports("avx512f")) {
+      quaternion_add_kernel = add_avx512f;
+      quaternion_subtract_kernel = subtract_avx512f;
+      quaternion_multiply_kernel = multiply_avx512f;
+      quaternion_divide_kernel = divide_avx512f;
+      quaternion_multiply_scalar_kernel = multiply_scalar_avx512f;
+      quaternion_divide_scalar_kernel = divide_scalar_avx512f;
+      quaternion_matmul_kernel = matmul_avx512f;
+      return "avx512f";
+   }
+   if (level >= 1 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      quaternion_add_kernel = add_avx2;
+      quaternion_subtract_kernel = subtract_avx2;
+      quaternion_multiply_kernel = multiply_avx2;
+      quaternion_divide_kernel = divide_avx2;
+      quaternion_multiply_scalar_kernel = multiply_scalar_avx2;
+      quaternion_divide_scalar_kernel = divide_scalar_avx2;
+      quaternion_matmul_kernel = matmul_avx2;
+      return "avx2";
+   }
+#else
+   (void)level;
+#endif
+   simd_avx2 = 0;
+   quaternion_simd_fast_normalize(0);
+   quaternion_power_kernel = power_generic;
+   quaternion_power_scalar_kernel = power_scalar_generic;
+   quaternion_exp_kernel = exp_generic;
+   quaternion_log_kernel = log_generic;
+   quaternion_add_kernel = add_generic;
+   quaternion_subtract_kernel = subtract_generic;
+   quaternion_multiply_kernel = multiply_generic;
+   quaternion_divide_kernel = divide_generic;
+   quaternion_multiply_scalar_kernel = multiply_scalar_generic;
+   quaternion_divide_scalar_kernel = divide_scalar_generic;
+   quaternion_add_scalar_kernel = add_scalar_generic;
+   quaternion_subtract_scalar_kernel = subtract_scalar_generic;
+   quaternion_rsubtract_scalar_kernel = rsubtract_scalar_generic;
+   quaternion_rdivide_scalar_kernel = rdivide_scalar_generic;
+   quaternion_matmul_kernel = matmul_generic;
+   quaternion_distance_kernel = distance_generic;
+   quaternion_moment_kernel = moment_generic;
+   quaternion_from_real_kernel = from_real_generic;
+   quaternion_to_real_kernel = to_real_generic;
+   quaternion32_from_real_kernel = from_real32_generic;
+   quaternion32_to_real_kernel = to_real32_generic;
+   dual_quaternion_multiply_kernel = dual_multiply_generic;
+   dual_quaternion_transform_kernel = dual_transform_generic;
+   quaternion32_add_kernel = add32_generic;
+   quaternion32_subtract_kernel = subtract32_generic;
+   quaternion32_multiply_kernel = multiply32_generic;
+   quaternion32_divide_kernel = divide32_generic;
+   quaternion32_multiply_scalar_kernel = multiply_scalar32_generic;
+   quaternion32_divide_scalar_kernel = divide_scalar32_generic;
+   quaternion32_add_scalar_kernel = add_scalar32_generic;
+   quaternion32_subtract_scalar_kernel = subtract_scalar32_generic;
+   quaternion32_rsubtract_scalar_kernel = rsubtract_scalar32_generic;
+   quaternion32_rdivide_scalar_kernel = rdivide_scalar32_generic;
+   quaternion_inverse_kernel = inverse_generic;
+   quaternion_norm_kernel = norm_generic;
+   quaternion32_inverse_kernel = inverse32_generic;
+   quaternion32_norm_kernel = norm32_generic;
+   return "none";
+}
+
+int
+quaternion_simd_fast_normalize(int fast)
+{
+#ifdef QUATERNION_SIMD_X86
+   if (simd_avx2) {
+      quaternion_normalized_kernel = fast ? fast_normalized_avx2 : normalized_avx2;
+      quaternion_unit_multiply_kernel = fast ? fast_unit_multiply_avx2 : unit_multiply_avx2;
+      quaternion32_normalized_kernel = fast ? fast_normalized32_avx2 : normalized32_avx2;
+      quaternion32_unit_multiply_kernel = fast ? fast_unit_multiply32_avx2 : unit_multiply32_avx2;
+      return fast != 0;
+   }
+#endif
+   (void)fast;
+   quaternion_normalized_kernel = normalized_generic;
+   quaternion_unit_multiply_kernel = unit_multiply_generic;
+   quaternion32_normalized_kernel = normalized32_generic;
+   quaternion32_unit_multiply_kernel = unit_multiply32_generic;
+   return 0;
+}
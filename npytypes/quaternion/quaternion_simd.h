@@ -0,0 +1,138 @@
+/*
+ * Vectorized quaternion array kernels
+ *
+ * Each kernel computes out[i] = a[i] op b[i] for i < n over contiguous
+ * arrays.  An input whose flag (sa, sb) is zero is not advanced, so a single
+ * quaternion or scalar can be broadcast against an array.  Unary kernels
+ * compute out[i] = f(a[i]), and the norm kernels the real |a[i]|**2.  The
+ * scalar kernels take real b[i]; the rsubtract and rdivide ones compute
+ * b[i] - a[i] and b[i]/a[i].
+ * quaternion_rotate_kernel rotates the contiguous 3-vectors v[3*i..3*i+2] by
+ * q[i] (or by q[0] if sq is zero).
+ * quaternion_slerp_kernel interpolates from a[i] to b[i] by t[i].
+ * quaternion_matmul_kernel adds a[0] b_0 + ... + a[kb-1] b_(kb-1) to c, where c
+ * and each b_k = b + 4*p*k hold p quaternions as planes of p w, x, y and z
+ * components and p is a multiple of QUATERNION_PLANE_ALIGN.
+ * quaternion_distance_kernel computes out[j] = quaternion_rotation_distance(q,
+ * b_j) for unit q and p unit quaternions b_j held in planes the same way, the
+ * planes starting stride doubles apart.  quaternion_moment_kernel adds to the
+ * symmetric 4x4 matrix m the sum of w[i] q[i] q[i]^T / |q[i]|^2 (w[0] for all
+ * i if sw is zero), with q[i] as a column vector, skipping zero q[i].  quaternion_from_real_kernel
+ * makes quaternions from the m = 1 (real) or m = 2 (complex) leading
+ * components a[m*i..m*i+m-1], the others zero, and quaternion_to_real_kernel
+ * extracts them.  The quaternion32_* kernels are the single precision
+ * versions.  dual_quaternion_multiply_kernel multiplies dual quaternions as
+ * the binary kernels do, and dual_quaternion_transform_kernel moves the
+ * 3-vectors v[3*i..3*i+2] by q[i] (or q[0]) as
+ * dual_quaternion_transform_point.  The kernels are function pointers, set by
+ * quaternion_simd_init to the widest instruction set the running CPU
+ * supports; quaternion_simd_fast_normalize switches the normalized and
+ * unit_multiply kernels between exact and approximate versions.
+ */
+#ifndef __QUATERNION_SIMD_H__
+#define __QUATERNION_SIMD_H__
+
+#include <stddef.h>
+#include "quaternion.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void quaternion_binary_kernel(quaternion *out, const quaternion *a, int sa,
+        const quaternion *b, int sb, size_t n);
+typedef void quaternion_scalar_kernel(quaternion *out, const quaternion *a, int sa,
+        const double *b, int sb, size_t n);
+typedef void quaternion_unary_kernel(quaternion *out, const quaternion *a, size_t n);
+typedef void quaternion_real_kernel(double *out, const quaternion *a, size_t n);
+typedef void quaternion_vector_kernel(double *out, const quaternion *q, int sq,
+        const double *v, size_t n);
+typedef void quaternion32_binary_kernel(quaternion32 *out, const quaternion32 *a, int sa,
+        const quaternion32 *b, int sb, size_t n);
+typedef void quaternion32_scalar_kernel(quaternion32 *out, const quaternion32 *a, int sa,
+        const float *b, int sb, size_t n);
+typedef void quaternion32_unary_kernel(quaternion32 *out, const quaternion32 *a, size_t n);
+typedef void quaternion32_real_kernel(float *out, const quaternion32 *a, size_t n);
+typedef void quaternion_interpolate_kernel(quaternion *out, const quaternion *a, int sa,
+        const quaternion *b, int sb, const double *t, int st, size_t n);
+typedef void quaternion_panel_kernel(double *c, const quaternion *a, size_t kb,
+        const double *b, size_t p);
+typedef void quaternion_plane_kernel(double *out, quaternion q, const double *b,
+        size_t stride, size_t p);
+typedef void quaternion_outer_kernel(double *m, const quaternion *q, const double *w,
+        int sw, size_t n);
+typedef void quaternion_pack_kernel(quaternion *out, const double *a, int m, size_t n);
+typedef void quaternion_unpack_kernel(double *out, const quaternion *q, int m, size_t n);
+typedef void quaternion32_pack_kernel(quaternion32 *out, const float *a, int m, size_t n);
+typedef void quaternion32_unpack_kernel(float *out, const quaternion32 *q, int m, size_t n);
+typedef void dual_quaternion_binary_kernel(dual_quaternion *out, const dual_quaternion *a,
+        int sa, const dual_quaternion *b, int sb, size_t n);
+typedef void dual_quaternion_vector_kernel(double *out, const dual_quaternion *q, int sq,
+        const double *v, size_t n);
+
+#define QUATERNION_PLANE_ALIGN 16
+
+extern quaternion_binary_kernel *quaternion_add_kernel;
+extern quaternion_binary_kernel *quaternion_subtract_kernel;
+extern quaternion_binary_kernel *quaternion_multiply_kernel;
+extern quaternion_binary_kernel *quaternion_divide_kernel;
+extern quaternion_scalar_kernel *quaternion_multiply_scalar_kernel;
+extern quaternion_scalar_kernel *quaternion_divide_scalar_kernel;
+extern quaternion_scalar_kernel *quaternion_add_scalar_kernel;
+extern quaternion_scalar_kernel *quaternion_subtract_scalar_kernel;
+extern quaternion_scalar_kernel *quaternion_rsubtract_scalar_kernel;
+extern quaternion_scalar_kernel *quaternion_rdivide_scalar_kernel;
+extern quaternion_binary_kernel *quaternion_power_kernel;
+extern quaternion_scalar_kernel *quaternion_power_scalar_kernel;
+extern quaternion_unary_kernel *quaternion_exp_kernel;
+extern quaternion_unary_kernel *quaternion_log_kernel;
+extern quaternion_unary_kernel *quaternion_normalized_kernel;
+extern quaternion_unary_kernel *quaternion_inverse_kernel;
+extern quaternion_real_kernel *quaternion_norm_kernel;
+extern quaternion_binary_kernel *quaternion_unit_multiply_kernel;
+extern quaternion_vector_kernel *quaternion_rotate_kernel;
+extern quaternion_interpolate_kernel *quaternion_slerp_kernel;
+extern quaternion_panel_kernel *quaternion_matmul_kernel;
+extern quaternion_plane_kernel *quaternion_distance_kernel;
+extern quaternion_outer_kernel *quaternion_moment_kernel;
+extern quaternion_pack_kernel *quaternion_from_real_kernel;
+extern quaternion_unpack_kernel *quaternion_to_real_kernel;
+extern quaternion32_binary_kernel *quaternion32_add_kernel;
+extern quaternion32_binary_kernel *quaternion32_subtract_kernel;
+extern quaternion32_binary_kernel *quaternion32_multiply_kernel;
+extern quaternion32_binary_kernel *quaternion32_divide_kernel;
+extern quaternion32_scalar_kernel *quaternion32_multiply_scalar_kernel;
+extern quaternion32_scalar_kernel *quaternion32_divide_scalar_kernel;
+extern quaternion32_scalar_kernel *quaternion32_add_scalar_kernel;
+extern quaternion32_scalar_kernel *quaternion32_subtract_scalar_kernel;
+extern quaternion32_scalar_kernel *quaternion32_rsubtract_scalar_kernel;
+extern quaternion32_scalar_kernel *quaternion32_rdivide_scalar_kernel;
+extern quaternion32_unary_kernel *quaternion32_normalized_kernel;
+extern quaternion32_unary_kernel *quaternion32_inverse_kernel;
+extern quaternion32_real_kernel *quaternion32_norm_kernel;
+extern quaternion32_binary_kernel *quaternion32_unit_multiply_kernel;
+extern quaternion32_pack_kernel *quaternion32_from_real_kernel;
+extern quaternion32_unpack_kernel *quaternion32_to_real_kernel;
+extern dual_quaternion_binary_kernel *dual_quaternion_multiply_kernel;
+extern dual_quaternion_vector_kernel *dual_quaternion_transform_kernel;
+
+/*
+ * Select kernels for the running CPU, using nothing wider than max_isa
+ * ("avx512f", "avx2" or "none"; NULL means no limit).  Returns the name of the
+ * instruction set selected.
+ */
+const char *quaternion_simd_init(const char *max_isa);
+
+/*
+ * Use approximate reciprocal square roots, refined by Newton's method, in the
+ * normalized and unit_multiply kernels if fast is nonzero, and exact square
+ * roots and divisions otherwise.  Returns whether the approximate kernels are
+ * in use, which needs AVX2.  quaternion_simd_init selects the exact ones.
+ */
+int quaternion_simd_fast_normalize(int fast);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,328 @@
+/*
+ * Quaternion arithmetic, for one precision
+ *
+ * This file is included by quaternion.c once for each precision, and by
+ * quaternion.h for QUATERNION_INLINE, with
+ *
+ *    Q        the quaternion type
+ *    T        its component type
+ *    F(name)  the name of function name, such as quaternion32_name
+ *    M(name)  the <math.h> function name for T, such as sqrtf for sqrt
+ *    L(name)  the <float.h> limit for T, such as FLT_MAX for MAX
+ *    E        the tolerance of isunit, such as QUATERNION32_UNIT_TOLERANCE
+ *    S        the storage class of the functions, empty or static inline
+ *
+ * defined, and undefines them at the end.  There is no include guard.
+ */
+
+S int
+F(isnonzero)(Q q)
+{
+    return q.w != 0 || q.x != 0 || q.y != 0 || q.z != 0;
+}
+
+S int
+F(isnan)(Q q)
+{
+    return isnan(q.w) || isnan(q.x) || isnan(q.y) || isnan(q.z);
+}
+
+S int
+F(isinf)(Q q)
+{
+    return isinf(q.w) || isinf(q.x) || isinf(q.y) || isinf(q.z);
+}
+
+S int
+F(isfinite)(Q q)
+{
+    return isfinite(q.w) && isfinite(q.x) && isfinite(q.y) && isfinite(q.z);
+}
+
+/* The larger of a and b, compiling to a single max instruction */
+#define LARGER(a, b) ((a) > (b) ? (a) : (b))
+
+/* The largest absolute component of q, for finite q */
+#define MAXABS(q) LARGER(LARGER(M(fabs)((q).w), M(fabs)((q).x)),\
+                         LARGER(M(fabs)((q).y), M(fabs)((q).z)))
+
+/* Scales q by 2**-e, e the exponent of MAXABS(q), exactly unless q is tiny */
+#define DOWNSCALE(q, e) (M(frexp)(MAXABS(q), &(e)),\
+   (q) = (Q) {M(ldexp)((q).w, -(e)), M(ldexp)((q).x, -(e)),\
+              M(ldexp)((q).y, -(e)), M(ldexp)((q).z, -(e))})
+
+/*
+ * Finite q whose squares would overflow, or lose bits to underflow, is scaled
+ * down first, as hypot does
+ */
+S T
+F(absolute)(Q q)
+{
+   T m = MAXABS(q);
+   int e;
+   if ((m >= M(sqrt)(L(MIN)) && m <= M(sqrt)(L(MAX))/4) ||
+         m == 0 || !F(isfinite)(q)) {
+      return M(sqrt)(q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z);
+   }
+   DOWNSCALE(q, e);
+   return M(ldexp)(M(sqrt)(q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z), e);
+}
+
+/* The squared norm |q|**2 */
+S T
+F(norm)(Q q)
+{
+   return q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z;
+}
+
+S int
+F(isunit)(Q q)
+{
+   return M(fabs)(F(norm)(q) - 1) <= E;
+}
+
+/* The Euclidean inner product of q1 and q2 as 4-vectors */
+S T
+F(inner)(Q q1, Q q2)
+{
+   return q1.w*q2.w + q1.x*q2.x + q1.y*q2.y + q1.z*q2.z;
+}
+
+S Q
+F(add)(Q q1, Q q2)
+{
+   return (Q) {
+      q1.w+q2.w,
+      q1.x+q2.x,
+      q1.y+q2.y,
+      q1.z+q2.z,
+   };
+}
+
+S Q
+F(subtract)(Q q1, Q q2)
+{
+   return (Q) {
+      q1.w-q2.w,
+      q1.x-q2.x,
+      q1.y-q2.y,
+      q1.z-q2.z,
+   };
+}
+
+S Q
+F(multiply)(Q q1, Q q2)
+{
+   return (Q) {
+      q1.w*q2.w - q1.x*q2.x - q1.y*q2.y - q1.z*q2.z,
+      q1.w*q2.x + q1.x*q2.w + q1.y*q2.z - q1.z*q2.y,
+      q1.w*q2.y - q1.x*q2.z + q1.y*q2.w + q1.z*q2.x,
+      q1.w*q2.z + q1.x*q2.y - q1.y*q2.x + q1.z*q2.w,
+   };
+}
+
+S Q
+F(divide)(Q q1, Q q2)
+{
+   T s = q2.w*q2.w + q2.x*q2.x + q2.y*q2.y + q2.z*q2.z;
+   return (Q) {
+      (  q1.w*q2.w + q1.x*q2.x + q1.y*q2.y + q1.z*q2.z) / s,
+      (- q1.w*q2.x + q1.x*q2.w + q1.y*q2.z - q1.z*q2.y) / s,
+      (- q1.w*q2.y - q1.x*q2.z + q1.y*q2.w + q1.z*q2.x) / s,
+      (- q1.w*q2.z + q1.x*q2.y - q1.y*q2.x + q1.z*q2.w) / s
+   };
+}
+
+S Q
+F(multiply_scalar)(Q q, T s)
+{
+   return (Q) {s*q.w, s*q.x, s*q.y, s*q.z};
+}
+
+S Q
+F(divide_scalar)(Q q, T s)
+{
+   return (Q) {q.w/s, q.x/s, q.y/s, q.z/s};
+}
+
+S Q
+F(add_scalar)(Q q, T s)
+{
+   return (Q) {q.w+s, q.x, q.y, q.z};
+}
+
+S Q
+F(subtract_scalar)(Q q, T s)
+{
+   return (Q) {q.w-s, q.x, q.y, q.z};
+}
+
+/* s - q and s/q, taking their arguments in the order of the functions above */
+S Q
+F(rsubtract_scalar)(Q q, T s)
+{
+   return (Q) {s-q.w, -q.x, -q.y, -q.z};
+}
+
+S Q
+F(rdivide_scalar)(Q q, T s)
+{
+   T k = s / (q.w*q.w + q.x*q.x + q.y*q.y + q.z*q.z);
+   return (Q) {k*q.w, -k*q.x, -k*q.y, -k*q.z};
+}
+
+S Q
+F(normalized)(Q q)
+{
+   return F(divide_scalar)(q, F(absolute)(q));
+}
+
+S Q
+F(inverse)(Q q)
+{
+   return F(rdivide_scalar)(q, 1);
+}
+
+/*
+ * The product q1*q2 scaled to unit length, as for composing rotations.  As
+ * |q1*q2| = |q1||q2|, finite q1 and q2 whose product could overflow or
+ * underflow are scaled down first, which only changes its length.
+ */
+S Q
+F(unit_multiply)(Q q1, Q q2)
+{
+   const T lo = M(sqrt)(M(sqrt)(L(MIN))), hi = M(sqrt)(M(sqrt)(L(MAX)))/4;
+   T m1 = MAXABS(q1), m2 = MAXABS(q2);
+   int e;
+   if (!(m1 >= lo && m1 <= hi && m2 >= lo && m2 <= hi) &&
+         F(isfinite)(q1) && F(isfinite)(q2)) {
+      DOWNSCALE(q1, e);
+      DOWNSCALE(q2, e);
+   }
+   return F(normalized)(F(multiply)(q1, q2));
+}
+
+S Q
+F(log)(Q q)
+{
+   T sumvsq = q.x*q.x + q.y*q.y + q.z*q.z;
+   T vnorm = M(sqrt)(sumvsq);
+   if (vnorm > 0) {
+      /*
+       * |q|**2 - 1, summed with the rounding errors of the squares and of
+       * each addition, so that log|q| = log1p(r)/2 keeps its accuracy near
+       * |q| = 1, where log(|q|) would cancel
+       */
+      T w2 = q.w*q.w, x2 = q.x*q.x, y2 = q.y*q.y, z2 = q.z*q.z;
+      T lo = (M(fma)(q.w, q.w, -w2) + M(fma)(q.x, q.x, -x2)) +
+             (M(fma)(q.y, q.y, -y2) + M(fma)(q.z, q.z, -z2));
+      T r = -1, c = 0, t, b, logm;
+      T s = M(atan2)(vnorm, q.w) / vnorm;
+#define TWO_SUM(a) (t = r + (a), b = t - r, c += (r - (t - b)) + ((a) - b), r = t)
+      TWO_SUM(w2); TWO_SUM(x2); TWO_SUM(y2); TWO_SUM(z2);
+#undef TWO_SUM
+      r += c + lo;
+      logm = M(fabs)(r) < (T)0.5 ? M(log1p)(r)/2 : M(log)(F(absolute)(q));
+      return (Q) {logm, s*q.x, s*q.y, s*q.z};
+   } else {
+      /* Real q: the axis of a negative real is arbitrary, so use x */
+      return (Q) {M(log)(M(fabs)(q.w)), M(atan2)(0, q.w), 0, 0};
+   }
+}
+
+S Q
+F(exp)(Q q)
+{
+   T vnorm = M(sqrt)(q.x*q.x + q.y*q.y + q.z*q.z);
+   T e = M(exp)(q.w);
+   T s = vnorm > 0 ? M(sin)(vnorm) / vnorm : 1;
+   return (Q) {e*M(cos)(vnorm), e*s*q.x, e*s*q.y, e*s*q.z};
+}
+
+S Q
+F(power)(Q q, Q p)
+{
+   return F(exp)(F(multiply)(F(log)(q), p));
+}
+
+S Q
+F(power_scalar)(Q q, T p)
+{
+   return F(exp)(F(multiply_scalar)(F(log)(q), p));
+}
+
+S Q
+F(negative)(Q q)
+{
+   return (Q) {-q.w, -q.x, -q.y, -q.z};
+}
+
+S Q
+F(conjugate)(Q q)
+{
+   return (Q) {q.w, -q.x, -q.y, -q.z};
+}
+
+S Q
+F(copysign)(Q q1, Q q2)
+{
+    return (Q) {
+        M(copysign)(q1.w, q2.w),
+        M(copysign)(q1.x, q2.x),
+        M(copysign)(q1.y, q2.y),
+        M(copysign)(q1.z, q2.z)
+    };
+}
+
+S int
+F(equal)(Q q1, Q q2)
+{
+    return 
+        !F(isnan)(q1) &&
+        !F(isnan)(q2) &&
+        q1.w == q2.w && 
+        q1.x == q2.x && 
+        q1.y == q2.y && 
+        q1.z == q2.z;
+}
+
+S int
+F(not_equal)(Q q1, Q q2)
+{
+    return !F(equal)(q1, q2);
+}
+
+S int
+F(less)(Q q1, Q q2)
+{
+    return
+        (!F(isnan)(q1) &&
+        !F(isnan)(q2)) && (
+            q1.w != q2.w ? q1.w < q2.w :
+            q1.x != q2.x ? q1.x < q2.x :
+            q1.y != q2.y ? q1.y < q2.y :
+            q1.z != q2.z ? q1.z < q2.z : 0);
+}
+
+S int
+F(less_equal)(Q q1, Q q2)
+{
+   return
+        (!F(isnan)(q1) &&
+        !F(isnan)(q2)) && (
+            q1.w != q2.w ? q1.w < q2.w :
+            q1.x != q2.x ? q1.x < q2.x :
+            q1.y != q2.y ? q1.y < q2.y :
+            q1.z != q2.z ? q1.z < q2.z : 1);
+}
+
+#undef LARGER
+#undef MAXABS
+#undef DOWNSCALE
+#undef Q
+#undef T
+#undef F
+#undef M
+#undef L
+#undef E
+#undef S
@@ -0,0 +1,505 @@
+#!/usr/bin/env python
+
+from __future__ import division
+from numpy import *
+from numpy.testing import assert_
+from npytypes.quaternion import *
+
+# Component dtype and tolerance, relative to the norms of the operands, of
+# each precision
+REAL = {quaternion: float64, quaternion32: float32}
+TOL = {quaternion: 1e-13, quaternion32: 1e-5}
+
+def quaternions(c, Q=quaternion):
+    '''Quaternions with components c[...,0:4]'''
+    return ascontiguousarray(c, REAL[Q]).view(Q).reshape(shape(c)[:-1])
+
+def components(q):
+    return ascontiguousarray(q).view(REAL[q.dtype.type]).reshape(q.shape+(4,))
+
+def random_quaternions(n, Q=quaternion, seed=1):
+    return quaternions(random.RandomState(seed).normal(size=(n,4)), Q)
+
+def random_rotations(n, seed=1):
+    c = random.RandomState(seed).normal(size=(n,4))
+    return quaternions(c/sqrt((c*c).sum(-1))[:,newaxis])
+
+def strided(q):
+    '''A copy of q in every other element of a larger array'''
+    s = empty(2*len(q),q.dtype)[::2]
+    s[...] = q
+    return s
+
+def assert_close(a, b, tol, scale=None):
+    '''|a-b| within tol relative to scale, by default the norms of b'''
+    a, b = components(a), components(b)
+    if scale is None:
+        scale = sqrt((b*b).sum(-1))[...,newaxis]
+    err = abs(a-b)/maximum(scale,1e-300)
+    if err.size:
+        assert_(err.max()<=tol,'error %g above %g'%(err.max(),tol))
+
+def hamilton(a, b):
+    '''Quaternion product of components, as a reference'''
+    aw, ax, ay, az = rollaxis(a,-1)
+    bw, bx, by, bz = rollaxis(b,-1)
+    return stack([aw*bw-ax*bx-ay*by-az*bz, aw*bx+ax*bw+ay*bz-az*by,
+                  aw*by-ax*bz+ay*bw+az*bx, aw*bz+ax*by-ay*bx+az*bw],-1)
+
+def test_kernels():
+    # Contiguous arrays run the vectorized kernels and strided ones the element
+    # by element loops, which must agree, tails and broadcasts included
+    for Q in quaternion, quaternion32:
+        for n in 0,1,3,4,5,8,9,31,1000:
+            a = random_quaternions(n,Q,1)
+            b = random_quaternions(n,Q,2)
+            s = random.RandomState(3).uniform(1,2,n).astype(REAL[Q])
+            for f in negative,conjugate,exp,log,normalized,inverse:
+                assert_close(f(a),f(strided(a)),TOL[Q])
+            for f in absolute,norm:
+                assert_(allclose(f(a),f(strided(a)),rtol=TOL[Q],atol=0))
+            for f in add,subtract,multiply,divide,power,unit_multiply:
+                assert_close(f(a,b),f(strided(a),strided(b)),TOL[Q])
+                if n:
+                    assert_close(f(a[:1],b),f(strided(a)[:1],strided(b)),TOL[Q])
+                    assert_close(f(a,b[:1]),f(strided(a),strided(b)[:1]),TOL[Q])
+            for f in add,subtract,multiply,divide:
+                assert_close(f(a,s),f(strided(a),strided(s)),TOL[Q])
+                assert_close(f(s,a),f(strided(s),strided(a)),TOL[Q])
+            assert_close(a*b,quaternions(hamilton(components(a),components(b)),Q),TOL[Q])
+    # In place operations alias the output with the first input
+    a = random_quaternions(13)
+    b = random_quaternions(13,seed=2)
+    c = a*b
+    a *= b
+    assert_(all(a==c))
+
+def test_extremes():
+    # Squared norms that overflow or underflow are scaled down first, in the
+    # kernels, the strided loops and the fast kernels alike, as are those
+    # which only leave the float range of the fast estimate
+    for Q in quaternion, quaternion32:
+        big, tiny = (1e300, 1e-310) if Q is quaternion else (1e30, 1e-40)
+        fbig = 1e20 if Q is quaternion else 1e10
+        c = random.RandomState(7).normal(size=(9,4))
+        n = sqrt((c*c).sum(-1))
+        for k in big,tiny,fbig,1/fbig:
+            q = quaternions(c*k,Q)
+            expected = quaternions(c/n[:,newaxis],Q)
+            for fast in False,True:
+                set_fast_normalize(fast)
+                for x in q,strided(q):
+                    assert_close(normalized(x),expected,4*TOL[Q])
+                    assert_close(unit_multiply(x,x),expected*expected,4*TOL[Q])
+                    assert_close(unit_multiply(x,q[:1]),expected*expected[:1],4*TOL[Q])
+            set_fast_normalize(False)
+            assert_(allclose(absolute(q)/k,n,rtol=4*TOL[Q],atol=0))
+        # Zero components don't lose the scale
+        assert_(absolute(Q(tiny,0,0,0))==REAL[Q](tiny))
+        assert_(absolute(Q(-big,0,0,0))==REAL[Q](big))
+        assert_(absolute(Q(0,0,0,0))==0 and isinf(absolute(Q(inf,1,0,0))))
+    set_fast_normalize(False)
+
+def test_accumulate():
+    # Each element of an accumulation depends on the output before it, which
+    # the kernels must not read early
+    for Q in quaternion, quaternion32:
+        for n in 1,2,7,64,1000,5000:
+            a = random_quaternions(n,Q)
+            a = a/absolute(a)
+            for f in add,subtract,multiply,divide,unit_multiply:
+                serial = a.copy()
+                for i in range(1,n):
+                    serial[i] = f(serial[i-1:i],a[i:i+1])[0]
+                # Sums are compared relative to the sum of the norms
+                scale = arange(1,n+1)[:,newaxis] if f in (add,subtract) else None
+                for x in a,strided(a):
+                    assert_close(f.accumulate(x),serial,sqrt(n)*TOL[Q],scale)
+                if f in (add,multiply):
+                    assert_close(f.reduce(a)[newaxis],serial[-1:],sqrt(n)*TOL[Q],
+                                 None if scale is None else scale[-1:])
+
+def test_log():
+    # The real part of log is log|q| = log1p(|q|**2-1)/2, accurate near |q| = 1
+    from fractions import Fraction
+    from math import log1p
+    for Q in quaternion, quaternion32:
+        c = components(random_rotations(1000))
+        c *= 1+random.RandomState(2).uniform(-1e-6,1e-6,(1000,1))
+        q = quaternions(c,Q)
+        c = components(q)
+        # |q|**2-1 summed exactly, with a loop since sum is numpy's here
+        expected = []
+        for row in c:
+            s = Fraction(-1)
+            for x in row:
+                s += Fraction(float(x))**2
+            expected.append(log1p(s)/2)
+        for x in q,strided(q):
+            real = components(log(x))[:,0]
+            assert_(allclose(real,expected,rtol=TOL[Q],atol=0))
+        assert_close(exp(log(q)),q,TOL[Q])
+
+def test_conversions():
+    q = random_rotations(1001)
+    v = random.RandomState(2).normal(size=(1001,3))
+    # rotate is q*v*conjugate(q) for unit q
+    pure = quaternions(concatenate([zeros((1001,1)),v],1))
+    assert_(allclose(rotate(q,v),components(q*pure*conjugate(q))[:,1:]))
+    # and q*v*inverse(q) for any nonzero q
+    q2 = random_quaternions(1001,seed=3)
+    assert_(allclose(rotate(q2,v),components(q2*pure*inverse(q2))[:,1:]))
+    m = as_rotation_matrix(q)
+    assert_(allclose(einsum('nij,nj->ni',m,v),rotate(q,v)))
+    assert_(allclose(einsum('nij,nkj->nik',m,m),eye(3)))
+    # Round trips give q or -q
+    for back in from_rotation_matrix(m),from_rotation_vector(as_rotation_vector(q)),from_euler(as_euler(q)):
+        assert_(allclose(abs(inner(back,q)),1,rtol=0,atol=1e-13))
+        assert_(allclose(absolute(back),1))
+    assert_(all(abs(as_rotation_vector(q)).sum(-1)<=sqrt(3)*pi))
+    for w in 1.,-2.,0.:
+        with errstate(all='raise'):
+            assert_(array_equal(as_rotation_vector(quaternion(w,0,0,0)),zeros(3)))
+    assert_(isnan(as_rotation_vector(quaternion(nan,0,0,0))).all())
+    e = as_euler(q)
+    assert_(all((e[:,1]>=0)&(e[:,1]<=pi)))
+
+def test_slerp():
+    q0 = random_rotations(100,1)
+    q1 = random_rotations(100,2)
+    # Endpoints, on the shorter arc, so q1 may come back as -q1
+    assert_close(slerp(q0,q1,0.),q0,1e-14)
+    assert_(allclose(abs(inner(slerp(q0,q1,1.),q1)),1))
+    assert_(allclose(rotation_distance(slerp(q0,q1,1.),q1),0,atol=1e-7))
+    assert_close(slerp(q0,q1,.3),slerp(strided(q0),strided(q1),strided(full(100,.3))),1e-14)
+    s0 = random_rotations(100,3)
+    s1 = random_rotations(100,4)
+    assert_close(squad(q0,q1,s0,s1,0.),q0,1e-14)
+    assert_close(squad(q0,q1,s0,s1,1.),q1,1e-14)
+    assert_(allclose(absolute(squad(q0,q1,s0,s1,.4)),1))
+
+def test_mean_rotation():
+    q = random_rotations(101)
+    w = random.RandomState(2).uniform(0,1,101)
+    mean = mean_rotation(q)
+    assert_(allclose(absolute(mean),1))
+    # q and -q count the same, and zero quaternions are skipped
+    assert_close(mean_rotation(where(arange(101)%2,q,-q)),mean,1e-13)
+    zero = quaternion(0,0,0,0)
+    for x in concatenate([q,[zero]]),concatenate([[zero],q,[zero,zero]]):
+        assert_close(mean_rotation(x),mean,1e-13)
+        assert_close(mean_rotation(strided(x)),mean,1e-13)
+    weighted = weighted_mean_rotation(q,w)
+    assert_close(weighted_mean_rotation(concatenate([q,[zero]]),concatenate([w,[5.]])),
+                 weighted,1e-13)
+    assert_(isnan(components(mean_rotation(zeros(5,quaternion)))).all())
+
+def test_resample():
+    def reference(q0, q1, u):
+        # slerp on the shorter arc, from the components
+        a, b = components(q0), components(q1)
+        d = (a*b).sum(-1)[:,newaxis]
+        b, d = where(d<0,-b,b), abs(d)
+        theta = arccos(minimum(d,1))
+        u = u[:,newaxis]
+        return quaternions((sin((1-u)*theta)*a+sin(u*theta)*b)/sin(theta))
+    rs = random.RandomState(2)
+    times = cumsum(rs.uniform(.5,1.5,50))
+    q = random_rotations(50)
+    # Samples are reproduced, times between them slerped, and the end values
+    # held outside
+    assert_close(resample(times,q,times[:-1]),q[:-1],1e-14)
+    new = sort(rs.uniform(times[0]-3,times[-1]+3,500))
+    j = clip(searchsorted(times,new,'right')-1,0,48)
+    u = clip((new-times[j])/(times[j+1]-times[j]),0,1)
+    expected = reference(q[j],q[j+1],u)
+    assert_close(resample(times,q,new),expected,1e-13)
+    assert_close(resample(times,q,new[::-1]),expected[::-1],1e-13)
+    assert_close(resample(times,strided(q),new),expected,1e-13)
+    assert_close(resample(times,q,new[new<times[0]]),q[:1],1e-14)
+    # Stacked series, and a single sample held everywhere
+    assert_close(resample(times,stack([q,q[::-1]]),new)[1],
+                 resample(times,q[::-1].copy(),new),1e-14)
+    assert_close(resample(times[:1],q[:1],new),q[:1],0)
+
+def test_product():
+    # The ordered products of a chain, against serial loops; with k > 0 they
+    # are renormalized, which only changes their norms
+    rs = random.RandomState(3)
+    for n in 1,5,100,3000:
+        q = random_rotations(n,n)*(1+rs.uniform(-1e-3,1e-3,n))
+        serial = q.copy()
+        for i in range(1,n):
+            serial[i] = serial[i-1]*q[i]
+        c = components(serial)
+        length = sqrt((c*c).sum(-1))[:,newaxis]
+        unit = quaternions(c/length)
+        assert_close(product(q,0)[newaxis],serial[-1:],1e-14)
+        assert_close(cumulative_product(q,0),serial,1e-14)
+        for k in 1,7,64:
+            assert_close(product(q,k)[newaxis],unit[-1:],1e-14,1)
+            for x in cumulative_product(q,k),cumulative_product(strided(q),k):
+                r = sqrt((components(x)**2).sum(-1))
+                assert_close(quaternions(components(x)/r[:,newaxis]),unit,1e-14,1)
+                # The norms keep at most k factors of 1 +- 1e-3
+                assert_(all(abs(log(r))<=k*1.001e-3))
+    assert_(product(zeros(0,quaternion),3)==quaternion(1,0,0,0))
+
+def test_angular_velocity():
+    # Constant rates are integrated exactly, at any spacing
+    t = cumsum(random.RandomState(2).uniform(.01,.03,200))
+    omega = array([.3,-1.2,.7])
+    a = (t-t[0])*sqrt((omega**2).sum())/2
+    axis = omega/sqrt((omega**2).sum())
+    exact = quaternions(concatenate([cos(a)[:,newaxis],sin(a)[:,newaxis]*axis],1))
+    w = tile(omega,(200,1))
+    assert_close(integrate_angular_velocity(w,t),exact,1e-13)
+    assert_(allclose(angular_velocity(exact,t),w,rtol=0,atol=1e-13))
+    assert_(allclose(angular_velocity(where(arange(200)%3,exact,-exact),t),w,rtol=0,atol=1e-13))
+    # Rotating by alpha about z and then beta about x, the body rates are
+    # (beta', alpha' sin(beta), alpha' cos(beta)); the integration error falls
+    # as h**4, and that of angular_velocity as h**2
+    errors = []
+    for n in 50,100,200,400:
+        t = linspace(0,2,n+1)
+        alpha, beta = sin(2*t), cos(t)
+        da, db = 2*cos(2*t), -sin(t)
+        w = stack([db,da*sin(beta),da*cos(beta)],1)
+        zero = zeros_like(t)
+        q = (quaternions(stack([cos(alpha/2),zero,zero,sin(alpha/2)],1))*
+             quaternions(stack([cos(beta/2),sin(beta/2),zero,zero],1)))
+        q = conjugate(q[0])*q
+        errors.append([abs(components(integrate_angular_velocity(w,t)-q)).max(),
+                       abs(angular_velocity(q,t)-w).max()])
+    ratios = array(errors[:-1])/array(errors[1:])
+    assert_(all(ratios[:,0]>14) and errors[-1][0]<1e-9)
+    assert_(all(ratios[:,1]>3.5) and errors[-1][1]<1e-4)
+
+def test_sort():
+    # compare orders nan quaternions first, then lexicographically
+    for Q in quaternion, quaternion32:
+        for n in 5,100,2000:
+            c = random.RandomState(n).randint(-2,3,(n,4)).astype(REAL[Q])
+            c[::7,2] = nan
+            q = quaternions(c,Q)
+            nans = isnan(c).any(1)
+            order = lexsort(c[:,::-1].T)
+            expected = concatenate([flatnonzero(nans),order[~nans[order]]])
+            for kind in 'quicksort','heapsort','mergesort':
+                s = components(sort(q,kind=kind))
+                assert_(array_equal(isnan(s),isnan(c[expected])))
+                assert_(array_equal(nan_to_num(s),nan_to_num(c[expected])))
+            i = argsort(q,kind='mergesort')
+            assert_(array_equal(i,expected))
+            assert_(argmin(q)==expected[0])
+
+def test_scalar():
+    # Arithmetic on scalars and real numbers is done directly, and agrees with
+    # the ufuncs
+    a, b = quaternion(1,2,3,4), quaternion(-2,.5,3,1)
+    A, B = quaternions([a.components]), quaternions([b.components])
+    assert_((a*b).components==(-16,-12.5,-3,-2.5))
+    assert_((a+b).components==(-1,2.5,6,5) and (a-b).components==(3,1.5,0,3))
+    for s in 2, 2., int64(2), float32(2):
+        assert_((a*s).components==(s*a).components==(2,4,6,8))
+        assert_((a+s).components==(3,2,3,4) and (s-a).components==(1,-2,-3,-4))
+        assert_((a/s).components==(.5,1,1.5,2))
+    assert_(allclose((1/a).components,array([1,-2,-3,-4])/30,rtol=1e-15,atol=0))
+    for x, y in (a/b,A/B),(a**b,A**B),(a**2.5,A**2.5),(2.5**a,2.5**A):
+        assert_close(quaternions([x.components]),y,1e-15)
+    assert_((-a).components==(-1,-2,-3,-4) and (+a).components==a.components)
+    assert_(abs(quaternion(2,4,4,8))==10 and type(abs(a)) is float)
+    # Other operands go through the ufuncs
+    assert_(type(a*B) is ndarray)
+    assert_close(a*B,A*B,0)
+    # Comparisons are lexicographic, as for tuples, also with real numbers
+    values = (1,2,3,4),(1,2,3,5),(1,2,-3,4),(0,9,9,9),(2,0,0,0)
+    for u in values:
+        for v in values:
+            x, y = quaternion(*u), quaternion(*v)
+            assert_([x==y,x!=y,x<y,x<=y,x>y,x>=y]==[u==v,u!=v,u<v,u<=v,u>v,u>=v])
+    assert_(quaternion(2,0,0,0)==2 and 2==quaternion(2,0,0,0))
+    assert_(quaternion(2,1,0,0)>2 and 2<quaternion(2,1,0,0) and quaternion(2,1,0,0)!=2.)
+    assert_(bool(a) and not bool(quaternion(0,0,0,0)))
+    # Freed scalars are reused, holding their new values
+    x = a*b
+    address = id(x)
+    del x
+    assert_(id(a*b)==address)
+    xs = [quaternion(i,-i,0,1) for i in range(200)]
+    del xs
+    xs = [quaternion(i,0,0,0)*2 for i in range(200)]
+    assert_([x.components for x in xs]==[(2*i,0,0,0) for i in range(200)])
+
+def test_items():
+    # Elements are read as quaternion scalars
+    c = random.RandomState(2).normal(size=(5,4))
+    q = quaternions(c)
+    for x in q[1],q.tolist()[1],q.astype(object)[1],q[::-1][3]:
+        assert_(type(x) is quaternion and x.components==tuple(c[1]))
+    # and set from quaternions, sequences and real arrays of four numbers, or
+    # real numbers
+    a = zeros(8,quaternion)
+    a[0] = q[0]
+    a[1] = tuple(c[1])
+    a[2] = list(c[2])
+    a[3] = c[3]
+    a[4] = arange(4,dtype=int32)
+    a[5] = [1,2.5,int64(3),float32(4)]
+    a[6] = 7
+    a[7] = float32(-.5)
+    assert_(array_equal(components(a[:4]),c[:4]))
+    assert_(components(a[4:]).tolist()==[[0,1,2,3],[1,2.5,3,4],[7,0,0,0],[-.5,0,0,0]])
+    for x in (1,2,3),[1,2,3,4,5],arange(3.),(),zeros(5),ones((2,2)),ones((1,4)):
+        try:
+            a[0] = x
+            assert_(False)
+        except ValueError:
+            pass
+    assert_(a[0]==q[0])
+    # Complex numbers set w and x, as the casts do; other objects are refused
+    # by type
+    a[1] = 1-2j
+    a[2] = complex64(.5+3j)
+    assert_(components(a[1:3]).tolist()==[[1,-2,0,0],[.5,3,0,0]])
+    for x in None,object():
+        try:
+            a[0] = x
+            assert_(False)
+        except TypeError as e:
+            assert_(type(x).__name__ in str(e))
+
+def test_predicates():
+    # isnan and isinf hold if they hold for any component, and isfinite if it
+    # holds for all; a quaternion is true if any component is nonzero
+    for i in range(4):
+        for x in nan,inf,-inf,1.:
+            c = zeros(4)
+            c[i] = x
+            q = quaternions([c])
+            assert_(isnan(q)[0]==isnan(x) and isinf(q)[0]==isinf(x))
+            assert_(isfinite(q)[0]==isfinite(x))
+            assert_(quaternion(*c) and count_nonzero(q)==1)
+    assert_(not quaternion(0,0,0,0) and count_nonzero(zeros(3,quaternion))==0)
+
+def test_cast_loops():
+    # Casts to quaternion write every element, from contiguous or strided
+    # input, with the imaginary part of complex types in x
+    for t in bool_,int8,uint16,int32,int64,float32,float64,longdouble:
+        x = arange(-4,5).astype(t)
+        for y in x,x[::2]:
+            assert_(components(y.astype(quaternion)).tolist()==[[float(v),0,0,0] for v in y])
+    for t in complex64,complex128,clongdouble:
+        x = (arange(-4,5)+.5j*arange(9)).astype(t)
+        for y in x,x[::2]:
+            assert_(components(y.astype(quaternion)).tolist()==
+                    [[float(v.real),float(v.imag),0,0] for v in y])
+    assert_(array_equal(components(quaternion(1,2,3,4)+arange(3.)),
+                        [[1,2,3,4],[2,2,3,4],[3,2,3,4]]))
+
+def test_casts():
+    for Q in quaternion, quaternion32:
+        c = random.RandomState(2).normal(size=(9,4)).astype(REAL[Q])
+        q = quaternions(c,Q)
+        # Only explicit casts keep the real part, or the first two components
+        for t in float32,float64:
+            assert_(array_equal(q.astype(t),c[:,0].astype(t)))
+            assert_(array_equal(q[::2].astype(t),c[::2,0].astype(t)))
+            assert_(not can_cast(Q,t))
+        for t in complex64,complex128:
+            r = q.astype(t)
+            assert_(array_equal(r.real,c[:,0].astype(r.real.dtype)))
+            assert_(array_equal(r.imag,c[:,1].astype(r.real.dtype)))
+        for t in int32,int64,float32,float64:
+            x = arange(-4,5).astype(t)
+            assert_(array_equal(components(x.astype(Q)),stack([x,0*x,0*x,0*x],1)))
+    assert_(can_cast(quaternion32,quaternion) and not can_cast(quaternion,quaternion32))
+
+def test_mixed():
+    # Real operands are converted as they are read, not through quaternion
+    # temporaries, and give what the quaternion promotion would
+    for Q in quaternion, quaternion32:
+        q = random_quaternions(300,Q)
+        # quaternion32 only has float32 loops; integers promote to quaternion
+        for t in (int32,int64,float64) if Q is quaternion else (float32,):
+            x = random.RandomState(4).randint(1,9,300).astype(t)
+            r = x.astype(Q)
+            for f in add,subtract,multiply,divide:
+                assert_(f(q,x).dtype==Q and f(x,q).dtype==Q)
+                assert_close(f(q,x),f(q,r),TOL[Q])
+                assert_close(f(x,q),f(r,q),TOL[Q])
+                assert_close(f(q[::3],x[::3]),f(q[::3],r[::3]),TOL[Q])
+                assert_close(f(q,t(3)),f(q,Q(3,0,0,0)),TOL[Q])
+
+def test_matrix_multiply():
+    for Q in quaternion, quaternion32:
+        a = random_quaternions(5*7,Q,1).reshape(5,7)
+        b = random_quaternions(7*3,Q,2).reshape(7,3)
+        expected = dot(a,b)
+        for c in matrix_multiply(a,b),matmul(a,b),matmul(a[:,::-1],b[::-1]):
+            assert_(c.dtype==Q and c.shape==(5,3))
+            assert_close(c,expected,TOL[Q],absolute(a).sum(-1)[:,newaxis,newaxis])
+        assert_close(matmul(a[newaxis],b),expected[newaxis],TOL[Q],
+                     absolute(a).sum(-1)[:,newaxis,newaxis])
+
+def test_distances():
+    q1 = random_rotations(200,1)
+    q2 = random_rotations(200,2)
+    c1, c2 = components(q1), components(q2)
+    length = lambda c: sqrt((c*c).sum(-1))
+    angle = arccos(abs((c1*c2).sum(-1)))
+    assert_(allclose(chordal_distance(q1,q2),minimum(length(c1-c2),length(c1+c2)),rtol=1e-14,atol=0))
+    assert_(allclose(intrinsic_distance(q1,q2),angle,rtol=1e-12,atol=0))
+    assert_(allclose(rotation_distance(q1,q2),2*angle,rtol=1e-12,atol=0))
+    assert_(all(intrinsic_distance(q1,q2)<=pi/2))
+    # The same for q and -q, and for any scale but the chordal distance
+    for f in chordal_distance,intrinsic_distance,rotation_distance:
+        d = f(q1,q2)
+        for a, b in (-q1,q2),(q1,-q2),(-q1,-q2),(q2,q1):
+            assert_(allclose(f(a,b),d,rtol=1e-15,atol=0))
+        assert_(all(f(q1,q1)==0) and all(f(q1,-q1)==0))
+    for f in intrinsic_distance,rotation_distance:
+        assert_(allclose(f(3*q1,q2/7),f(q1,q2),rtol=1e-14,atol=0))
+    # Small angles are accurate to rounding, where arccos of the inner product
+    # would lose half the digits
+    for t in 1e-4,1e-8,1e-12:
+        r = q1*quaternion(cos(t/2),0,sin(t/2),0)
+        assert_(allclose(rotation_distance(q1,r),t,rtol=0,atol=1e-15))
+        assert_(allclose(chordal_distance(-q1,r),2*sin(t/4),rtol=0,atol=1e-15))
+    assert_(allclose(pairwise_distance(q1[:7],q2),rotation_distance(q1[:7,newaxis],q2),
+                     rtol=0,atol=1e-13))
+
+def test_index():
+    a = random_quaternions(3000,seed=5)
+    q = random_quaternions(40,seed=6)
+    index = RotationIndex(a)
+    brute = pairwise_distance(q,a)
+    d, i = index.query(q,5)
+    assert_(allclose(d,sort(brute,1)[:,:5],rtol=0,atol=1e-12))
+    assert_(allclose(brute[arange(40)[:,newaxis],i],d,rtol=0,atol=1e-12))
+    assert_(array_equal(index.count(q,.5),(brute<=.5).sum(1)))
+    # A layout whose cells end off the vector width is scanned point by point
+    c = random.RandomState(7).normal(scale=.01,size=(18,4))
+    c[:,0] = 1
+    index = RotationIndex(quaternions(c),1)
+    assert_(index.offsets.tolist()==[0,32])
+    d, i = index.query(q,5)
+    index.offsets = array([0,18])
+    d2, i2 = index.query(q,5)
+    assert_(array_equal(i2,i) and allclose(d2,d,rtol=0,atol=1e-12))
+    assert_(array_equal(index.count(q,2),(pairwise_distance(q,quaternions(c))<=2).sum(1)))
+
+def test_dual_quaternion():
+    q = random_rotations(50)
+    t = random.RandomState(2).normal(size=(50,3))
+    v = random.RandomState(3).normal(size=(50,3))
+    a = from_rigid_transform(q,t)
+    assert_(allclose(transform(a,v),rotate(q,v)+t))
+    # multiply composes, applying the right factor first, also accumulated
+    b = multiply.accumulate(a)
+    assert_(allclose(transform(b[2],v),transform(a[0],transform(a[1],transform(a[2],v)))))
+
+if __name__=='__main__':
+    for name in sorted(dir()):
+        if name.startswith('test_'):
+            globals()[name]()
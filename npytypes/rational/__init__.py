@@ -1,12 +1,26 @@
+from contextlib import contextmanager
+
 import numpy as np
 
-from npytypes.rational.rational import denominator, gcd, lcm, numerator, rational
+from npytypes.isa import load_extension
+load_extension('npytypes.rational.rational')
+
+from npytypes.rational.rational import denominator, gcd, isoverflow, lcm, numerator, rational, set_overflow_policy
 from npytypes.rational.info import __doc__
 
-__all__ = ['denominator', 'gcd', 'lcm', 'numerator', 'rational']
+__all__ = ['denominator', 'gcd', 'isoverflow', 'lcm', 'numerator', 'overflow_policy', 'rational', 'set_overflow_policy']
 
 if np.__dict__.get('rational') is not None:
     raise RuntimeError('The NumPy package already has a rational type')
 
 np.rational = rational
 np.typeDict['rational'] = np.dtype(rational)
+
+@contextmanager
+def overflow_policy(policy):
+    '''Apply set_overflow_policy(policy) within a with block'''
+    old = set_overflow_policy(policy)
+    try:
+        yield
+    finally:
+        set_overflow_policy(old)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+'''Timings for rational kernels.  Run with "python bench_rational.py".
+
+"python bench_rational.py loops" times only the ufunc loops, in nanoseconds
+per element.  To see the effect of a build, such as the NPYTYPES_OPTIMIZE=1
+profile of setup.py, save their timings for one build with "--save file" and
+give the file to a run of the other with "--compare file".
+'''
+
+from __future__ import division, print_function
+import argparse
+import json
+import sys
+import timeit
+import numpy as np
+try:
+    # From an installed or built tree, the widest build the CPU runs
+    from npytypes.isa import load_extension
+    load_extension('npytypes.rational.rational')
+    from npytypes.rational.rational import *
+except ImportError:
+    from rational import *
+
+def best(f, repeat=5):
+    '''Best of several timings of f(), in seconds'''
+    number = 1
+    while timeit.timeit(f, number=number) < 0.2 and number < 1<<20:
+        number *= 2
+    return min(timeit.repeat(f, number=number, repeat=repeat))/number
+
+def random_matrix(shape, den, seed):
+    '''Random rationals with small numerators and denominators below den'''
+    r = np.random.RandomState(seed)
+    n = r.randint(-9, 10, shape).astype(rational)
+    d = r.randint(1, den, shape).astype(rational)
+    return n/d
+
+def bench_matrix_multiply():
+    print('matrix_multiply vs. matrix_multiply_modular')
+    for n in 8, 16, 32, 64, 128:
+        for den in 2, 4:
+            a = random_matrix((n,n), den, 1)
+            b = random_matrix((n,n), den, 2)
+            try:
+                matrix_multiply(a, b)
+                t0 = '%10.3g s' % best(lambda: matrix_multiply(a, b))
+            except OverflowError:
+                t0 = '  overflow'
+            try:
+                matrix_multiply_modular(a, b)
+                t1 = '%10.3g s' % best(lambda: matrix_multiply_modular(a, b))
+            except OverflowError:
+                t1 = '  overflow'
+            print('  n = %3d, denominators < %d: %s %s' % (n, den, t0, t1))
+            sys.stdout.flush()
+
+def bench_statistics():
+    print('x.sum()/n vs. mean(x), (x*w).sum() vs. x.dot(w)')
+    for n in 100, 1000, 10000:
+        x = random_matrix(n, 4, 3)
+        w = random_matrix(n, 4, 4)
+        t0 = best(lambda: x.sum()/n)
+        t1 = best(lambda: mean(x))
+        t2 = best(lambda: (x*w).sum())
+        t3 = best(lambda: x.dot(w))
+        print('  n = %5d: %10.3g s %10.3g s   %10.3g s %10.3g s' % (n, t0, t1, t2, t3))
+        sys.stdout.flush()
+
+def bench_loops(save=None, compare=None, n=10000):
+    print('ufunc loops, ns per element, n = %d' % n)
+    x = random_matrix(n, 4, 5)
+    y = abs(random_matrix(n, 4, 6)) + 1
+    unary = ['negative', 'absolute', 'floor', 'ceil', 'trunc', 'rint', 'square',
+             'reciprocal', 'sign']
+    binary = ['add', 'subtract', 'multiply', 'divide', 'remainder', 'floor_divide',
+              'minimum', 'maximum', 'equal', 'not_equal', 'less', 'greater',
+              'less_equal', 'greater_equal']
+    loops = [(name, lambda f=getattr(np, name): f(y)) for name in unary]
+    loops += [(name, lambda f=getattr(np, name): f(x, y)) for name in binary]
+    loops += [('numerator', lambda: numerator(x)), ('denominator', lambda: denominator(x))]
+    times = dict((name, best(f)/n*1e9) for name, f in loops)
+    base = {}
+    if compare:
+        with open(compare) as f:
+            base = json.load(f)
+    for name, _ in loops:
+        if name in base:
+            print('  %-14s %8.1f %8.1f %6.2fx' % (name, base[name], times[name],
+                                                   base[name]/times[name]))
+        else:
+            print('  %-14s %8.1f' % (name, times[name]))
+    if save:
+        with open(save, 'w') as f:
+            json.dump(times, f, indent=1, sort_keys=True)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('benchmarks', nargs='*',
+                        help='matrix_multiply, statistics or loops (default all)')
+    parser.add_argument('--save', help='file to save the loop timings in')
+    parser.add_argument('--compare', help='file of loop timings of another build')
+    args = parser.parse_args()
+    benchmarks = args.benchmarks or ['matrix_multiply', 'statistics', 'loops']
+    if 'matrix_multiply' in benchmarks:
+        bench_matrix_multiply()
+    if 'statistics' in benchmarks:
+        bench_statistics()
+    if 'loops' in benchmarks:
+        bench_loops(args.save, args.compare)
@@ -15,8 +15,27 @@
 /* Uncomment the following line to work around a bug in numpy */
 /* #define ACQUIRE_GIL */
 
+/*
+ * What elementwise loops do when an element overflows: raise OverflowError
+ * for the whole call, replace the element by the masked sentinel, or replace
+ * it by the nearest representable rational.  See set_overflow_policy.
+ */
+enum { OVERFLOW_RAISE, OVERFLOW_MASK, OVERFLOW_SATURATE };
+static int overflow_policy = OVERFLOW_RAISE;
+
+/*
+ * Set by loops which handle overflow themselves; set_overflow then only
+ * records the overflow in overflow_pending.  Safe since all loops hold the GIL.
+ */
+static int overflow_deferred = 0;
+static int overflow_pending = 0;
+
 static void
 set_overflow(void) {
+    if (overflow_deferred) {
+        overflow_pending = 1;
+        return;
+    }
 #ifdef ACQUIRE_GIL
     /* Need to grab the GIL to dodge a bug in numpy */
     PyGILState_STATE state = PyGILState_Ensure();
@@ -51,6 +70,7 @@ static NPY_INLINE int32_t
 safe_neg(int32_t x) {
     if (x==(int32_t)1<<31) {
         set_overflow();
+        return INT32_MAX;
     }
     return -x;
 }
@@ -63,6 +83,7 @@ safe_abs32(int32_t x) {
     int32_t nx = -x;
     if (nx<0) {
         set_overflow();
+        return INT32_MAX;
     }
     return nx;
 }
@@ -110,6 +131,13 @@ lcm(int64_t x, int64_t y) {
     return safe_abs64(lcm);
 }
 
+#ifdef __SIZEOF_INT128__
+/* Double width integers, for kernels which defer normalization */
+#define HAVE_WIDE_INT
+typedef __int128 wide_int;
+typedef unsigned __int128 wide_uint;
+#endif
+
 /* Fixed precision rational numbers */
 
 typedef struct {
@@ -122,11 +150,82 @@ typedef struct {
     int32_t dmm;
 } rational;
 
+/*
+ * Masked sentinel written by loops under the "mask" overflow policy.  Its
+ * negative denominator never occurs in a valid rational.
+ */
+static const rational rational_masked = {0,INT32_MIN};
+
+static NPY_INLINE int
+rational_is_masked(rational x) {
+    return x.dmm==INT32_MIN;
+}
+
+/*
+ * Nearest rational to n/d whose numerator and denominator fit, used as the
+ * result of an overflowing operation.  Assumes d > 0.  Beyond the integer
+ * range we clamp to INT32_MIN or INT32_MAX, and otherwise pick the closer of the last
+ * continued fraction convergent and semiconvergent that fit.
+ */
+static rational
+rational_saturate(int64_t n, int64_t d) {
+    int64_t a = n<0?-n:n, b = d, p0 = 0, q0 = 1, p1 = 1, q1 = 0, k, pb, qb;
+    rational r;
+    if (a/b>=INT32_MAX) {
+        r.n = n>=0?INT32_MAX:a/b>INT32_MAX?INT32_MIN:-INT32_MAX;
+        r.dmm = 0;
+        return r;
+    }
+    for (;;) {
+        int64_t t = a/b;
+        if ((p1 && t>(INT32_MAX-p0)/p1) || (q1 && t>(INT32_MAX-q0)/q1)) {
+            break;
+        }
+        k = p0+t*p1;
+        p0 = p1;
+        p1 = k;
+        k = q0+t*q1;
+        q0 = q1;
+        q1 = k;
+        k = a-t*b;
+        a = b;
+        b = k;
+        if (!b) {
+            break;
+        }
+    }
+    /* Largest semiconvergent between p0/q0 and p1/q1 */
+    k = (INT32_MAX-q0)/q1;
+    if (p1 && (INT32_MAX-p0)/p1<k) {
+        k = (INT32_MAX-p0)/p1;
+    }
+    pb = p0+k*p1;
+    qb = q0+k*q1;
+    {
+        /* Compare |p1/q1-x| against |pb/qb-x| for x = |n|/d */
+        int64_t an = n<0?-n:n;
+#ifdef HAVE_WIDE_INT
+        wide_int e1 = (wide_int)p1*d-(wide_int)an*q1, eb = (wide_int)pb*d-(wide_int)an*qb;
+        int closer = (e1<0?-e1:e1)*qb <= (eb<0?-eb:eb)*q1;
+#else
+        double x = (double)an/d;
+        int closer = fabs((double)p1/q1-x) <= fabs((double)pb/qb-x);
+#endif
+        r.n = closer?p1:pb;
+        r.dmm = (closer?q1:qb)-1;
+    }
+    if (n<0) {
+        r.n = -r.n;
+    }
+    return r;
+}
+
 static NPY_INLINE rational
 make_rational_int(int64_t n) {
     rational r = {n,0};
     if (r.n != n) {
         set_overflow();
+        r.n = n<0?INT32_MIN:INT32_MAX;
     }
     return r;
 }
@@ -145,6 +244,7 @@ make_rational_slow(int64_t n_, int64_t d_) {
         int32_t d = d_;
         if (r.n!=n_ || d!=d_) {
             set_overflow();
+            r = d_<0?rational_saturate(-n_,-d_):rational_saturate(n_,d_);
         }
         else {
             if (d <= 0) {
@@ -173,6 +273,7 @@ make_rational_fast(int64_t n_, int64_t d_) {
     r.dmm = d_-1;
     if (r.n!=n_ || r.dmm+1!=d_) {
         set_overflow();
+        r = rational_saturate(n_,d_);
     }
     return r;
 }
@@ -325,6 +426,228 @@ rational_nonzero(rational x) {
     return x.n!=0;
 }
 
+/*
+ * Unnormalized sums of rationals
+ *
+ * Terms are accumulated over a common denominator without reducing, and the
+ * fraction is only reduced when it would otherwise overflow, and once at the
+ * end.  None of these functions touch Python error state: they return 0 on
+ * overflow instead, so that callers can run without the GIL.
+ */
+
+#ifdef HAVE_WIDE_INT
+typedef wide_int sum_int;
+#else
+typedef int64_t sum_int;
+#endif
+
+typedef struct {
+    sum_int n;
+    /* always positive */
+    sum_int d;
+    /* set if a masked term was added, which makes the whole sum masked */
+    int masked;
+} rational_sum;
+
+/* Overflow checked arithmetic for values with |x| <= max */
+#ifdef HAVE_WIDE_INT
+static NPY_INLINE int
+sum_int_add(sum_int x, sum_int y, sum_int* z) {
+    return !__builtin_add_overflow(x,y,z);
+}
+
+static NPY_INLINE int
+sum_int_mul(sum_int x, sum_int y, sum_int* z) {
+    return !__builtin_mul_overflow(x,y,z);
+}
+#else
+static NPY_INLINE int
+sum_int_add(sum_int x, sum_int y, sum_int* z) {
+    if (x>0 ? y>INT64_MAX-x : y<-INT64_MAX-x) {
+        return 0;
+    }
+    *z = x+y;
+    return 1;
+}
+
+static NPY_INLINE int
+sum_int_mul(sum_int x, sum_int y, sum_int* z) {
+    if (x && y && (x<0?-x:x)>INT64_MAX/(y<0?-y:y)) {
+        return 0;
+    }
+    *z = x*y;
+    return 1;
+}
+#endif
+
+static NPY_INLINE void
+rational_sum_init(rational_sum* s) {
+    s->n = 0;
+    s->d = 1;
+    s->masked = 0;
+}
+
+/* gcd of |x| and y > 0 */
+static sum_int
+sum_int_gcd(sum_int x, sum_int y) {
+    if (x<0) {
+        x = -x;
+    }
+    while (y) {
+        sum_int t = x%y;
+        x = y;
+        y = t;
+    }
+    return x;
+}
+
+static void
+rational_sum_reduce(rational_sum* s) {
+    sum_int g = sum_int_gcd(s->n,s->d);
+    if (g>1) {
+        s->n /= g;
+        s->d /= g;
+    }
+}
+
+/* Add n/d to s, assuming d > 0 and |n|,d < 2**63 */
+static NPY_INLINE int
+rational_sum_add(rational_sum* s, int64_t n, int64_t d) {
+    int retry;
+    for (retry = 0; retry < 2; retry++) {
+        if (d==s->d) {
+            sum_int nf;
+            if (sum_int_add(s->n,n,&nf)) {
+                s->n = nf;
+                return 1;
+            }
+        }
+        else {
+            /* Bring both to the common denominator lcm(s->d,d) */
+            int64_t g = d==1?1:gcd(s->d%d,d);
+            sum_int nf, nd, tn;
+            if (sum_int_mul(s->n,d/g,&nf) && sum_int_mul(s->d,d/g,&nd) &&
+                    sum_int_mul(n,s->d/g,&tn) && sum_int_add(nf,tn,&nf)) {
+                s->n = nf;
+                s->d = nd;
+                return 1;
+            }
+        }
+        rational_sum_reduce(s);
+    }
+    return 0;
+}
+
+/* Add t to s, where both may be unreduced */
+static int
+rational_sum_add_sum(rational_sum* s, rational_sum t) {
+    int retry;
+    if (s->masked || t.masked) {
+        s->masked = 1;
+        return 1;
+    }
+    for (retry = 0; retry < 2; retry++) {
+        sum_int g = sum_int_gcd(s->d,t.d), nf, nd, tn;
+        if (sum_int_mul(s->n,t.d/g,&nf) && sum_int_mul(s->d,t.d/g,&nd) &&
+                sum_int_mul(t.n,s->d/g,&tn) && sum_int_add(nf,tn,&nf)) {
+            s->n = nf;
+            s->d = nd;
+            return 1;
+        }
+        rational_sum_reduce(s);
+        rational_sum_reduce(&t);
+    }
+    return 0;
+}
+
+/* Multiply s by t, cancelling common factors first */
+static int
+rational_sum_multiply(rational_sum* s, rational_sum t) {
+    sum_int g, h, n, d;
+    if (s->masked || t.masked) {
+        s->masked = 1;
+        return 1;
+    }
+    if (!s->n || !t.n) {
+        rational_sum_init(s);
+        return 1;
+    }
+    g = sum_int_gcd(s->n,t.d);
+    h = sum_int_gcd(t.n,s->d);
+    if (!sum_int_mul(s->n/g,t.n/h,&n) || !sum_int_mul(s->d/h,t.d/g,&d)) {
+        return 0;
+    }
+    s->n = n;
+    s->d = d;
+    return 1;
+}
+
+/* Divide s by t, which must be nonzero */
+static int
+rational_sum_divide(rational_sum* s, rational_sum t) {
+    rational_sum r;
+    r.n = t.n<0?-t.d:t.d;
+    r.d = t.n<0?-t.n:t.n;
+    r.masked = t.masked;
+    return rational_sum_multiply(s,r);
+}
+
+/* Store the reduced value of s into r, returning 0 if it doesn't fit */
+static int
+rational_sum_value(rational_sum* s, rational* r) {
+    if (s->masked) {
+        *r = rational_masked;
+        return 1;
+    }
+    rational_sum_reduce(s);
+    if (s->n<INT32_MIN || s->n>INT32_MAX || s->d>INT32_MAX) {
+        return 0;
+    }
+    r->n = s->n;
+    r->dmm = s->d-1;
+    return 1;
+}
+
+/* Sum n strided rationals into s */
+static int
+rational_sum_strided(rational_sum* s, const char* x, npy_intp xs, npy_intp n) {
+    npy_intp i;
+    rational_sum_init(s);
+    for (i = 0; i < n; i++, x += xs) {
+        rational r;
+        memcpy(&r,x,sizeof(r));
+        if (rational_is_masked(r)) {
+            s->masked = 1;
+            return 1;
+        }
+        if (r.n && !rational_sum_add(s,r.n,d(r))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Sum the n strided products x[i]*y[i] into s */
+static int
+rational_sum_products(rational_sum* s, const char* x, npy_intp xs,
+        const char* y, npy_intp ys, npy_intp n) {
+    npy_intp i;
+    rational_sum_init(s);
+    for (i = 0; i < n; i++, x += xs, y += ys) {
+        rational a, b;
+        memcpy(&a,x,sizeof(a));
+        memcpy(&b,y,sizeof(b));
+        if (rational_is_masked(a) || rational_is_masked(b)) {
+            s->masked = 1;
+            return 1;
+        }
+        if (a.n && b.n && !rational_sum_add(s,(int64_t)a.n*b.n,(int64_t)d(a)*d(b))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static int
 scan_rational(const char** s, rational* x) {
     long n,d;
@@ -706,6 +1029,10 @@ static PyObject*
 npyrational_getitem(void* data, void* arr) {
     rational r;
     memcpy(&r,data,sizeof(rational));
+    /* Masked elements have no rational value; read them as nan, as casts do */
+    if (rational_is_masked(r)) {
+        return PyFloat_FromDouble(NAN);
+    }
     return PyRational_FromRational(r);
 }
 
@@ -795,9 +1122,14 @@ static int
 npyrational_compare(const void* d0, const void* d1, void* arr) {
     rational x = *(rational*)d0,
              y = *(rational*)d1;
+    /* Masked values sort last, as NaN does */
+    if (rational_is_masked(x) || rational_is_masked(y)) {
+        return rational_is_masked(x)-rational_is_masked(y);
+    }
     return rational_lt(x,y)?-1:rational_eq(x,y)?0:1;
 }
 
+/* The first masked element wins, as the first NaN does for floats */
 #define FIND_EXTREME(name,op) \
     static int \
     npyrational_##name(void* data_, npy_intp n, npy_intp* max_ind, void* arr) { \
@@ -808,8 +1140,8 @@ npyrational_compare(const void* d0, const void* d1, void* arr) {
         npy_intp best_i = 0; \
         rational best_r = data[0]; \
         npy_intp i; \
-        for (i = 1; i < n; i++) { \
-            if (rational_##op(data[i],best_r)) { \
+        for (i = 1; i < n && !rational_is_masked(best_r); i++) { \
+            if (rational_is_masked(data[i]) || rational_##op(data[i],best_r)) { \
                 best_i = i; \
                 best_r = data[i]; \
             } \
@@ -823,13 +1155,11 @@ FIND_EXTREME(argmax,gt)
 static void
 npyrational_dot(void* ip0_, npy_intp is0, void* ip1_, npy_intp is1,
         void* op, npy_intp n, void* arr) {
+    /* Accumulate over a common denominator, normalizing only at the end */
     rational r = {0};
-    const char *ip0 = (char*)ip0_, *ip1 = (char*)ip1_;
-    npy_intp i;
-    for (i = 0; i < n; i++) {
-        r = rational_add(r,rational_multiply(*(rational*)ip0,*(rational*)ip1));
-        ip0 += is0;
-        ip1 += is1;
+    rational_sum s;
+    if (!rational_sum_products(&s,(char*)ip0_,is0,(char*)ip1_,is1,n) || !rational_sum_value(&s,&r)) {
+        set_overflow();
     }
     *(rational*)op = r;
 }
@@ -838,7 +1168,8 @@ static npy_bool
 npyrational_nonzero(void* data, void* arr) {
     rational r;
     memcpy(&r,data,sizeof(r));
-    return rational_nonzero(r)?NPY_TRUE:NPY_FALSE;
+    /* Masked elements are true, like NaN */
+    return rational_nonzero(r)||rational_is_masked(r)?NPY_TRUE:NPY_FALSE;
 }
 
 static int
@@ -892,27 +1223,52 @@ PyArray_Descr npyrational_descr = {
     &npyrational_arrfuncs,  /* f */
 };
 
+/*
+ * Elementwise loops producing rationals apply the overflow policy: between
+ * OVERFLOW_BEGIN and OVERFLOW_END set_overflow only marks the current element,
+ * and OVERFLOW_CHECK replaces it by the masked sentinel if the policy says so
+ * (under "saturate" the arithmetic has already saturated it).  Overflows which
+ * aren't checked, as in casts to integers, are raised at the end.
+ */
+#define OVERFLOW_BEGIN \
+    overflow_deferred = overflow_policy!=OVERFLOW_RAISE;
+#define OVERFLOW_CHECK(r) \
+    if (overflow_pending) { \
+        overflow_pending = 0; \
+        if (overflow_policy==OVERFLOW_MASK) { \
+            r = rational_masked; \
+        } \
+    }
+#define OVERFLOW_END \
+    overflow_deferred = 0; \
+    if (overflow_pending) { \
+        overflow_pending = 0; \
+        set_overflow(); \
+    }
+
 #define DEFINE_CAST(From,To,statement) \
     static void \
     npycast_##From##_##To(void* from_, void* to_, npy_intp n, void* fromarr, void* toarr) { \
         const From* from = (From*)from_; \
         To* to = (To*)to_; \
         npy_intp i; \
+        OVERFLOW_BEGIN \
         for (i = 0; i < n; i++) { \
             From x = from[i]; \
             statement \
             to[i] = y; \
         } \
+        OVERFLOW_END \
     }
 #define DEFINE_INT_CAST(bits) \
-    DEFINE_CAST(int##bits##_t,rational,rational y = make_rational_int(x);) \
+    DEFINE_CAST(int##bits##_t,rational,rational y = make_rational_int(x); OVERFLOW_CHECK(y)) \
     DEFINE_CAST(rational,int##bits##_t,int32_t z = rational_int(x); int##bits##_t y = z; if (y != z) set_overflow();)
 DEFINE_INT_CAST(8)
 DEFINE_INT_CAST(16)
 DEFINE_INT_CAST(32)
 DEFINE_INT_CAST(64)
-DEFINE_CAST(rational,float,double y = rational_double(x);)
-DEFINE_CAST(rational,double,double y = rational_double(x);)
+DEFINE_CAST(rational,float,double y = rational_is_masked(x)?NAN:rational_double(x);)
+DEFINE_CAST(rational,double,double y = rational_is_masked(x)?NAN:rational_double(x);)
 DEFINE_CAST(npy_bool,rational,rational y = make_rational_int(x);)
 DEFINE_CAST(rational,npy_bool,npy_bool y = rational_nonzero(x);)
 
@@ -929,21 +1285,45 @@ DEFINE_CAST(rational,npy_bool,npy_bool y = rational_nonzero(x);)
         } \
     }
 #define RATIONAL_BINARY_UFUNC(name,type,exp) BINARY_UFUNC(rational_ufunc_##name,rational,rational,type,exp)
-RATIONAL_BINARY_UFUNC(add,rational,rational_add(x,y))
-RATIONAL_BINARY_UFUNC(subtract,rational,rational_subtract(x,y))
-RATIONAL_BINARY_UFUNC(multiply,rational,rational_multiply(x,y))
-RATIONAL_BINARY_UFUNC(divide,rational,rational_divide(x,y))
-RATIONAL_BINARY_UFUNC(remainder,rational,rational_remainder(x,y))
-RATIONAL_BINARY_UFUNC(floor_divide,rational,make_rational_int(rational_floor(rational_divide(x,y))))
+/* Masked inputs give masked outputs under every policy */
+#define POLICY_BINARY_UFUNC(name,exp) \
+    void rational_ufunc_##name(char** args, npy_intp* dimensions, npy_intp* steps, void* data) { \
+        npy_intp is0 = steps[0], is1 = steps[1], os = steps[2], n = *dimensions; \
+        char *i0 = args[0], *i1 = args[1], *o = args[2]; \
+        int k; \
+        OVERFLOW_BEGIN \
+        for (k = 0; k < n; k++) { \
+            rational x = *(rational*)i0; \
+            rational y = *(rational*)i1; \
+            rational z = rational_masked; \
+            if (!rational_is_masked(x) && !rational_is_masked(y)) { \
+                z = exp; \
+                OVERFLOW_CHECK(z) \
+            } \
+            *(rational*)o = z; \
+            i0 += is0; i1 += is1; o += os; \
+        } \
+        OVERFLOW_END \
+    }
+POLICY_BINARY_UFUNC(add,rational_add(x,y))
+POLICY_BINARY_UFUNC(subtract,rational_subtract(x,y))
+POLICY_BINARY_UFUNC(multiply,rational_multiply(x,y))
+POLICY_BINARY_UFUNC(divide,rational_divide(x,y))
+POLICY_BINARY_UFUNC(remainder,rational_remainder(x,y))
+POLICY_BINARY_UFUNC(floor_divide,make_rational_int(rational_floor(rational_divide(x,y))))
 PyUFuncGenericFunction rational_ufunc_true_divide = rational_ufunc_divide;
-RATIONAL_BINARY_UFUNC(minimum,rational,rational_lt(x,y)?x:y)
-RATIONAL_BINARY_UFUNC(maximum,rational,rational_lt(x,y)?y:x)
-RATIONAL_BINARY_UFUNC(equal,npy_bool,rational_eq(x,y))
-RATIONAL_BINARY_UFUNC(not_equal,npy_bool,rational_ne(x,y))
-RATIONAL_BINARY_UFUNC(less,npy_bool,rational_lt(x,y))
-RATIONAL_BINARY_UFUNC(greater,npy_bool,rational_gt(x,y))
-RATIONAL_BINARY_UFUNC(less_equal,npy_bool,rational_le(x,y))
-RATIONAL_BINARY_UFUNC(greater_equal,npy_bool,rational_ge(x,y))
+POLICY_BINARY_UFUNC(minimum,rational_lt(x,y)?x:y)
+POLICY_BINARY_UFUNC(maximum,rational_lt(x,y)?y:x)
+/* Masked values compare like NaN: unequal to everything, and unordered */
+#define MASKED_COMPARE(exp,masked) \
+    (rational_is_masked(x) || rational_is_masked(y) ? masked : exp)
+RATIONAL_BINARY_UFUNC(equal,npy_bool,MASKED_COMPARE(rational_eq(x,y),0))
+RATIONAL_BINARY_UFUNC(not_equal,npy_bool,MASKED_COMPARE(rational_ne(x,y),1))
+RATIONAL_BINARY_UFUNC(less,npy_bool,MASKED_COMPARE(rational_lt(x,y),0))
+RATIONAL_BINARY_UFUNC(greater,npy_bool,MASKED_COMPARE(rational_gt(x,y),0))
+RATIONAL_BINARY_UFUNC(less_equal,npy_bool,MASKED_COMPARE(rational_le(x,y),0))
+RATIONAL_BINARY_UFUNC(greater_equal,npy_bool,MASKED_COMPARE(rational_ge(x,y),0))
+#undef MASKED_COMPARE
 
 BINARY_UFUNC(gcd_ufunc,int64_t,int64_t,int64_t,gcd(x,y))
 BINARY_UFUNC(lcm_ufunc,int64_t,int64_t,int64_t,lcm(x,y))
@@ -959,15 +1339,34 @@ BINARY_UFUNC(lcm_ufunc,int64_t,int64_t,int64_t,lcm(x,y))
             i += is; o += os; \
         } \
     }
-UNARY_UFUNC(negative,rational,rational_negative(x))
-UNARY_UFUNC(absolute,rational,rational_abs(x))
-UNARY_UFUNC(floor,rational,make_rational_int(rational_floor(x)))
-UNARY_UFUNC(ceil,rational,make_rational_int(rational_ceil(x)))
-UNARY_UFUNC(trunc,rational,make_rational_int(x.n/d(x)))
-UNARY_UFUNC(square,rational,rational_multiply(x,x))
-UNARY_UFUNC(rint,rational,make_rational_int(rational_rint(x)))
-UNARY_UFUNC(sign,rational,make_rational_int(rational_sign(x)))
-UNARY_UFUNC(reciprocal,rational,rational_inverse(x))
+#define POLICY_UNARY_UFUNC(name,exp) \
+    void rational_ufunc_##name(char** args, npy_intp* dimensions, npy_intp* steps, void* data) { \
+        npy_intp is = steps[0], os = steps[1], n = *dimensions; \
+        char *i = args[0], *o = args[1]; \
+        int k; \
+        OVERFLOW_BEGIN \
+        for (k = 0; k < n; k++) { \
+            rational x = *(rational*)i; \
+            rational z = x; \
+            if (!rational_is_masked(x)) { \
+                z = exp; \
+                OVERFLOW_CHECK(z) \
+            } \
+            *(rational*)o = z; \
+            i += is; o += os; \
+        } \
+        OVERFLOW_END \
+    }
+POLICY_UNARY_UFUNC(negative,rational_negative(x))
+POLICY_UNARY_UFUNC(absolute,rational_abs(x))
+POLICY_UNARY_UFUNC(floor,make_rational_int(rational_floor(x)))
+POLICY_UNARY_UFUNC(ceil,make_rational_int(rational_ceil(x)))
+POLICY_UNARY_UFUNC(trunc,make_rational_int(x.n/d(x)))
+POLICY_UNARY_UFUNC(square,rational_multiply(x,x))
+POLICY_UNARY_UFUNC(rint,make_rational_int(rational_rint(x)))
+POLICY_UNARY_UFUNC(sign,make_rational_int(rational_sign(x)))
+POLICY_UNARY_UFUNC(reciprocal,rational_inverse(x))
+UNARY_UFUNC(isoverflow,npy_bool,rational_is_masked(x))
 UNARY_UFUNC(numerator,int64_t,x.n)
 UNARY_UFUNC(denominator,int64_t,d(x))
 
@@ -1036,82 +1435,1421 @@ rational_gufunc_matrix_multiply(char **args, npy_intp *dimensions, npy_intp *ste
     }
 }
 
+#ifdef HAVE_WIDE_INT
 
-PyMethodDef module_methods[] = {
-    {0} /* sentinel */
-};
+/*
+ * Multimodular matrix multiply
+ *
+ * rational_matrix_multiply normalizes after every multiply-add, so the running
+ * denominator overflows long before the entries of the product do.  Instead,
+ * we clear denominators along each row of the first matrix and each column of
+ * the second, multiply the resulting integer matrices modulo several 31-bit
+ * primes, and recover each entry by Chinese remaindering and rational
+ * reconstruction.  Enough primes are used that a reconstructed entry which
+ * differs from the true product is always detected, so overflow is reported
+ * exactly when the true entry does not fit in a rational.
+ */
 
-#if defined(NPY_PY3K)
-static struct PyModuleDef moduledef = {
-    PyModuleDef_HEAD_INIT,
-    "rational",
-    NULL,
-    -1,
-    module_methods,
-    NULL,
-    NULL,
-    NULL,
-    NULL
+/* Primes just below 2**31, all larger than 2**MODULAR_PRIME_BITS */
+static const uint32_t modular_primes[] = {
+    2147483647u,2147483629u,2147483587u,2147483579u,2147483563u,2147483549u,
+    2147483543u,2147483497u,2147483489u,2147483477u,2147483423u,2147483399u,
+    2147483353u,2147483323u,2147483269u,2147483249u,2147483237u,2147483179u,
+    2147483171u,2147483137u,2147483123u,2147483077u,2147483069u,2147483059u,
+    2147483053u,2147483033u,2147483029u,2147482951u,2147482949u,2147482943u,
+    2147482937u,2147482921u,2147482877u,2147482873u,2147482867u,2147482859u,
+    2147482819u,2147482817u,2147482811u,2147482801u,2147482763u,2147482739u,
+    2147482697u,2147482693u,2147482681u,2147482663u,2147482661u,2147482621u,
 };
-#endif
+#define MODULAR_PRIMES (npy_intp)(sizeof(modular_primes)/sizeof(uint32_t))
+#define MODULAR_PRIME_BITS 30.999
 
-#if defined(NPY_PY3K)
-PyMODINIT_FUNC PyInit_rational(void) {
-#else
-PyMODINIT_FUNC initrational(void) {
-#endif
+static NPY_INLINE uint32_t
+mod_reduce(int64_t x, uint32_t p) {
+    int64_t r = x%(int64_t)p;
+    return r<0?r+p:r;
+}
 
-    PyObject *m;
+static NPY_INLINE uint32_t
+mod_mul(uint32_t x, uint32_t y, uint32_t p) {
+    return (uint64_t)x*y%p;
+}
 
-    import_array();
-    if (PyErr_Occurred()) {
-        return NULL;
-    }
-    import_umath();
-    if (PyErr_Occurred()) {
-        return NULL;
-    }
-    PyObject* numpy_str = PyUString_FromString("numpy");
-    if (!numpy_str) {
-        return NULL;
-    }
-    PyObject* numpy = PyImport_Import(numpy_str);
-    Py_DECREF(numpy_str);
-    if (!numpy) {
-        return NULL;
-    }
+/* Inverse of x modulo the prime p, assuming x is nonzero mod p */
+static uint32_t
+mod_inverse(uint32_t x, uint32_t p) {
+    int64_t r0 = p, r1 = x, t0 = 0, t1 = 1;
+    while (r1) {
+        int64_t q = r0/r1;
+        int64_t t = r0-q*r1;
+        r0 = r1;
+        r1 = t;
+        t = t0-q*t1;
+        t0 = t1;
+        t1 = t;
+    }
+    return mod_reduce(t0,p);
+}
 
-    /* Can't set this until we import numpy */
-    PyRational_Type.tp_base = &PyGenericArrType_Type;
+/*
+ * Least common multiple of the denominators of n strided rationals, or 0 if
+ * it does not fit in int64_t.  *bits receives an upper bound on its log2.
+ */
+static int64_t
+denominator_lcm(const rational* x, npy_intp n, npy_intp stride, double* bits) {
+    int64_t l = 1;
+    double sum = 0;
+    npy_intp i;
+    for (i = 0; i < n; i++) {
+        int64_t dx = d(x[i*stride]);
+        sum += log2((double)dx);
+        if (l) {
+            int64_t s = dx/gcd(l,dx);
+            l = l>INT64_MAX/s?0:l*s;
+        }
+    }
+    *bits = l?log2((double)l):sum;
+    return l;
+}
 
-    /* Initialize rational type object */
-    if (PyType_Ready(&PyRational_Type) < 0) {
-        return NULL;
+/*
+ * c = a*b (mod p) for contiguous matrices of residues.  The inner loop is a
+ * 32x32->64 bit multiply-add over a row of b, which compilers vectorize
+ * directly.  Accumulators stay under 2**63 by subtracting the largest
+ * multiple of p below 2**63 whenever they reach it, and are only reduced
+ * properly once per entry.
+ */
+static void
+modular_matmul(const uint32_t* a, const uint32_t* b, uint32_t* c, uint64_t* acc,
+        npy_intp dm, npy_intp dn, npy_intp dp, uint32_t p) {
+    const uint64_t q = ((uint64_t)1<<63)/p*p;
+    npy_intp i, j, k;
+    for (i = 0; i < dm; i++) {
+        for (j = 0; j < dp; j++) {
+            acc[j] = 0;
+        }
+        for (k = 0; k < dn; k++) {
+            const uint64_t x = a[i*dn+k];
+            const uint32_t* row = b+k*dp;
+            if (!x) {
+                continue;
+            }
+            for (j = 0; j < dp; j++) {
+                uint64_t t = acc[j]+x*row[j];
+                acc[j] = t-(q&-(t>>63));
+            }
+        }
+        for (j = 0; j < dp; j++) {
+            c[i*dp+j] = acc[j]%p;
+        }
     }
+}
 
-    /* Initialize rational descriptor */
-    PyArray_InitArrFuncs(&npyrational_arrfuncs);
-    npyrational_arrfuncs.getitem = npyrational_getitem;
-    npyrational_arrfuncs.setitem = npyrational_setitem;
-    npyrational_arrfuncs.copyswapn = npyrational_copyswapn;
-    npyrational_arrfuncs.copyswap = npyrational_copyswap;
-    npyrational_arrfuncs.compare = npyrational_compare;
-    npyrational_arrfuncs.argmin = npyrational_argmin;
-    npyrational_arrfuncs.argmax = npyrational_argmax;
-    npyrational_arrfuncs.dotfunc = npyrational_dot;
-    npyrational_arrfuncs.nonzero = npyrational_nonzero;
-    npyrational_arrfuncs.fill = npyrational_fill;
-    npyrational_arrfuncs.fillwithscalar = npyrational_fillwithscalar;
-    /* Left undefined: scanfunc, fromstr, sort, argsort */
-    Py_TYPE(&npyrational_descr) = &PyArrayDescr_Type;
-    int npy_rational = PyArray_RegisterDataType(&npyrational_descr);
-    if (npy_rational<0) {
-        return NULL;
+/*
+ * Residues of n strided rationals scaled by their common denominator scale
+ * (or unscaled if scale is 0).  Returns 0 if p divides some denominator.
+ */
+static int
+modular_images(const rational* x, npy_intp n, npy_intp stride, int64_t scale,
+        uint32_t p, uint32_t* out, npy_intp ostride) {
+    npy_intp i;
+    for (i = 0; i < n; i++) {
+        rational y = x[i*stride];
+        uint32_t f;
+        if ((uint32_t)d(y)==p) {
+            return 0;
+        }
+        if (scale) {
+            f = mod_reduce(scale/d(y),p);
+        }
+        else {
+            f = d(y)==1?1:mod_inverse(d(y),p);
+        }
+        out[i*ostride] = mod_mul(mod_reduce(y.n,p),f,p);
     }
+    return 1;
+}
 
-    /* Support dtype(rational) syntax */
-    if (PyDict_SetItemString(PyRational_Type.tp_dict,"dtype",(PyObject*)&npyrational_descr)<0) {
-        return NULL;
+/*
+ * Find a/b == c (mod m) with |a| <= 2**31 and 0 < b < 2**31, which is unique
+ * if it exists since m > 2**63.  Returns 0 if there is no such fraction or
+ * if it does not fit in a rational.
+ */
+static int
+rational_reconstruct(wide_uint c, wide_uint m, rational* r) {
+    const wide_int bound = (wide_int)1<<31;
+    wide_int r0 = m, r1 = c, t0 = 0, t1 = 1;
+    while (r1 > bound) {
+        wide_int q = r0/r1;
+        wide_int t = r0-q*r1;
+        r0 = r1;
+        r1 = t;
+        t = t0-q*t1;
+        t0 = t1;
+        t1 = t;
+    }
+    if (t1 < 0) {
+        t1 = -t1;
+        r1 = -r1;
+    }
+    if (t1 >= bound || r1 >= bound || gcd(r1,t1)!=1) {
+        return 0;
+    }
+    r->n = r1;
+    r->dmm = t1-1;
+    return 1;
+}
+
+/*
+ * Multimodular version of rational_matrix_multiply.  Returns 0 without
+ * writing any output if the product needs more primes than we have or
+ * memory runs out, in which case the caller should fall back.
+ */
+static int
+rational_matrix_multiply_modular(char **args, npy_intp *dimensions, npy_intp *steps)
+{
+    npy_intp dm = dimensions[0], dn = dimensions[1], dp = dimensions[2];
+    npy_intp is1_m = steps[0], is1_n = steps[1];
+    npy_intp is2_n = steps[2], is2_p = steps[3];
+    npy_intp os_m = steps[4], os_p = steps[5];
+    npy_intp i, j, k, u, used;
+    int ok = 0;
+
+    /* contiguous copies of the inputs, their scales, and work space */
+    rational* a = malloc(sizeof(rational)*(dm*dn+dn*dp+1));
+    rational* b = a+dm*dn;
+    int64_t* sa = malloc(sizeof(int64_t)*(dm+dp+1));
+    int64_t* sb = sa+dm;
+    uint32_t* ia = malloc(sizeof(uint32_t)*(dm*dn+dn*dp+1));
+    uint32_t* ib = ia+dm*dn;
+    uint64_t* acc = malloc(sizeof(uint64_t)*(dp+1));
+    uint32_t* res = 0;
+    uint32_t primes[MODULAR_PRIMES];
+    if (!a || !sa || !ia || !acc) {
+        goto done;
+    }
+
+    for (i = 0; i < dm; i++) {
+        for (k = 0; k < dn; k++) {
+            a[i*dn+k] = *(rational*)(args[0]+i*is1_m+k*is1_n);
+        }
+    }
+    for (k = 0; k < dn; k++) {
+        for (j = 0; j < dp; j++) {
+            b[k*dp+j] = *(rational*)(args[1]+k*is2_n+j*is2_p);
+        }
+    }
+    /* Leave masked inputs to the dot products, which propagate them */
+    for (k = 0; k < dm*dn+dn*dp; k++) {
+        if (rational_is_masked(a[k])) {
+            goto done;
+        }
+    }
+
+    /*
+     * Each entry is S/(Da*Db) for an integer S with |S| < dn*2**62*Da*Db,
+     * where Da and Db are the row and column denominators.  Any wrong
+     * candidate a/b differs from S/(Da*Db) by a nonzero integer
+     * S*b-a*Da*Db below 2**31*(|S|+Da*Db) in absolute value, which the
+     * primes catch once their product exceeds that bound.
+     */
+    double bits_a = 0, bits_b = 0, bits;
+    for (i = 0; i < dm; i++) {
+        double bits_i;
+        sa[i] = denominator_lcm(a+i*dn,dn,1,&bits_i);
+        bits_a = bits_i>bits_a?bits_i:bits_a;
+    }
+    for (j = 0; j < dp; j++) {
+        double bits_j;
+        sb[j] = denominator_lcm(b+j,dn,dp,&bits_j);
+        bits_b = bits_j>bits_b?bits_j:bits_b;
+    }
+    bits = 95+(dn>1?log2((double)dn):0)+bits_a+bits_b;
+    npy_intp count = (npy_intp)ceil(bits/MODULAR_PRIME_BITS);
+    if (count > MODULAR_PRIMES) {
+        goto done;
+    }
+    res = malloc(sizeof(uint32_t)*(count*dm*dp+1));
+    if (!res) {
+        goto done;
+    }
+
+    /* Multiply modulo each usable prime, removing the scales afterwards */
+    for (u = 0, used = 0; u < MODULAR_PRIMES && used < count; u++) {
+        uint32_t p = modular_primes[u];
+        uint32_t* c = res+used*dm*dp;
+        int usable = 1;
+        for (i = 0; i < dm && usable; i++) {
+            usable = modular_images(a+i*dn,dn,1,sa[i],p,ia+i*dn,1);
+        }
+        for (j = 0; j < dp && usable; j++) {
+            usable = modular_images(b+j,dn,dp,sb[j],p,ib+j,dp);
+        }
+        if (!usable) {
+            continue;
+        }
+        modular_matmul(ia,ib,c,acc,dm,dn,dp,p);
+        for (j = 0; j < dp; j++) {
+            acc[j] = sb[j]?mod_inverse(mod_reduce(sb[j],p),p):1;
+        }
+        for (i = 0; i < dm; i++) {
+            uint32_t f = sa[i]?mod_inverse(mod_reduce(sa[i],p),p):1;
+            for (j = 0; j < dp; j++) {
+                c[i*dp+j] = mod_mul(mod_mul(c[i*dp+j],f,p),acc[j],p);
+            }
+        }
+        primes[used++] = p;
+    }
+    if (used < count) {
+        goto done;
+    }
+
+    /* Combine the first three residues by Garner's algorithm, then check the
+     * reconstructed fraction against the remaining primes */
+    const uint32_t p0 = primes[0], p1 = primes[1], p2 = primes[2];
+    const uint64_t p01 = (uint64_t)p0*p1;
+    const uint32_t inv0 = mod_inverse(p0%p1,p1);
+    const uint32_t inv01 = mod_inverse(p01%p2,p2);
+    const wide_uint m = (wide_uint)p01*p2;
+    for (i = 0; i < dm; i++) {
+        for (j = 0; j < dp; j++) {
+            const npy_intp e = i*dp+j;
+            const npy_intp mp = dm*dp;
+            uint32_t r0 = res[e], r1 = res[mp+e], r2 = res[2*mp+e];
+            uint64_t x01 = r0+(uint64_t)p0*mod_mul(mod_reduce((int64_t)r1-r0,p1),inv0,p1);
+            wide_uint x = x01+(wide_uint)p01*mod_mul(mod_reduce((int64_t)r2-(int64_t)(x01%p2),p2),inv01,p2);
+            rational r = {0};
+            int good = rational_reconstruct(x,m,&r);
+            for (u = 3; u < count && good; u++) {
+                uint32_t p = primes[u];
+                good = mod_mul(res[u*mp+e],mod_reduce(d(r),p),p)==mod_reduce(r.n,p);
+            }
+            if (!good) {
+                set_overflow();
+                r.n = r.dmm = 0;
+            }
+            *(rational*)(args[2]+i*os_m+j*os_p) = r;
+        }
+    }
+    ok = 1;
+
+    done:
+    free(a);
+    free(sa);
+    free(ia);
+    free(acc);
+    free(res);
+    return ok;
+}
+
+#endif
+
+static void
+rational_gufunc_matrix_multiply_modular(char **args, npy_intp *dimensions, npy_intp *steps, void *NPY_UNUSED(func))
+{
+    /* outer dimensions counter */
+    npy_intp N_;
+
+    /* length of flattened outer dimensions */
+    npy_intp dN = dimensions[0];
+
+    /* striding over flattened outer dimensions for input and output arrays */
+    npy_intp s0 = steps[0];
+    npy_intp s1 = steps[1];
+    npy_intp s2 = steps[2];
+
+    /* fall back to ordinary dot products if the modular engine can't run */
+    for (N_ = 0; N_ < dN; N_++, args[0] += s0, args[1] += s1, args[2] += s2) {
+#ifdef HAVE_WIDE_INT
+        if (rational_matrix_multiply_modular(args, dimensions+1, steps+3)) {
+            continue;
+        }
+#endif
+        rational_matrix_multiply(args, dimensions+1, steps+3);
+    }
+}
+
+/*
+ * Exact statistics
+ *
+ * Each kernel accumulates its sums over a running common denominator with
+ * wide numerators and normalizes once per output, so intermediate sums never
+ * overflow as long as the denominators share enough factors.
+ */
+
+/* Store s into op, raising OverflowError if ok is false or s doesn't fit */
+static void
+rational_sum_store(rational_sum* s, int ok, char* op) {
+    rational r = {0};
+    if (!ok || !rational_sum_value(s,&r)) {
+        set_overflow();
+    }
+    memcpy(op,&r,sizeof(r));
+}
+
+static void
+rational_gufunc_mean(char **args, npy_intp *dimensions, npy_intp *steps, void *NPY_UNUSED(func))
+{
+    npy_intp N_, dN = dimensions[0], dn = dimensions[1];
+    npy_intp s0 = steps[0], s1 = steps[1], is_n = steps[2];
+    for (N_ = 0; N_ < dN; N_++, args[0] += s0, args[1] += s1) {
+        rational_sum s, count = {dn,1};
+        if (!dn) {
+            set_zero_divide();
+        }
+        rational_sum_store(&s, dn && rational_sum_strided(&s,args[0],is_n,dn)
+            && rational_sum_divide(&s,count), args[1]);
+    }
+}
+
+static void
+rational_gufunc_var(char **args, npy_intp *dimensions, npy_intp *steps, void *NPY_UNUSED(func))
+{
+    npy_intp N_, dN = dimensions[0], dn = dimensions[1];
+    npy_intp s0 = steps[0], s1 = steps[1], is_n = steps[2];
+    for (N_ = 0; N_ < dN; N_++, args[0] += s0, args[1] += s1) {
+        /* var = mean(x**2) - mean(x)**2, computed exactly */
+        rational_sum mean, square, count = {dn,1};
+        int ok;
+        if (!dn) {
+            set_zero_divide();
+        }
+        ok = dn && rational_sum_strided(&mean,args[0],is_n,dn)
+            && rational_sum_products(&square,args[0],is_n,args[0],is_n,dn)
+            && rational_sum_divide(&mean,count) && rational_sum_divide(&square,count)
+            && rational_sum_multiply(&mean,mean);
+        if (ok) {
+            mean.n = -mean.n;
+            ok = rational_sum_add_sum(&square,mean);
+        }
+        rational_sum_store(&square,ok,args[1]);
+    }
+}
+
+static void
+rational_gufunc_weighted_sum(char **args, npy_intp *dimensions, npy_intp *steps, void *NPY_UNUSED(func))
+{
+    npy_intp N_, dN = dimensions[0], dn = dimensions[1];
+    npy_intp s0 = steps[0], s1 = steps[1], s2 = steps[2], is0_n = steps[3], is1_n = steps[4];
+    for (N_ = 0; N_ < dN; N_++, args[0] += s0, args[1] += s1, args[2] += s2) {
+        rational_sum s;
+        rational_sum_store(&s, rational_sum_products(&s,args[0],is0_n,args[1],is1_n,dn), args[2]);
+    }
+}
+
+static void
+rational_gufunc_average(char **args, npy_intp *dimensions, npy_intp *steps, void *NPY_UNUSED(func))
+{
+    npy_intp N_, dN = dimensions[0], dn = dimensions[1];
+    npy_intp s0 = steps[0], s1 = steps[1], s2 = steps[2], is0_n = steps[3], is1_n = steps[4];
+    for (N_ = 0; N_ < dN; N_++, args[0] += s0, args[1] += s1, args[2] += s2) {
+        rational_sum s, w;
+        int ok = rational_sum_products(&s,args[0],is0_n,args[1],is1_n,dn)
+            && rational_sum_strided(&w,args[1],is1_n,dn);
+        if (ok && !w.n && !w.masked) {
+            set_zero_divide();
+            ok = 0;
+        }
+        rational_sum_store(&s, ok && rational_sum_divide(&s,w), args[2]);
+    }
+}
+
+/* Sparse rational matrices in compressed sparse row format */
+
+typedef struct {
+    PyObject_HEAD
+    npy_intp rows, cols;
+    /* int32 row offsets into indices and data, of length rows+1 */
+    PyArrayObject* indptr;
+    /* int32 column indices of the nonzeros, sorted within each row */
+    PyArrayObject* indices;
+    /* rational values of the nonzeros */
+    PyArrayObject* data;
+} PyCSR;
+
+static PyTypeObject PyCSR_Type;
+
+static PyArrayObject*
+new_rational_array(int nd, npy_intp* dims) {
+    Py_INCREF(&npyrational_descr);
+    return (PyArrayObject*)PyArray_Zeros(nd,dims,&npyrational_descr,0);
+}
+
+static PyArrayObject*
+as_rational_array(PyObject* object, int mindim, int maxdim) {
+    Py_INCREF(&npyrational_descr);
+    return (PyArrayObject*)PyArray_FromAny(object,&npyrational_descr,
+            mindim,maxdim,NPY_ARRAY_IN_ARRAY,0);
+}
+
+/*
+ * Exact dot product of one sparse row with a strided dense vector.  Products
+ * are accumulated without reducing, so each row is normalized only once.
+ */
+static NPY_INLINE int
+csr_row_dot(const int32_t* indices, const rational* data, npy_intp begin,
+        npy_intp end, const rational* x, npy_intp xstride, rational* y) {
+    rational_sum s;
+    npy_intp k;
+    rational_sum_init(&s);
+    for (k = begin; k < end; k++) {
+        rational a = data[k], b = x[indices[k]*xstride];
+        if (rational_is_masked(b)) {
+            *y = rational_masked;
+            return 1;
+        }
+        if (b.n && !rational_sum_add(&s,(int64_t)a.n*b.n,(int64_t)d(a)*d(b))) {
+            return 0;
+        }
+    }
+    return rational_sum_value(&s,y);
+}
+
+/*
+ * y = a*x for contiguous x of shape (cols,k) and y of shape (rows,k).  Rows
+ * are independent and touch no Python state, so we drop the GIL and, if
+ * built with OpenMP, run them in parallel.  Returns 0 on overflow.
+ */
+static int
+csr_multiply(PyCSR* a, const rational* x, npy_intp k, rational* y) {
+    const int32_t* indptr = (int32_t*)PyArray_DATA(a->indptr);
+    const int32_t* indices = (int32_t*)PyArray_DATA(a->indices);
+    const rational* data = (rational*)PyArray_DATA(a->data);
+    npy_intp rows = a->rows, i;
+    int ok = 1;
+    NPY_BEGIN_THREADS_DEF;
+    NPY_BEGIN_THREADS;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic,64) reduction(&:ok)
+#endif
+    for (i = 0; i < rows; i++) {
+        npy_intp c;
+        for (c = 0; c < k; c++) {
+            ok &= csr_row_dot(indices,data,indptr[i],indptr[i+1],x+c,k,y+i*k+c);
+        }
+    }
+    NPY_END_THREADS;
+    return ok;
+}
+
+/* The kernels trust the components, so we never let them change */
+static void
+csr_freeze(PyCSR* self) {
+    PyArray_CLEARFLAGS(self->indptr,NPY_ARRAY_WRITEABLE);
+    PyArray_CLEARFLAGS(self->indices,NPY_ARRAY_WRITEABLE);
+    PyArray_CLEARFLAGS(self->data,NPY_ARRAY_WRITEABLE);
+}
+
+static PyObject*
+pycsr_from_dense(PyTypeObject* type, PyObject* object) {
+    PyArrayObject* a = as_rational_array(object,2,2);
+    if (!a) {
+        return 0;
+    }
+    npy_intp rows = PyArray_DIM(a,0), cols = PyArray_DIM(a,1), i, j, nnz = 0;
+    const rational* x = (rational*)PyArray_DATA(a);
+    if (cols > INT32_MAX) {
+        Py_DECREF(a);
+        PyErr_SetString(PyExc_ValueError,"too many columns for csr_matrix");
+        return 0;
+    }
+    for (i = 0; i < rows*cols; i++) {
+        if (rational_is_masked(x[i])) {
+            Py_DECREF(a);
+            PyErr_SetString(PyExc_ValueError,"csr_matrix can't store masked values");
+            return 0;
+        }
+        nnz += x[i].n!=0;
+    }
+    if (nnz > INT32_MAX) {
+        Py_DECREF(a);
+        PyErr_SetString(PyExc_ValueError,"too many nonzeros for csr_matrix");
+        return 0;
+    }
+    npy_intp n1 = rows+1;
+    PyCSR* self = (PyCSR*)type->tp_alloc(type,0);
+    if (!self) {
+        Py_DECREF(a);
+        return 0;
+    }
+    self->rows = rows;
+    self->cols = cols;
+    self->indptr = (PyArrayObject*)PyArray_SimpleNew(1,&n1,NPY_INT32);
+    self->indices = (PyArrayObject*)PyArray_SimpleNew(1,&nnz,NPY_INT32);
+    self->data = new_rational_array(1,&nnz);
+    if (!self->indptr || !self->indices || !self->data) {
+        Py_DECREF(a);
+        Py_DECREF(self);
+        return 0;
+    }
+    int32_t* indptr = (int32_t*)PyArray_DATA(self->indptr);
+    int32_t* indices = (int32_t*)PyArray_DATA(self->indices);
+    rational* data = (rational*)PyArray_DATA(self->data);
+    nnz = 0;
+    for (i = 0; i < rows; i++) {
+        indptr[i] = nnz;
+        for (j = 0; j < cols; j++) {
+            if (x[i*cols+j].n) {
+                indices[nnz] = j;
+                data[nnz++] = x[i*cols+j];
+            }
+        }
+    }
+    indptr[rows] = nnz;
+    Py_DECREF(a);
+    csr_freeze(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+pycsr_from_components(PyTypeObject* type, PyObject* components, PyObject* shape) {
+    npy_intp rows, cols, i, k;
+    if (!shape || !PyTuple_Check(shape)) {
+        PyErr_SetString(PyExc_TypeError,
+                "csr_matrix((data,indices,indptr),shape) requires a shape tuple");
+        return 0;
+    }
+    if (!PyArg_ParseTuple(shape,"nn;shape must be (rows,cols)",&rows,&cols)) {
+        return 0;
+    }
+    if (rows<0 || cols<0 || cols>INT32_MAX) {
+        PyErr_SetString(PyExc_ValueError,"invalid csr_matrix shape");
+        return 0;
+    }
+    PyCSR* self = (PyCSR*)type->tp_alloc(type,0);
+    if (!self) {
+        return 0;
+    }
+    self->rows = rows;
+    self->cols = cols;
+    /* Copy the components, so that later changes by the caller can't break them */
+    Py_INCREF(&npyrational_descr);
+    self->data = (PyArrayObject*)PyArray_FromAny(PyTuple_GET_ITEM(components,0),
+            &npyrational_descr,1,1,NPY_ARRAY_CARRAY|NPY_ARRAY_ENSURECOPY,0);
+    self->indices = (PyArrayObject*)PyArray_FROMANY(PyTuple_GET_ITEM(components,1),
+            NPY_INT32,1,1,NPY_ARRAY_CARRAY|NPY_ARRAY_ENSURECOPY|NPY_ARRAY_FORCECAST);
+    self->indptr = (PyArrayObject*)PyArray_FROMANY(PyTuple_GET_ITEM(components,2),
+            NPY_INT32,1,1,NPY_ARRAY_CARRAY|NPY_ARRAY_ENSURECOPY|NPY_ARRAY_FORCECAST);
+    if (!self->data || !self->indices || !self->indptr) {
+        Py_DECREF(self);
+        return 0;
+    }
+    /* Validate structure, since the kernels trust it */
+    const int32_t* indptr = (int32_t*)PyArray_DATA(self->indptr);
+    const int32_t* indices = (int32_t*)PyArray_DATA(self->indices);
+    npy_intp nnz = PyArray_DIM(self->data,0);
+    int ok = PyArray_DIM(self->indptr,0)==rows+1 && PyArray_DIM(self->indices,0)==nnz
+             && indptr[0]==0 && indptr[rows]==nnz;
+    for (i = 0; i < rows && ok; i++) {
+        ok = indptr[i]<=indptr[i+1];
+    }
+    for (k = 0; k < nnz && ok; k++) {
+        ok = indices[k]>=0 && indices[k]<cols;
+    }
+    if (!ok) {
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_ValueError,"inconsistent csr_matrix components");
+        return 0;
+    }
+    const rational* data = (rational*)PyArray_DATA(self->data);
+    for (k = 0; k < nnz; k++) {
+        if (rational_is_masked(data[k])) {
+            Py_DECREF(self);
+            PyErr_SetString(PyExc_ValueError,"csr_matrix can't store masked values");
+            return 0;
+        }
+    }
+    for (i = 0; i < rows && ok; i++) {
+        for (k = indptr[i]+1; k < indptr[i+1] && ok; k++) {
+            ok = indices[k-1]<=indices[k];
+        }
+    }
+    if (!ok) {
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_ValueError,
+                "csr_matrix indices must be sorted within each row");
+        return 0;
+    }
+    csr_freeze(self);
+    return (PyObject*)self;
+}
+
+static PyObject*
+pycsr_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    PyObject *object, *shape = 0;
+    if (kwds && PyDict_Size(kwds)) {
+        PyErr_SetString(PyExc_TypeError,
+                "constructor takes no keyword arguments");
+        return 0;
+    }
+    if (!PyArg_ParseTuple(args,"O|O:csr_matrix",&object,&shape)) {
+        return 0;
+    }
+    if (PyTuple_Check(object) && PyTuple_GET_SIZE(object)==3) {
+        return pycsr_from_components(type,object,shape);
+    }
+    if (shape) {
+        PyErr_SetString(PyExc_TypeError,
+                "shape is only allowed with (data,indices,indptr)");
+        return 0;
+    }
+    return pycsr_from_dense(type,object);
+}
+
+static void
+pycsr_dealloc(PyObject* self) {
+    PyCSR* a = (PyCSR*)self;
+    Py_XDECREF(a->indptr);
+    Py_XDECREF(a->indices);
+    Py_XDECREF(a->data);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject*
+pycsr_repr(PyObject* self) {
+    PyCSR* a = (PyCSR*)self;
+    return PyUString_FromFormat("csr_matrix(shape=(%ld, %ld), nnz=%ld)",
+            (long)a->rows,(long)a->cols,(long)PyArray_DIM(a->data,0));
+}
+
+static PyObject*
+pycsr_dot(PyObject* self, PyObject* object) {
+    PyCSR* a = (PyCSR*)self;
+    PyArrayObject* x = as_rational_array(object,1,2);
+    if (!x) {
+        return 0;
+    }
+    if (PyArray_DIM(x,0)!=a->cols) {
+        Py_DECREF(x);
+        PyErr_Format(PyExc_ValueError,"dimension mismatch: %ld columns, %ld rows",
+                (long)a->cols,(long)PyArray_DIM(x,0));
+        return 0;
+    }
+    int nd = PyArray_NDIM(x);
+    npy_intp dims[2] = {a->rows,nd==2?PyArray_DIM(x,1):1};
+    PyArrayObject* y = new_rational_array(nd,dims);
+    if (!y) {
+        Py_DECREF(x);
+        return 0;
+    }
+    int ok = csr_multiply(a,(rational*)PyArray_DATA(x),dims[1],(rational*)PyArray_DATA(y));
+    Py_DECREF(x);
+    if (!ok) {
+        Py_DECREF(y);
+        set_overflow();
+        return 0;
+    }
+    return (PyObject*)y;
+}
+
+static PyObject*
+pycsr_toarray(PyObject* self, PyObject* NPY_UNUSED(args)) {
+    PyCSR* a = (PyCSR*)self;
+    npy_intp dims[2] = {a->rows,a->cols}, i, k;
+    PyArrayObject* y = new_rational_array(2,dims);
+    if (!y) {
+        return 0;
+    }
+    const int32_t* indptr = (int32_t*)PyArray_DATA(a->indptr);
+    const int32_t* indices = (int32_t*)PyArray_DATA(a->indices);
+    const rational* data = (rational*)PyArray_DATA(a->data);
+    rational* out = (rational*)PyArray_DATA(y);
+    /* Repeated indices within a row are summed, as dot does */
+    for (i = 0; i < a->rows; i++) {
+        for (k = indptr[i]; k < indptr[i+1]; k++) {
+            rational* o = out+i*a->cols+indices[k];
+            *o = k>indptr[i] && indices[k]==indices[k-1] ? rational_add(*o,data[k]) : data[k];
+        }
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(y);
+        return 0;
+    }
+    return (PyObject*)y;
+}
+
+static PyMethodDef pycsr_methods[] = {
+    {"dot",pycsr_dot,METH_O,"exact product with a dense rational vector or matrix"},
+    {"toarray",pycsr_toarray,METH_NOARGS,"dense rational array with the same entries"},
+    {0} /* sentinel */
+};
+
+static PyObject*
+pycsr_shape(PyObject* self, void* closure) {
+    PyCSR* a = (PyCSR*)self;
+    return Py_BuildValue("(nn)",a->rows,a->cols);
+}
+
+static PyObject*
+pycsr_nnz(PyObject* self, void* closure) {
+    return PyInt_FromLong(PyArray_DIM(((PyCSR*)self)->data,0));
+}
+
+#define CSR_COMPONENT(name) \
+    static PyObject* \
+    pycsr_##name(PyObject* self, void* closure) { \
+        /* A read only view, since a view of a read only array can't be made writeable */ \
+        PyArrayObject* x = (PyArrayObject*)PyArray_View(((PyCSR*)self)->name,0,0); \
+        if (x) { \
+            PyArray_CLEARFLAGS(x,NPY_ARRAY_WRITEABLE); \
+        } \
+        return (PyObject*)x; \
+    }
+CSR_COMPONENT(data)
+CSR_COMPONENT(indices)
+CSR_COMPONENT(indptr)
+
+static PyGetSetDef pycsr_getset[] = {
+    {(char*)"shape",pycsr_shape,0,(char*)"(rows,cols)",0},
+    {(char*)"nnz",pycsr_nnz,0,(char*)"number of stored entries",0},
+    {(char*)"data",pycsr_data,0,(char*)"rational values of the stored entries",0},
+    {(char*)"indices",pycsr_indices,0,(char*)"int32 column indices of the stored entries",0},
+    {(char*)"indptr",pycsr_indptr,0,(char*)"int32 offsets of each row into data and indices",0},
+    {0} /* sentinel */
+};
+
+static PyTypeObject PyCSR_Type = {
+#if defined(NPY_PY3K)
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+#else
+    PyObject_HEAD_INIT(&PyType_Type)
+    0,                                        /* ob_size */
+#endif
+    "csr_matrix",                             /* tp_name */
+    sizeof(PyCSR),                            /* tp_basicsize */
+    0,                                        /* tp_itemsize */
+    pycsr_dealloc,                            /* tp_dealloc */
+    0,                                        /* tp_print */
+    0,                                        /* tp_getattr */
+    0,                                        /* tp_setattr */
+#if defined(NPY_PY3K)
+    0,                                          /* tp_reserved */
+#else
+    0,                                          /* tp_compare */
+#endif
+    pycsr_repr,                               /* tp_repr */
+    0,                                        /* tp_as_number */
+    0,                                        /* tp_as_sequence */
+    0,                                        /* tp_as_mapping */
+    0,                                        /* tp_hash */
+    0,                                        /* tp_call */
+    0,                                        /* tp_str */
+    0,                                        /* tp_getattro */
+    0,                                        /* tp_setattro */
+    0,                                        /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                       /* tp_flags */
+    "Sparse rational matrices in compressed sparse row format", /* tp_doc */
+    0,                                        /* tp_traverse */
+    0,                                        /* tp_clear */
+    0,                                        /* tp_richcompare */
+    0,                                        /* tp_weaklistoffset */
+    0,                                        /* tp_iter */
+    0,                                        /* tp_iternext */
+    pycsr_methods,                            /* tp_methods */
+    0,                                        /* tp_members */
+    pycsr_getset,                             /* tp_getset */
+    0,                                        /* tp_base */
+    0,                                        /* tp_dict */
+    0,                                        /* tp_descr_get */
+    0,                                        /* tp_descr_set */
+    0,                                        /* tp_dictoffset */
+    0,                                        /* tp_init */
+    0,                                        /* tp_alloc */
+    pycsr_new,                                /* tp_new */
+    0,                                        /* tp_free */
+    0,                                          /* tp_is_gc */
+    0,                                          /* tp_bases */
+    0,                                          /* tp_mro */
+    0,                                          /* tp_cache */
+    0,                                          /* tp_subclasses */
+    0,                                          /* tp_weaklist */
+    0,                                          /* tp_del */
+#if PY_VERSION_HEX >= 0x02060000
+    0,                                          /* tp_version_tag */
+#endif
+};
+
+/*
+ * Fused evaluation of rational expressions
+ *
+ * evaluate("(a*b-c)/(d+e)") compiles the expression into a small stack
+ * program and runs it over cache sized blocks of the broadcast inputs, one
+ * instruction at a time, without allocating temporaries.  Intermediates are
+ * kept unreduced as 64-bit numerator/denominator pairs.  As long as both fit
+ * in 32 bits the reduced value would too, so we only reduce an intermediate
+ * when it leaves that range, raising overflow exactly when the equivalent
+ * chain of ufuncs would.  Each result is reduced once at the end.
+ */
+
+#define EVAL_BLOCK 256
+#define EVAL_MAX_DEPTH 32
+#define EVAL_MAX_PROGRAM 256
+
+enum {
+    EVAL_INPUT,
+    EVAL_CONSTANT,
+    EVAL_ADD,
+    EVAL_SUBTRACT,
+    EVAL_MULTIPLY,
+    EVAL_DIVIDE,
+    EVAL_NEGATIVE
+};
+
+typedef struct {
+    int op;
+    /* input index for EVAL_INPUT, value for EVAL_CONSTANT */
+    int32_t arg;
+} eval_instruction;
+
+typedef struct {
+    const char* s;
+    /* variable lookup */
+    PyObject *local_dict, *global_dict;
+    /* maps names to input indices */
+    PyObject* names;
+    PyObject* inputs;
+    eval_instruction program[EVAL_MAX_PROGRAM];
+    int size, depth, max_depth;
+} eval_compiler;
+
+/*
+ * Unreduced intermediate, with |n| <= 2**31 and 0 < d < 2**31 between
+ * instructions, or n = d = 0 for a masked element, which stays masked
+ */
+typedef struct {
+    int64_t n, d;
+} eval_value;
+
+static int
+eval_emit(eval_compiler* c, int op, int32_t arg) {
+    if (c->size==EVAL_MAX_PROGRAM) {
+        PyErr_SetString(PyExc_ValueError,"rational expression is too long");
+        return 0;
+    }
+    c->program[c->size].op = op;
+    c->program[c->size++].arg = arg;
+    c->depth += op==EVAL_INPUT || op==EVAL_CONSTANT ? 1 : op==EVAL_NEGATIVE ? 0 : -1;
+    if (c->depth > EVAL_MAX_DEPTH) {
+        PyErr_SetString(PyExc_ValueError,"rational expression is nested too deeply");
+        return 0;
+    }
+    if (c->depth > c->max_depth) {
+        c->max_depth = c->depth;
+    }
+    return 1;
+}
+
+static NPY_INLINE char
+eval_peek(eval_compiler* c) {
+    while (isspace((unsigned char)*c->s)) {
+        c->s++;
+    }
+    return *c->s;
+}
+
+static int eval_parse_sum(eval_compiler* c);
+
+static int
+eval_parse_variable(eval_compiler* c) {
+    const char* start = c->s;
+    while (isalnum((unsigned char)*c->s) || *c->s=='_') {
+        c->s++;
+    }
+    PyObject* name = PyUString_FromStringAndSize(start,c->s-start);
+    if (!name) {
+        return 0;
+    }
+    PyObject* index = PyDict_GetItem(c->names,name);
+    if (index) {
+        Py_DECREF(name);
+        return eval_emit(c,EVAL_INPUT,PyInt_AsLong(index));
+    }
+    /* Look in local_dict, then global_dict, letting errors other than a missing name through */
+    PyObject* value = c->local_dict?PyObject_GetItem(c->local_dict,name):0;
+    if (!value && c->global_dict && (!PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_KeyError))) {
+        PyErr_Clear();
+        value = PyObject_GetItem(c->global_dict,name);
+    }
+    if (!value) {
+        if (!PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_KeyError)) {
+            char buffer[64];
+            snprintf(buffer,sizeof(buffer),"%.*s",(int)(c->s-start),start);
+            PyErr_Clear();
+            PyErr_Format(PyExc_NameError,"name '%s' is not defined",buffer);
+        }
+        Py_DECREF(name);
+        return 0;
+    }
+    Py_ssize_t n = PyList_GET_SIZE(c->inputs);
+    if (n==NPY_MAXARGS-1) {
+        PyErr_SetString(PyExc_ValueError,"too many variables in rational expression");
+        Py_DECREF(name);
+        Py_DECREF(value);
+        return 0;
+    }
+    index = PyInt_FromLong(n);
+    int ok = index && PyDict_SetItem(c->names,name,index)==0
+                   && PyList_Append(c->inputs,value)==0;
+    Py_XDECREF(index);
+    Py_DECREF(name);
+    Py_DECREF(value);
+    return ok && eval_emit(c,EVAL_INPUT,n);
+}
+
+static int
+eval_parse_atom(eval_compiler* c) {
+    char t = eval_peek(c);
+    if (t=='(') {
+        c->s++;
+        if (!eval_parse_sum(c)) {
+            return 0;
+        }
+        if (eval_peek(c)!=')') {
+            PyErr_SetString(PyExc_SyntaxError,"expected ')' in rational expression");
+            return 0;
+        }
+        c->s++;
+        return 1;
+    }
+    if (isdigit((unsigned char)t)) {
+        char* end;
+        long long n = strtoll(c->s,&end,10);
+        c->s = end;
+        if (n > INT32_MAX) {
+            set_overflow();
+            return 0;
+        }
+        return eval_emit(c,EVAL_CONSTANT,n);
+    }
+    if (isalpha((unsigned char)t) || t=='_') {
+        return eval_parse_variable(c);
+    }
+    PyErr_Format(PyExc_SyntaxError,"unexpected %s in rational expression",
+            t?"character":"end of input");
+    return 0;
+}
+
+static int
+eval_parse_unary(eval_compiler* c) {
+    char t = eval_peek(c);
+    if (t=='-' || t=='+') {
+        c->s++;
+        return eval_parse_unary(c) && (t=='+' || eval_emit(c,EVAL_NEGATIVE,0));
+    }
+    return eval_parse_atom(c);
+}
+
+static int
+eval_parse_product(eval_compiler* c) {
+    if (!eval_parse_unary(c)) {
+        return 0;
+    }
+    for (;;) {
+        char t = eval_peek(c);
+        if (t!='*' && t!='/') {
+            return 1;
+        }
+        c->s++;
+        if (!eval_parse_unary(c) || !eval_emit(c,t=='*'?EVAL_MULTIPLY:EVAL_DIVIDE,0)) {
+            return 0;
+        }
+    }
+}
+
+static int
+eval_parse_sum(eval_compiler* c) {
+    if (!eval_parse_product(c)) {
+        return 0;
+    }
+    for (;;) {
+        char t = eval_peek(c);
+        if (t!='+' && t!='-') {
+            return 1;
+        }
+        c->s++;
+        if (!eval_parse_product(c) || !eval_emit(c,t=='+'?EVAL_ADD:EVAL_SUBTRACT,0)) {
+            return 0;
+        }
+    }
+}
+
+/* Overflow checked int64 arithmetic, returning 0 on overflow */
+static NPY_INLINE int
+eval_add(int64_t x, int64_t y, int64_t* z) {
+    if (x>0 ? y>INT64_MAX-x : y<INT64_MIN-x) {
+        return 0;
+    }
+    *z = x+y;
+    return 1;
+}
+
+static NPY_INLINE int
+eval_mul(int64_t x, int64_t y, int64_t* z) {
+#ifdef HAVE_WIDE_INT
+    wide_int w = (wide_int)x*y;
+    *z = w;
+    return *z==w;
+#else
+    if (x && y && (x==INT64_MIN || y==INT64_MIN || (x<0?-x:x)>INT64_MAX/(y<0?-y:y))) {
+        return 0;
+    }
+    *z = x*y;
+    return 1;
+#endif
+}
+
+/* z = a*b+c*e, returning 0 on overflow */
+static NPY_INLINE int
+eval_cross(int64_t a, int64_t b, int64_t c, int64_t e, int64_t* z) {
+    int64_t x, y;
+    return eval_mul(a,b,&x) && eval_mul(c,e,&y) && eval_add(x,y,z);
+}
+
+/* Bring an intermediate back into 32-bit range, as a ufunc would */
+static NPY_INLINE void
+eval_check(eval_value* v) {
+    if (v->n<INT32_MIN || v->n>INT32_MAX || v->d>INT32_MAX) {
+        int64_t g = gcd(v->n,v->d);
+        v->n /= g;
+        v->d /= g;
+        if (v->n<INT32_MIN || v->n>INT32_MAX || v->d>INT32_MAX) {
+            set_overflow();
+            v->n = 0;
+            v->d = 1;
+        }
+    }
+}
+
+/* Run the program over one block of at most EVAL_BLOCK elements */
+static void
+eval_block(const eval_compiler* c, char** data, npy_intp* strides, npy_intp count,
+        eval_value* stack) {
+    int pc, sp = 0;
+    npy_intp i;
+    for (pc = 0; pc < c->size; pc++) {
+        eval_instruction in = c->program[pc];
+        /* the top of the stack, and the operands of binary instructions */
+        eval_value* z = stack+sp*EVAL_BLOCK;
+        eval_value *x, *y;
+        switch (in.op) {
+            case EVAL_INPUT: {
+                const char* p = data[in.arg];
+                npy_intp s = strides[in.arg];
+                for (i = 0; i < count; i++) {
+                    rational r = *(rational*)(p+i*s);
+                    z[i].n = r.n;
+                    z[i].d = rational_is_masked(r)?0:d(r);
+                }
+                sp++;
+                break;
+            }
+            case EVAL_CONSTANT:
+                for (i = 0; i < count; i++) {
+                    z[i].n = in.arg;
+                    z[i].d = 1;
+                }
+                sp++;
+                break;
+            case EVAL_NEGATIVE:
+                y = z-EVAL_BLOCK;
+                for (i = 0; i < count; i++) {
+                    y[i].n = -y[i].n;
+                    eval_check(y+i);
+                }
+                break;
+            /* ok is computed with overflow checked arithmetic into n and d */
+            #define EVAL_BINARY(op,ok) \
+            case op: \
+                y = z-EVAL_BLOCK; \
+                x = y-EVAL_BLOCK; \
+                for (i = 0; i < count; i++) { \
+                    int64_t n = 0, d = 0; \
+                    if (x[i].d && y[i].d && !(ok)) { \
+                        set_overflow(); \
+                        n = 0; \
+                        d = 1; \
+                    } \
+                    x[i].n = n; \
+                    x[i].d = d; \
+                    eval_check(x+i); \
+                } \
+                sp--; \
+                break;
+            EVAL_BINARY(EVAL_ADD,eval_cross(x[i].n,y[i].d,y[i].n,x[i].d,&n)
+                    && eval_mul(x[i].d,y[i].d,&d))
+            EVAL_BINARY(EVAL_SUBTRACT,eval_cross(x[i].n,y[i].d,-y[i].n,x[i].d,&n)
+                    && eval_mul(x[i].d,y[i].d,&d))
+            EVAL_BINARY(EVAL_MULTIPLY,eval_mul(x[i].n,y[i].n,&n) && eval_mul(x[i].d,y[i].d,&d))
+            #undef EVAL_BINARY
+            case EVAL_DIVIDE:
+                y = z-EVAL_BLOCK;
+                x = y-EVAL_BLOCK;
+                for (i = 0; i < count; i++) {
+                    int64_t n = 0, d = 0;
+                    if (!x[i].d || !y[i].d) {
+                        /* masked operands give a masked result */
+                    }
+                    else if (!eval_mul(x[i].n,y[i].d,&n) || !eval_mul(x[i].d,y[i].n,&d)) {
+                        set_overflow();
+                        n = 0;
+                        d = 1;
+                    }
+                    else if (!d) {
+                        set_zero_divide();
+                        n = 0;
+                        d = 1;
+                    }
+                    else if (d<0) {
+                        n = -n;
+                        d = -d;
+                    }
+                    x[i].n = n;
+                    x[i].d = d;
+                    eval_check(x+i);
+                }
+                sp--;
+                break;
+        }
+    }
+}
+
+static PyObject*
+rational_evaluate(PyObject* self, PyObject* args) {
+    const char* ex;
+    PyObject* local_dict = 0;
+    if (!PyArg_ParseTuple(args,"s|O:evaluate",&ex,&local_dict)) {
+        return 0;
+    }
+    eval_compiler c;
+    c.s = ex;
+    c.size = c.depth = c.max_depth = 0;
+    /* Default to the caller's namespace, and fall back to its globals, as numexpr does */
+    c.local_dict = local_dict && local_dict!=Py_None ? local_dict : PyEval_GetLocals();
+    c.global_dict = PyEval_GetGlobals();
+    c.names = PyDict_New();
+    c.inputs = PyList_New(0);
+    PyObject* result = 0;
+    eval_value* stack = 0;
+    NpyIter* iter = 0;
+    if (!c.names || !c.inputs || !eval_parse_sum(&c)) {
+        goto done;
+    }
+    if (eval_peek(&c)) {
+        PyErr_SetString(PyExc_SyntaxError,"unexpected character in rational expression");
+        goto done;
+    }
+
+    /* Broadcast the inputs against a rational output, casting in buffered blocks */
+    int nin = PyList_GET_SIZE(c.inputs), i;
+    PyArrayObject* ops[NPY_MAXARGS];
+    npy_uint32 op_flags[NPY_MAXARGS];
+    PyArray_Descr* op_dtypes[NPY_MAXARGS];
+    for (i = 0; i <= nin; i++) {
+        ops[i] = 0;
+    }
+    for (i = 0; i < nin; i++) {
+        ops[i] = (PyArrayObject*)PyArray_FROM_O(PyList_GET_ITEM(c.inputs,i));
+        if (!ops[i]) {
+            goto cleanup;
+        }
+        op_flags[i] = NPY_ITER_READONLY|NPY_ITER_NBO|NPY_ITER_ALIGNED;
+        op_dtypes[i] = &npyrational_descr;
+    }
+    op_flags[nin] = NPY_ITER_WRITEONLY|NPY_ITER_ALLOCATE;
+    op_dtypes[nin] = &npyrational_descr;
+    iter = NpyIter_AdvancedNew(nin+1,ops,
+            NPY_ITER_EXTERNAL_LOOP|NPY_ITER_BUFFERED|NPY_ITER_ZEROSIZE_OK,
+            NPY_KEEPORDER,NPY_SAFE_CASTING,op_flags,op_dtypes,-1,0,0,EVAL_BLOCK);
+    if (!iter) {
+        goto cleanup;
+    }
+    stack = malloc(sizeof(eval_value)*EVAL_BLOCK*(c.max_depth+1));
+    if (!stack) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    if (NpyIter_GetIterSize(iter)) {
+        NpyIter_IterNextFunc* next = NpyIter_GetIterNext(iter,0);
+        char** data = NpyIter_GetDataPtrArray(iter);
+        npy_intp* strides = NpyIter_GetInnerStrideArray(iter);
+        npy_intp* size = NpyIter_GetInnerLoopSizePtr(iter);
+        if (!next) {
+            goto cleanup;
+        }
+        do {
+            char* p[NPY_MAXARGS];
+            npy_intp k, j;
+            for (i = 0; i <= nin; i++) {
+                p[i] = data[i];
+            }
+            for (k = 0; k < *size; k += EVAL_BLOCK) {
+                npy_intp count = *size-k<EVAL_BLOCK?*size-k:EVAL_BLOCK;
+                eval_block(&c,p,strides,count,stack);
+                /* Reduce each result exactly once */
+                for (j = 0; j < count; j++) {
+                    eval_value v = stack[j];
+                    rational* r = (rational*)(p[nin]+j*strides[nin]);
+                    if (!v.d) {
+                        *r = rational_masked;
+                        continue;
+                    }
+                    int64_t g = gcd(v.n,v.d);
+                    r->n = v.n/g;
+                    r->dmm = v.d/g-1;
+                }
+                for (i = 0; i <= nin; i++) {
+                    p[i] += count*strides[i];
+                }
+            }
+        } while (next(iter));
+    }
+    if (!PyErr_Occurred()) {
+        result = (PyObject*)NpyIter_GetOperandArray(iter)[nin];
+        Py_INCREF(result);
+    }
+
+    cleanup:
+    for (i = 0; i < nin; i++) {
+        Py_XDECREF(ops[i]);
+    }
+    done:
+    if (iter) {
+        NpyIter_Deallocate(iter);
+    }
+    free(stack);
+    Py_XDECREF(c.names);
+    Py_XDECREF(c.inputs);
+    return result;
+}
+
+static const char* overflow_policy_names[] = {"raise","mask","saturate"};
+
+static PyObject*
+rational_set_overflow_policy(PyObject* self, PyObject* args) {
+    const char* name;
+    int old = overflow_policy, i;
+    if (!PyArg_ParseTuple(args,"s:set_overflow_policy",&name)) {
+        return 0;
+    }
+    for (i = 0; i < 3; i++) {
+        if (!strcmp(name,overflow_policy_names[i])) {
+            overflow_policy = i;
+            return PyUString_FromString(overflow_policy_names[old]);
+        }
+    }
+    PyErr_Format(PyExc_ValueError,"unknown overflow policy '%s', expected 'raise', 'mask' or 'saturate'",name);
+    return 0;
+}
+
+PyMethodDef module_methods[] = {
+    {"evaluate",rational_evaluate,METH_VARARGS,
+        "evaluate(ex, local_dict=None)\n\n"
+        "Evaluate a rational expression built from +, -, *, /, parentheses,\n"
+        "integer literals and array variables in one fused pass.  Variables are\n"
+        "looked up in local_dict, by default the caller's locals, and then in\n"
+        "the caller's globals."},
+    {"set_overflow_policy",rational_set_overflow_policy,METH_VARARGS,
+        "set_overflow_policy(policy) -> old_policy\n\n"
+        "Set what elementwise rational ufuncs and casts do when an element\n"
+        "overflows: 'raise' (the default) raises OverflowError for the whole\n"
+        "call, 'mask' stores a masked sentinel (see isoverflow) which later\n"
+        "ufuncs propagate, and 'saturate' stores the nearest representable\n"
+        "rational.  Scalar arithmetic always raises.  Under every policy,\n"
+        "evaluate, dot and the statistics gufuncs give masked results for\n"
+        "masked inputs, masked values read from Python as nan, comparisons,\n"
+        "argmin, argmax and truth tests treat them like NaN, and csr_matrix\n"
+        "refuses to store them."},
+    {0} /* sentinel */
+};
+
+/*
+ * The module name; setup.py builds the optimized profile again under other
+ * names, one for each instruction set
+ */
+#ifndef NPYTYPES_MODULE
+#define NPYTYPES_MODULE rational
+#endif
+#define MODULE_STRING(name) MODULE_STRING2(name)
+#define MODULE_STRING2(name) #name
+#define MODULE_INIT(prefix, name) MODULE_INIT2(prefix, name)
+#define MODULE_INIT2(prefix, name) prefix##name
+
+#if defined(NPY_PY3K)
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    MODULE_STRING(NPYTYPES_MODULE),
+    NULL,
+    -1,
+    module_methods,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+#endif
+
+#if defined(NPY_PY3K)
+PyMODINIT_FUNC MODULE_INIT(PyInit_, NPYTYPES_MODULE)(void) {
+#else
+PyMODINIT_FUNC MODULE_INIT(init, NPYTYPES_MODULE)(void) {
+#endif
+
+    PyObject *m;
+
+    import_array();
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    import_umath();
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    PyObject* numpy_str = PyUString_FromString("numpy");
+    if (!numpy_str) {
+        return NULL;
+    }
+    PyObject* numpy = PyImport_Import(numpy_str);
+    Py_DECREF(numpy_str);
+    if (!numpy) {
+        return NULL;
+    }
+
+    /* Can't set this until we import numpy */
+    PyRational_Type.tp_base = &PyGenericArrType_Type;
+
+    /* Initialize rational type object */
+    if (PyType_Ready(&PyRational_Type) < 0) {
+        return NULL;
+    }
+
+    /* Initialize sparse matrix type object */
+    if (PyType_Ready(&PyCSR_Type) < 0) {
+        return NULL;
+    }
+
+    /* Initialize rational descriptor */
+    PyArray_InitArrFuncs(&npyrational_arrfuncs);
+    npyrational_arrfuncs.getitem = npyrational_getitem;
+    npyrational_arrfuncs.setitem = npyrational_setitem;
+    npyrational_arrfuncs.copyswapn = npyrational_copyswapn;
+    npyrational_arrfuncs.copyswap = npyrational_copyswap;
+    npyrational_arrfuncs.compare = npyrational_compare;
+    npyrational_arrfuncs.argmin = npyrational_argmin;
+    npyrational_arrfuncs.argmax = npyrational_argmax;
+    npyrational_arrfuncs.dotfunc = npyrational_dot;
+    npyrational_arrfuncs.nonzero = npyrational_nonzero;
+    npyrational_arrfuncs.fill = npyrational_fill;
+    npyrational_arrfuncs.fillwithscalar = npyrational_fillwithscalar;
+    /* Left undefined: scanfunc, fromstr, sort, argsort */
+    Py_TYPE(&npyrational_descr) = &PyArrayDescr_Type;
+    int npy_rational = PyArray_RegisterDataType(&npyrational_descr);
+    if (npy_rational<0) {
+        return NULL;
+    }
+
+    /* Support dtype(rational) syntax */
+    if (PyDict_SetItemString(PyRational_Type.tp_dict,"dtype",(PyObject*)&npyrational_descr)<0) {
+        return NULL;
     }
 
     /* Register casts to and from rational */
@@ -1185,7 +2923,7 @@ PyMODINIT_FUNC initrational(void) {
 #if defined(NPY_PY3K)
     m = PyModule_Create(&moduledef);
 #else
-    m = Py_InitModule("rational", module_methods);
+    m = Py_InitModule(MODULE_STRING(NPYTYPES_MODULE), module_methods);
 #endif
 
     if (!m) {
@@ -1196,6 +2934,10 @@ PyMODINIT_FUNC initrational(void) {
     Py_INCREF(&PyRational_Type);
     PyModule_AddObject(m,"rational",(PyObject*)&PyRational_Type);
 
+    /* Add sparse matrix type */
+    Py_INCREF(&PyCSR_Type);
+    PyModule_AddObject(m,"csr_matrix",(PyObject*)&PyCSR_Type);
+
     /* Create matrix multiply generalized ufunc */
     PyObject* gufunc = PyUFunc_FromFuncAndDataAndSignature(0,0,0,0,2,1,PyUFunc_None,(char*)"matrix_multiply",(char*)"return result of multiplying two matrices of rationals",0,"(m,n),(n,p)->(m,p)");
     if (!gufunc) {
@@ -1207,6 +2949,32 @@ PyMODINIT_FUNC initrational(void) {
     }
     PyModule_AddObject(m,"matrix_multiply",(PyObject*)gufunc);
 
+    /* Create multimodular matrix multiply generalized ufunc */
+    gufunc = PyUFunc_FromFuncAndDataAndSignature(0,0,0,0,2,1,PyUFunc_None,(char*)"matrix_multiply_modular",(char*)"return result of multiplying two matrices of rationals, overflowing only if the result does",0,"(m,n),(n,p)->(m,p)");
+    if (!gufunc) {
+        return NULL;
+    }
+    if (PyUFunc_RegisterLoopForType((PyUFuncObject*)gufunc,npy_rational,rational_gufunc_matrix_multiply_modular,types2,0) < 0) {
+        return NULL;
+    }
+    PyModule_AddObject(m,"matrix_multiply_modular",(PyObject*)gufunc);
+
+    /* Create exact statistics generalized ufuncs */
+    #define NEW_STATISTIC_GUFUNC(name,nin,signature,doc) { \
+        PyObject* gufunc = PyUFunc_FromFuncAndDataAndSignature(0,0,0,0,nin,1,PyUFunc_None,(char*)#name,(char*)doc,0,signature); \
+        if (!gufunc) { \
+            return NULL; \
+        } \
+        if (PyUFunc_RegisterLoopForType((PyUFuncObject*)gufunc,npy_rational,rational_gufunc_##name,types2,0) < 0) { \
+            return NULL; \
+        } \
+        PyModule_AddObject(m,#name,(PyObject*)gufunc); \
+    }
+    NEW_STATISTIC_GUFUNC(mean,1,"(n)->()","exact mean along the last axis");
+    NEW_STATISTIC_GUFUNC(var,1,"(n)->()","exact population variance along the last axis");
+    NEW_STATISTIC_GUFUNC(weighted_sum,2,"(n),(n)->()","exact sum of x*w along the last axis");
+    NEW_STATISTIC_GUFUNC(average,2,"(n),(n)->()","exact weighted mean sum(x*w)/sum(w) along the last axis");
+
     /* Create numerator and denominator ufuncs */
     #define NEW_UNARY_UFUNC(name,type,doc) { \
         PyObject* ufunc = PyUFunc_FromFuncAndData(0,0,0,0,1,1,PyUFunc_None,(char*)#name,(char*)doc,0); \
@@ -1221,6 +2989,7 @@ PyMODINIT_FUNC initrational(void) {
     }
     NEW_UNARY_UFUNC(numerator,NPY_INT64,"rational number numerator");
     NEW_UNARY_UFUNC(denominator,NPY_INT64,"rational number denominator");
+    NEW_UNARY_UFUNC(isoverflow,NPY_BOOL,"true where an element was masked by the 'mask' overflow policy");
 
     /* Create gcd and lcm ufuncs */
     #define GCD_LCM_UFUNC(name,type,doc) { \
@@ -245,6 +245,243 @@ def test_gcd_lcm():
     assert_(all(lcm(2,[1,2,3,4,5,6])==[2,2,6,4,10,6]))
     assert_(lcm.reduce(arange(1,10))==2520)
 
+def test_matrix_multiply_modular():
+    random.seed(1262081)
+    for _ in range(50):
+        m,n,p = random.randint(1,6,3)
+        x = random.randint(-50,50,(m,n)).astype(rational)/random.randint(1,20,(m,n))
+        y = random.randint(-50,50,(n,p)).astype(rational)/random.randint(1,20,(n,p))
+        try:
+            z = matrix_multiply(x,y)
+        except OverflowError:
+            continue
+        assert_(all(matrix_multiply_modular(x,y)==z))
+    # Intermediate sums overflow even 128 bits, but the result fits
+    p = array([2,3,5,7,11,13,17,19,23,29,31,37,41,43,47,53,59,61,67,71,
+               73,79,83,89,97,101,103,107,109,113])
+    x = (1/concatenate([p,-p]).astype(rational)).reshape(1,-1)
+    y = concatenate([arange(1,31),arange(1,31)]).reshape(-1,1).astype(rational)
+    y[0] = 2
+    try:
+        matrix_multiply(x,y)
+        assert_(False)
+    except OverflowError:
+        pass
+    assert_(matrix_multiply_modular(x,y)[0,0]==R(1,2))
+    # Results that don't fit still overflow
+    x = array([[1<<30,1<<30]]).astype(rational)
+    try:
+        matrix_multiply_modular(x,ones((2,1),rational))
+        assert_(False)
+    except OverflowError:
+        pass
+    x = array([[1<<30,-(1<<30)]]).astype(rational)
+    assert_(matrix_multiply_modular(x,ones((2,1),rational))[0,0]==0)
+
+def test_statistics():
+    random.seed(1262081)
+    for _ in range(20):
+        n = random.randint(1,40)
+        x = random.randint(-50,50,(3,n)).astype(rational)/random.randint(1,5,(3,n))
+        w = random.randint(-5,10,(3,n)).astype(rational)/random.randint(1,4,(3,n))
+        try:
+            s = x.sum(axis=-1)/n
+            v = ((x-s[:,None])**2).sum(axis=-1)/n
+            t = w.sum(axis=-1)
+        except OverflowError:
+            continue
+        assert_(all(mean(x)==s))
+        assert_(all(var(x)==v))
+        assert_(all(weighted_sum(x,w)==dot(x,w.T).diagonal()))
+        if all(t!=0):
+            assert_(all(average(x,w)==weighted_sum(x,w)/t))
+    # Intermediate sums may overflow 32 bits, so long as the result fits
+    p = array([2,3,5,7,11,13,17,19,23,29,31,37])
+    x = 1/concatenate([p,-p,[1]]).astype(rational)
+    assert_(mean(x)==R(1,25))
+    assert_(dot(x,ones(25,rational))==1)
+    for f,args in (mean,(x[:0],)),(var,(x[:0],)),(average,(x,0*x)):
+        try:
+            f(*args)
+            assert_(False)
+        except ZeroDivisionError:
+            pass
+    try:
+        weighted_sum(array([1<<30,1<<30],rational),ones(2,rational))
+        assert_(False)
+    except OverflowError:
+        pass
+
+def test_overflow_policy():
+    x = array([1,1<<30,3,-(1<<31)],rational)
+    y = array([2,4,R(1,7),1],rational)
+    try:
+        x*y
+        assert_(False)
+    except OverflowError:
+        pass
+    assert_(set_overflow_policy('mask')=='raise')
+    try:
+        z = x*y
+        assert_(all(isoverflow(z)==[0,1,0,0]))
+        assert_(all(z[~isoverflow(z)]==[2,R(3,7),-(1<<31)]))
+        # Masks propagate, and new overflows are masked too
+        assert_(all(isoverflow(-(z+1))==[0,1,0,0]))
+        assert_(all(isoverflow(-z)==[0,1,0,1]))
+        assert_(isnan(z.astype(float)[1]))
+        assert_(all(isoverflow(array([1<<40,3]).astype(rational))==[1,0]))
+        # Scalar arithmetic still raises
+        try:
+            R(1<<30)*4
+            assert_(False)
+        except OverflowError:
+            pass
+        # Everything else propagates masks or refuses them
+        m = z[1:2]
+        assert_(isoverflow(evaluate('z/2-1')).tolist()==[0,1,0,0])
+        for f,args in (mean,(z,)),(var,(z,)),(average,(z,y)),(average,(y,z)),(weighted_sum,(y,z)),(dot,(z,y)):
+            # Masked scalar results read as nan
+            assert_(isnan(f(*args)))
+        w = where(isoverflow(z)|(z>0),z,1).reshape(2,2)
+        assert_(all(isoverflow(matrix_multiply(w,y.reshape(2,2)))==[[1,1],[0,0]]))
+        assert_(all(isoverflow(csr_matrix(y.reshape(2,2)).dot(w))==[[0,1],[0,1]]))
+        assert_(all(isoverflow(csr_matrix(y.reshape(2,2)).dot(w.T))==[[1,0],[1,0]]))
+        for arg in z.reshape(2,2),(z,[0,1,2,3],[0,4]):
+            try:
+                csr_matrix(*((arg,) if len(arg)==2 else (arg,(1,4))))
+                assert_(False)
+            except ValueError:
+                pass
+        assert_(all((z==z)==[1,0,1,1]))
+        assert_(all((z!=z)==[0,1,0,0]))
+        assert_(not any((z<m)|(z<=m)|(z>m)|(z>=m)))
+        assert_(isoverflow(sort(z)).tolist()==[0,0,0,1])
+        # Masked elements read as nan, are true, and are found first by
+        # argmin and argmax, as NaN is
+        assert_(isnan(z[1]) and isnan(z.tolist()[1]) and z.tolist()[2]==R(3,7))
+        assert_(count_nonzero(z-z)==1 and z[1:2] and not (z-z)[:1])
+        for f in argmin,argmax:
+            assert_(f(z)==1 and f(z[::-1])==2 and f(concatenate([z,z]))==1)
+            assert_(f(z[2:])==(1 if f is argmin else 0))
+        assert_(set_overflow_policy('saturate')=='mask')
+        assert_(all(x*y==[2,(1<<31)-1,R(3,7),-(1<<31)]))
+        assert_(all(x-1==[0,(1<<30)-1,2,-(1<<31)]))
+        assert_(all(-x==[-1,-(1<<30),-3,(1<<31)-1]))
+        # Too fine results become the nearest representable fraction
+        a = array([R(-123456,46341)])*array([R(98765,46337)])
+        assert_(a[0]==R(-531422759,93587575))
+        assert_(array([R(1,46341)])**2==R(1,(1<<31)-1))
+    finally:
+        set_overflow_policy('raise')
+    try:
+        set_overflow_policy('ignore')
+        assert_(False)
+    except ValueError:
+        pass
+
+def test_csr_matrix():
+    random.seed(1262081)
+    x = random.randint(-5,5,(7,9)).astype(rational)/random.randint(1,10,(7,9))
+    x[x<0] = 0
+    a = csr_matrix(x)
+    assert_(a.shape==(7,9))
+    assert_(a.nnz==count_nonzero(x))
+    assert_(a.indices.dtype==a.indptr.dtype==dtype(int32))
+    assert_(a.data.dtype==dtype(rational))
+    assert_(all(a.toarray()==x))
+    b = csr_matrix((a.data,a.indices,a.indptr),a.shape)
+    assert_(all(b.toarray()==x))
+    # Exact spmv and spmm
+    v = arange(9).astype(rational)/7
+    assert_(all(a.dot(v)==matrix_multiply(x,v.reshape(-1,1)).ravel()))
+    w = random.randint(-5,5,(9,4)).astype(rational)/3
+    assert_(all(a.dot(w)==matrix_multiply(x,w)))
+    assert_(all(a.dot(arange(9))==matrix_multiply(x,arange(9).astype(rational).reshape(-1,1)).ravel()))
+    # Rows normalize once, so cancelling terms don't overflow
+    p = array([2,3,5,7,11,13,17,19,23,29,31,37])
+    c = csr_matrix((1/array([p,-p]).T.ravel().astype(rational),repeat(arange(12),2),[0,24]),(1,12))
+    assert_(c.dot(ones(12,rational))[0]==0)
+    try:
+        csr_matrix(array([[1<<30,1<<30]]).astype(rational)).dot(ones(2,rational))
+        assert_(False)
+    except OverflowError:
+        pass
+    # Repeated indices are summed, by toarray as by dot
+    d = csr_matrix((array([R(1,2),R(1,3),R(1,6),5,R(-1,4)]),[1,1,1,0,2],[0,3,5]),(2,3))
+    assert_(d.toarray().tolist()==[[0,1,0],[5,0,R(-1,4)]])
+    assert_(all(d.toarray().dot(arange(3))==d.dot(arange(3))))
+    try:
+        csr_matrix((array([1<<30,1<<30]).astype(rational),[0,0],[0,2]),(1,1)).toarray()
+        assert_(False)
+    except OverflowError:
+        pass
+    # Components are copied on construction and read only afterwards
+    indices = a.indices.copy()
+    b = csr_matrix((a.data,indices,a.indptr),a.shape)
+    indices[:] = 1<<30
+    assert_(all(b.dot(v)==a.dot(v)))
+    for component in b.data,b.indices,b.indptr:
+        assert_(not component.flags.writeable)
+        try:
+            component.flags.writeable = True
+            assert_(False)
+        except ValueError:
+            pass
+    unsorted = a.indices.copy()
+    unsorted[a.indptr[0]:a.indptr[1]] = unsorted[a.indptr[0]:a.indptr[1]][::-1]
+    for args in ((a.data,a.indices,a.indptr),(7,10)),((a.data,a.indices+9,a.indptr),a.shape),((a.data,a.indices,a.indptr[1:]),a.shape),((a.data,unsorted,a.indptr),a.shape):
+        try:
+            csr_matrix(*args).dot(ones(9,rational))
+            assert_(False)
+        except ValueError:
+            pass
+
+def test_evaluate():
+    random.seed(1262081)
+    a,b,c,d = [random.randint(-20,20,s).astype(rational)/random.randint(1,15,s) for s in ((3,4),4,(3,1),4)]
+    assert_(all(evaluate('(a*b - c) / (d*d + 1)')==(a*b-c)/(d*d+1)))
+    assert_(all(evaluate('-a + 3*b - -c',{'a':a,'b':b,'c':c})==-a+3*b+c))
+    assert_(all(evaluate('2*x/4',{'x':arange(5)})==arange(5).astype(rational)/2))
+    assert_(evaluate('1+2')==3)
+    # Overflow and zero division match the ufuncs
+    r = array([1<<30]).astype(rational)
+    for ex in 'r+r','r*2','r+r-r':
+        try:
+            evaluate(ex)
+            assert_(False)
+        except OverflowError:
+            pass
+    assert_(evaluate('r/4*(2+2)')==r)
+    try:
+        evaluate('1/z',{'z':zeros(3,rational)})
+        assert_(False)
+    except ZeroDivisionError:
+        pass
+    for ex in 'a+','a b','(a','a**2','':
+        try:
+            evaluate(ex)
+            assert_(False)
+        except SyntaxError:
+            pass
+    try:
+        evaluate('undefined+1')
+        assert_(False)
+    except NameError:
+        pass
+    # Names missing from local_dict come from the caller's globals
+    assert_(all(evaluate('x+evaluate_global',{'x':arange(3)})==arange(3)+R(1,3)))
+    # Errors other than a missing name are not hidden
+    class Broken(dict):
+        def __getitem__(self,name):
+            raise RuntimeError(name)
+    try:
+        evaluate('x+1',Broken())
+        assert_(False)
+    except RuntimeError:
+        pass
+
+evaluate_global = R(1,3)
+
 def test_numpy_errors():
     # Check that exceptions inside ufuncs are detected
     r = array([1<<30]).astype(rational)
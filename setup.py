@@ -1,19 +1,61 @@
+import os
+import platform
 from distutils.core import setup, Extension
+from distutils.command.build_ext import build_ext
 import numpy as np
 
+# Set NPYTYPES_OPENMP=1 to run the row-parallel and chunked kernels on several threads
+openmp = ['-fopenmp'] if os.environ.get('NPYTYPES_OPENMP') == '1' else []
+
+# Set NPYTYPES_OPTIMIZE=1 for the optimized profile: -O3 with link time
+# optimization and, on x86-64, each extension built twice more for the
+# x86-64-v3 (AVX2) and x86-64-v4 (AVX-512) instruction sets, as name_v3 and
+# name_v4, of which npytypes.isa imports the widest the CPU runs.  -march
+# x86-64-v3 needs gcc 11 or clang 12.  So that every build rounds alike,
+# -ffp-contract=off keeps the compiler from fusing the portable code's
+# multiplies and adds into FMAs, at compile or link time, and the FMA builds
+# don't auto-vectorize, as gcc 12's vectorizer fuses the quaternion products
+# into vfmaddsub regardless.
+optimize = os.environ.get('NPYTYPES_OPTIMIZE') == '1'
+flags = ['-O3', '-flto', '-ffp-contract=off'] if optimize else []
+isas = [('', [])]
+if optimize and platform.machine() in ('x86_64', 'AMD64'):
+    isas += [('_v3', ['-march=x86-64-v3', '-fno-tree-vectorize']),
+             ('_v4', ['-march=x86-64-v4', '-fno-tree-vectorize'])]
+
+class build_isa_ext(build_ext):
+    '''Compiles each build of an extension in its own directory, since the
+    builds share their sources'''
+    def build_extension(self, ext):
+        build_temp = self.build_temp
+        self.build_temp = os.path.join(build_temp, ext.name)
+        try:
+            build_ext.build_extension(self, ext)
+        finally:
+            self.build_temp = build_temp
+
 ext_modules = []
 
-ext = Extension('npytypes.rational.rational',
-                sources=['npytypes/rational/rational.c'],
-                include_dirs=[np.get_include()])
-ext_modules.append(ext)
+def add_extension(name, sources, compile_args):
+    '''Add the extension module name, built for each instruction set'''
+    for suffix, march in isas:
+        macros = [('NPYTYPES_MODULE', name.rpartition('.')[2] + suffix)] if suffix else []
+        ext = Extension(name + suffix,
+                        sources=sources,
+                        include_dirs=[np.get_include()],
+                        define_macros=macros,
+                        extra_compile_args=compile_args + flags + march + openmp,
+                        extra_link_args=flags + march + openmp)
+        ext_modules.append(ext)
+
+add_extension('npytypes.rational.rational',
+              ['npytypes/rational/rational.c'], [])
 
-ext = Extension('npytypes.quaternion.numpy_quaternion',
-                sources=['npytypes/quaternion/quaternion.c',
-                         'npytypes/quaternion/numpy_quaternion.c'],
-                include_dirs=[np.get_include()],
-                extra_compile_args=['-std=c99'])
-ext_modules.append(ext)
+add_extension('npytypes.quaternion.numpy_quaternion',
+              ['npytypes/quaternion/quaternion.c',
+               'npytypes/quaternion/quaternion_simd.c',
+               'npytypes/quaternion/numpy_quaternion.c'],
+              ['-std=c99'])
 
 setup(name='npytypes',
       version='0.1',
@@ -22,4 +64,5 @@ setup(name='npytypes',
                 'npytypes.quaternion',
                 'npytypes.rational'
                 ],
-      ext_modules=ext_modules)
+      ext_modules=ext_modules,
+      cmdclass={'build_ext': build_isa_ext})